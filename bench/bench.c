@@ -0,0 +1,624 @@
+/**
+ * @file bench.c
+ * @author Nilo Edson (niloedson.ms@gmail.com)
+ * @brief Benchmarks the bmp.h library over the sample images and synthetic
+ * images of several sizes and bit depths.
+ * @version 0.1
+ * @date 2022-04-18
+ *
+ * @copyright Copyright (c) 2022
+ *
+ * Usage: bench [-t trials] [-w warmup] [-T threads] [-j file.json] [-S] [dir]
+ *
+ * Every benchmark reports the median of <trials> timed runs (after <warmup>
+ * untimed ones) as megapixels per second and nanoseconds per pixel, the
+ * library allocations made per run and the peak resident set size. -S skips
+ * the synthetic images, -j also writes the results as JSON.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "bmp.h"
+
+#define BENCH_MAXRESULTS 1024
+
+// synthetic images: width x height for each bit depth
+static const uint32_t bench_sizes[][2] = { {1024, 1024}, {2048, 2048}, {4096, 4096} };
+static const uint16_t bench_bitcounts[] = { 8, 16, 24, 32 };
+
+typedef struct bench_input {
+    char name[256];
+    char path[512];
+    bmp_image * img;
+} bench_input;
+
+typedef struct bench_result {
+    char bench[32];
+    char image[256];
+    uint32_t width;
+    uint32_t height;
+    uint16_t bitcount;
+    uint32_t compression;
+    uint32_t trials;
+    uint64_t minimum;       // ns
+    uint64_t median;        // ns
+    double mean;            // ns
+    double allocs;          // library allocations per run
+    double allocbytes;      // library bytes allocated per run
+    long peakrss;           // kB
+} bench_result;
+
+/**
+ * @brief One benchmark: <run> performs a single call on <in>, timing only
+ * the call itself between bench_start() and bench_stop().
+ */
+typedef struct bench_case {
+    const char * name;
+    int (*applies)(bmp_image * img);
+    void (*run)(bench_input * in);
+} bench_case;
+
+/* allocation counting ---------------------------------------------------------*/
+
+static size_t bench_allocs = 0;
+static size_t bench_allocbytes = 0;
+
+static void * bench_alloc(void * context, size_t size)
+{
+    (void) context;
+    __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&bench_allocbytes, size, __ATOMIC_RELAXED);
+    return malloc(size);
+}
+
+static void bench_release(void * context, void * ptr)
+{
+    (void) context;
+    free(ptr);
+}
+
+/* timing ----------------------------------------------------------------------*/
+
+static struct {
+    uint64_t start;
+    uint64_t elapsed;
+    size_t allocs;
+    size_t allocbytes;
+} bench_clock;
+
+static uint64_t bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void bench_start(void)
+{
+    bench_clock.allocs -= bench_allocs;
+    bench_clock.allocbytes -= bench_allocbytes;
+    bench_clock.start = bench_now();
+}
+
+static void bench_stop(void)
+{
+    bench_clock.elapsed += bench_now() - bench_clock.start;
+    bench_clock.allocs += bench_allocs;
+    bench_clock.allocbytes += bench_allocbytes;
+}
+
+/**
+ * @brief Reset the peak resident set size (Linux), so each benchmark
+ * reports its own.
+ */
+static void bench_resetpeak(void)
+{
+    FILE * fptr = fopen("/proc/self/clear_refs", "w");
+    if (fptr == NULL) return;
+    fputs("5", fptr);
+    fclose(fptr);
+}
+
+static long bench_peakrss(void)
+{
+    char line[256];
+    long peak = -1;
+
+    FILE * fptr = fopen("/proc/self/status", "r");
+    if (fptr != NULL) {
+        while (fgets(line, sizeof(line), fptr) != NULL) {
+            if (sscanf(line, "VmHWM: %ld", &peak) == 1) break;
+        }
+        fclose(fptr);
+    }
+
+    if (peak < 0) {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        peak = usage.ru_maxrss;
+    }
+
+    return peak;
+}
+
+/* helpers ---------------------------------------------------------------------*/
+
+static bmp_image * bench_clone(bmp_image * img)
+{
+    bmp_image * new = bmp_calloc(sizeof(bmp_image));
+    if (new == NULL) return NULL;
+
+    new->fileheader = img->fileheader;
+    bmp_cpdibs(new, img);
+
+    uint32_t palettesize = bmp_getpalettesize(img);
+
+    if (palettesize > 0 && img->dib.bmiColors != NULL) {
+        new->dib.bmiColors = bmp_alloc(palettesize);
+        if (new->dib.bmiColors == NULL) return bmp_cleanup(NULL, new);
+        memcpy(new->dib.bmiColors, img->dib.bmiColors, palettesize);
+    }
+
+    new->ciPixelArray = bmp_alloc(bmp_getarraysize(new));
+    if (new->ciPixelArray == NULL) return bmp_cleanup(NULL, new);
+
+    // mapped rows may keep their padding, the copy is packed
+    if (img->rowStride != 0) {
+        bmp_unpad(new, img->ciPixelArray);
+    } else {
+        memcpy(new->ciPixelArray, img->ciPixelArray, bmp_getarraysize(new));
+    }
+
+    return new;
+}
+
+/**
+ * @brief Smooth gradients with some noise: neither trivially compressible
+ * nor random.
+ */
+static bmp_image * bench_synthetic(uint32_t width, uint32_t height, uint16_t bitcount)
+{
+    bmp_image * img = bmp_calloc(sizeof(bmp_image));
+    if (img == NULL) return NULL;
+
+    img->dib.bmiHeader.biSize = BMP_INFOHEADER;
+    img->dib.bmiHeader.biWidth = width;
+    img->dib.bmiHeader.biHeight = height;
+    img->dib.bmiHeader.biPlanes = BMP_DEFAULT_COLORPLANES;
+    img->dib.bmiHeader.biBitCount = bitcount;
+    img->dib.bmiHeader.biCompression = BMP_BI_RGB;
+
+    uint32_t palettesize = bmp_getpalettesize(img);
+
+    if (palettesize > 0) {
+        img->dib.bmiColors = bmp_alloc(palettesize);
+        if (img->dib.bmiColors == NULL) return bmp_cleanup(NULL, img);
+
+        for (uint32_t i = 0; i < palettesize / sizeof(bmp_rgbquad); i++) {
+            img->dib.bmiColors[i] = (bmp_rgbquad) { i, i, i, 0 };
+        }
+    }
+
+    img->dib.bmiHeader.biSizeImage = bmp_getstride(img) * height;
+    img->fileheader.bfType = BMP_FILETYPE_BM;
+    img->fileheader.bfOffBits = bmp_getheaderssize(img);
+    img->fileheader.bfSize = img->fileheader.bfOffBits + img->dib.bmiHeader.biSizeImage;
+
+    img->ciPixelArray = bmp_alloc(bmp_getarraysize(img));
+    if (img->ciPixelArray == NULL) return bmp_cleanup(NULL, img);
+
+    uint32_t state = 0x9E3779B9;
+    uint32_t rowsize = bmp_getrowsize(img);
+
+    for (uint32_t y = 0; y < height; y++) {
+        uint8_t * row = img->ciPixelArray + (size_t) y * rowsize;
+        for (uint32_t i = 0; i < rowsize; i++) {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            row[i] = ((i / 16 + y / 16) & 0xFF) + ((state & 0x1F) == 0 ? (state >> 8) & 0x0F : 0);
+        }
+    }
+
+    return img;
+}
+
+/* benchmarks ------------------------------------------------------------------*/
+
+static int bench_any(bmp_image * img)
+{
+    (void) img;
+    return 1;
+}
+
+static int bench_isrgb(bmp_image * img)
+{
+    uint16_t bitcount = img->dib.bmiHeader.biBitCount;
+    return bmp_isuncompressed(img) && (bitcount == 16 || bitcount == 24 || bitcount == 32);
+}
+
+static int bench_isinvertible(bmp_image * img)
+{
+    uint16_t bitcount = img->dib.bmiHeader.biBitCount;
+    return bmp_isuncompressed(img) && (bitcount == 8 || bitcount == 24 || bitcount == 32);
+}
+
+static int bench_is24(bmp_image * img)
+{
+    return img->dib.bmiHeader.biCompression == BMP_BI_RGB && img->dib.bmiHeader.biBitCount == 24;
+}
+
+static int bench_is8(bmp_image * img)
+{
+    return img->dib.bmiHeader.biCompression == BMP_BI_RGB && img->dib.bmiHeader.biBitCount == 8;
+}
+
+static int bench_isrle8(bmp_image * img)
+{
+    return img->dib.bmiHeader.biCompression == BMP_BI_RLE8;
+}
+
+static void bench_read(bench_input * in)
+{
+    bench_start();
+    bmp_image * img = bmp_read(in->path);
+    bench_stop();
+    bmp_cleanup(NULL, img);
+}
+
+static void bench_openmapped(bench_input * in)
+{
+    bench_start();
+    bmp_image * img = bmp_open_mapped(in->path);
+    bench_stop();
+    bmp_cleanup(NULL, img);
+}
+
+static void bench_save(bench_input * in)
+{
+    char path[] = "/tmp/bmp-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) return;
+    close(fd);
+
+    bench_start();
+    bmp_save(in->img, path);
+    bench_stop();
+
+    unlink(path);
+}
+
+static void bench_rgb2gray(bench_input * in)
+{
+    bench_start();
+    bmp_image * gray = bmp_rgb2gray(in->img, BMP_SET_256_COLOURS);
+    bench_stop();
+    bmp_cleanup(NULL, gray);
+}
+
+static void bench_invert(bench_input * in)
+{
+    bench_start();
+    bmp_invert(in->img);
+    bench_stop();
+}
+
+static void bench_filtercolor(bench_input * in)
+{
+    bmp_image * img = bench_clone(in->img);
+    if (img == NULL) return;
+
+    bench_start();
+    bmp_filtercolor(img, BMP_COLOR_GREEN);
+    bench_stop();
+
+    bmp_cleanup(NULL, img);
+}
+
+static void bench_padh(bench_input * in)
+{
+    bmp_image * img = bench_clone(in->img);
+    if (img == NULL) return;
+
+    bench_start();
+    bmp_padh(img, 16, BMP_PADTYPE_REPLICATE);
+    bench_stop();
+
+    bmp_cleanup(NULL, img);
+}
+
+static void bench_padv(bench_input * in)
+{
+    bmp_image * img = bench_clone(in->img);
+    if (img == NULL) return;
+
+    bench_start();
+    bmp_padv(img, 16, BMP_PADTYPE_REPLICATE);
+    bench_stop();
+
+    bmp_cleanup(NULL, img);
+}
+
+static void bench_rle8decoder(bench_input * in)
+{
+    bench_start();
+    bmp_image * decoded = bmp_rle8decoder(in->img);
+    bench_stop();
+    bmp_cleanup(NULL, decoded);
+}
+
+static void bench_rle8encoder(bench_input * in)
+{
+    bench_start();
+    bmp_image * encoded = bmp_rle8encoder(in->img, BMP_RLEMODE_FAST);
+    bench_stop();
+    bmp_cleanup(NULL, encoded);
+}
+
+static void bench_pipeline(bench_input * in)
+{
+    bench_start();
+    bmp_pipeline * pipeline = bmp_pipeline_create(in->img);
+    bmp_pipeline_add_gray(pipeline, BMP_SET_256_COLOURS);
+    bmp_pipeline_add_invert(pipeline);
+    bmp_pipeline_add_pad(pipeline, 16, 16, BMP_PADTYPE_REPLICATE);
+    bmp_image * out = bmp_pipeline_run(pipeline);
+    bench_stop();
+
+    bmp_cleanup(NULL, out);
+    bmp_pipeline_free(pipeline);
+}
+
+static const bench_case bench_cases[] = {
+    { "read", bench_any, bench_read },
+    { "open_mapped", bench_any, bench_openmapped },
+    { "save", bench_any, bench_save },
+    { "rgb2gray", bench_isrgb, bench_rgb2gray },
+    { "invert", bench_isinvertible, bench_invert },
+    { "filtercolor", bench_is24, bench_filtercolor },
+    { "padh", bench_is8, bench_padh },
+    { "padv", bench_is8, bench_padv },
+    { "rle8decoder", bench_isrle8, bench_rle8decoder },
+    { "rle8encoder", bench_is8, bench_rle8encoder },
+    { "pipeline", bench_isrgb, bench_pipeline },
+};
+
+/* driver ----------------------------------------------------------------------*/
+
+static int bench_cmpu64(const void * a, const void * b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static int bench_cmpinput(const void * a, const void * b)
+{
+    return strcmp(((const bench_input *) a)->name, ((const bench_input *) b)->name);
+}
+
+static void bench_measure(const bench_case * bc, bench_input * in, uint32_t warmup,
+                          uint32_t trials, bench_result * result)
+{
+    uint64_t * samples = malloc(trials * sizeof(uint64_t));
+    if (samples == NULL) return;
+
+    bench_resetpeak();
+
+    for (uint32_t i = 0; i < warmup; i++) {
+        bench_clock.elapsed = 0;
+        bc->run(in);
+    }
+
+    bench_clock.allocs = 0;
+    bench_clock.allocbytes = 0;
+
+    double total = 0;
+
+    for (uint32_t i = 0; i < trials; i++) {
+        bench_clock.elapsed = 0;
+        bc->run(in);
+        samples[i] = bench_clock.elapsed;
+        total += samples[i];
+    }
+
+    qsort(samples, trials, sizeof(uint64_t), bench_cmpu64);
+
+    snprintf(result->bench, sizeof(result->bench), "%s", bc->name);
+    snprintf(result->image, sizeof(result->image), "%.*s", (int) sizeof(result->image) - 1, in->name);
+    result->width = in->img->dib.bmiHeader.biWidth;
+    result->height = bmp_getheight(in->img);
+    result->bitcount = in->img->dib.bmiHeader.biBitCount;
+    result->compression = in->img->dib.bmiHeader.biCompression;
+    result->trials = trials;
+    result->minimum = samples[0];
+    result->median = samples[trials / 2];
+    result->mean = total / trials;
+    result->allocs = (double) bench_clock.allocs / trials;
+    result->allocbytes = (double) bench_clock.allocbytes / trials;
+    result->peakrss = bench_peakrss();
+
+    free(samples);
+}
+
+static double bench_pixels(bench_result * result)
+{
+    return (double) result->width * result->height;
+}
+
+static void bench_print(bench_result * result)
+{
+    double pixels = bench_pixels(result);
+    double mps = (result->median > 0) ? pixels * 1e3 / result->median : 0;
+
+    printf("%-12s %-28s %5ux%-5u %2ubpp %10.1f MP/s %8.3f ns/px %7.1f allocs %8ld kB\n",
+           result->bench, result->image, result->width, result->height, result->bitcount,
+           mps, result->median / pixels, result->allocs, result->peakrss);
+}
+
+static int bench_writejson(const char * filename, bench_result * results, uint32_t nresults,
+                           uint32_t warmup, uint32_t trials)
+{
+    FILE * fptr = fopen(filename, "w");
+    if (fptr == NULL) return 0;
+
+    fprintf(fptr, "{\n  \"threads\": %u,\n  \"warmup\": %u,\n  \"trials\": %u,\n  \"results\": [\n",
+            bmp_get_threads(), warmup, trials);
+
+    for (uint32_t i = 0; i < nresults; i++) {
+        bench_result * r = &results[i];
+        double pixels = bench_pixels(r);
+
+        fprintf(fptr, "    {\"bench\": \"%s\", \"image\": \"%s\", \"width\": %u, \"height\": %u, "
+                      "\"bitcount\": %u, \"compression\": %u, \"median_ns\": %llu, \"min_ns\": %llu, "
+                      "\"mean_ns\": %.0f, \"mpix_per_s\": %.3f, \"ns_per_pixel\": %.4f, "
+                      "\"allocs\": %.2f, \"alloc_bytes\": %.0f, \"peak_rss_kb\": %ld}%s\n",
+                r->bench, r->image, r->width, r->height, r->bitcount, r->compression,
+                (unsigned long long) r->median, (unsigned long long) r->minimum, r->mean,
+                (r->median > 0) ? pixels * 1e3 / r->median : 0, r->median / pixels,
+                r->allocs, r->allocbytes, r->peakrss, (i + 1 < nresults) ? "," : "");
+    }
+
+    fprintf(fptr, "  ]\n}\n");
+
+    return fclose(fptr) == 0;
+}
+
+static uint32_t bench_loadsamples(const char * dirname, bench_input * inputs, uint32_t max)
+{
+    DIR * dir = opendir(dirname);
+    if (dir == NULL) return 0;
+
+    uint32_t n = 0;
+    struct dirent * entry;
+
+    while ((entry = readdir(dir)) != NULL && n < max)
+    {
+        size_t len = strlen(entry->d_name);
+        if (len < 4 || strcmp(entry->d_name + len - 4, ".bmp") != 0) continue;
+
+        bench_input * in = &inputs[n];
+        snprintf(in->name, sizeof(in->name), "%s", entry->d_name);
+        snprintf(in->path, sizeof(in->path), "%s/%s", dirname, entry->d_name);
+
+        in->img = bmp_read(in->path);
+        if (in->img != NULL) n++;
+    }
+
+    closedir(dir);
+
+    qsort(inputs, n, sizeof(bench_input), bench_cmpinput);
+
+    return n;
+}
+
+/**
+ * @brief Synthetic inputs are saved once, so the read benchmarks have a
+ * file to work on; RLE8 copies of the 8bpp ones feed the decoder.
+ */
+static uint32_t bench_loadsynthetic(bench_input * inputs, uint32_t max)
+{
+    uint32_t n = 0;
+
+    for (size_t s = 0; s < sizeof(bench_sizes) / sizeof(bench_sizes[0]); s++) {
+        for (size_t b = 0; b < sizeof(bench_bitcounts) / sizeof(bench_bitcounts[0]); b++)
+        {
+            if (n + 2 > max) return n;
+
+            uint32_t width = bench_sizes[s][0];
+            uint32_t height = bench_sizes[s][1];
+            bench_input * in = &inputs[n];
+            char name[64];
+
+            in->img = bench_synthetic(width, height, bench_bitcounts[b]);
+            if (in->img == NULL) continue;
+
+            snprintf(name, sizeof(name), "synthetic-%ux%u-%ubpp", width, height, bench_bitcounts[b]);
+            snprintf(in->name, sizeof(in->name), "%.*s", (int) sizeof(name) - 1, name);
+            snprintf(in->path, sizeof(in->path), "/tmp/bmp-bench-%s.bmp", in->name);
+            bmp_save(in->img, in->path);
+            n++;
+
+            if (bench_bitcounts[b] != 8) continue;
+
+            bench_input * rle = &inputs[n];
+            rle->img = bmp_rle8encoder(in->img, BMP_RLEMODE_FAST);
+            if (rle->img == NULL) continue;
+
+            snprintf(rle->name, sizeof(rle->name), "%.*s-rle8", (int) sizeof(name) - 1, name);
+            snprintf(rle->path, sizeof(rle->path), "/tmp/bmp-bench-%s.bmp", rle->name);
+            bmp_save(rle->img, rle->path);
+            n++;
+        }
+    }
+
+    return n;
+}
+
+int main(int argc, char * argv[])
+{
+    uint32_t trials = 5;
+    uint32_t warmup = 1;
+    const char * json = NULL;
+    int synthetic = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:w:T:j:S")) != -1)
+    {
+        switch (opt)
+        {
+        case 't': trials = strtoul(optarg, NULL, 10); break;
+        case 'w': warmup = strtoul(optarg, NULL, 10); break;
+        case 'T': bmp_set_threads(strtoul(optarg, NULL, 10)); break;
+        case 'j': json = optarg; break;
+        case 'S': synthetic = 0; break;
+        default:
+            fprintf(stderr, "usage: %s [-t trials] [-w warmup] [-T threads] [-j file.json] [-S] [dir]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (trials == 0) trials = 1;
+
+    const char * dirname = (optind < argc) ? argv[optind] : "samples";
+
+    bmp_allocator counting = { bench_alloc, bench_release, NULL };
+    bmp_set_allocator(&counting);
+
+    static bench_input inputs[128];
+    uint32_t ninputs = bench_loadsamples(dirname, inputs, 64);
+    uint32_t nsamples = ninputs;
+
+    if (synthetic) ninputs += bench_loadsynthetic(inputs + ninputs, 128 - ninputs);
+
+    static bench_result results[BENCH_MAXRESULTS];
+    uint32_t nresults = 0;
+
+    for (size_t c = 0; c < sizeof(bench_cases) / sizeof(bench_cases[0]); c++) {
+        for (uint32_t i = 0; i < ninputs && nresults < BENCH_MAXRESULTS; i++)
+        {
+            if (!bench_cases[c].applies(inputs[i].img)) continue;
+
+            bench_measure(&bench_cases[c], &inputs[i], warmup, trials, &results[nresults]);
+            bench_print(&results[nresults]);
+            nresults++;
+        }
+    }
+
+    for (uint32_t i = 0; i < ninputs; i++) {
+        if (i >= nsamples) unlink(inputs[i].path);
+        bmp_cleanup(NULL, inputs[i].img);
+    }
+
+    if (json != NULL && !bench_writejson(json, results, nresults, warmup, trials)) {
+        fprintf(stderr, "could not write %s\n", json);
+        return 1;
+    }
+
+    return 0;
+}
@@ -8,56 +8,209 @@
  * @copyright Copyright (c) 2022
  */
 
+#define _DEFAULT_SOURCE
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BMP_X86 1
+#include <immintrin.h>
+#else
+#define BMP_X86 0
+#endif
+
 #include "bmp.h"
 
+static bmp_stats bmp_statistics = { .enabled = BMP_STATS_ENABLED };
+
+// the per-function counters, seen as one flat array of uint64_t
+#define BMP_STATS_COUNTERS (BMP_STAT_COUNT * sizeof(bmp_funcstats) / sizeof(uint64_t))
+
+#if BMP_STATS_ENABLED
+
+typedef struct bmp_statscope {
+    bmp_statid id;
+    uint64_t bytes;
+    uint64_t wall;
+    uint64_t cpu;
+} bmp_statscope;
+
+static uint64_t bmp_clockns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static bmp_statscope bmp_statbegin(bmp_statid id)
+{
+    return (bmp_statscope) {
+        id, 0, bmp_clockns(CLOCK_MONOTONIC), bmp_clockns(CLOCK_PROCESS_CPUTIME_ID)
+    };
+}
+
+static uint32_t bmp_statbucket(uint64_t ns)
+{
+    uint32_t bucket = 63 - __builtin_clzll(ns | 1);
+    return (bucket < BMP_STATS_BUCKETS) ? bucket : BMP_STATS_BUCKETS - 1;
+}
+
+// runs when the scope of an instrumented function ends, whatever the return
+static void bmp_statend(bmp_statscope * scope)
+{
+    uint64_t wall = bmp_clockns(CLOCK_MONOTONIC) - scope->wall;
+    uint64_t cpu = bmp_clockns(CLOCK_PROCESS_CPUTIME_ID) - scope->cpu;
+    bmp_funcstats * f = &bmp_statistics.functions[scope->id];
+
+    __atomic_add_fetch(&f->calls, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&f->bytes, scope->bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&f->wallns, wall, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&f->cpuns, cpu, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&f->wallhist[bmp_statbucket(wall)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&f->cpuhist[bmp_statbucket(cpu)], 1, __ATOMIC_RELAXED);
+}
+
+#define BMP_STATS_SCOPE(id) \
+    bmp_statscope bmp_scope __attribute__((cleanup(bmp_statend))) = bmp_statbegin(id)
+#define BMP_STATS_BYTES(n) (bmp_scope.bytes = (n))
+#define BMP_STATS_ADD(field, n) __atomic_add_fetch(&bmp_statistics.field, (n), __ATOMIC_RELAXED)
+
+#else
+
+#define BMP_STATS_SCOPE(id) do {} while (0)
+#define BMP_STATS_BYTES(n) ((void) 0)
+#define BMP_STATS_ADD(field, n) ((void) 0)
+
+#endif
+
+/**
+ * Write every byte described by <iov>, resuming after short writes.
+ */
+static int bmp_writeiov(int fd, struct iovec * iov, int iovcnt)
+{
+    while (iovcnt > 0)
+    {
+        ssize_t written = writev(fd, iov, iovcnt);
+
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+
+        while (iovcnt > 0 && (size_t) written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t *) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Bytes of pixel data a file of <img> stores, row padding included. 
+ * Headers that passed bmp_checkheaders() keep it within 32 bits.
+ */
+static uint64_t bmp_filedatasize(bmp_image * img)
+{
+    if (bmp_isuncompressed(img)) 
+        return (uint64_t) bmp_getstride(img) * bmp_getheight(img);
+
+    return bmp_getdatasize(img);
+}
+
 bmp_image * bmp_read(const char * filename)
 {
+    BMP_STATS_SCOPE(BMP_STAT_READ);
+
     FILE * fptr = NULL;
     bmp_image * img = NULL;
 
     fptr = fopen(filename, "r");
     if (fptr == NULL) return bmp_cleanup(fptr, img);
 
-    img = malloc(sizeof(bmp_image));
+    img = bmp_calloc(sizeof(bmp_image));
     if (img == NULL) return bmp_cleanup(fptr, img);
 
-    if (fread( &img->fileheader, sizeof(bmp_fileheader), 1, fptr) != 1) 
+    if (bmp_readheaders(fptr, img) == 0) return bmp_cleanup(fptr, img);
+
+    if (fseek(fptr, img->fileheader.bfOffBits, SEEK_SET) != 0)
         return bmp_cleanup(fptr, img);
+
+    uint32_t datasize = bmp_filedatasize(img);
+
+    img->ciPixelArray = bmp_alloc(sizeof(uint8_t)*datasize);
     
-    if (fread( &img->dib.bmiHeader, sizeof(bmp_infoheader), 1, fptr) != 1) 
+    if (img->ciPixelArray == NULL) 
+        return bmp_cleanup(fptr, img);
+
+    if (fread(img->ciPixelArray, sizeof(uint8_t), datasize, fptr) != datasize) 
         return bmp_cleanup(fptr, img);
+
+    fclose(fptr);
+
+    if (bmp_isuncompressed(img)) bmp_unpad(img, img->ciPixelArray);
+
+    BMP_STATS_BYTES(bmp_getdatasize(img));
+
+    return img;
+}
+
+int bmp_readheaders(FILE * fptr, bmp_image * img)
+{
+    if (fread( &img->fileheader, sizeof(bmp_fileheader), 1, fptr) != 1) 
+        return 0;
+    
+    if (fread( &img->dib.bmiHeader, sizeof(bmp_infoheader), 1, fptr) != 1) 
+        return 0;
     
     if (img->dib.bmiHeader.biSize >= BMP_V4HEADER)
     {
         if (fread( &img->dib.bmiv4Header, sizeof(bmp_v4header), 1, fptr) != 1) 
-            return bmp_cleanup(fptr, img);
+            return 0;
     }
 
     if (img->dib.bmiHeader.biSize >= BMP_V5HEADER)
     {
         if (fread( &img->dib.bmiv5Header, sizeof(bmp_v5header), 1, fptr) != 1) 
-            return bmp_cleanup(fptr, img);
+            return 0;
     }
 
-    if (bmp_checkheaders(img) == 0) return bmp_cleanup(fptr, img);
+    if (bmp_checkheaders(img) == 0) return 0;
 
     uint32_t palettesize = bmp_getpalettesize(img);
 
     switch (img->dib.bmiHeader.biBitCount) {
     case BMP_1_BIT:
+    case BMP_2_BITS:
     case BMP_4_BITS:
     case BMP_8_BITS:
-        img->dib.bmiColors = malloc(palettesize);
+        img->dib.bmiColors = bmp_alloc(palettesize);
+        if (img->dib.bmiColors == NULL) return 0;
         if (fread( img->dib.bmiColors, palettesize, 1, fptr) != 1) 
-            return bmp_cleanup(fptr, img);
+            return 0;
         break;
     case BMP_16_BITS:
     case BMP_32_BITS:
-        if (img->dib.bmiHeader.biCompression == BMP_BI_BITFIELDS)
+        if (img->dib.bmiHeader.biCompression == BMP_BI_BITFIELDS 
+         || img->dib.bmiHeader.biCompression == BMP_BI_ALPHABITFIELDS)
         {
-            img->dib.bmiColors = malloc(palettesize);
+            img->dib.bmiColors = bmp_alloc(palettesize);
+            if (img->dib.bmiColors == NULL) return 0;
             if (fread( img->dib.bmiColors, palettesize, 1, fptr) != 1) 
-                return bmp_cleanup(fptr, img);
+                return 0;
         }
         break;
     case BMP_24_BITS:
@@ -66,1136 +219,8270 @@ bmp_image * bmp_read(const char * filename)
         break;
     }
 
-    uint32_t datasize = bmp_getdatasize(img);
-
-    img->ciPixelArray = malloc(sizeof(uint8_t)*datasize);
-    
-    if (img->ciPixelArray == NULL) 
-        return bmp_cleanup(fptr, img);
-
-    if (fread(img->ciPixelArray, sizeof(uint8_t), datasize, fptr) != datasize) 
-        return bmp_cleanup(fptr, img);
-
-    fclose(fptr);
-
-    return img;
+    return 1;
 }
 
-int bmp_save(bmp_image * img, const char * filename)
+int bmp_writeheaders(FILE * fptr, bmp_image * img)
 {
-    FILE * fptr = NULL;
-    fptr = fopen(filename, "w");
-
-    if (fptr == NULL) return 0;
-
-    if (fwrite(&img->fileheader, sizeof(bmp_fileheader), 1, fptr) != 1) {
-        fclose(fptr);
+    if (fwrite(&img->fileheader, sizeof(bmp_fileheader), 1, fptr) != 1) 
         return 0;
-    }
 
-    if (fwrite(&img->dib.bmiHeader, sizeof(bmp_infoheader), 1, fptr) != 1) {
-        fclose(fptr);
+    if (fwrite(&img->dib.bmiHeader, sizeof(bmp_infoheader), 1, fptr) != 1) 
         return 0;
-    }
 
     if (img->dib.bmiHeader.biSize >= BMP_V4HEADER)
     {
-        if (fwrite(&img->dib.bmiv4Header, sizeof(bmp_v4header), 1, fptr) != 1) {
-            fclose(fptr);
+        if (fwrite(&img->dib.bmiv4Header, sizeof(bmp_v4header), 1, fptr) != 1) 
             return 0;
-        }
     }
     
     if (img->dib.bmiHeader.biSize >= BMP_V5HEADER)
     {
-        if (fwrite(&img->dib.bmiv5Header, sizeof(bmp_v5header), 1, fptr) != 1) {
-            fclose(fptr);
+        if (fwrite(&img->dib.bmiv5Header, sizeof(bmp_v5header), 1, fptr) != 1) 
             return 0;
-        }
     }
     
     uint32_t palettesize = bmp_getpalettesize(img);
 
-    if (palettesize > 0)
-    {
-        if (fwrite(img->dib.bmiColors, palettesize, 1, fptr) != 1) {
-            fclose(fptr);
-            return 0;
-        }
-    }
-
-    uint32_t datasize = bmp_getdatasize(img);
-
-    uint32_t rows = img->dib.bmiHeader.biHeight;
-    uint32_t columns = img->dib.bmiHeader.biWidth / 8;
-
-    uint8_t * datapadded;
-
-    if (img->dib.bmiHeader.biWidth % 8)
-    {
-        columns = columns + 1;
-        columns = columns * 8;
-        
-        datapadded = malloc(sizeof(uint8_t)*rows*columns);
-
-        for (uint32_t i = 0; i < rows*columns; i++) datapadded[i] = 0;
-        
-        for (uint32_t y = 0; y < rows; y++)
-        {
-            for (uint32_t x = 0; x < img->dib.bmiHeader.biWidth; x++)
-            {
-                datapadded[y*columns + x] = img->ciPixelArray[y*img->dib.bmiHeader.biWidth + x];
-            }
-        }
-
-        if (fwrite(datapadded, sizeof(uint8_t), rows*columns, fptr) != rows*columns) {
-            fclose(fptr);
-            free(datapadded);
-            return 0;
-        }
-
-        free(datapadded);
-    }
-    else
+    if (palettesize > 0 && img->dib.bmiColors != NULL)
     {
-        if (fwrite(img->ciPixelArray, sizeof(uint8_t), datasize, fptr) != datasize) {
-            fclose(fptr);
+        if (fwrite(img->dib.bmiColors, palettesize, 1, fptr) != 1) 
             return 0;
-        }
     }
 
-    fclose(fptr);
-
     return 1;
 }
 
-uint8_t bmp_getpixelcolor(bmp_image * img, int x, int y, bmp_color color)
+/**
+ * Bytes of palette (or bit field masks) a file of <img> stores after its
+ * headers, 0 for none.
+ */
+static uint32_t bmp_filepalettesize(bmp_image * img)
 {
-    switch (img->dib.bmiHeader.biBitCount)
-    {
-    case BMP_0_BITS:
+    switch (img->dib.bmiHeader.biBitCount) {
     case BMP_1_BIT:
     case BMP_2_BITS:
     case BMP_4_BITS:
-        //TODO: add support for these formats.
-        return 0;
-        break;
     case BMP_8_BITS:
-        return img->ciPixelArray[y*img->dib.bmiHeader.biWidth+x];
-        break;
+        return bmp_getpalettesize(img);
     case BMP_16_BITS:
-        //TODO: add support for this format.
+    case BMP_32_BITS:
+        if (img->dib.bmiHeader.biCompression == BMP_BI_BITFIELDS 
+         || img->dib.bmiHeader.biCompression == BMP_BI_ALPHABITFIELDS)
+            return bmp_getpalettesize(img);
         return 0;
-        break;
     case BMP_24_BITS:
-        return img->ciPixelArray[3*(y*img->dib.bmiHeader.biWidth+x)+color];
-        break;
-    case BMP_32_BITS:
-        return img->ciPixelArray[4*(y*img->dib.bmiHeader.biWidth+x)+color];
-        break;
-
+        // never expect a BMP color palette
     default:
         return 0;
-        break;
     }
-    // if (img->dib.bmiHeader.biBitCount == BMP_8_BITS) 
-    //     return img->ciPixelArray[ y*img->dib.bmiHeader.biWidth + x ];
-    // return img->ciPixelArray[3*(y*img->dib.bmiHeader.biWidth + x) + color];
-}
-
-uint8_t bmp_findgray(uint8_t red, uint8_t green, uint8_t blue)
-{
-    double gray = 0.2989 * red + 0.5870 * green + 0.1140 * blue;
-    return  (uint8_t) gray;
 }
 
-bmp_image * bmp_rgb2gray(bmp_image * img, bmp_setncolours ncolours)
+/**
+ * Fill the headers of <img> from the <length> bytes of a whole Bitmap 
+ * file at <data>, checking that its palette and pixels lie within them.
+ * Returns the offset of the palette, 0 if something is wrong.
+ */
+static size_t bmp_parseheaders(bmp_image * img, const uint8_t * data, size_t length)
 {
-    if (img == NULL) return NULL;
-    
-    //TODO: extend support to convert 16bpp and 32bpp images
-    if (img->dib.bmiHeader.biBitCount != BMP_24_BITS) return NULL;
-    
-    bmp_image * new = malloc(sizeof(bmp_image));
-    if (new == NULL) return bmp_cleanup(NULL, new);
-
-    new->dib.bmiHeader.biSize = BMP_INFOHEADER;
-    new->dib.bmiHeader.biWidth = img->dib.bmiHeader.biWidth;
-    new->dib.bmiHeader.biHeight = img->dib.bmiHeader.biHeight;
-    new->dib.bmiHeader.biPlanes = BMP_DEFAULT_COLORPLANES;
-    new->dib.bmiHeader.biBitCount = BMP_8_BITS;
-    new->dib.bmiHeader.biCompression = BMP_BI_RGB;
-    new->dib.bmiHeader.biSizeImage = new->dib.bmiHeader.biWidth 
-                    * new->dib.bmiHeader.biHeight 
-                    * new->dib.bmiHeader.biBitCount / BMP_8_BITS;
-    new->dib.bmiHeader.biXPelsPerMeter = img->dib.bmiHeader.biXPelsPerMeter;
-    new->dib.bmiHeader.biYPelsPerMeter = img->dib.bmiHeader.biYPelsPerMeter;
-    new->dib.bmiHeader.biClrUsed = 0;
-    new->dib.bmiHeader.biClrImportant = 0;
+    size_t offset = 0;
 
-    uint32_t palettesize = pow(2, new->dib.bmiHeader.biBitCount) 
-                    * sizeof(bmp_rgbquad);
-    
-    new->fileheader.bfType = BMP_FILETYPE_BM;
-    new->fileheader.bfSize = BMP_FILEHEADER_SIZE 
-                    + new->dib.bmiHeader.biSize 
-                    + palettesize 
-                    + new->dib.bmiHeader.biSizeImage;
-    
-    new->fileheader.bfReserved1 = 0;
-    new->fileheader.bfReserved2 = 0;
-    
-    new->fileheader.bfOffBits = BMP_FILEHEADER_SIZE 
-                    + new->dib.bmiHeader.biSize 
-                    + palettesize;
-    
-    //TODO: add support to 4bpp, 2bpp and 1bpp generation
+    if (length < BMP_FILEHEADER_SIZE + BMP_INFOHEADER) return 0;
 
-    new->dib.bmiColors = malloc(palettesize);
+    memcpy(&img->fileheader, data + offset, sizeof(bmp_fileheader));
+    offset += sizeof(bmp_fileheader);
 
-    if (ncolours == 0) ncolours = BMP_SET_256_COLOURS;
+    memcpy(&img->dib.bmiHeader, data + offset, sizeof(bmp_infoheader));
+    offset += sizeof(bmp_infoheader);
 
-    uint32_t maxcolours = pow(2, new->dib.bmiHeader.biBitCount);
-    uint32_t steps = (maxcolours/ncolours);
+    if (img->dib.bmiHeader.biSize >= BMP_V4HEADER)
+    {
+        if (offset + sizeof(bmp_v4header) > length) return 0;
+        memcpy(&img->dib.bmiv4Header, data + offset, sizeof(bmp_v4header));
+        offset += sizeof(bmp_v4header);
+    }
 
-    for (uint32_t i = 0; i < maxcolours; i = i + steps) {
-        for (uint8_t k = 0; k < steps; k++) {
-            new->dib.bmiColors[i+k].rgbBlue = i;
-            new->dib.bmiColors[i+k].rgbGreen = i;
-            new->dib.bmiColors[i+k].rgbRed = i;
-            new->dib.bmiColors[i+k].rgbReserved = 0;
-        }
+    if (img->dib.bmiHeader.biSize >= BMP_V5HEADER)
+    {
+        if (offset + sizeof(bmp_v5header) > length) return 0;
+        memcpy(&img->dib.bmiv5Header, data + offset, sizeof(bmp_v5header));
+        offset += sizeof(bmp_v5header);
     }
 
-    new->ciPixelArray = malloc(new->dib.bmiHeader.biSizeImage);
+    if (bmp_checkheaders(img) == 0) return 0;
 
-    for (size_t x = 0; x < new->dib.bmiHeader.biWidth; x++) {
-        for (size_t y = 0; y < new->dib.bmiHeader.biHeight; y++) {
+    if (offset + bmp_filepalettesize(img) > length) return 0;
 
-            uint8_t ReqG = bmp_getpixelcolor(img, x, y, BMP_COLOR_RED) == bmp_getpixelcolor(img, x, y, BMP_COLOR_GREEN);
-            uint8_t GeqB = bmp_getpixelcolor(img, x, y, BMP_COLOR_GREEN) == bmp_getpixelcolor(img, x, y, BMP_COLOR_BLUE);
-            uint8_t BeqR = bmp_getpixelcolor(img, x, y, BMP_COLOR_BLUE) == bmp_getpixelcolor(img, x, y, BMP_COLOR_RED);
+    uint64_t datasize = bmp_filedatasize(img);
 
-            if (ReqG && GeqB && BeqR) {
-                new->ciPixelArray[y*new->dib.bmiHeader.biWidth + x] = 
-                    bmp_getpixelcolor(img, x, y, BMP_COLOR_RED);
-            } else {
-                new->ciPixelArray[y*new->dib.bmiHeader.biWidth + x] = 
-                    bmp_findgray(
-                        bmp_getpixelcolor(img, x, y, BMP_COLOR_RED),
-                        bmp_getpixelcolor(img, x, y, BMP_COLOR_GREEN),
-                        bmp_getpixelcolor(img, x, y, BMP_COLOR_BLUE)
-                    );
-            }
-            
-        }
-    }
+    if (img->fileheader.bfOffBits > length
+        || datasize > length - img->fileheader.bfOffBits)
+        return 0;
 
-    return new;
+    return offset;
 }
 
-void bmp_filtercolor(bmp_image * img, bmp_color color)
+bmp_image * bmp_open_mapped(const char * filename)
 {
-    //TODO: add support for 16 and 32 bits per pixel images.
-    if (img->dib.bmiHeader.biBitCount != BMP_24_BITS) return;
-    
-    //TODO: add support for compressed images.
-    if (img->dib.bmiHeader.biCompression != BMP_BI_RGB) return;
-    
-    uint32_t datasize = bmp_getdatasize(img);
+    BMP_STATS_SCOPE(BMP_STAT_OPEN_MAPPED);
 
-    for (unsigned int pixel = color; pixel < datasize; pixel++) {
-        if ((pixel % 3) != color) {
-            img->ciPixelArray[pixel] = 0;
-        }
-    }
-}
+    struct stat st;
+    bmp_image * img = NULL;
 
-void bmp_invert(bmp_image * img)
-{
-    uint32_t datasize = bmp_getdatasize(img);
-    
-    switch (img->dib.bmiHeader.biBitCount)
-    {
-    case BMP_1_BIT:
-    case BMP_2_BITS:
-    case BMP_4_BITS:
-    case BMP_16_BITS:
-        //TODO: implement this behavior.
-        break;
-    case BMP_32_BITS:
-        for (uint32_t i = 0; i < datasize; i++) {
-            if ((i+1)%4) img->ciPixelArray[i] = ~img->ciPixelArray[i];
-        }
-        break;
-    case BMP_8_BITS:
-    case BMP_24_BITS:
-        for (uint32_t i = 0; i < datasize; i++) {
-            img->ciPixelArray[i] = ~img->ciPixelArray[i];
-        }
-        break;
-    default:
-        break;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    if (fstat(fd, &st) != 0 || st.st_size < BMP_FILEHEADER_SIZE + BMP_INFOHEADER
+        || (uint64_t) st.st_size > SIZE_MAX) {
+        close(fd);
+        return NULL;
     }
-}
 
-void bmp_addpad(bmp_image * img, uint32_t rows, uint32_t columns, bmp_padtype type)
-{
-    bmp_padv(img, rows, type);
-    bmp_padh(img, columns, type);
-}
+    /**
+     * MAP_PRIVATE gives copy-on-write pages: in-place operations such as
+     * bmp_invert() only duplicate the pages they touch and never reach the
+     * file on disk.
+     */
+    uint8_t * map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
 
-void bmp_padh(bmp_image * img, uint32_t num, bmp_padtype type)
-{
-    if (img->dib.bmiHeader.biBitCount != BMP_8_BITS) return;
-    //TODO: add support to other bit per pixel configurations.
+    if (map == MAP_FAILED) return NULL;
 
-    uint32_t newWidth = img->dib.bmiHeader.biWidth + 2*num;
+    img = bmp_calloc(sizeof(bmp_image));
+    if (img == NULL) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
 
-    uint32_t datasize = newWidth 
-                    * img->dib.bmiHeader.biHeight 
-                    * img->dib.bmiHeader.biBitCount / BMP_8_BITS;
+    img->mapAddress = map;
+    img->mapLength = st.st_size;
 
-    uint8_t * newPixelArray = malloc(datasize);
+    size_t offset = bmp_parseheaders(img, map, img->mapLength);
+    if (offset == 0) return bmp_cleanup(NULL, img);
 
-    for (uint32_t y = 0; y < img->dib.bmiHeader.biHeight; y++)
-    {
-        for (uint32_t x = 0; x < num; x++)
-        {
-            switch (type)
-            {
-            case BMP_PADTYPE_ZEROS:
-                newPixelArray[y * newWidth + x] = 0;
-                break;
-            
-            case BMP_PADTYPE_REPLICATE:
-                newPixelArray[y * newWidth + x] = img->ciPixelArray[y * img->dib.bmiHeader.biWidth + 0];
-                break;
-            
-            default:
-                return;
-                break;
-            }
-        }
+    if (bmp_filepalettesize(img) > 0) img->dib.bmiColors = (bmp_rgbquad *) (map + offset);
 
-        for (uint32_t x = num; x < img->dib.bmiHeader.biWidth + num; x++)
-        {
-            newPixelArray[y * newWidth + x] = img->ciPixelArray[y * img->dib.bmiHeader.biWidth + x - num];
-        }
+    img->ciPixelArray = map + img->fileheader.bfOffBits;
 
-        for (uint32_t x = img->dib.bmiHeader.biWidth + num; x < newWidth; x++)
-        {
-            switch (type)
-            {
-            case BMP_PADTYPE_ZEROS:
-                newPixelArray[y * newWidth + x] = 0;
-                break;
-            
-            case BMP_PADTYPE_REPLICATE:
-                newPixelArray[y * newWidth + x] = img->ciPixelArray[y * img->dib.bmiHeader.biWidth + img->dib.bmiHeader.biWidth - 1];
-                break;
-            
-            default:
-                return;
-                break;
-            }
-        }       
-    }
-    
-    free(img->ciPixelArray);
-    
-    img->ciPixelArray = malloc(datasize);
-    for (size_t i = 0; i < datasize; i++)
-    {
-        img->ciPixelArray[i] = newPixelArray[i];
-    }
-    
-    free(newPixelArray);
+    // padded rows are used where they are, operations step over the padding
+    if (bmp_isuncompressed(img) && bmp_getstride(img) != bmp_getrowsize(img))
+        img->rowStride = bmp_getstride(img);
 
-    img->fileheader.bfSize = img->fileheader.bfSize - img->dib.bmiHeader.biSizeImage + datasize;
-    img->dib.bmiHeader.biSizeImage = datasize;
-    img->dib.bmiHeader.biWidth = newWidth;
-}
+    // every row operations will step to lies within the mapping
+    if ((uint64_t) bmp_getarraysize(img) > img->mapLength - img->fileheader.bfOffBits)
+        return bmp_cleanup(NULL, img);
 
-void bmp_padv(bmp_image * img, uint32_t num, bmp_padtype type)
-{
-    if (img->dib.bmiHeader.biBitCount != BMP_8_BITS) return;
-    //TODO: add support to other bit per pixel configurations.
+    BMP_STATS_BYTES(bmp_getdatasize(img));
 
-    uint32_t newHeight = img->dib.bmiHeader.biHeight + 2*num;
+    return img;
+}
 
-    uint32_t datasize = img->dib.bmiHeader.biWidth 
-                    * newHeight 
-                    * img->dib.bmiHeader.biBitCount / BMP_8_BITS;
+bmp_image * bmp_read_buffer(const void * data, size_t size)
+{
+    BMP_STATS_SCOPE(BMP_STAT_READ_BUFFER);
 
-    uint8_t * newPixelArray = malloc(datasize);
+    if (data == NULL) return NULL;
 
-    for (uint32_t x = 0; x < img->dib.bmiHeader.biWidth; x++)
-    {
-        for (uint32_t y = 0; y < num; y++)
-        {
-            switch (type)
-            {
-            case BMP_PADTYPE_ZEROS:
-                newPixelArray[y * img->dib.bmiHeader.biWidth + x] = 0;
-                break;
-            
-            case BMP_PADTYPE_REPLICATE:
-                newPixelArray[y * img->dib.bmiHeader.biWidth + x] = img->ciPixelArray[0 + x];
-                break;
-            
-            default:
-                return;
-                break;
-            }
-        }
+    bmp_image * img = bmp_calloc(sizeof(bmp_image));
+    if (img == NULL) return NULL;
 
-        for (uint32_t y = num; y < img->dib.bmiHeader.biHeight + num; y++)
-        {
-            newPixelArray[y * img->dib.bmiHeader.biWidth + x] = img->ciPixelArray[(y - num) * img->dib.bmiHeader.biWidth + x];
-        }
+    size_t offset = bmp_parseheaders(img, data, size);
+    if (offset == 0) return bmp_cleanup(NULL, img);
 
-        for (uint32_t y = img->dib.bmiHeader.biHeight + num; y < newHeight; y++)
-        {
-            switch (type)
-            {
-            case BMP_PADTYPE_ZEROS:
-                newPixelArray[y * img->dib.bmiHeader.biWidth + x] = 0;
-                break;
-            
-            case BMP_PADTYPE_REPLICATE:
-                newPixelArray[y * img->dib.bmiHeader.biWidth + x] = img->ciPixelArray[(img->dib.bmiHeader.biHeight - 1) * img->dib.bmiHeader.biWidth + x];
-                break;
-            
-            default:
-                return;
-                break;
-            }
-        }
+    uint32_t palettesize = bmp_filepalettesize(img);
+
+    if (palettesize > 0) {
+        img->dib.bmiColors = bmp_alloc(palettesize);
+        if (img->dib.bmiColors == NULL) return bmp_cleanup(NULL, img);
+        memcpy(img->dib.bmiColors, (const uint8_t *) data + offset, palettesize);
     }
 
-    free(img->ciPixelArray);
-    
-    img->ciPixelArray = malloc(datasize);
-    for (size_t i = 0; i < datasize; i++)
+    const uint8_t * pixels = (const uint8_t *) data + img->fileheader.bfOffBits;
+
+    if (bmp_isuncompressed(img))
     {
-        img->ciPixelArray[i] = newPixelArray[i];
+        img->ciPixelArray = bmp_alloc((size_t) bmp_getrowsize(img) * bmp_getheight(img));
+        if (img->ciPixelArray == NULL) return bmp_cleanup(NULL, img);
+        bmp_unpad(img, pixels);
     }
-    
-    free(newPixelArray);
-    
-    img->fileheader.bfSize = img->fileheader.bfSize - img->dib.bmiHeader.biSizeImage + datasize;
-    img->dib.bmiHeader.biSizeImage = datasize;
-    img->dib.bmiHeader.biHeight = newHeight;
+    else
+    {
+        img->ciPixelArray = bmp_alloc(bmp_getdatasize(img));
+        if (img->ciPixelArray == NULL) return bmp_cleanup(NULL, img);
+        memcpy(img->ciPixelArray, pixels, bmp_getdatasize(img));
+    }
+
+    BMP_STATS_BYTES(bmp_getdatasize(img));
+
+    return img;
 }
 
-void bmp_printdetails(bmp_image * img)
+/**
+ * Headers <img> is saved with: the sizes the file will really have, 
+ * whatever the layout of its rows in memory. Returns the size of the 
+ * pixel data in the file.
+ */
+static uint32_t bmp_saveheaders(bmp_image * img, bmp_image * header)
 {
-    printf("\n");
-    printf("From BITMAPFILEHEADER: \n");
+    uint32_t datasize = bmp_getdatasize(img);
 
-    printf("filetype:         \t%u  \t0x%x\n", img->fileheader.bfType, img->fileheader.bfType);
-    printf("filesize:         \t%u  \t0x%x\n", img->fileheader.bfSize, img->fileheader.bfSize);
-    printf("reserved1:        \t%u  \t0x%x\n", img->fileheader.bfReserved1, img->fileheader.bfReserved1);
-    printf("reserved2:        \t%u  \t0x%x\n", img->fileheader.bfReserved2, img->fileheader.bfReserved2);
-    printf("offset bits:      \t%u  \t0x%x\n", img->fileheader.bfOffBits, img->fileheader.bfOffBits);
+    if (bmp_isuncompressed(img)) datasize = bmp_getstride(img) * bmp_getheight(img);
 
-    printf("\n");
-    printf("From BITMAPINFOHEADER: \n");
+    *header = *img;
 
-    printf("size:             \t%u  \t0x%x\n", img->dib.bmiHeader.biSize, img->dib.bmiHeader.biSize);
-    printf("width:            \t%u  \t0x%x\n", img->dib.bmiHeader.biWidth, img->dib.bmiHeader.biWidth);
-    printf("height:           \t%u  \t0x%x\n", img->dib.bmiHeader.biHeight, img->dib.bmiHeader.biHeight);
-    printf("planes:           \t%u  \t0x%x\n", img->dib.bmiHeader.biPlanes, img->dib.bmiHeader.biPlanes);
-    printf("bits per pixel:   \t%u  \t0x%x\n", img->dib.bmiHeader.biBitCount, img->dib.bmiHeader.biBitCount);
-    printf("compression:      \t%u  \t0x%x\n", img->dib.bmiHeader.biCompression, img->dib.bmiHeader.biCompression);
-    printf("imagesize:        \t%u  \t0x%x\n", img->dib.bmiHeader.biSizeImage, img->dib.bmiHeader.biSizeImage);
-    printf("xresolution:      \t%u  \t0x%x\n", img->dib.bmiHeader.biXPelsPerMeter, img->dib.bmiHeader.biXPelsPerMeter);
-    printf("yresolution:      \t%u  \t0x%x\n", img->dib.bmiHeader.biYPelsPerMeter, img->dib.bmiHeader.biYPelsPerMeter);
-    printf("colours used:     \t%u  \t0x%x\n", img->dib.bmiHeader.biClrUsed, img->dib.bmiHeader.biClrUsed);
-    printf("main colours:     \t%u  \t0x%x\n", img->dib.bmiHeader.biClrImportant, img->dib.bmiHeader.biClrImportant);
+    header->fileheader.bfOffBits = bmp_getheaderssize(img);
+    header->fileheader.bfSize = header->fileheader.bfOffBits + datasize;
+    header->dib.bmiHeader.biSizeImage = datasize;
 
-    if (img->dib.bmiHeader.biSize >= BMP_V4HEADER)
-    {
-        printf("\n");
-        printf("From BITMAPV4HEADER: \n");
+    return datasize;
+}
 
-        printf("red mask:       \t0x%x\n", img->dib.bmiv4Header.bV4RedMask);
-        printf("green mask:     \t0x%x\n", img->dib.bmiv4Header.bV4GreenMask);
-        printf("blue mask:      \t0x%x\n", img->dib.bmiv4Header.bV4BlueMask);
-        printf("alpha mask:     \t0x%x\n", img->dib.bmiv4Header.bV4AlphaMask);
-        printf("color space:    \t0x%x\n", img->dib.bmiv4Header.bV4CSType);
-        printf("red (x):        \t0x%x\n", img->dib.bmiv4Header.bV4Endpoints.ciexyzRed.ciexyzX);
-        printf("red (y):        \t0x%x\n", img->dib.bmiv4Header.bV4Endpoints.ciexyzRed.ciexyzY);
-        printf("red (z):        \t0x%x\n", img->dib.bmiv4Header.bV4Endpoints.ciexyzRed.ciexyzZ);
-        printf("green (x):      \t0x%x\n", img->dib.bmiv4Header.bV4Endpoints.ciexyzGreen.ciexyzX);
-        printf("green (y):      \t0x%x\n", img->dib.bmiv4Header.bV4Endpoints.ciexyzGreen.ciexyzY);
-        printf("green (z):      \t0x%x\n", img->dib.bmiv4Header.bV4Endpoints.ciexyzGreen.ciexyzZ);
-        printf("blue (x):       \t0x%x\n", img->dib.bmiv4Header.bV4Endpoints.ciexyzBlue.ciexyzX);
-        printf("blue (y):       \t0x%x\n", img->dib.bmiv4Header.bV4Endpoints.ciexyzBlue.ciexyzY);
-        printf("blue (z):       \t0x%x\n", img->dib.bmiv4Header.bV4Endpoints.ciexyzBlue.ciexyzZ);
-        printf("gamma red:      \t0x%x\n", img->dib.bmiv4Header.bV4GammaRed);
-        printf("gamma green:    \t0x%x\n", img->dib.bmiv4Header.bV4GammaGreen);
-        printf("gamma blue:     \t0x%x\n", img->dib.bmiv4Header.bV4GammaBlue);
+int bmp_save_buffer(bmp_image * img, void * data, size_t size)
+{
+    BMP_STATS_SCOPE(BMP_STAT_SAVE_BUFFER);
+
+    if (img == NULL || img->ciPixelArray == NULL || data == NULL) return 0;
+
+    bmp_image header;
+    uint32_t datasize = bmp_saveheaders(img, &header);
+
+    if (size < header.fileheader.bfSize) return 0;
+
+    BMP_STATS_BYTES(datasize);
+
+    uint8_t * dst = data;
+
+    memcpy(dst, &header.fileheader, sizeof(bmp_fileheader));
+    dst += sizeof(bmp_fileheader);
+
+    memcpy(dst, &header.dib.bmiHeader, sizeof(bmp_infoheader));
+    dst += sizeof(bmp_infoheader);
+
+    if (img->dib.bmiHeader.biSize >= BMP_V4HEADER) {
+        memcpy(dst, &header.dib.bmiv4Header, sizeof(bmp_v4header));
+        dst += sizeof(bmp_v4header);
     }
-    
-    if (img->dib.bmiHeader.biSize >= BMP_V5HEADER)
-    {
-        printf("\n");
-        printf("From BITMAPV5HEADER: \n");
 
-        printf("intent:         \t%u    \t0x%x\n", img->dib.bmiv5Header.bV5Intent, img->dib.bmiv5Header.bV5Intent);
-        printf("profile data:   \t%u    \t0x%x\n", img->dib.bmiv5Header.bV5ProfileData, img->dib.bmiv5Header.bV5ProfileData);
-        printf("profile size:   \t%u    \t0x%x\n", img->dib.bmiv5Header.bV5ProfileSize, img->dib.bmiv5Header.bV5ProfileSize);
-        printf("reserved:       \t%u    \t0x%x\n", img->dib.bmiv5Header.bV5Reserved, img->dib.bmiv5Header.bV5Reserved);
+    if (img->dib.bmiHeader.biSize >= BMP_V5HEADER) {
+        memcpy(dst, &header.dib.bmiv5Header, sizeof(bmp_v5header));
+        dst += sizeof(bmp_v5header);
     }
 
-    printf("\n");
-}
+    uint32_t palettesize = bmp_getpalettesize(img);
 
-void bmp_printpixel(bmp_image * img, int x, int y)
-{
-    switch (img->dib.bmiHeader.biBitCount)
-    {
-    case BMP_1_BIT:
-    case BMP_2_BITS:
-    case BMP_4_BITS:
-    case BMP_16_BITS:
-        //TODO: implement support for these bpp.
-        break;
-    case BMP_8_BITS:
-        printf(
-            "img[%i][%i] = (%u)\n", x, y, 
-            bmp_getpixelcolor(img, x, y, BMP_COLOR_RED)
-        );
-        break;
-    case BMP_24_BITS:
-        printf(
-            "img[%i][%i] = (%u, %u, %u)\n", x, y, 
-            bmp_getpixelcolor(img, x, y, BMP_COLOR_RED), 
-            bmp_getpixelcolor(img, x, y, BMP_COLOR_GREEN), 
-            bmp_getpixelcolor(img, x, y, BMP_COLOR_BLUE)
-        );
-        break;
-    case BMP_32_BITS:
-        printf(
-            "img[%i][%i] = (%u, %u, %u, %u)\n", x, y, 
-            bmp_getpixelcolor(img, x, y, BMP_COLOR_RED), 
-            bmp_getpixelcolor(img, x, y, BMP_COLOR_GREEN), 
-            bmp_getpixelcolor(img, x, y, BMP_COLOR_BLUE), 
-            bmp_getpixelcolor(img, x, y, BMP_COLOR_ALPHA)
-        );
-        break;
-    default:
-        break;
+    if (palettesize > 0 && img->dib.bmiColors != NULL) {
+        memcpy(dst, img->dib.bmiColors, palettesize);
+        dst += palettesize;
     }
-}
 
-bmp_image * bmp_cleanup(FILE * fptr , bmp_image * img)
-{
-    if (fptr != NULL) fclose(fptr);
+    uint32_t rows = bmp_getheight(img);
+    uint32_t rowsize = bmp_getrowsize(img);
+    uint32_t stride = bmp_getstride(img);
+    uint32_t step = bmp_getrowstep(img);
 
-    if (img != NULL) {
-        if (img->dib.bmiColors != NULL) free(img->dib.bmiColors);
-        if (img->ciPixelArray != NULL) free(img->ciPixelArray);
-        free(img);
+    if (!bmp_isuncompressed(img) || step == stride) {
+        memcpy(dst, img->ciPixelArray, datasize);
+        return 1;
     }
 
-    return NULL;
+    for (uint32_t y = 0; y < rows; y++, dst += stride) {
+        memcpy(dst, img->ciPixelArray + (size_t) y * step, rowsize);
+        memset(dst + rowsize, 0, stride - rowsize);
+    }
+
+    return 1;
 }
 
-int bmp_checkheaders(bmp_image * img)
+int bmp_save(bmp_image * img, const char * filename)
 {
-    if (img->fileheader.bfType != BMP_FILETYPE_BM)
-        return 0;
+    BMP_STATS_SCOPE(BMP_STAT_SAVE);
 
-    switch (img->dib.bmiHeader.biBitCount) {
-    case BMP_0_BITS: break;
-    case BMP_1_BIT: break;
-    case BMP_2_BITS: break;
-    case BMP_4_BITS: break;
-    case BMP_8_BITS: break;
-    case BMP_16_BITS: break;
-    case BMP_24_BITS: break;
-    case BMP_32_BITS: break;
-    default : return 0;
-    }
+    FILE * fptr = NULL;
+    fptr = fopen(filename, "w");
 
-    if (img->dib.bmiHeader.biPlanes != BMP_DEFAULT_COLORPLANES) 
-        return 0;
+    if (fptr == NULL) return 0;
 
-    switch (img->dib.bmiHeader.biCompression) {
-    case BMP_BI_RGB: break;
-    case BMP_BI_RLE8: break;
-    case BMP_BI_RLE4: break;
-    case BMP_BI_BITFIELDS: break;
-    case BMP_BI_JPEG: break;
-    case BMP_BI_PNG: break;
-    case BMP_BI_ALPHABITFIELDS: break;
-    case BMP_BI_CMYK: break;
-    case BMP_BI_CMYKRLE8: break;
-    case BMP_BI_CMYKRLE4: break;
-    default : return 0;
+    uint32_t rows = bmp_getheight(img);
+    uint32_t rowsize = bmp_getrowsize(img);
+    uint32_t stride = bmp_getstride(img);
+    uint32_t step = bmp_getrowstep(img);
+
+    bmp_image header;
+    uint32_t datasize = bmp_saveheaders(img, &header);
+
+    BMP_STATS_BYTES(datasize);
+
+    if (bmp_writeheaders(fptr, &header) == 0) {
+        fclose(fptr);
+        return 0;
     }
 
-    if (img->dib.bmiHeader.biSize >= BMP_V4HEADER)
+    // rows already padded (mapped files) go out as they are
+    if (!bmp_isuncompressed(img) || step == stride)
     {
-        switch (img->dib.bmiv4Header.bV4CSType)
-        {
-        case BMP_LCS_CALIBRATED_RGB: break;
-        case BMP_LCS_sRGB: break;
-        case BMP_LCS_WINDOWS_COLOR_SPACE: break;
-        case BMP_LCS_PROFILE_LINKED: break;
-        case BMP_LCS_PROFILE_EMBEDDED: break;
-        default: return 0;
+        if (fwrite(img->ciPixelArray, sizeof(uint8_t), datasize, fptr) != datasize) {
+            fclose(fptr);
+            return 0;
         }
+
+        return fclose(fptr) == 0;
     }
-    
-    if (img->dib.bmiHeader.biSize >= BMP_V5HEADER)
+
+    if (fflush(fptr) != 0) {
+        fclose(fptr);
+        return 0;
+    }
+
+    /**
+     * Padded rows go straight from ciPixelArray to the file, each row 
+     * followed by its padding bytes, BMP_SAVE_IOVROWS rows per writev().
+     */
+    static const uint8_t pad[4] = {0, 0, 0, 0};
+    struct iovec iov[2*BMP_SAVE_IOVROWS];
+    int fd = fileno(fptr);
+
+    for (uint32_t y = 0; y < rows; )
     {
-        switch (img->dib.bmiv5Header.bV5Intent)
+        int iovcnt = 0;
+
+        for (uint32_t k = 0; k < BMP_SAVE_IOVROWS && y < rows; k++, y++)
         {
-        case BMP_LCS_GM_ABS_COLORIMETRIC: break;
-        case BMP_LCS_GM_BUSINESS: break;
-        case BMP_LCS_GM_GRAPHICS: break;
-        case BMP_LCS_GM_IMAGES: break;
-        default: return 0;
+            iov[iovcnt].iov_base = img->ciPixelArray + (size_t) y * step;
+            iov[iovcnt].iov_len = rowsize;
+            iovcnt++;
+            iov[iovcnt].iov_base = (void *) pad;
+            iov[iovcnt].iov_len = stride - rowsize;
+            iovcnt++;
+        }
+
+        if (bmp_writeiov(fd, iov, iovcnt) == 0) {
+            fclose(fptr);
+            return 0;
         }
     }
-    
+
+    return fclose(fptr) == 0;
 }
 
-bmp_image * bmp_getredbricks()
+/**
+ * Red, green, blue and alpha masks of a 16bpp or 32bpp pixel of <img>: 
+ * from the V4 header or the mask palette of bit field images, X1R5G5B5 
+ * and X8R8G8B8 for BI_RGB. The alpha mask comes with V4 headers and 
+ * BI_ALPHABITFIELDS.
+ */
+static void bmp_bitmasks(bmp_image * img, uint32_t masks[4])
 {
-    bmp_image * img = malloc(sizeof(bmp_image));
-    if (img == NULL) return NULL;
+    uint32_t compression = img->dib.bmiHeader.biCompression;
+
+    if (img->dib.bmiHeader.biBitCount == BMP_16_BITS) {
+        masks[0] = BMP_BITFIELDS_R5G5B5_R5;
+        masks[1] = BMP_BITFIELDS_R5G5B5_G5;
+        masks[2] = BMP_BITFIELDS_R5G5B5_B5;
+    } else {
+        masks[0] = 0x00FF0000;
+        masks[1] = 0x0000FF00;
+        masks[2] = 0x000000FF;
+    }
+    masks[3] = 0;
+
+    if (compression != BMP_BI_BITFIELDS && compression != BMP_BI_ALPHABITFIELDS) return;
+
+    if (img->dib.bmiHeader.biSize >= BMP_V4HEADER) {
+        masks[0] = img->dib.bmiv4Header.bV4RedMask;
+        masks[1] = img->dib.bmiv4Header.bV4GreenMask;
+        masks[2] = img->dib.bmiv4Header.bV4BlueMask;
+        masks[3] = img->dib.bmiv4Header.bV4AlphaMask;
+    } else if (img->dib.bmiColors != NULL) {
+        memcpy(masks, img->dib.bmiColors, 3 * sizeof(uint32_t));
+        if (compression == BMP_BI_ALPHABITFIELDS) memcpy(&masks[3], &img->dib.bmiColors[3], sizeof(uint32_t));
+    }
+}
 
-    img->fileheader.bfType = BMP_FILETYPE_BM;
-    img->fileheader.bfSize = 630;
-    img->fileheader.bfReserved1 = 0;
-    img->fileheader.bfReserved2 = 0;
-    img->fileheader.bfOffBits = 118;
+/**
+ * A colour field of a 16bpp or 32bpp pixel, <max> 0 if it is missing. 
+ * (value * scale + BMP_BITFIELD_ROUND) >> BMP_BITFIELD_SHIFT reads it as
+ * a byte, the same as (value * 255 + max / 2) / max for every width up 
+ * to 8 bits.
+ */
+typedef struct bmp_bitfield {
+    uint32_t shift;
+    uint32_t max;
+    uint32_t scale;
+} bmp_bitfield;
+
+// the field of <mask>, narrowed to its top 8 bits if <narrow>
+static void bmp_bitfield_init(bmp_bitfield * field, uint32_t mask, int narrow)
+{
+    uint32_t shift = 0;
+    uint32_t width = 0;
 
-    img->dib.bmiHeader.biSize = 40;
-    img->dib.bmiHeader.biWidth = 32;
-    img->dib.bmiHeader.biHeight = 32;
-    img->dib.bmiHeader.biPlanes = 1;
-    img->dib.bmiHeader.biBitCount = BMP_4_BITS;
-    img->dib.bmiHeader.biCompression = BMP_BI_RGB;
-    img->dib.bmiHeader.biSizeImage = 0;
-    img->dib.bmiHeader.biXPelsPerMeter = 0;
-    img->dib.bmiHeader.biYPelsPerMeter = 0;
-    img->dib.bmiHeader.biClrUsed = 0;
-    img->dib.bmiHeader.biClrImportant = 0;
+    while (mask != 0 && !(mask & 1)) { mask >>= 1; shift++; }
+    while (width < 32 - shift && (mask & (1u << width))) width++;
 
-    img->dib.bmiColors = malloc(sizeof(bmp_rgbquad)*pow(2,img->dib.bmiHeader.biBitCount));
+    if (narrow && width > 8) {
+        shift += width - 8;
+        width = 8;
+    }
 
-    img->dib.bmiColors[0].rgbBlue = 0x00; img->dib.bmiColors[0].rgbGreen = 0x00; img->dib.bmiColors[0].rgbRed = 0x00; img->dib.bmiColors[0].rgbReserved = 0x00;
-    img->dib.bmiColors[1].rgbBlue = 0x00; img->dib.bmiColors[1].rgbGreen = 0x00; img->dib.bmiColors[1].rgbRed = 0x80; img->dib.bmiColors[1].rgbReserved = 0x00;
-    img->dib.bmiColors[2].rgbBlue = 0x00; img->dib.bmiColors[2].rgbGreen = 0x80; img->dib.bmiColors[2].rgbRed = 0x00; img->dib.bmiColors[2].rgbReserved = 0x00;
-    img->dib.bmiColors[3].rgbBlue = 0x00; img->dib.bmiColors[3].rgbGreen = 0x80; img->dib.bmiColors[3].rgbRed = 0x80; img->dib.bmiColors[3].rgbReserved = 0x00;
-    
-    img->dib.bmiColors[4].rgbBlue = 0x80; img->dib.bmiColors[4].rgbGreen = 0x00; img->dib.bmiColors[4].rgbRed = 0x00; img->dib.bmiColors[4].rgbReserved = 0x00;
-    img->dib.bmiColors[5].rgbBlue = 0x80; img->dib.bmiColors[5].rgbGreen = 0x00; img->dib.bmiColors[5].rgbRed = 0x80; img->dib.bmiColors[5].rgbReserved = 0x00;
-    img->dib.bmiColors[6].rgbBlue = 0x80; img->dib.bmiColors[6].rgbGreen = 0x80; img->dib.bmiColors[6].rgbRed = 0x00; img->dib.bmiColors[6].rgbReserved = 0x00;
-    img->dib.bmiColors[7].rgbBlue = 0x80; img->dib.bmiColors[7].rgbGreen = 0x80; img->dib.bmiColors[7].rgbRed = 0x80; img->dib.bmiColors[7].rgbReserved = 0x00;
-    
-    img->dib.bmiColors[8].rgbBlue = 0xc0; img->dib.bmiColors[8].rgbGreen = 0xc0; img->dib.bmiColors[8].rgbRed = 0xc0; img->dib.bmiColors[8].rgbReserved = 0x00;
-    img->dib.bmiColors[9].rgbBlue = 0x00; img->dib.bmiColors[9].rgbGreen = 0x00; img->dib.bmiColors[9].rgbRed = 0xff; img->dib.bmiColors[9].rgbReserved = 0x00;
-    img->dib.bmiColors[10].rgbBlue = 0x00; img->dib.bmiColors[10].rgbGreen = 0xff; img->dib.bmiColors[10].rgbRed = 0x00; img->dib.bmiColors[10].rgbReserved = 0x00;
-    img->dib.bmiColors[11].rgbBlue = 0x00; img->dib.bmiColors[11].rgbGreen = 0xff; img->dib.bmiColors[11].rgbRed = 0xff; img->dib.bmiColors[11].rgbReserved = 0x00;
-    
-    img->dib.bmiColors[12].rgbBlue = 0xff; img->dib.bmiColors[12].rgbGreen = 0x00; img->dib.bmiColors[12].rgbRed = 0x00; img->dib.bmiColors[12].rgbReserved = 0x00;
-    img->dib.bmiColors[13].rgbBlue = 0xff; img->dib.bmiColors[13].rgbGreen = 0x00; img->dib.bmiColors[13].rgbRed = 0xff; img->dib.bmiColors[13].rgbReserved = 0x00;
-    img->dib.bmiColors[14].rgbBlue = 0xff; img->dib.bmiColors[14].rgbGreen = 0xff; img->dib.bmiColors[14].rgbRed = 0x00; img->dib.bmiColors[14].rgbReserved = 0x00;
-    img->dib.bmiColors[15].rgbBlue = 0xff; img->dib.bmiColors[15].rgbGreen = 0xff; img->dib.bmiColors[15].rgbRed = 0xff; img->dib.bmiColors[15].rgbReserved = 0x00;
+    field->shift = shift;
+    field->max = (uint32_t) ((1ull << width) - 1);
+    field->scale = (width == 0 || width > 8) ? 0 : ((255u << BMP_BITFIELD_SHIFT) + field->max / 2) / field->max;
+}
+
+/**
+ * Whether the pixels of <img> are read through their bit fields: all 
+ * 16bpp ones, and 32bpp ones unless laid out as blue, green, red and a 
+ * fourth byte, which are read as bytes.
+ */
+static int bmp_hasfields(bmp_image * img)
+{
+    uint32_t masks[4];
+
+    switch (img->dib.bmiHeader.biBitCount)
+    {
+    case BMP_16_BITS:
+        return 1;
+    case BMP_32_BITS:
+        bmp_bitmasks(img, masks);
+        return masks[0] != 0x00FF0000 || masks[1] != 0x0000FF00 || masks[2] != 0x000000FF 
+            || (masks[3] != 0 && masks[3] != 0xFF000000);
+    default:
+        return 0;
+    }
+}
+
+uint8_t bmp_getpixelcolor(bmp_image * img, int x, int y, bmp_color color)
+{
+    uint32_t bitcount = img->dib.bmiHeader.biBitCount;
+    const uint8_t * row = img->ciPixelArray + (size_t) y * bmp_getrowstep(img);
+
+    switch (bitcount)
+    {
+    case BMP_0_BITS:
+        return 0;
+        break;
+    case BMP_1_BIT:
+    case BMP_2_BITS:
+    case BMP_4_BITS:
+        // the palette index, as for 8bpp
+        return (row[x * bitcount / 8] >> (8 - bitcount - x * bitcount % 8)) & ((1u << bitcount) - 1);
+        break;
+    case BMP_8_BITS:
+        return row[x];
+        break;
+    case BMP_16_BITS:
+    case BMP_32_BITS:
+    {
+        if (!bmp_hasfields(img)) return row[4*x + color];
+
+        uint32_t masks[4];
+        uint32_t mask;
+        uint32_t pixel;
+        bmp_bitfield field;
+
+        // masks go red, green, blue, alpha; colours blue, green, red, alpha
+        bmp_bitmasks(img, masks);
+        mask = masks[(color == BMP_COLOR_ALPHA) ? 3 : BMP_COLOR_RED - color];
+
+        if (bitcount == BMP_16_BITS) {
+            mask &= 0xFFFF;
+            pixel = row[2*x] | (row[2*x + 1] << 8);
+        } else {
+            pixel = row[4*x] | (row[4*x + 1] << 8) | ((uint32_t) row[4*x + 2] << 16) | ((uint32_t) row[4*x + 3] << 24);
+        }
+        bmp_bitfield_init(&field, mask, 1);
+
+        uint32_t value = (pixel >> field.shift) & field.max;
+        return (value * field.scale + BMP_BITFIELD_ROUND) >> BMP_BITFIELD_SHIFT;
+        break;
+    }
+    case BMP_24_BITS:
+        return row[3*x + color];
+        break;
+
+    default:
+        return 0;
+        break;
+    }
+    // if (img->dib.bmiHeader.biBitCount == BMP_8_BITS) 
+    //     return img->ciPixelArray[ y*img->dib.bmiHeader.biWidth + x ];
+    // return img->ciPixelArray[3*(y*img->dib.bmiHeader.biWidth + x) + color];
+}
+
+uint8_t bmp_findgray(uint8_t red, uint8_t green, uint8_t blue)
+{
+    uint32_t gray = BMP_GRAY_WEIGHT_RED * red 
+                    + BMP_GRAY_WEIGHT_GREEN * green 
+                    + BMP_GRAY_WEIGHT_BLUE * blue 
+                    + BMP_GRAY_ROUND;
+    return (uint8_t) (gray >> BMP_GRAY_SHIFT);
+}
+
+bmp_image * bmp_grayheader(bmp_image * img, bmp_setncolours ncolours)
+{
+    if (img == NULL) return NULL;
+
+    bmp_image * new = bmp_calloc(sizeof(bmp_image));
+    if (new == NULL) return bmp_cleanup(NULL, new);
+
+    new->dib.bmiHeader.biSize = BMP_INFOHEADER;
+    new->dib.bmiHeader.biWidth = img->dib.bmiHeader.biWidth;
+    new->dib.bmiHeader.biHeight = img->dib.bmiHeader.biHeight;
+    new->dib.bmiHeader.biPlanes = BMP_DEFAULT_COLORPLANES;
+    new->dib.bmiHeader.biBitCount = BMP_8_BITS;
+    new->dib.bmiHeader.biCompression = BMP_BI_RGB;
+    new->dib.bmiHeader.biSizeImage = bmp_getstride(new) * bmp_getheight(new);
+    new->dib.bmiHeader.biXPelsPerMeter = img->dib.bmiHeader.biXPelsPerMeter;
+    new->dib.bmiHeader.biYPelsPerMeter = img->dib.bmiHeader.biYPelsPerMeter;
+    new->dib.bmiHeader.biClrUsed = 0;
+    new->dib.bmiHeader.biClrImportant = 0;
+
+    uint32_t palettesize = pow(2, new->dib.bmiHeader.biBitCount) 
+                    * sizeof(bmp_rgbquad);
+    
+    new->fileheader.bfType = BMP_FILETYPE_BM;
+    new->fileheader.bfSize = BMP_FILEHEADER_SIZE 
+                    + new->dib.bmiHeader.biSize 
+                    + palettesize 
+                    + new->dib.bmiHeader.biSizeImage;
+    
+    new->fileheader.bfReserved1 = 0;
+    new->fileheader.bfReserved2 = 0;
+    
+    new->fileheader.bfOffBits = BMP_FILEHEADER_SIZE 
+                    + new->dib.bmiHeader.biSize 
+                    + palettesize;
+    
+    //TODO: add support to 4bpp, 2bpp and 1bpp generation
+
+    new->dib.bmiColors = bmp_alloc(palettesize);
+    if (new->dib.bmiColors == NULL) return bmp_cleanup(NULL, new);
+
+    uint32_t maxcolours = pow(2, new->dib.bmiHeader.biBitCount);
+    bmp_lut lut;
+    bmp_lut_quantize(&lut, ncolours);
+
+    for (uint32_t i = 0; i < maxcolours; i++) {
+        new->dib.bmiColors[i].rgbBlue = lut.table[BMP_COLOR_BLUE][i];
+        new->dib.bmiColors[i].rgbGreen = lut.table[BMP_COLOR_GREEN][i];
+        new->dib.bmiColors[i].rgbRed = lut.table[BMP_COLOR_RED][i];
+        new->dib.bmiColors[i].rgbReserved = 0;
+    }
+
+    return new;
+}
+
+#if BMP_X86
+/**
+ * Gray levels of 4 BGRx pixels held as bytes in <bgrx>, using the same 
+ * fixed-point formula as bmp_findgray(). The x byte is weighted 0.
+ */
+static inline int bmp_gray4_sse2(__m128i bgrx)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i weights = _mm_set_epi16(0, BMP_GRAY_WEIGHT_RED, BMP_GRAY_WEIGHT_GREEN, BMP_GRAY_WEIGHT_BLUE,
+                                          0, BMP_GRAY_WEIGHT_RED, BMP_GRAY_WEIGHT_GREEN, BMP_GRAY_WEIGHT_BLUE);
+    const __m128i round = _mm_set1_epi32(BMP_GRAY_ROUND);
+
+    __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(bgrx, zero), weights);
+    __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(bgrx, zero), weights);
+
+    lo = _mm_add_epi32(lo, _mm_srli_epi64(lo, 32));
+    hi = _mm_add_epi32(hi, _mm_srli_epi64(hi, 32));
+
+    __m128i sum = _mm_unpacklo_epi64(_mm_shuffle_epi32(lo, _MM_SHUFFLE(3, 3, 2, 0)),
+                                     _mm_shuffle_epi32(hi, _MM_SHUFFLE(3, 3, 2, 0)));
+    sum = _mm_srli_epi32(_mm_add_epi32(sum, round), BMP_GRAY_SHIFT);
+    sum = _mm_packs_epi32(sum, sum);
+    sum = _mm_packus_epi16(sum, sum);
+
+    return _mm_cvtsi128_si32(sum);
+}
+
+static uint32_t bmp_grayrow_sse2_32(const uint8_t * src, uint8_t * dst, uint32_t width)
+{
+    uint32_t x = 0;
+
+    for (; x + 4 <= width; x += 4) {
+        int gray = bmp_gray4_sse2(_mm_loadu_si128((const __m128i *) (src + 4*x)));
+        memcpy(dst + x, &gray, 4);
+    }
+
+    return x;
+}
+
+__attribute__((target("ssse3")))
+static uint32_t bmp_grayrow_ssse3_24(const uint8_t * src, uint8_t * dst, uint32_t width)
+{
+    const __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    uint32_t x = 0;
+
+    // each 16-byte load covers 4 pixels plus 4 bytes read ahead
+    for (; x + 6 <= width; x += 4) {
+        __m128i bgr = _mm_loadu_si128((const __m128i *) (src + 3*x));
+        int gray = bmp_gray4_sse2(_mm_shuffle_epi8(bgr, spread));
+        memcpy(dst + x, &gray, 4);
+    }
+
+    return x;
+}
+
+__attribute__((target("avx2")))
+static uint32_t bmp_grayrow_avx2(const uint8_t * src, uint8_t * dst, uint32_t width, uint32_t bytesperpixel)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i weights = _mm256_set_epi16(0, BMP_GRAY_WEIGHT_RED, BMP_GRAY_WEIGHT_GREEN, BMP_GRAY_WEIGHT_BLUE,
+                                             0, BMP_GRAY_WEIGHT_RED, BMP_GRAY_WEIGHT_GREEN, BMP_GRAY_WEIGHT_BLUE,
+                                             0, BMP_GRAY_WEIGHT_RED, BMP_GRAY_WEIGHT_GREEN, BMP_GRAY_WEIGHT_BLUE,
+                                             0, BMP_GRAY_WEIGHT_RED, BMP_GRAY_WEIGHT_GREEN, BMP_GRAY_WEIGHT_BLUE);
+    const __m256i spread = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+                                            0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m256i round = _mm256_set1_epi32(BMP_GRAY_ROUND);
+    uint32_t x = 0;
+
+    // 24bpp lanes are loaded 12 bytes apart, reading 4 bytes ahead
+    uint32_t ahead = (bytesperpixel == 3) ? 2 : 0;
+
+    for (; x + 8 + ahead <= width; x += 8) {
+        __m256i bgrx;
+
+        if (bytesperpixel == 3) {
+            __m128i lo = _mm_loadu_si128((const __m128i *) (src + 3*x));
+            __m128i hi = _mm_loadu_si128((const __m128i *) (src + 3*x + 12));
+            bgrx = _mm256_shuffle_epi8(_mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1), spread);
+        } else {
+            bgrx = _mm256_loadu_si256((const __m256i *) (src + 4*x));
+        }
+
+        __m256i lo = _mm256_madd_epi16(_mm256_unpacklo_epi8(bgrx, zero), weights);
+        __m256i hi = _mm256_madd_epi16(_mm256_unpackhi_epi8(bgrx, zero), weights);
+
+        lo = _mm256_add_epi32(lo, _mm256_srli_epi64(lo, 32));
+        hi = _mm256_add_epi32(hi, _mm256_srli_epi64(hi, 32));
+
+        __m256i sum = _mm256_unpacklo_epi64(_mm256_shuffle_epi32(lo, _MM_SHUFFLE(3, 3, 2, 0)),
+                                            _mm256_shuffle_epi32(hi, _MM_SHUFFLE(3, 3, 2, 0)));
+        sum = _mm256_srli_epi32(_mm256_add_epi32(sum, round), BMP_GRAY_SHIFT);
+        sum = _mm256_packs_epi32(sum, sum);
+        sum = _mm256_packus_epi16(sum, sum);
+
+        int gray = _mm_cvtsi128_si32(_mm256_castsi256_si128(sum));
+        memcpy(dst + x, &gray, 4);
+        gray = _mm_cvtsi128_si32(_mm256_extracti128_si256(sum, 1));
+        memcpy(dst + x + 4, &gray, 4);
+    }
+
+    return x;
+}
+#endif
+
+/**
+ * Convert one row of 24bpp or 32bpp pixels, vector kernels first and the
+ * scalar formula for whatever they leave.
+ */
+static void bmp_grayrow(const uint8_t * src, uint8_t * dst, uint32_t width, uint32_t bytesperpixel)
+{
+    uint32_t x = 0;
+
+#if BMP_X86
+    if (__builtin_cpu_supports("avx2")) {
+        x = bmp_grayrow_avx2(src, dst, width, bytesperpixel);
+    } else if (bytesperpixel == 4) {
+        x = bmp_grayrow_sse2_32(src, dst, width);
+    } else if (__builtin_cpu_supports("ssse3")) {
+        x = bmp_grayrow_ssse3_24(src, dst, width);
+    }
+#endif
+
+    for (; x < width; x++) {
+        const uint8_t * pixel = src + bytesperpixel * x;
+        dst[x] = bmp_findgray(pixel[BMP_COLOR_RED], pixel[BMP_COLOR_GREEN], pixel[BMP_COLOR_BLUE]);
+    }
+}
+
+/**
+ * Per-channel contributions to the gray level of a bit field pixel: the 
+ * channel value is expanded to 8 bits and multiplied by its weight once,
+ * so each pixel costs three lookups. 32bpp fields are narrowed to their
+ * top 8 bits to keep the tables small.
+ */
+static int bmp_grayfieldtables(bmp_image * img, uint32_t * tables[3], uint32_t shifts[3], uint32_t maxima[3])
+{
+    uint32_t bitcount = img->dib.bmiHeader.biBitCount;
+    uint32_t masks[4];
+    const uint32_t weights[3] = {
+        BMP_GRAY_WEIGHT_RED, BMP_GRAY_WEIGHT_GREEN, BMP_GRAY_WEIGHT_BLUE
+    };
+
+    bmp_bitmasks(img, masks);
+
+    for (int c = 0; c < 3; c++)
+    {
+        bmp_bitfield field;
+        bmp_bitfield_init(&field, (bitcount == BMP_16_BITS) ? masks[c] & 0xFFFF : masks[c], bitcount == BMP_32_BITS);
+
+        shifts[c] = field.shift;
+        maxima[c] = field.max;
+        tables[c] = bmp_alloc(sizeof(uint32_t) * (field.max + 1));
+        if (tables[c] == NULL) return 0;
+
+        for (uint32_t v = 0; v <= field.max; v++) {
+            uint32_t value = (field.max == 0) ? 0 : (v * 255 + field.max / 2) / field.max;
+            tables[c][v] = value * weights[c];
+        }
+    }
+
+    return 1;
+}
+
+typedef struct bmp_grayargs {
+    const uint8_t * src;
+    uint8_t * dst;
+    uint32_t width;
+    uint32_t rowsize;
+    uint32_t bitcount;
+    uint32_t * tables[3];   // bit field pixels, NULL for bytes
+    uint32_t shifts[3];
+    uint32_t maxima[3];
+} bmp_grayargs;
+
+static void bmp_grayfieldrow(const uint8_t * src, uint8_t * dst, uint32_t width, uint32_t bytes, 
+                             uint32_t * tables[3], const uint32_t shifts[3], const uint32_t maxima[3])
+{
+    for (uint32_t x = 0; x < width; x++) {
+        uint32_t pixel = src[bytes*x] | (src[bytes*x + 1] << 8);
+        if (bytes == 4) pixel |= ((uint32_t) src[4*x + 2] << 16) | ((uint32_t) src[4*x + 3] << 24);
+        uint32_t gray = tables[0][(pixel >> shifts[0]) & maxima[0]]
+                      + tables[1][(pixel >> shifts[1]) & maxima[1]]
+                      + tables[2][(pixel >> shifts[2]) & maxima[2]]
+                      + BMP_GRAY_ROUND;
+        dst[x] = gray >> BMP_GRAY_SHIFT;
+    }
+}
+
+static void bmp_grayband(void * arg, uint32_t begin, uint32_t end)
+{
+    bmp_grayargs * args = arg;
+
+    for (uint32_t y = begin; y < end; y++)
+    {
+        const uint8_t * src = args->src + (size_t) y * args->rowsize;
+        uint8_t * out = args->dst + (size_t) y * args->width;
+
+        if (args->tables[0] != NULL) {
+            bmp_grayfieldrow(src, out, args->width, args->bitcount / BMP_8_BITS, args->tables, args->shifts, args->maxima);
+        } else {
+            bmp_grayrow(src, out, args->width, args->bitcount / BMP_8_BITS);
+        }
+    }
+}
+
+void bmp_rgb2grayrows(bmp_image * img, uint8_t * dst)
+{
+    bmp_grayargs args = {
+        .src = img->ciPixelArray, .dst = dst, .width = img->dib.bmiHeader.biWidth, 
+        .rowsize = bmp_getrowstep(img), .bitcount = img->dib.bmiHeader.biBitCount
+    };
+
+    switch (img->dib.bmiHeader.biBitCount)
+    {
+    case BMP_16_BITS:
+    case BMP_32_BITS:
+        if (bmp_hasfields(img)) {
+            if (bmp_grayfieldtables(img, args.tables, args.shifts, args.maxima)) {
+                bmp_parallel_rows(bmp_getheight(img), bmp_rowgrain(args.rowsize), bmp_grayband, &args);
+            }
+            bmp_free(args.tables[0]);
+            bmp_free(args.tables[1]);
+            bmp_free(args.tables[2]);
+            break;
+        }
+        bmp_parallel_rows(bmp_getheight(img), bmp_rowgrain(args.rowsize), bmp_grayband, &args);
+        break;
+    case BMP_24_BITS:
+        bmp_parallel_rows(bmp_getheight(img), bmp_rowgrain(args.rowsize), bmp_grayband, &args);
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * Give the colour channels of <lut> the same <table>, alpha stays as is.
+ */
+static void bmp_lutcolours(bmp_lut * lut, const uint8_t table[256])
+{
+    memcpy(lut->table[BMP_COLOR_BLUE], table, 256);
+    memcpy(lut->table[BMP_COLOR_GREEN], table, 256);
+    memcpy(lut->table[BMP_COLOR_RED], table, 256);
+}
+
+void bmp_lut_identity(bmp_lut * lut)
+{
+    if (lut == NULL) return;
+
+    for (uint32_t c = 0; c < BMP_LUT_CHANNELS; c++) {
+        for (uint32_t v = 0; v < 256; v++) {
+            lut->table[c][v] = v;
+        }
+    }
+}
+
+void bmp_lut_invert(bmp_lut * lut)
+{
+    if (lut == NULL) return;
+
+    uint8_t table[256];
+    for (uint32_t v = 0; v < 256; v++) table[v] = 255 - v;
+
+    bmp_lut_identity(lut);
+    bmp_lutcolours(lut, table);
+}
+
+void bmp_lut_filter(bmp_lut * lut, bmp_color color)
+{
+    if (lut == NULL) return;
+
+    bmp_lut_identity(lut);
+
+    if (color != BMP_COLOR_BLUE) memset(lut->table[BMP_COLOR_BLUE], 0, 256);
+    if (color != BMP_COLOR_GREEN) memset(lut->table[BMP_COLOR_GREEN], 0, 256);
+    if (color != BMP_COLOR_RED) memset(lut->table[BMP_COLOR_RED], 0, 256);
+}
+
+void bmp_lut_threshold(bmp_lut * lut, uint8_t level)
+{
+    if (lut == NULL) return;
+
+    uint8_t table[256];
+    for (uint32_t v = 0; v < 256; v++) table[v] = (v >= level) ? 255 : 0;
+
+    bmp_lut_identity(lut);
+    bmp_lutcolours(lut, table);
+}
+
+void bmp_lut_gamma(bmp_lut * lut, double gamma)
+{
+    if (lut == NULL) return;
+
+    bmp_lut_identity(lut);
+    if (!(gamma > 0)) return;
+
+    uint8_t table[256];
+    for (uint32_t v = 0; v < 256; v++) table[v] = (uint8_t) (255.0 * pow(v / 255.0, gamma) + 0.5);
+
+    bmp_lutcolours(lut, table);
+}
+
+void bmp_lut_stretch(bmp_lut * lut, uint8_t low, uint8_t high)
+{
+    if (lut == NULL) return;
+
+    if (high <= low) {
+        bmp_lut_threshold(lut, low);
+        return;
+    }
+
+    uint8_t table[256];
+    uint32_t range = high - low;
+
+    for (uint32_t v = 0; v < 256; v++) {
+        if (v <= low) table[v] = 0;
+        else if (v >= high) table[v] = 255;
+        else table[v] = ((v - low) * 255 + range / 2) / range;
+    }
+
+    bmp_lut_identity(lut);
+    bmp_lutcolours(lut, table);
+}
+
+void bmp_lut_quantize(bmp_lut * lut, bmp_setncolours ncolours)
+{
+    if (lut == NULL) return;
+
+    if (ncolours == 0) ncolours = BMP_SET_256_COLOURS;
+
+    uint32_t steps = BMP_SET_256_COLOURS / ncolours;
+    uint8_t table[256];
+
+    for (uint32_t v = 0; v < 256; v++) table[v] = (v / steps) * steps;
+
+    bmp_lut_identity(lut);
+    bmp_lutcolours(lut, table);
+}
+
+void bmp_lut_compose(bmp_lut * lut, const bmp_lut * first, const bmp_lut * then)
+{
+    if (lut == NULL || first == NULL || then == NULL) return;
+
+    // built aside, <lut> may be <first> or <then>
+    bmp_lut composed;
+
+    for (uint32_t c = 0; c < BMP_LUT_CHANNELS; c++) {
+        for (uint32_t v = 0; v < 256; v++) {
+            composed.table[c][v] = then->table[c][first->table[c][v]];
+        }
+    }
+
+    *lut = composed;
+}
+
+/**
+ * Whether every byte of a row with <bytesperpixel> goes through the same 
+ * table, which lets the kernels skip the per-channel selection.
+ */
+static int bmp_lutuniform(const bmp_lut * lut, uint32_t bytesperpixel)
+{
+    if (bytesperpixel == 1) return 1;
+
+    const uint8_t * blue = lut->table[BMP_COLOR_BLUE];
+
+    if (memcmp(blue, lut->table[BMP_COLOR_GREEN], 256)) return 0;
+    if (memcmp(blue, lut->table[BMP_COLOR_RED], 256)) return 0;
+    if (bytesperpixel == 4 && memcmp(blue, lut->table[BMP_COLOR_ALPHA], 256)) return 0;
+
+    return 1;
+}
+
+#if BMP_X86
+/**
+ * Look 64 bytes up in the 256-entry table held by <t>: two 128-entry 
+ * permutes, picked by the top bit of each byte.
+ */
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+static inline __m512i bmp_lut512(const __m512i t[4], __m512i x)
+{
+    __m512i lo = _mm512_permutex2var_epi8(t[0], x, t[1]);
+    __m512i hi = _mm512_permutex2var_epi8(t[2], x, t[3]);
+    return _mm512_mask_blend_epi8(_mm512_movepi8_mask(x), lo, hi);
+}
+
+/**
+ * Per-channel lookups are blended by which channel each byte belongs to;
+ * 64 bytes hold a whole number of 32bpp pixels but not of 24bpp ones, 
+ * whose channel masks rotate by one byte every step.
+ */
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+static size_t bmp_lutrow_vbmi(const bmp_lut * lut, int uniform, const uint8_t * src, uint8_t * dst, size_t size, uint32_t bytesperpixel)
+{
+    uint32_t channels = uniform ? 1 : bytesperpixel;
+    __m512i t[BMP_LUT_CHANNELS][4];
+    __mmask64 masks[BMP_LUT_CHANNELS] = { 0 };
+    size_t i = 0;
+
+    for (uint32_t c = 0; c < channels; c++) {
+        for (uint32_t k = 0; k < 4; k++) {
+            t[c][k] = _mm512_loadu_si512(lut->table[c] + 64*k);
+        }
+    }
+
+    for (uint32_t b = 0; b < 64; b++) {
+        masks[b % channels] |= (__mmask64) 1 << b;
+    }
+
+    for (; i + 64 <= size; i += 64) {
+        __m512i x = _mm512_loadu_si512(src + i);
+        __m512i y = bmp_lut512(t[0], x);
+
+        for (uint32_t c = 1; c < channels; c++) {
+            y = _mm512_mask_blend_epi8(masks[c], y, bmp_lut512(t[c], x));
+        }
+
+        _mm512_storeu_si512(dst + i, y);
+
+        if (channels == 3) {
+            __mmask64 last = masks[2];
+            masks[2] = masks[1];
+            masks[1] = masks[0];
+            masks[0] = last;
+        }
+    }
+
+    return i;
+}
+
+/**
+ * Uniform tables only: the table is cut in 16 rows of 16 entries, each 
+ * row is looked up with a byte shuffle on the low nibble and kept where 
+ * the high nibble selects it.
+ */
+__attribute__((target("avx2")))
+static size_t bmp_lutrow_avx2(const uint8_t table[256], const uint8_t * src, uint8_t * dst, size_t size)
+{
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i rows[16];
+    size_t i = 0;
+
+    for (uint32_t k = 0; k < 16; k++) {
+        rows[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) (table + 16*k)));
+    }
+
+    for (; i + 32 <= size; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *) (src + i));
+        __m256i lo = _mm256_and_si256(x, nibble);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), nibble);
+        __m256i y = _mm256_setzero_si256();
+
+        for (uint32_t k = 0; k < 16; k++) {
+            __m256i select = _mm256_cmpeq_epi8(hi, _mm256_set1_epi8(k));
+            y = _mm256_or_si256(y, _mm256_and_si256(_mm256_shuffle_epi8(rows[k], lo), select));
+        }
+
+        _mm256_storeu_si256((__m256i *) (dst + i), y);
+    }
+
+    return i;
+}
+#endif
+
+/**
+ * Run <size> bytes of 8bpp, 24bpp or 32bpp pixels through <lut>, the 
+ * first byte being a blue one; <src> and <dst> may be the same buffer. 
+ * 8bpp rows use the blue table only.
+ */
+static void bmp_lutrow(const bmp_lut * lut, int uniform, const uint8_t * src, uint8_t * dst, size_t size, uint32_t bytesperpixel)
+{
+    size_t i = 0;
+
+#if BMP_X86
+    if (__builtin_cpu_supports("avx512vbmi")) {
+        i = bmp_lutrow_vbmi(lut, uniform, src, dst, size, bytesperpixel);
+    } else if (uniform && __builtin_cpu_supports("avx2")) {
+        i = bmp_lutrow_avx2(lut->table[BMP_COLOR_BLUE], src, dst, size);
+    }
+#endif
+
+    if (uniform) {
+        const uint8_t * table = lut->table[BMP_COLOR_BLUE];
+        for (; i < size; i++) dst[i] = table[src[i]];
+    } else {
+        for (; i < size; i++) dst[i] = lut->table[i % bytesperpixel][src[i]];
+    }
+}
+
+/**
+ * Run the colour channels of <n> palette entries through <lut>.
+ */
+static void bmp_lutpalette(bmp_rgbquad * colors, uint32_t n, const bmp_lut * lut)
+{
+    for (uint32_t i = 0; i < n; i++) {
+        colors[i].rgbBlue = lut->table[BMP_COLOR_BLUE][colors[i].rgbBlue];
+        colors[i].rgbGreen = lut->table[BMP_COLOR_GREEN][colors[i].rgbGreen];
+        colors[i].rgbRed = lut->table[BMP_COLOR_RED][colors[i].rgbRed];
+    }
+}
+
+/**
+ * Lay <lut> over the bit fields of <img>: each field value, read as a 
+ * byte, goes through the table of its colour and back to the width of 
+ * the field.
+ */
+static void bmp_lutfields_init(bmp_lutfields * fields, bmp_image * img, const bmp_lut * lut)
+{
+    uint32_t bitcount = img->dib.bmiHeader.biBitCount;
+    uint32_t masks[4];
+
+    bmp_bitmasks(img, masks);
+    fields->keep = (bitcount == BMP_16_BITS) ? 0xFFFF : 0xFFFFFFFF;
+
+    for (uint32_t c = 0; c < 4; c++)
+    {
+        // masks go red, green, blue, alpha; tables blue, green, red, alpha
+        const uint8_t * table = lut->table[(c == 3) ? BMP_COLOR_ALPHA : BMP_COLOR_RED - c];
+        uint32_t mask = (bitcount == BMP_16_BITS) ? masks[c] & 0xFFFF : masks[c];
+        bmp_bitfield narrow;
+        bmp_bitfield field;
+
+        bmp_bitfield_init(&narrow, mask, 1);
+        bmp_bitfield_init(&field, mask, 0);
+        fields->shifts[c] = narrow.shift;
+        fields->maxima[c] = narrow.max;
+        fields->keep &= ~mask;
+
+        for (uint32_t v = 0; v <= narrow.max; v++) {
+            uint32_t byte = table[(v * narrow.scale + BMP_BITFIELD_ROUND) >> BMP_BITFIELD_SHIFT];
+            fields->table[c][v] = (uint32_t) (((uint64_t) byte * field.max + 127) / 255) << field.shift;
+        }
+    }
+}
+
+// <width> bit field pixels of <bytes> each through <fields>, <src> may be <dst>
+static void bmp_lutfieldrow(const bmp_lutfields * fields, const uint8_t * src, uint8_t * dst, uint32_t width, uint32_t bytes)
+{
+    for (uint32_t x = 0; x < width; x++)
+    {
+        uint32_t pixel = src[bytes*x] | (src[bytes*x + 1] << 8);
+        if (bytes == 4) pixel |= ((uint32_t) src[4*x + 2] << 16) | ((uint32_t) src[4*x + 3] << 24);
+
+        pixel = (pixel & fields->keep) 
+              | fields->table[0][(pixel >> fields->shifts[0]) & fields->maxima[0]] 
+              | fields->table[1][(pixel >> fields->shifts[1]) & fields->maxima[1]] 
+              | fields->table[2][(pixel >> fields->shifts[2]) & fields->maxima[2]] 
+              | fields->table[3][(pixel >> fields->shifts[3]) & fields->maxima[3]];
+
+        dst[bytes*x] = pixel & 0xFF;
+        dst[bytes*x + 1] = (pixel >> 8) & 0xFF;
+        if (bytes == 4) {
+            dst[4*x + 2] = (pixel >> 16) & 0xFF;
+            dst[4*x + 3] = pixel >> 24;
+        }
+    }
+}
+
+typedef struct bmp_lutargs {
+    const bmp_lut * lut;
+    int uniform;
+    uint8_t * data;
+    size_t rowsize;
+    size_t step;            // bytes between rows, more than <rowsize> for padded rows
+    uint32_t bytesperpixel;
+    const bmp_lutfields * fields;   // bit field pixels, NULL for bytes
+    uint32_t width;
+} bmp_lutargs;
+
+static void bmp_lutband(void * arg, uint32_t begin, uint32_t end)
+{
+    bmp_lutargs * args = arg;
+    uint8_t * data = args->data + begin * args->step;
+
+    if (args->fields != NULL) {
+        for (uint32_t y = begin; y < end; y++, data += args->step) {
+            bmp_lutfieldrow(args->fields, data, data, args->width, args->bytesperpixel);
+        }
+        return;
+    }
+
+    if (args->step == args->rowsize) {
+        bmp_lutrow(args->lut, args->uniform, data, data, (end - begin) * args->rowsize, args->bytesperpixel);
+        return;
+    }
+
+    for (uint32_t y = begin; y < end; y++, data += args->step) {
+        bmp_lutrow(args->lut, args->uniform, data, data, args->rowsize, args->bytesperpixel);
+    }
+}
+
+// number of palette entries of an indexed image
+static uint32_t bmp_palettecount(bmp_image * img)
+{
+    return bmp_isindexed(img) ? bmp_getpalettesize(img) / sizeof(bmp_rgbquad) : 0;
+}
+
+/**
+ * Shared by bmp_applylut() and the operations built on it: an indexed 
+ * image is changed through its palette, never its pixels. Returns the 
+ * bytes looked up, 0 for images it cannot handle.
+ */
+static size_t bmp_lutimage(bmp_image * img, const bmp_lut * lut)
+{
+    if (img == NULL || lut == NULL) return 0;
+
+    if (bmp_isindexed(img)) {
+        bmp_lutpalette(img->dib.bmiColors, bmp_palettecount(img), lut);
+        return bmp_getpalettesize(img);
+    }
+
+    //TODO: add support for compressed images.
+    if (!bmp_isuncompressed(img)) return 0;
+
+    switch (img->dib.bmiHeader.biBitCount)
+    {
+    case BMP_8_BITS:
+    case BMP_16_BITS:
+    case BMP_24_BITS:
+    case BMP_32_BITS:
+        break;
+    default:
+        return 0;
+    }
+
+    uint32_t bytesperpixel = img->dib.bmiHeader.biBitCount / BMP_8_BITS;
+    bmp_lutfields fields;
+    bmp_lutargs args = {
+        lut, bmp_lutuniform(lut, bytesperpixel), img->ciPixelArray, bmp_getrowsize(img), 
+        bmp_getrowstep(img), bytesperpixel, NULL, img->dib.bmiHeader.biWidth
+    };
+
+    if (bmp_hasfields(img)) {
+        bmp_lutfields_init(&fields, img, lut);
+        args.fields = &fields;
+    }
+
+    bmp_parallel_rows(bmp_getheight(img), bmp_rowgrain(args.rowsize), bmp_lutband, &args);
+
+    return bmp_getarraysize(img);
+}
+
+void bmp_applylut(bmp_image * img, const bmp_lut * lut)
+{
+    BMP_STATS_SCOPE(BMP_STAT_APPLYLUT);
+
+    size_t bytes = bmp_lutimage(img, lut);
+    BMP_STATS_BYTES(bytes);
+    (void) bytes;
+}
+
+/**
+ * Palette-domain gray conversion: gray levels are quantized to <ncolours>
+ * steps, as in bmp_grayheader().
+ */
+static void bmp_graypalette(bmp_rgbquad * colors, uint32_t n, bmp_setncolours ncolours)
+{
+    bmp_lut lut;
+    bmp_lut_quantize(&lut, ncolours);
+
+    for (uint32_t i = 0; i < n; i++) {
+        uint8_t gray = lut.table[BMP_COLOR_BLUE][bmp_findgray(colors[i].rgbRed, colors[i].rgbGreen, colors[i].rgbBlue)];
+        colors[i].rgbBlue = gray;
+        colors[i].rgbGreen = gray;
+        colors[i].rgbRed = gray;
+    }
+}
+
+/**
+ * Copy of the headers and palette of <img>, without pixels.
+ */
+static bmp_image * bmp_cloneheaders(bmp_image * img)
+{
+    bmp_image * new = bmp_calloc(sizeof(bmp_image));
+    if (new == NULL) return NULL;
+
+    new->fileheader = img->fileheader;
+    bmp_cpdibs(new, img);
+
+    uint32_t palettesize = bmp_getpalettesize(img);
+
+    if (palettesize > 0 && img->dib.bmiColors != NULL)
+    {
+        new->dib.bmiColors = bmp_alloc(palettesize);
+        if (new->dib.bmiColors == NULL) return bmp_cleanup(NULL, new);
+
+        memcpy(new->dib.bmiColors, img->dib.bmiColors, palettesize);
+    }
+
+    return new;
+}
+
+static bmp_image * bmp_clone(bmp_image * img)
+{
+    bmp_image * new = bmp_cloneheaders(img);
+    if (new == NULL) return NULL;
+
+    // the copy gets packed rows
+    new->ciPixelArray = bmp_alloc(bmp_getarraysize(new));
+    if (new->ciPixelArray == NULL) return bmp_cleanup(NULL, new);
+
+    if (img->rowStride != 0) {
+        bmp_unpad(new, img->ciPixelArray);
+    } else {
+        memcpy(new->ciPixelArray, img->ciPixelArray, bmp_getarraysize(new));
+    }
+
+    return new;
+}
+
+bmp_image * bmp_rgb2gray(bmp_image * img, bmp_setncolours ncolours)
+{
+    BMP_STATS_SCOPE(BMP_STAT_RGB2GRAY);
+
+    if (img == NULL) return NULL;
+
+    // indexed images keep their indices and get a gray palette
+    if (bmp_isindexed(img))
+    {
+        bmp_image * new = bmp_clone(img);
+        if (new == NULL) return NULL;
+
+        bmp_graypalette(new->dib.bmiColors, bmp_palettecount(new), ncolours);
+        BMP_STATS_BYTES(bmp_getpalettesize(new));
+
+        return new;
+    }
+    
+    switch (img->dib.bmiHeader.biBitCount)
+    {
+    case BMP_16_BITS:
+    case BMP_24_BITS:
+    case BMP_32_BITS:
+        break;
+    default:
+        return NULL;
+    }
+
+    if (!bmp_isuncompressed(img)) return NULL;
+    
+    bmp_image * new = bmp_grayheader(img, ncolours);
+    if (new == NULL) return NULL;
+
+    new->ciPixelArray = bmp_alloc(bmp_getarraysize(new));
+    if (new->ciPixelArray == NULL) return bmp_cleanup(NULL, new);
+
+    bmp_rgb2grayrows(img, new->ciPixelArray);
+
+    BMP_STATS_BYTES(bmp_getdatasize(img));
+
+    return new;
+}
+
+typedef struct bmp_expandargs {
+    const uint8_t * src;
+    uint8_t * dst;
+    uint32_t width;
+    uint32_t rowsize;
+    uint32_t bitcount;
+    uint32_t bytes;         // per output pixel: 1 (gray level) or 3 (BGR)
+    uint8_t lut[256][3];
+} bmp_expandargs;
+
+static void bmp_expandband(void * arg, uint32_t begin, uint32_t end)
+{
+    bmp_expandargs * args = arg;
+    uint32_t bitcount = args->bitcount;
+    uint8_t mask = (1u << bitcount) - 1;
+
+    for (uint32_t y = begin; y < end; y++)
+    {
+        const uint8_t * src = args->src + (size_t) y * args->rowsize;
+        uint8_t * dst = args->dst + (size_t) y * args->width * args->bytes;
+
+        for (uint32_t x = 0; x < args->width; x++)
+        {
+            uint32_t bit = x * bitcount;
+            uint8_t index = (src[bit / 8] >> (8 - bitcount - bit % 8)) & mask;
+
+            if (args->bytes == 1) {
+                dst[x] = args->lut[index][0];
+            } else {
+                dst[3*x] = args->lut[index][0];
+                dst[3*x + 1] = args->lut[index][1];
+                dst[3*x + 2] = args->lut[index][2];
+            }
+        }
+    }
+}
+
+/**
+ * Fill the palette lookup of <args> from <src>, returns 1 if every 
+ * palette entry is gray.
+ */
+static int bmp_expandpalette(bmp_image * src, bmp_expandargs * args)
+{
+    uint32_t ncolors = bmp_palettecount(src);
+    int gray = 1;
+
+    // indices past the palette end up black
+    for (uint32_t i = 0; i < ncolors && i < 256; i++) {
+        bmp_rgbquad * c = &src->dib.bmiColors[i];
+        args->lut[i][0] = c->rgbBlue;
+        args->lut[i][1] = c->rgbGreen;
+        args->lut[i][2] = c->rgbRed;
+        if (c->rgbBlue != c->rgbGreen || c->rgbGreen != c->rgbRed) gray = 0;
+    }
+
+    return gray;
+}
+
+/**
+ * Headers (no pixels) for the expanded <src>: 8bpp with a plain gray 
+ * palette if <gray>, 24bpp otherwise.
+ */
+static bmp_image * bmp_expandheader(bmp_image * src, int gray)
+{
+    if (gray) return bmp_grayheader(src, BMP_SET_256_COLOURS);
+
+    bmp_image * new = bmp_calloc(sizeof(bmp_image));
+    if (new == NULL) return NULL;
+
+    bmp_cpdibs(new, src);
+
+    new->dib.bmiHeader.biBitCount = BMP_24_BITS;
+    new->dib.bmiHeader.biCompression = BMP_BI_RGB;
+    new->dib.bmiHeader.biClrUsed = 0;
+    new->dib.bmiHeader.biClrImportant = 0;
+    new->dib.bmiHeader.biSizeImage = bmp_getstride(new) * bmp_getheight(new);
+
+    new->fileheader.bfType = BMP_FILETYPE_BM;
+    new->fileheader.bfOffBits = bmp_getheaderssize(new);
+    new->fileheader.bfSize = new->fileheader.bfOffBits + new->dib.bmiHeader.biSizeImage;
+
+    return new;
+}
+
+bmp_image * bmp_materialize(bmp_image * img)
+{
+    if (img == NULL || !bmp_isindexed(img)) return NULL;
+
+    bmp_image * decoded = NULL;
+
+    switch (img->dib.bmiHeader.biCompression)
+    {
+    case BMP_BI_RGB:
+        break;
+    case BMP_BI_RLE8:
+        decoded = bmp_rle8decoder(img);
+        if (decoded == NULL) return NULL;
+        break;
+    case BMP_BI_RLE4:
+        decoded = bmp_rle4decoder(img);
+        if (decoded == NULL) return NULL;
+        break;
+    default:
+        return NULL;
+    }
+
+    bmp_image * src = (decoded != NULL) ? decoded : img;
+
+    bmp_expandargs * args = bmp_calloc(sizeof(bmp_expandargs));
+    if (args == NULL) {
+        bmp_cleanup(NULL, decoded);
+        return NULL;
+    }
+
+    int gray = bmp_expandpalette(src, args);
+    bmp_image * new = bmp_expandheader(src, gray);
+
+    if (new != NULL) new->ciPixelArray = bmp_alloc(bmp_getarraysize(new));
+
+    if (new == NULL || new->ciPixelArray == NULL) {
+        bmp_free(args);
+        bmp_cleanup(NULL, decoded);
+        return bmp_cleanup(NULL, new);
+    }
+
+    args->src = src->ciPixelArray;
+    args->dst = new->ciPixelArray;
+    args->width = src->dib.bmiHeader.biWidth;
+    args->rowsize = bmp_getrowstep(src);
+    args->bitcount = src->dib.bmiHeader.biBitCount;
+    args->bytes = gray ? 1 : 3;
+
+    bmp_parallel_rows(bmp_getheight(src), bmp_rowgrain(bmp_getrowsize(new)), bmp_expandband, args);
+
+    bmp_free(args);
+    bmp_cleanup(NULL, decoded);
+
+    return new;
+}
+
+void bmp_filtercolor(bmp_image * img, bmp_color color)
+{
+    BMP_STATS_SCOPE(BMP_STAT_FILTERCOLOR);
+
+    if (img == NULL) return;
+
+    switch (img->dib.bmiHeader.biBitCount)
+    {
+    case BMP_16_BITS:
+    case BMP_24_BITS:
+    case BMP_32_BITS:
+        break;
+    default:
+        if (!bmp_isindexed(img)) return;
+        break;
+    }
+
+    bmp_lut lut;
+    bmp_lut_filter(&lut, color);
+
+    size_t bytes = bmp_lutimage(img, &lut);
+    BMP_STATS_BYTES(bytes);
+    (void) bytes;
+}
+
+void bmp_invert(bmp_image * img)
+{
+    BMP_STATS_SCOPE(BMP_STAT_INVERT);
+
+    bmp_lut lut;
+    bmp_lut_invert(&lut);
+
+    size_t bytes = bmp_lutimage(img, &lut);
+    BMP_STATS_BYTES(bytes);
+    (void) bytes;
+}
+
+bmp_planar * bmp_planar_create(uint32_t width, uint32_t height, int alpha)
+{
+    if (width == 0 || height == 0) return NULL;
+
+    bmp_planar * planar = bmp_calloc(sizeof(bmp_planar));
+    if (planar == NULL) return NULL;
+
+    uint32_t nplanes = alpha ? 4 : 3;
+    size_t stride = ((size_t) width + BMP_PLANAR_ALIGN - 1) / BMP_PLANAR_ALIGN * BMP_PLANAR_ALIGN;
+    size_t planesize = stride * height;
+
+    planar->block = bmp_alloc(nplanes * planesize + BMP_PLANAR_ALIGN - 1);
+    if (planar->block == NULL) {
+        bmp_free(planar);
+        return NULL;
+    }
+
+    uint8_t * base = (uint8_t *) (((uintptr_t) planar->block + BMP_PLANAR_ALIGN - 1) 
+                    & ~(uintptr_t) (BMP_PLANAR_ALIGN - 1));
+
+    for (uint32_t c = 0; c < nplanes; c++) planar->planes[c] = base + c * planesize;
+
+    planar->width = width;
+    planar->height = height;
+    planar->stride = (uint32_t) stride;
+
+    return planar;
+}
+
+void bmp_planar_free(bmp_planar * planar)
+{
+    if (planar == NULL) return;
+
+    bmp_free(planar->block);
+    bmp_free(planar);
+}
+
+#if BMP_X86
+/**
+ * 16 BGR pixels from three loads; each plane gathers its bytes from the 
+ * loads with one shuffle apiece.
+ */
+__attribute__((target("ssse3")))
+static uint32_t bmp_splitrow_ssse3_24(const uint8_t * src, uint8_t * const planes[3], uint32_t width)
+{
+    const __m128i masks[3][3] = {
+        { _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1),
+          _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1),
+          _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13) },
+        { _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1),
+          _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1),
+          _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14) },
+        { _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1),
+          _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1),
+          _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15) }
+    };
+    uint32_t x = 0;
+
+    for (; x + 16 <= width; x += 16)
+    {
+        __m128i v[3];
+        for (uint32_t k = 0; k < 3; k++) v[k] = _mm_loadu_si128((const __m128i *) (src + 3*x + 16*k));
+
+        for (uint32_t c = 0; c < 3; c++) {
+            __m128i p = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v[0], masks[c][0]), 
+                                                  _mm_shuffle_epi8(v[1], masks[c][1])), 
+                                     _mm_shuffle_epi8(v[2], masks[c][2]));
+            _mm_store_si128((__m128i *) (planes[c] + x), p);
+        }
+    }
+
+    return x;
+}
+
+__attribute__((target("ssse3")))
+static uint32_t bmp_mergerow_ssse3_24(const uint8_t * const planes[3], uint8_t * dst, uint32_t width)
+{
+    const __m128i masks[3][3] = {
+        { _mm_setr_epi8(0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5),
+          _mm_setr_epi8(-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1),
+          _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1) },
+        { _mm_setr_epi8(-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1),
+          _mm_setr_epi8(5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10),
+          _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1) },
+        { _mm_setr_epi8(-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1),
+          _mm_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1),
+          _mm_setr_epi8(10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15) }
+    };
+    uint32_t x = 0;
+
+    for (; x + 16 <= width; x += 16)
+    {
+        __m128i p[3];
+        for (uint32_t c = 0; c < 3; c++) p[c] = _mm_load_si128((const __m128i *) (planes[c] + x));
+
+        for (uint32_t k = 0; k < 3; k++) {
+            __m128i v = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(p[0], masks[k][0]), 
+                                                  _mm_shuffle_epi8(p[1], masks[k][1])), 
+                                     _mm_shuffle_epi8(p[2], masks[k][2]));
+            _mm_storeu_si128((__m128i *) (dst + 3*x + 16*k), v);
+        }
+    }
+
+    return x;
+}
+
+/**
+ * 16 BGRA pixels: channels grouped inside each lane, then the dwords 
+ * regrouped so each 64-bit half holds eight bytes of one channel.
+ */
+__attribute__((target("avx2")))
+static uint32_t bmp_splitrow_avx2_32(const uint8_t * src, uint8_t * const planes[4], uint32_t width)
+{
+    const __m256i group = _mm256_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15,
+                                           0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+    const __m256i gather = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    uint32_t x = 0;
+
+    for (; x + 16 <= width; x += 16)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *) (src + 4*x));
+        __m256i b = _mm256_loadu_si256((const __m256i *) (src + 4*x + 32));
+
+        a = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(a, group), gather);
+        b = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(b, group), gather);
+
+        // blue and red, then green and alpha
+        __m256i br = _mm256_unpacklo_epi64(a, b);
+        __m256i ga = _mm256_unpackhi_epi64(a, b);
+
+        _mm_store_si128((__m128i *) (planes[BMP_COLOR_BLUE] + x), _mm256_castsi256_si128(br));
+        _mm_store_si128((__m128i *) (planes[BMP_COLOR_RED] + x), _mm256_extracti128_si256(br, 1));
+        _mm_store_si128((__m128i *) (planes[BMP_COLOR_GREEN] + x), _mm256_castsi256_si128(ga));
+        _mm_store_si128((__m128i *) (planes[BMP_COLOR_ALPHA] + x), _mm256_extracti128_si256(ga, 1));
+    }
+
+    return x;
+}
+
+static uint32_t bmp_mergerow_sse2_32(const uint8_t * const planes[4], uint8_t * dst, uint32_t width)
+{
+    uint32_t x = 0;
+
+    for (; x + 16 <= width; x += 16)
+    {
+        __m128i b = _mm_load_si128((const __m128i *) (planes[BMP_COLOR_BLUE] + x));
+        __m128i g = _mm_load_si128((const __m128i *) (planes[BMP_COLOR_GREEN] + x));
+        __m128i r = _mm_load_si128((const __m128i *) (planes[BMP_COLOR_RED] + x));
+        __m128i a = _mm_load_si128((const __m128i *) (planes[BMP_COLOR_ALPHA] + x));
+
+        __m128i bglo = _mm_unpacklo_epi8(b, g), bghi = _mm_unpackhi_epi8(b, g);
+        __m128i ralo = _mm_unpacklo_epi8(r, a), rahi = _mm_unpackhi_epi8(r, a);
+
+        _mm_storeu_si128((__m128i *) (dst + 4*x), _mm_unpacklo_epi16(bglo, ralo));
+        _mm_storeu_si128((__m128i *) (dst + 4*x + 16), _mm_unpackhi_epi16(bglo, ralo));
+        _mm_storeu_si128((__m128i *) (dst + 4*x + 32), _mm_unpacklo_epi16(bghi, rahi));
+        _mm_storeu_si128((__m128i *) (dst + 4*x + 48), _mm_unpackhi_epi16(bghi, rahi));
+    }
+
+    return x;
+}
+#endif
+
+/**
+ * One row of <bytes> interleaved pixels into the planes, which start at 
+ * the row and are aligned.
+ */
+static void bmp_splitrow(const uint8_t * src, uint8_t * const planes[4], uint32_t width, uint32_t bytes)
+{
+    uint32_t x = 0;
+
+#if BMP_X86
+    if (bytes == 3 && __builtin_cpu_supports("ssse3")) {
+        x = bmp_splitrow_ssse3_24(src, planes, width);
+    } else if (bytes == 4 && __builtin_cpu_supports("avx2")) {
+        x = bmp_splitrow_avx2_32(src, planes, width);
+    }
+#endif
+
+    for (; x < width; x++) {
+        for (uint32_t c = 0; c < bytes; c++) planes[c][x] = src[bytes*x + c];
+    }
+}
+
+/**
+ * Inverse of bmp_splitrow(). Without an alpha plane the fourth byte of 
+ * 32bpp pixels is written 0, as BI_RGB wants its unused byte.
+ */
+static void bmp_mergerow(const uint8_t * const planes[4], uint8_t * dst, uint32_t width, uint32_t bytes)
+{
+    uint32_t x = 0;
+
+#if BMP_X86
+    if (bytes == 3 && __builtin_cpu_supports("ssse3")) {
+        x = bmp_mergerow_ssse3_24(planes, dst, width);
+    } else if (bytes == 4 && planes[BMP_COLOR_ALPHA] != NULL) {
+        x = bmp_mergerow_sse2_32(planes, dst, width);
+    }
+#endif
+
+    for (; x < width; x++) {
+        for (uint32_t c = 0; c < 3; c++) dst[bytes*x + c] = planes[c][x];
+        if (bytes == 4) dst[4*x + 3] = (planes[BMP_COLOR_ALPHA] != NULL) ? planes[BMP_COLOR_ALPHA][x] : 0;
+    }
+}
+
+typedef struct bmp_planarargs {
+    bmp_planar * planar;
+    uint8_t * pixels;
+    uint32_t rowsize;
+    uint32_t bytes;
+    int merge;
+} bmp_planarargs;
+
+static void bmp_planarband(void * arg, uint32_t begin, uint32_t end)
+{
+    bmp_planarargs * args = arg;
+    bmp_planar * planar = args->planar;
+
+    for (uint32_t y = begin; y < end; y++)
+    {
+        uint8_t * planes[BMP_LUT_CHANNELS];
+        uint8_t * pixels = args->pixels + (size_t) y * args->rowsize;
+
+        for (uint32_t c = 0; c < BMP_LUT_CHANNELS; c++) {
+            planes[c] = (planar->planes[c] != NULL) ? planar->planes[c] + (size_t) y * planar->stride : NULL;
+        }
+
+        if (args->merge) {
+            bmp_mergerow((const uint8_t * const *) planes, pixels, planar->width, args->bytes);
+        } else {
+            bmp_splitrow(pixels, planes, planar->width, args->bytes);
+        }
+    }
+}
+
+// 24bpp and 32bpp images whose bytes are the B, G, R (and A) channels
+static int bmp_planarformat(bmp_image * img)
+{
+    if (img == NULL || img->ciPixelArray == NULL) return 0;
+    if (img->dib.bmiHeader.biCompression != BMP_BI_RGB) return 0;
+
+    return img->dib.bmiHeader.biBitCount == BMP_24_BITS 
+        || img->dib.bmiHeader.biBitCount == BMP_32_BITS;
+}
+
+bmp_planar * bmp_planar_split(bmp_image * img)
+{
+    BMP_STATS_SCOPE(BMP_STAT_PLANAR_SPLIT);
+
+    if (!bmp_planarformat(img)) return NULL;
+
+    uint32_t bytes = img->dib.bmiHeader.biBitCount / BMP_8_BITS;
+    bmp_planar * planar = bmp_planar_create(img->dib.bmiHeader.biWidth, bmp_getheight(img), bytes == 4);
+    if (planar == NULL) return NULL;
+
+    bmp_planarargs args = { planar, img->ciPixelArray, bmp_getrowstep(img), bytes, 0 };
+
+    bmp_parallel_rows(planar->height, bmp_rowgrain(args.rowsize), bmp_planarband, &args);
+
+    BMP_STATS_BYTES(bmp_getdatasize(img));
+
+    return planar;
+}
+
+int bmp_planar_merge(const bmp_planar * planar, bmp_image * img)
+{
+    BMP_STATS_SCOPE(BMP_STAT_PLANAR_MERGE);
+
+    if (planar == NULL || !bmp_planarformat(img)) return 0;
+    if (planar->width != (uint32_t) img->dib.bmiHeader.biWidth || planar->height != bmp_getheight(img)) return 0;
+
+    bmp_planarargs args = {
+        (bmp_planar *) planar, img->ciPixelArray, bmp_getrowstep(img), 
+        img->dib.bmiHeader.biBitCount / BMP_8_BITS, 1
+    };
+
+    bmp_parallel_rows(planar->height, bmp_rowgrain(args.rowsize), bmp_planarband, &args);
+
+    BMP_STATS_BYTES(bmp_getdatasize(img));
+
+    return 1;
+}
+
+void bmp_planar_filtercolor(bmp_planar * planar, bmp_color color)
+{
+    if (planar == NULL) return;
+
+    size_t planesize = (size_t) planar->stride * planar->height;
+
+    // as bmp_lut_filter(): alpha stays, the other colours go dark
+    for (uint32_t c = BMP_COLOR_BLUE; c <= BMP_COLOR_RED; c++) {
+        if (c != color) memset(planar->planes[c], 0, planesize);
+    }
+}
+
+void bmp_planar_applylut(bmp_planar * planar, const bmp_lut * lut)
+{
+    if (planar == NULL || lut == NULL) return;
+
+    size_t planesize = (size_t) planar->stride * planar->height;
+    bmp_lut single;
+
+    // whole planes through the uniform kernels, one table at a time
+    for (uint32_t c = 0; c < BMP_LUT_CHANNELS; c++)
+    {
+        if (planar->planes[c] == NULL) continue;
+
+        memcpy(single.table[BMP_COLOR_BLUE], lut->table[c], 256);
+        bmp_lutrow(&single, 1, planar->planes[c], planar->planes[c], planesize, 1);
+    }
+}
+
+/**
+ * Rows of 1bpp, 2bpp and 4bpp palette indices are worked on one index 
+ * per byte: whole rows are unpacked to bytes, handed to the 8bpp code 
+ * and packed back.
+ */
+#if BMP_X86
+// 32 1bpp pixels: each byte spread over 8 lanes and tested bit by bit
+__attribute__((target("avx2")))
+static uint32_t bmp_unpack1_avx2(const uint8_t * src, uint8_t * dst, uint32_t width)
+{
+    const __m256i spread = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+                                            2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+    const __m256i bits = _mm256_set1_epi64x(0x0102040810204080);
+    const __m256i one = _mm256_set1_epi8(1);
+    uint32_t x = 0;
+
+    for (; x + 32 <= width; x += 32) {
+        int word;
+        memcpy(&word, src + x / 8, 4);
+        __m256i v = _mm256_shuffle_epi8(_mm256_set1_epi32(word), spread);
+        v = _mm256_cmpeq_epi8(_mm256_and_si256(v, bits), bits);
+        _mm256_storeu_si256((__m256i *) (dst + x), _mm256_and_si256(v, one));
+    }
+
+    return x;
+}
+
+// 32 2bpp or 4bpp pixels: the fields of each byte interleaved, high first
+static uint32_t bmp_unpack24_sse2(const uint8_t * src, uint8_t * dst, uint32_t width, uint32_t bits)
+{
+    const __m128i mask = _mm_set1_epi8((1 << bits) - 1);
+    uint32_t x = 0;
+
+    for (; x + 32 <= width; x += 32)
+    {
+        if (bits == BMP_4_BITS) {
+            __m128i v = _mm_loadu_si128((const __m128i *) (src + x / 2));
+            __m128i high = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+            __m128i low = _mm_and_si128(v, mask);
+            _mm_storeu_si128((__m128i *) (dst + x), _mm_unpacklo_epi8(high, low));
+            _mm_storeu_si128((__m128i *) (dst + x + 16), _mm_unpackhi_epi8(high, low));
+        } else {
+            __m128i v = _mm_loadl_epi64((const __m128i *) (src + x / 4));
+            __m128i f3 = _mm_and_si128(_mm_srli_epi16(v, 6), mask);
+            __m128i f2 = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+            __m128i f1 = _mm_and_si128(_mm_srli_epi16(v, 2), mask);
+            __m128i f0 = _mm_and_si128(v, mask);
+            __m128i high = _mm_unpacklo_epi8(f3, f2);
+            __m128i low = _mm_unpacklo_epi8(f1, f0);
+            _mm_storeu_si128((__m128i *) (dst + x), _mm_unpacklo_epi16(high, low));
+            _mm_storeu_si128((__m128i *) (dst + x + 16), _mm_unpackhi_epi16(high, low));
+        }
+    }
+
+    return x;
+}
+
+/**
+ * 32 1bpp pixels: the low bit of each index moved to the top of its byte,
+ * bytes reversed within each group of 8 so movemask puts the leftmost 
+ * pixel in the high bit.
+ */
+__attribute__((target("avx2")))
+static uint32_t bmp_pack1_avx2(const uint8_t * src, uint8_t * dst, uint32_t width)
+{
+    const __m256i reverse = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                                             7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    const __m256i one = _mm256_set1_epi8(1);
+    uint32_t x = 0;
+
+    for (; x + 32 <= width; x += 32) {
+        __m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i *) (src + x)), one);
+        int word = _mm256_movemask_epi8(_mm256_slli_epi16(_mm256_shuffle_epi8(v, reverse), 7));
+        memcpy(dst + x / 8, &word, 4);
+    }
+
+    return x;
+}
+
+/**
+ * 32 4bpp or 64 2bpp pixels: neighbours merged by multiply-adds, 
+ * (a << 4) + b for 4bpp, then (a << 2) + b twice for 2bpp.
+ */
+__attribute__((target("ssse3")))
+static uint32_t bmp_pack24_ssse3(const uint8_t * src, uint8_t * dst, uint32_t width, uint32_t bits)
+{
+    const __m128i mask = _mm_set1_epi8((1 << bits) - 1);
+    uint32_t x = 0;
+
+    if (bits == BMP_4_BITS)
+    {
+        const __m128i nibbles = _mm_set1_epi16(0x0110);
+
+        for (; x + 32 <= width; x += 32) {
+            __m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i *) (src + x)), mask);
+            __m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i *) (src + x + 16)), mask);
+            a = _mm_maddubs_epi16(a, nibbles);
+            b = _mm_maddubs_epi16(b, nibbles);
+            _mm_storeu_si128((__m128i *) (dst + x / 2), _mm_packus_epi16(a, b));
+        }
+        return x;
+    }
+
+    const __m128i pairs = _mm_set1_epi16(0x0104);
+    const __m128i quads = _mm_set1_epi32(0x00010010);
+
+    for (; x + 64 <= width; x += 64)
+    {
+        __m128i v[4];
+        for (uint32_t k = 0; k < 4; k++) {
+            v[k] = _mm_and_si128(_mm_loadu_si128((const __m128i *) (src + x + 16*k)), mask);
+            v[k] = _mm_madd_epi16(_mm_maddubs_epi16(v[k], pairs), quads);
+        }
+        __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(v[0], v[1]), _mm_packs_epi32(v[2], v[3]));
+        _mm_storeu_si128((__m128i *) (dst + x / 4), bytes);
+    }
+
+    return x;
+}
+#endif
+
+// palette indices of <bits> each, the leftmost pixel in the high bits
+static void bmp_unpackindices(const uint8_t * src, uint8_t * dst, uint32_t width, uint32_t bits)
+{
+    if (bits == BMP_8_BITS) {
+        memcpy(dst, src, width);
+        return;
+    }
+
+    uint32_t x = 0;
+
+#if BMP_X86
+    if (bits == BMP_1_BIT && __builtin_cpu_supports("avx2")) {
+        x = bmp_unpack1_avx2(src, dst, width);
+    } else if (bits != BMP_1_BIT) {
+        x = bmp_unpack24_sse2(src, dst, width, bits);
+    }
+#endif
+
+    uint32_t mask = (1u << bits) - 1;
+    uint32_t perbyte = 8 / bits;
+
+    // whole bytes, then the pixels of the last one
+    for (; x + perbyte <= width; x += perbyte) {
+        uint32_t byte = src[x / perbyte];
+        for (uint32_t k = 0; k < perbyte; k++) dst[x + k] = (byte >> (8 - bits * (k + 1))) & mask;
+    }
+    for (uint32_t k = 0; x < width; x++, k++) {
+        dst[x] = (src[x / perbyte] >> (8 - bits * (k + 1))) & mask;
+    }
+}
+
+static void bmp_packindices(const uint8_t * src, uint8_t * dst, uint32_t width, uint32_t bits)
+{
+    if (bits == BMP_8_BITS) {
+        memcpy(dst, src, width);
+        return;
+    }
+
+    uint32_t x = 0;
+
+#if BMP_X86
+    if (bits == BMP_1_BIT && __builtin_cpu_supports("avx2")) {
+        x = bmp_pack1_avx2(src, dst, width);
+    } else if (bits != BMP_1_BIT && __builtin_cpu_supports("ssse3")) {
+        x = bmp_pack24_ssse3(src, dst, width, bits);
+    }
+#endif
+
+    uint32_t mask = (1u << bits) - 1;
+    uint32_t perbyte = 8 / bits;
+
+    for (; x < width; x += perbyte) {
+        uint32_t byte = 0;
+        for (uint32_t k = 0; k < perbyte; k++) {
+            uint32_t index = (x + k < width) ? (src[x + k] & mask) : 0;
+            byte |= index << (8 - bits * (k + 1));
+        }
+        dst[x / perbyte] = byte;
+    }
+}
+
+// pixels [first, first + count) of a row of <bits> indices
+static void bmp_unpackspan(const uint8_t * src, uint32_t first, uint32_t count, uint32_t bits, uint8_t * dst)
+{
+    uint32_t perbyte = 8 / bits;
+    uint32_t mask = (1u << bits) - 1;
+    uint32_t lead = 0;
+
+    // up to the first byte boundary one pixel at a time
+    for (; lead < count && (first + lead) % perbyte != 0; lead++) {
+        uint32_t x = first + lead;
+        dst[lead] = (src[x / perbyte] >> (8 - bits * (x % perbyte + 1))) & mask;
+    }
+
+    bmp_unpackindices(src + (first + lead) / perbyte, dst + lead, count - lead, bits);
+}
+
+// 1bpp, 2bpp and 4bpp uncompressed images, worked on as one index per byte
+static int bmp_issubbyte(bmp_image * img)
+{
+    if (img == NULL || img->ciPixelArray == NULL || !bmp_isuncompressed(img)) return 0;
+
+    switch (img->dib.bmiHeader.biBitCount)
+    {
+    case BMP_1_BIT:
+    case BMP_2_BITS:
+    case BMP_4_BITS:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+typedef struct bmp_unpackargs {
+    const uint8_t * src;
+    uint8_t * dst;
+    uint32_t width;
+    uint32_t srcrowsize;
+    uint32_t dstrowsize;
+    uint32_t bits;
+    int pack;
+} bmp_unpackargs;
+
+static void bmp_unpackband(void * arg, uint32_t begin, uint32_t end)
+{
+    bmp_unpackargs * args = arg;
+
+    for (uint32_t y = begin; y < end; y++) {
+        const uint8_t * src = args->src + (size_t) y * args->srcrowsize;
+        uint8_t * dst = args->dst + (size_t) y * args->dstrowsize;
+
+        if (args->pack) {
+            bmp_packindices(src, dst, args->width, args->bits);
+        } else {
+            bmp_unpackindices(src, dst, args->width, args->bits);
+        }
+    }
+}
+
+/**
+ * 8bpp working copy of a 1bpp, 2bpp or 4bpp image, one index per byte, 
+ * for operations that only have byte kernels. It carries no palette.
+ */
+static bmp_image * bmp_unpackimage(bmp_image * img)
+{
+    bmp_image * work = bmp_calloc(sizeof(bmp_image));
+    if (work == NULL) return NULL;
+
+    work->fileheader = img->fileheader;
+    bmp_cpdibs(work, img);
+    work->dib.bmiHeader.biBitCount = BMP_8_BITS;
+    work->dib.bmiHeader.biSizeImage = bmp_getstride(work) * bmp_getheight(work);
+    work->fileheader.bfSize = work->fileheader.bfOffBits + work->dib.bmiHeader.biSizeImage;
+
+    work->ciPixelArray = bmp_alloc(bmp_getarraysize(work));
+    if (work->ciPixelArray == NULL) return bmp_cleanup(NULL, work);
+
+    bmp_unpackargs args = {
+        img->ciPixelArray, work->ciPixelArray, img->dib.bmiHeader.biWidth, 
+        bmp_getrowstep(img), bmp_getrowsize(work), img->dib.bmiHeader.biBitCount, 0
+    };
+
+    bmp_parallel_rows(bmp_getheight(img), bmp_rowgrain(args.dstrowsize), bmp_unpackband, &args);
+
+    return work;
+}
+
+// pack the indices of the working copy <work> back into <img>
+static void bmp_packimage(bmp_image * work, bmp_image * img)
+{
+    bmp_unpackargs args = {
+        work->ciPixelArray, img->ciPixelArray, img->dib.bmiHeader.biWidth, 
+        bmp_getrowsize(work), bmp_getrowstep(img), img->dib.bmiHeader.biBitCount, 1
+    };
+
+    bmp_parallel_rows(bmp_getheight(img), bmp_rowgrain(args.srcrowsize), bmp_unpackband, &args);
+}
+
+/**
+ * Run the 8bpp operation <apply> on the working copy of the 1bpp, 2bpp 
+ * or 4bpp image <img>, and pack its result back if it succeeds.
+ */
+static int bmp_onindices(bmp_image * img, int (*apply)(bmp_image *, const void *), const void * params)
+{
+    bmp_image * work = bmp_unpackimage(img);
+    if (work == NULL) return 0;
+
+    int done = apply(work, params);
+    if (done) bmp_packimage(work, img);
+
+    bmp_cleanup(NULL, work);
+
+    return done;
+}
+
+/**
+ * Replace the RLE pixels of <img> with their decoded rows, headers and 
+ * palette following; other images are left as they are. Returns 0 if 
+ * the pixels cannot be decoded.
+ */
+static int bmp_decoderle(bmp_image * img)
+{
+    bmp_image * decoded = NULL;
+
+    switch (img->dib.bmiHeader.biCompression)
+    {
+    case BMP_BI_RLE8:
+        decoded = bmp_rle8decoder(img);
+        break;
+    case BMP_BI_RLE4:
+        decoded = bmp_rle4decoder(img);
+        break;
+    default:
+        return 1;
+    }
+
+    if (decoded == NULL) return 0;
+
+    bmp_release(img, img->dib.bmiColors);
+    bmp_release(img, img->ciPixelArray);
+
+    img->fileheader = decoded->fileheader;
+    img->dib = decoded->dib;
+    img->ciPixelArray = decoded->ciPixelArray;
+    img->rowStride = 0;
+
+    decoded->dib.bmiColors = NULL;
+    decoded->ciPixelArray = NULL;
+    bmp_cleanup(NULL, decoded);
+
+    return 1;
+}
+
+/**
+ * Format conversion goes through a hub row of BGRA words, the 32bpp
+ * BI_RGB layout: each source row is decoded into it and the target row
+ * encoded from it, both through tables built once per conversion.
+ */
+#define BMP_HUB(b, g, r, a) \
+    ((uint32_t) (b) | ((uint32_t) (g) << 8) | ((uint32_t) (r) << 16) | ((uint32_t) (a) << 24))
+
+typedef struct bmp_convertargs {
+    const uint8_t * src;
+    uint8_t * dst;
+    uint32_t width;
+    uint32_t height;
+    uint32_t srcrowsize;
+    uint32_t dstrowsize;
+    uint32_t srcbits;
+    uint32_t dstbits;
+    int flip;                   // top-down source, bottom-up target
+    int indices;                // indexed to indexed, palette kept
+    int gray;                   // indexed target of gray levels
+    int fields;                 // bit field source
+    int masked;                 // bit field target
+    uint32_t palette[256];      // hub word of each index
+    uint32_t (* expand)[8];     // 1/2/4bpp source: hub words of the pixels of a byte
+    bmp_bitfield srcfields[4];  // R, G, B, A
+    bmp_bitfield dstfields[4];
+    uint32_t pack[4][256];      // bit field target: field bits of each R, G, B, A byte
+    uint8_t quant[3][256];      // indexed target: index bits of each B, G, R byte, or gray index
+    int failed;
+} bmp_convertargs;
+
+// bit position of the R, G, B and A bytes in hub words
+static const uint32_t bmp_hubpositions[4] = { 16, 8, 0, 24 };
+
+#if BMP_X86
+__attribute__((target("avx2")))
+static uint32_t bmp_bgr2bgra_avx2(const uint8_t * src, uint8_t * dst, uint32_t width)
+{
+    const __m256i spread = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+                                            0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    uint32_t x = 0;
+
+    // lanes loaded 12 bytes apart, reading 4 bytes ahead
+    for (; x + 10 <= width; x += 8) {
+        __m256i bgr = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) (src + 3*x))),
+                                              _mm_loadu_si128((const __m128i *) (src + 3*x + 12)), 1);
+        _mm256_storeu_si256((__m256i *) (dst + 4*x), _mm256_shuffle_epi8(bgr, spread));
+    }
+
+    return x;
+}
+
+__attribute__((target("avx2")))
+static uint32_t bmp_bgra2bgr_avx2(const uint8_t * src, uint8_t * dst, uint32_t width)
+{
+    const __m256i pack = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                          0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    const __m256i join = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+    uint32_t x = 0;
+
+    for (; x + 8 <= width; x += 8) {
+        __m256i bgr = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *) (src + 4*x)), pack);
+        bgr = _mm256_permutevar8x32_epi32(bgr, join);
+        _mm_storeu_si128((__m128i *) (dst + 3*x), _mm256_castsi256_si128(bgr));
+        _mm_storel_epi64((__m128i *) (dst + 3*x + 16), _mm256_extracti128_si256(bgr, 1));
+    }
+
+    return x;
+}
+
+/**
+ * 8 bit field pixels: each field masked, scaled to a byte and moved to
+ * its hub position.
+ */
+__attribute__((target("avx2")))
+static uint32_t bmp_unpackfields_avx2(const uint8_t * src, uint32_t * dst, uint32_t width, 
+                                      uint32_t bytes, const bmp_bitfield fields[4])
+{
+    const __m256i round = _mm256_set1_epi32(BMP_BITFIELD_ROUND);
+    __m128i shifts[4], positions[4];
+    __m256i maxima[4], scales[4];
+    uint32_t x = 0;
+
+    for (uint32_t c = 0; c < 4; c++) {
+        shifts[c] = _mm_cvtsi32_si128(fields[c].shift);
+        positions[c] = _mm_cvtsi32_si128(bmp_hubpositions[c]);
+        maxima[c] = _mm256_set1_epi32(fields[c].max);
+        scales[c] = _mm256_set1_epi32(fields[c].scale);
+    }
+
+    for (; x + 8 <= width; x += 8)
+    {
+        __m256i pixels = (bytes == 2) ? _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *) (src + 2*x)))
+                                      : _mm256_loadu_si256((const __m256i *) (src + 4*x));
+        __m256i hub = _mm256_setzero_si256();
+
+        for (uint32_t c = 0; c < 4; c++) {
+            __m256i v = _mm256_and_si256(_mm256_srl_epi32(pixels, shifts[c]), maxima[c]);
+            v = _mm256_srli_epi32(_mm256_add_epi32(_mm256_mullo_epi32(v, scales[c]), round), BMP_BITFIELD_SHIFT);
+            hub = _mm256_or_si256(hub, _mm256_sll_epi32(v, positions[c]));
+        }
+
+        _mm256_storeu_si256((__m256i *) (dst + x), hub);
+    }
+
+    return x;
+}
+
+/**
+ * Inverse of bmp_unpackfields_avx2() for fields up to 8 bits wide: 
+ * (v * max + 127) / 255 with the division done as (t + 1 + (t >> 8)) >> 8,
+ * exact below 65535.
+ */
+__attribute__((target("avx2")))
+static uint32_t bmp_packfields_avx2(const uint8_t * hub, uint8_t * dst, uint32_t width, 
+                                    uint32_t bytes, const bmp_bitfield fields[4])
+{
+    const __m256i low = _mm256_set1_epi32(0xFF);
+    const __m256i half = _mm256_set1_epi32(127);
+    const __m256i one = _mm256_set1_epi32(1);
+    __m128i shifts[4], positions[4];
+    __m256i maxima[4];
+    uint32_t x = 0;
+
+    for (uint32_t c = 0; c < 4; c++) {
+        shifts[c] = _mm_cvtsi32_si128(fields[c].shift);
+        positions[c] = _mm_cvtsi32_si128(bmp_hubpositions[c]);
+        maxima[c] = _mm256_set1_epi32(fields[c].max);
+    }
+
+    for (; x + 8 <= width; x += 8)
+    {
+        __m256i words = _mm256_loadu_si256((const __m256i *) (hub + 4*x));
+        __m256i pixels = _mm256_setzero_si256();
+
+        for (uint32_t c = 0; c < 4; c++) {
+            __m256i v = _mm256_and_si256(_mm256_srl_epi32(words, positions[c]), low);
+            __m256i t = _mm256_add_epi32(_mm256_mullo_epi32(v, maxima[c]), half);
+            v = _mm256_srli_epi32(_mm256_add_epi32(_mm256_add_epi32(t, one), _mm256_srli_epi32(t, 8)), 8);
+            pixels = _mm256_or_si256(pixels, _mm256_sll_epi32(v, shifts[c]));
+        }
+
+        if (bytes == 2) {
+            pixels = _mm256_permute4x64_epi64(_mm256_packus_epi32(pixels, pixels), 0xD8);
+            _mm_storeu_si128((__m128i *) (dst + 2*x), _mm256_castsi256_si128(pixels));
+        } else {
+            _mm256_storeu_si256((__m256i *) (dst + 4*x), pixels);
+        }
+    }
+
+    return x;
+}
+
+__attribute__((target("ssse3")))
+static uint32_t bmp_bgr2bgra_ssse3(const uint8_t * src, uint8_t * dst, uint32_t width)
+{
+    const __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    uint32_t x = 0;
+
+    for (; x + 6 <= width; x += 4) {
+        __m128i bgr = _mm_loadu_si128((const __m128i *) (src + 3*x));
+        _mm_storeu_si128((__m128i *) (dst + 4*x), _mm_shuffle_epi8(bgr, spread));
+    }
+
+    return x;
+}
+
+__attribute__((target("ssse3")))
+static uint32_t bmp_bgra2bgr_ssse3(const uint8_t * src, uint8_t * dst, uint32_t width)
+{
+    const __m128i pack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    uint32_t x = 0;
+
+    for (; x + 4 <= width; x += 4) {
+        __m128i bgr = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (src + 4*x)), pack);
+        int last = _mm_cvtsi128_si32(_mm_srli_si128(bgr, 8));
+        _mm_storel_epi64((__m128i *) (dst + 3*x), bgr);
+        memcpy(dst + 3*x + 8, &last, 4);
+    }
+
+    return x;
+}
+#endif
+
+// 24bpp pixels to hub words, the fourth byte 0
+static void bmp_bgr2bgra(const uint8_t * src, uint8_t * dst, uint32_t width)
+{
+    uint32_t x = 0;
+
+#if BMP_X86
+    if (__builtin_cpu_supports("avx2")) {
+        x = bmp_bgr2bgra_avx2(src, dst, width);
+    } else if (__builtin_cpu_supports("ssse3")) {
+        x = bmp_bgr2bgra_ssse3(src, dst, width);
+    }
+#endif
+
+    for (; x < width; x++) {
+        dst[4*x] = src[3*x];
+        dst[4*x + 1] = src[3*x + 1];
+        dst[4*x + 2] = src[3*x + 2];
+        dst[4*x + 3] = 0;
+    }
+}
+
+static void bmp_bgra2bgr(const uint8_t * src, uint8_t * dst, uint32_t width)
+{
+    uint32_t x = 0;
+
+#if BMP_X86
+    if (__builtin_cpu_supports("avx2")) {
+        x = bmp_bgra2bgr_avx2(src, dst, width);
+    } else if (__builtin_cpu_supports("ssse3")) {
+        x = bmp_bgra2bgr_ssse3(src, dst, width);
+    }
+#endif
+
+    for (; x < width; x++) {
+        dst[3*x] = src[4*x];
+        dst[3*x + 1] = src[4*x + 1];
+        dst[3*x + 2] = src[4*x + 2];
+    }
+}
+
+// 16bpp or 32bpp bit field pixels to hub words
+static void bmp_unpackfields(const uint8_t * src, uint32_t * dst, uint32_t width, 
+                             uint32_t bytes, const bmp_bitfield fields[4])
+{
+    uint32_t x = 0;
+
+#if BMP_X86
+    if (__builtin_cpu_supports("avx2")) {
+        x = bmp_unpackfields_avx2(src, dst, width, bytes, fields);
+    }
+#endif
+
+    for (; x < width; x++)
+    {
+        uint32_t pixel = src[bytes*x] | (src[bytes*x + 1] << 8);
+        uint32_t word = 0;
+
+        if (bytes == 4) pixel |= ((uint32_t) src[4*x + 2] << 16) | ((uint32_t) src[4*x + 3] << 24);
+
+        for (uint32_t c = 0; c < 4; c++) {
+            uint32_t value = (pixel >> fields[c].shift) & fields[c].max;
+            word |= ((value * fields[c].scale + BMP_BITFIELD_ROUND) >> BMP_BITFIELD_SHIFT) << bmp_hubpositions[c];
+        }
+
+        dst[x] = word;
+    }
+}
+
+// hub words to bit field pixels, <pack> holds the field bits of each byte
+static void bmp_packfields(const uint8_t * hub, uint8_t * dst, uint32_t width, uint32_t bytes, 
+                           const bmp_bitfield fields[4], const uint32_t pack[4][256])
+{
+    uint32_t x = 0;
+
+#if BMP_X86
+    int narrow = 1;
+    for (uint32_t c = 0; c < 4; c++) narrow &= fields[c].max <= 0xFF;
+
+    if (narrow && __builtin_cpu_supports("avx2")) {
+        x = bmp_packfields_avx2(hub, dst, width, bytes, fields);
+    }
+#else
+    (void) fields;
+#endif
+
+    for (; x < width; x++)
+    {
+        const uint8_t * word = hub + 4*x;
+        uint32_t pixel = pack[0][word[BMP_COLOR_RED]] | pack[1][word[BMP_COLOR_GREEN]] 
+                       | pack[2][word[BMP_COLOR_BLUE]] | pack[3][word[BMP_COLOR_ALPHA]];
+
+        dst[bytes*x] = pixel & 0xFF;
+        dst[bytes*x + 1] = (pixel >> 8) & 0xFF;
+        if (bytes == 4) {
+            dst[4*x + 2] = (pixel >> 16) & 0xFF;
+            dst[4*x + 3] = pixel >> 24;
+        }
+    }
+}
+
+/**
+ * Source row to hub words, returns the hub: 32bpp BI_RGB rows already
+ * are one.
+ */
+static const uint8_t * bmp_decoderow(const bmp_convertargs * args, const uint8_t * src, uint32_t * hub)
+{
+    uint32_t width = args->width;
+
+    if (args->fields) {
+        bmp_unpackfields(src, hub, width, args->srcbits / 8, args->srcfields);
+        return (const uint8_t *) hub;
+    }
+
+    switch (args->srcbits)
+    {
+    case BMP_32_BITS:
+        return src;
+    case BMP_24_BITS:
+        bmp_bgr2bgra(src, (uint8_t *) hub, width);
+        break;
+    case BMP_8_BITS:
+        for (uint32_t x = 0; x < width; x++) hub[x] = args->palette[src[x]];
+        break;
+    default:
+    {
+        // a whole byte of pixels per lookup
+        uint32_t perbyte = 8 / args->srcbits;
+        uint32_t x = 0;
+
+        for (; x + perbyte <= width; x += perbyte) {
+            memcpy(hub + x, args->expand[src[x / perbyte]], perbyte * sizeof(uint32_t));
+        }
+        if (x < width) memcpy(hub + x, args->expand[src[x / perbyte]], (width - x) * sizeof(uint32_t));
+        break;
+    }
+    }
+
+    return (const uint8_t *) hub;
+}
+
+// hub words to a target row, <indices> is scratch for indexed targets
+static void bmp_encoderow(const bmp_convertargs * args, const uint8_t * hub, uint8_t * dst, uint8_t * indices)
+{
+    uint32_t width = args->width;
+
+    if (args->masked) {
+        bmp_packfields(hub, dst, width, args->dstbits / 8, args->dstfields, args->pack);
+        return;
+    }
+
+    switch (args->dstbits)
+    {
+    case BMP_32_BITS:
+        if (hub != dst) memcpy(dst, hub, (size_t) width * 4);
+        return;
+    case BMP_24_BITS:
+        bmp_bgra2bgr(hub, dst, width);
+        return;
+    default:
+        break;
+    }
+
+    for (uint32_t x = 0; x < width; x++) {
+        const uint8_t * pixel = hub + 4*x;
+        if (args->gray) {
+            indices[x] = args->quant[0][bmp_findgray(pixel[BMP_COLOR_RED], pixel[BMP_COLOR_GREEN], pixel[BMP_COLOR_BLUE])];
+        } else {
+            indices[x] = args->quant[0][pixel[0]] | args->quant[1][pixel[1]] | args->quant[2][pixel[2]];
+        }
+    }
+
+    bmp_packindices(indices, dst, width, args->dstbits);
+}
+
+static void bmp_convertband(void * arg, uint32_t begin, uint32_t end)
+{
+    bmp_convertargs * args = arg;
+    uint32_t * hub = bmp_alloc((size_t) args->width * (sizeof(uint32_t) + 1));
+    if (hub == NULL) {
+        args->failed = 1;
+        return;
+    }
+
+    uint8_t * indices = (uint8_t *) (hub + args->width);
+
+    for (uint32_t y = begin; y < end; y++)
+    {
+        const uint8_t * src = args->src + (size_t) y * args->srcrowsize;
+        uint8_t * dst = args->dst + (size_t) (args->flip ? args->height - 1 - y : y) * args->dstrowsize;
+
+        if (args->indices) {
+            bmp_unpackindices(src, indices, args->width, args->srcbits);
+            bmp_packindices(indices, dst, args->width, args->dstbits);
+        } else {
+            // a 32bpp BI_RGB target is its own hub
+            int direct = args->dstbits == BMP_32_BITS && !args->masked && ((uintptr_t) dst & 3) == 0;
+            uint32_t * row = direct ? (uint32_t *) dst : hub;
+            bmp_encoderow(args, bmp_decoderow(args, src, row), dst, indices);
+        }
+    }
+
+    bmp_free(hub);
+}
+
+/**
+ * Hub words of the source pixels: palette, byte expansion of sub-byte
+ * indices, or the shift and scale of each bit field.
+ */
+static int bmp_convertsource(bmp_image * img, bmp_convertargs * args)
+{
+    uint32_t bits = img->dib.bmiHeader.biBitCount;
+
+    if (bmp_isindexed(img))
+    {
+        uint32_t ncolors = bmp_palettecount(img);
+
+        // indices past the palette end up black
+        for (uint32_t i = 0; i < ncolors && i < 256; i++) {
+            bmp_rgbquad * c = &img->dib.bmiColors[i];
+            args->palette[i] = BMP_HUB(c->rgbBlue, c->rgbGreen, c->rgbRed, 0);
+        }
+
+        if (bits == BMP_8_BITS) return 1;
+
+        args->expand = bmp_alloc(256 * sizeof(*args->expand));
+        if (args->expand == NULL) return 0;
+
+        uint32_t perbyte = 8 / bits;
+        uint32_t mask = (1u << bits) - 1;
+
+        for (uint32_t byte = 0; byte < 256; byte++) {
+            for (uint32_t k = 0; k < perbyte; k++) {
+                args->expand[byte][k] = args->palette[(byte >> (8 - bits * (k + 1))) & mask];
+            }
+        }
+        return 1;
+    }
+
+    switch (bits)
+    {
+    case BMP_16_BITS:
+        break;
+    case BMP_24_BITS:
+        return img->dib.bmiHeader.biCompression == BMP_BI_RGB;
+    case BMP_32_BITS:
+        if (img->dib.bmiHeader.biCompression == BMP_BI_RGB) return 1;
+        break;
+    default:
+        return 0;
+    }
+
+    uint32_t masks[4];
+
+    bmp_bitmasks(img, masks);
+    args->fields = 1;
+
+    for (int c = 0; c < 4; c++) {
+        bmp_bitfield_init(&args->srcfields[c], (bits == BMP_16_BITS) ? masks[c] & 0xFFFF : masks[c], 1);
+    }
+
+    return 1;
+}
+
+/**
+ * Headers and pixel array of the converted <img>, with room for the
+ * <ncolors> entries of an indexed target or the masks of a bit field one.
+ */
+static bmp_image * bmp_convertheaders(bmp_image * img, uint32_t bitcount, uint32_t compression, uint32_t ncolors)
+{
+    bmp_image * new = bmp_calloc(sizeof(bmp_image));
+    if (new == NULL) return NULL;
+
+    new->fileheader.bfType = BMP_FILETYPE_BM;
+    new->dib.bmiHeader.biSize = BMP_INFOHEADER;
+    new->dib.bmiHeader.biWidth = img->dib.bmiHeader.biWidth;
+    new->dib.bmiHeader.biHeight = img->dib.bmiHeader.biHeight;
+    new->dib.bmiHeader.biPlanes = 1;
+    new->dib.bmiHeader.biBitCount = bitcount;
+    new->dib.bmiHeader.biCompression = compression;
+    new->dib.bmiHeader.biXPelsPerMeter = img->dib.bmiHeader.biXPelsPerMeter;
+    new->dib.bmiHeader.biYPelsPerMeter = img->dib.bmiHeader.biYPelsPerMeter;
+    new->dib.bmiHeader.biClrUsed = (bitcount <= BMP_8_BITS && ncolors < (1u << bitcount)) ? ncolors : 0;
+
+    uint32_t palettesize = bmp_getpalettesize(new);
+
+    if (palettesize > 0) {
+        new->dib.bmiColors = bmp_calloc(palettesize);
+        if (new->dib.bmiColors == NULL) return bmp_cleanup(NULL, new);
+    }
+
+    new->dib.bmiHeader.biSizeImage = bmp_getstride(new) * bmp_getheight(new);
+    new->fileheader.bfOffBits = bmp_getheaderssize(new);
+    new->fileheader.bfSize = new->fileheader.bfOffBits + new->dib.bmiHeader.biSizeImage;
+
+    new->ciPixelArray = bmp_alloc(bmp_getarraysize(new));
+    if (new->ciPixelArray == NULL) return bmp_cleanup(NULL, new);
+
+    return new;
+}
+
+/**
+ * Target tables and palette. Bit field targets pack each byte with 
+ * rounding into its field, the masks going to the palette unless it is
+ * BI_RGB. Indexed sources keep their palette when it fits the target 
+ * depth; colours go to a 3-3-2 cube at 8bpp and to gray levels at 4bpp 
+ * and 1bpp.
+ */
+static void bmp_converttarget(bmp_image * img, bmp_image * new, const uint32_t masks[4], bmp_convertargs * args)
+{
+    uint32_t bits = new->dib.bmiHeader.biBitCount;
+
+    if (masks != NULL)
+    {
+        args->masked = 1;
+
+        for (uint32_t c = 0; c < 4; c++) {
+            bmp_bitfield * field = &args->dstfields[c];
+            bmp_bitfield_init(field, masks[c], 0);
+            for (uint32_t v = 0; v < 256; v++) {
+                args->pack[c][v] = (uint32_t) (((uint64_t) v * field->max + 127) / 255) << field->shift;
+            }
+        }
+
+        // BI_BITFIELDS palettes hold three masks, BI_ALPHABITFIELDS four
+        if (new->dib.bmiColors != NULL) {
+            uint32_t count = (new->dib.bmiHeader.biCompression == BMP_BI_ALPHABITFIELDS) ? 4 : 3;
+            memcpy(new->dib.bmiColors, masks, count * sizeof(uint32_t));
+        }
+        return;
+    }
+
+    if (bits > BMP_8_BITS) return;
+
+    uint32_t ncolors = 1u << bits;
+    bmp_rgbquad * palette = new->dib.bmiColors;
+
+    if (bmp_isindexed(img) && bmp_palettecount(img) <= ncolors) {
+        memcpy(palette, img->dib.bmiColors, bmp_getpalettesize(img));
+        args->indices = 1;
+        return;
+    }
+
+    if (bits == BMP_8_BITS)
+    {
+        for (uint32_t v = 0; v < 256; v++) {
+            args->quant[0][v] = (v * 3 + 127) / 255;
+            args->quant[1][v] = ((v * 7 + 127) / 255) << 2;
+            args->quant[2][v] = ((v * 7 + 127) / 255) << 5;
+        }
+        for (uint32_t i = 0; i < ncolors; i++) {
+            palette[i].rgbBlue = (i & 3) * 255 / 3;
+            palette[i].rgbGreen = ((i >> 2) & 7) * 255 / 7;
+            palette[i].rgbRed = (i >> 5) * 255 / 7;
+        }
+        return;
+    }
+
+    args->gray = 1;
+
+    for (uint32_t v = 0; v < 256; v++) {
+        args->quant[0][v] = (v * (ncolors - 1) + 127) / 255;
+    }
+    for (uint32_t i = 0; i < ncolors; i++) {
+        uint8_t gray = i * 255 / (ncolors - 1);
+        palette[i].rgbBlue = gray;
+        palette[i].rgbGreen = gray;
+        palette[i].rgbRed = gray;
+    }
+}
+
+/**
+ * Convert <img> into <bitcount> bits per pixel and <compression>, with
+ * <masks> (R, G, B, A) for bit field targets, NULL otherwise.
+ */
+static bmp_image * bmp_convertimage(bmp_image * img, uint32_t bitcount, uint32_t compression, const uint32_t masks[4])
+{
+    if (img == NULL || img->ciPixelArray == NULL) return NULL;
+
+    // uncompressed target first, RLE targets are encoded from it
+    uint32_t target = (compression == BMP_BI_RLE8 || compression == BMP_BI_RLE4) ? BMP_BI_RGB : compression;
+    bmp_image * decoded = NULL;
+
+    switch (img->dib.bmiHeader.biCompression)
+    {
+    case BMP_BI_RLE8:
+        decoded = bmp_rle8decoder(img);
+        if (decoded == NULL) return NULL;
+        break;
+    case BMP_BI_RLE4:
+        decoded = bmp_rle4decoder(img);
+        if (decoded == NULL) return NULL;
+        break;
+    default:
+        if (!bmp_isuncompressed(img)) return NULL;
+        break;
+    }
+
+    bmp_image * src = (decoded != NULL) ? decoded : img;
+    bmp_convertargs * args = bmp_calloc(sizeof(bmp_convertargs));
+    bmp_image * new = NULL;
+
+    if (args != NULL && bmp_convertsource(src, args)) {
+        uint32_t ncolors = 0;
+        if (bitcount <= BMP_8_BITS) {
+            ncolors = 1u << bitcount;
+            if (bmp_isindexed(src) && bmp_palettecount(src) < ncolors) ncolors = bmp_palettecount(src);
+        }
+        new = bmp_convertheaders(src, bitcount, target, ncolors);
+    }
+
+    // RLE bitmaps are always stored bottom-up
+    if (new != NULL && compression != target && new->dib.bmiHeader.biHeight < 0) {
+        new->dib.bmiHeader.biHeight = -new->dib.bmiHeader.biHeight;
+        args->flip = 1;
+    }
+
+    if (new != NULL)
+    {
+        bmp_converttarget(src, new, masks, args);
+
+        args->src = src->ciPixelArray;
+        args->dst = new->ciPixelArray;
+        args->width = src->dib.bmiHeader.biWidth;
+        args->height = bmp_getheight(src);
+        args->srcrowsize = bmp_getrowstep(src);
+        args->dstrowsize = bmp_getrowsize(new);
+        args->srcbits = src->dib.bmiHeader.biBitCount;
+        args->dstbits = bitcount;
+
+        bmp_parallel_rows(bmp_getheight(new), bmp_rowgrain(args->dstrowsize), bmp_convertband, args);
+
+        if (args->failed) new = bmp_cleanup(NULL, new);
+    }
+
+    if (args != NULL) {
+        bmp_free(args->expand);
+        bmp_free(args);
+    }
+    bmp_cleanup(NULL, decoded);
+
+    if (new == NULL || compression == target) return new;
+
+    bmp_image * encoded = (compression == BMP_BI_RLE8) ? bmp_rle8encoder(new, BMP_RLEMODE_FAST)
+                                                       : bmp_rle4encoder(new, BMP_RLEMODE_FAST);
+    bmp_cleanup(NULL, new);
+
+    return encoded;
+}
+
+bmp_image * bmp_convert(bmp_image * img, bmp_bitcount bitcount, bmp_compression compression)
+{
+    BMP_STATS_SCOPE(BMP_STAT_CONVERT);
+
+    const uint32_t x1r5g5b5[4] = {
+        BMP_BITFIELDS_R5G5B5_R5, BMP_BITFIELDS_R5G5B5_G5, BMP_BITFIELDS_R5G5B5_B5, 0
+    };
+    const uint32_t r5g6b5[4] = {
+        BMP_BITFIELDS_R5G6B5_R5, BMP_BITFIELDS_R5G6B5_G6, BMP_BITFIELDS_R5G6B5_B5, 0
+    };
+    const uint32_t * masks = NULL;
+
+    switch (compression)
+    {
+    case BMP_BI_RGB:
+        if (bitcount == BMP_2_BITS) return NULL;
+        if (bitcount == BMP_16_BITS) masks = x1r5g5b5;
+        break;
+    case BMP_BI_BITFIELDS:
+        if (bitcount != BMP_16_BITS) return NULL;
+        masks = r5g6b5;
+        break;
+    case BMP_BI_RLE8:
+        if (bitcount != BMP_8_BITS) return NULL;
+        break;
+    case BMP_BI_RLE4:
+        if (bitcount != BMP_4_BITS) return NULL;
+        break;
+    default:
+        return NULL;
+    }
+
+    switch (bitcount)
+    {
+    case BMP_1_BIT:
+    case BMP_4_BITS:
+    case BMP_8_BITS:
+    case BMP_16_BITS:
+    case BMP_24_BITS:
+    case BMP_32_BITS:
+        break;
+    default:
+        return NULL;
+    }
+
+    bmp_image * new = bmp_convertimage(img, bitcount, compression, masks);
+    if (new != NULL) BMP_STATS_BYTES(bmp_getarraysize(img) + bmp_getarraysize(new));
+
+    return new;
+}
+
+bmp_image * bmp_convert_bitfields(bmp_image * img, bmp_bitcount bitcount, const uint32_t masks[4])
+{
+    BMP_STATS_SCOPE(BMP_STAT_CONVERT);
+
+    if (masks == NULL) return NULL;
+    if (bitcount != BMP_16_BITS && bitcount != BMP_32_BITS) return NULL;
+
+    // contiguous fields within the pixel, none overlapping
+    uint64_t limit = (bitcount == BMP_16_BITS) ? 0xFFFF : 0xFFFFFFFF;
+    uint32_t used = 0;
+
+    for (uint32_t c = 0; c < 4; c++)
+    {
+        bmp_bitfield field;
+        bmp_bitfield_init(&field, masks[c], 0);
+
+        if (masks[c] > limit || (masks[c] & used)) return NULL;
+        if (((uint64_t) field.max << field.shift) != masks[c]) return NULL;
+
+        used |= masks[c];
+    }
+
+    bmp_image * new = bmp_convertimage(img, bitcount, (masks[3] != 0) ? BMP_BI_ALPHABITFIELDS : BMP_BI_BITFIELDS, masks);
+    if (new != NULL) BMP_STATS_BYTES(bmp_getarraysize(img) + bmp_getarraysize(new));
+
+    return new;
+}
+
+int64_t bmp_borderindex(int64_t i, uint32_t n, bmp_padtype type)
+{
+    if (i >= 0 && i < n) return i;
+    if (n == 0) return -1;
+
+    switch (type)
+    {
+    case BMP_PADTYPE_REPLICATE:
+        return (i < 0) ? 0 : n - 1;
+    case BMP_PADTYPE_REFLECT:
+    {
+        if (n == 1) return 0;
+
+        // the mirrored sequence repeats every 2(n - 1) pixels
+        int64_t period = 2 * (int64_t) (n - 1);
+        i %= period;
+        if (i < 0) i += period;
+
+        return (i < n) ? i : period - i;
+    }
+    case BMP_PADTYPE_WRAP:
+        i %= n;
+        return (i < 0) ? i + n : i;
+    default:
+        return -1;
+    }
+}
+
+/**
+ * Widen a row of <width> pixels by <num> pixels on both sides, following
+ * <type> for the new ones. 1bpp, 2bpp and 4bpp rows go through <work>, 
+ * room for both rows as 8bpp.
+ */
+static void bmp_padrow(const uint8_t * src, uint8_t * dst, uint32_t width, uint32_t num, 
+                       uint32_t bitcount, bmp_padtype type, uint8_t * work)
+{
+    if (bitcount < BMP_8_BITS) {
+        uint8_t * wide = work + width;
+
+        bmp_unpackindices(src, work, width, bitcount);
+        bmp_padrow(work, wide, width, num, BMP_8_BITS, type, NULL);
+        bmp_packindices(wide, dst, width + 2*num, bitcount);
+        return;
+    }
+
+    uint32_t bytes = bitcount / BMP_8_BITS;
+    size_t size = (size_t) width * bytes;
+    uint8_t * right = dst + (size_t) (num + width) * bytes;
+
+    memcpy(dst + (size_t) num * bytes, src, size);
+
+    if (type == BMP_PADTYPE_ZEROS || width == 0) {
+        memset(dst, 0, (size_t) num * bytes);
+        memset(right, 0, (size_t) num * bytes);
+    } else if (type == BMP_PADTYPE_REPLICATE && bytes == 1) {
+        memset(dst, src[0], num);
+        memset(right, src[width - 1], num);
+    } else {
+        for (uint32_t i = 0; i < num; i++) {
+            int64_t left = bmp_borderindex((int64_t) i - num, width, type);
+            int64_t next = bmp_borderindex((int64_t) width + i, width, type);
+
+            memcpy(dst + (size_t) i * bytes, src + left * bytes, bytes);
+            memcpy(right + (size_t) i * bytes, src + next * bytes, bytes);
+        }
+    }
+}
+
+typedef struct bmp_padargs {
+    const uint8_t * src;
+    uint8_t * dst;
+    uint32_t width;
+    uint32_t height;
+    uint32_t bitcount;
+    size_t rowsize;
+    size_t newRowsize;
+    uint32_t rows;
+    uint32_t columns;
+    bmp_padtype type;
+    int failed;
+} bmp_padargs;
+
+static void bmp_padband(void * arg, uint32_t begin, uint32_t end)
+{
+    bmp_padargs * args = arg;
+    uint8_t * work = NULL;
+
+    if (args->bitcount < BMP_8_BITS) {
+        work = bmp_alloc(2 * (size_t) args->width + 2 * (size_t) args->columns);
+        if (work == NULL) {
+            args->failed = 1;
+            return;
+        }
+    }
+
+    for (uint32_t y = begin; y < end; y++)
+    {
+        uint8_t * dst = args->dst + (size_t) y * args->newRowsize;
+        int64_t source = bmp_borderindex((int64_t) y - args->rows, args->height, args->type);
+
+        if (source < 0) {
+            memset(dst, 0, args->newRowsize);
+        } else {
+            bmp_padrow(args->src + source * args->rowsize, dst, args->width, args->columns, 
+                       args->bitcount, args->type, work);
+        }
+    }
+
+    bmp_free(work);
+}
+
+/**
+ * Shared by bmp_addpad(), bmp_padh() and bmp_padv(): every row of the 
+ * result is built once, straight into a single new pixel array, whose 
+ * size goes to <bytes>. Returns 0 if <img> was left as it was.
+ */
+static int bmp_pad(bmp_image * img, uint32_t rows, uint32_t columns, bmp_padtype type, size_t * bytes)
+{
+    if (img == NULL || img->ciPixelArray == NULL) return 0;
+
+    //TODO: add support for compressed images.
+    if (!bmp_isuncompressed(img)) return 0;
+
+    switch (type)
+    {
+    case BMP_PADTYPE_ZEROS:
+    case BMP_PADTYPE_REPLICATE:
+    case BMP_PADTYPE_REFLECT:
+    case BMP_PADTYPE_WRAP:
+        break;
+    default:
+        return 0;
+    }
+
+    // the padded headers must hold the same limits bmp_checkheaders() does
+    uint64_t newWidth = (uint64_t) img->dib.bmiHeader.biWidth + 2 * (uint64_t) columns;
+    uint64_t newHeight = (uint64_t) bmp_getheight(img) + 2 * (uint64_t) rows;
+    uint64_t newStride = (newWidth * img->dib.bmiHeader.biBitCount + 31) / 32 * 4;
+
+    if (newWidth > INT32_MAX || newHeight > INT32_MAX || newStride * newHeight > UINT32_MAX) 
+        return 0;
+
+    size_t newRowsize = (newWidth * img->dib.bmiHeader.biBitCount + 7) / 8;
+    size_t datasize = newRowsize * newHeight;
+
+    uint8_t * newPixelArray = bmp_alloc(datasize);
+    if (newPixelArray == NULL) return 0;
+
+    bmp_padargs args = {
+        img->ciPixelArray, newPixelArray, img->dib.bmiHeader.biWidth, bmp_getheight(img), 
+        img->dib.bmiHeader.biBitCount, bmp_getrowstep(img), newRowsize, rows, columns, type, 0
+    };
+
+    bmp_parallel_rows(newHeight, bmp_rowgrain(newRowsize), bmp_padband, &args);
+
+    if (args.failed) {
+        bmp_release(img, newPixelArray);
+        return 0;
+    }
+
+    bmp_release(img, img->ciPixelArray);
+    img->ciPixelArray = newPixelArray;
+    img->rowStride = 0;
+
+    img->dib.bmiHeader.biWidth = newWidth;
+    img->dib.bmiHeader.biHeight = (img->dib.bmiHeader.biHeight < 0) 
+                    ? -(int32_t) newHeight : (int32_t) newHeight;
+    img->dib.bmiHeader.biSizeImage = bmp_getstride(img) * newHeight;
+    img->fileheader.bfSize = img->fileheader.bfOffBits + img->dib.bmiHeader.biSizeImage;
+
+    *bytes = datasize;
+    return 1;
+}
+
+int bmp_addpad(bmp_image * img, uint32_t rows, uint32_t columns, bmp_padtype type)
+{
+    BMP_STATS_SCOPE(BMP_STAT_ADDPAD);
+
+    size_t bytes = 0;
+    int status = bmp_pad(img, rows, columns, type, &bytes);
+    BMP_STATS_BYTES(bytes);
+
+    return status;
+}
+
+int bmp_padh(bmp_image * img, uint32_t num, bmp_padtype type)
+{
+    BMP_STATS_SCOPE(BMP_STAT_PADH);
+
+    size_t bytes = 0;
+    int status = bmp_pad(img, 0, num, type, &bytes);
+    BMP_STATS_BYTES(bytes);
+
+    return status;
+}
+
+int bmp_padv(bmp_image * img, uint32_t num, bmp_padtype type)
+{
+    BMP_STATS_SCOPE(BMP_STAT_PADV);
+
+    size_t bytes = 0;
+    int status = bmp_pad(img, num, 0, type, &bytes);
+    BMP_STATS_BYTES(bytes);
+
+    return status;
+}
+
+/**
+ * Convert <n> weights to 16-bit fixed point with as many fractional bits 
+ * (at most 14) as keep every weight within int16_t and the sum of the 
+ * products with inputs up to <maxinput> within int32_t. Returns the 
+ * fractional bits, -1 if the weights do not fit at all.
+ */
+static int bmp_fixedweights(const double * weights, uint32_t n, int16_t * fixed, double maxinput)
+{
+    double largest = 0, total = 0;
+
+    for (uint32_t i = 0; i < n; i++) {
+        if (!isfinite(weights[i])) return -1;
+        largest = fmax(largest, fabs(weights[i]));
+        total += fabs(weights[i]);
+    }
+
+    int shift = 14;
+    while (shift >= 0 && (largest * (1 << shift) > INT16_MAX || total * maxinput * (1 << shift) > INT32_MAX / 2)) {
+        shift--;
+    }
+    if (shift < 0) return -1;
+
+    for (uint32_t i = 0; i < n; i++) {
+        fixed[i] = (int16_t) lround(weights[i] * (1 << shift));
+    }
+
+    return shift;
+}
+
+// round to nearest and drop <shift> fractional bits
+#define BMP_CONV_DESCALE(acc, shift) (((acc) + ((1 << (shift)) >> 1)) >> (shift))
+
+#if BMP_X86
+/**
+ * Two taps at a time: the 16 bytes under each are widened to 16 bits and
+ * interleaved, so one madd multiplies and sums a pair into 32 bits.
+ */
+__attribute__((target("avx2")))
+static inline void bmp_convpair_avx2(__m256i a, __m256i b, int16_t wa, int16_t wb, __m256i * lo, __m256i * hi)
+{
+    __m256i w = _mm256_set1_epi32((int32_t) (((uint32_t) (uint16_t) wb << 16) | (uint16_t) wa));
+
+    *lo = _mm256_add_epi32(*lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w));
+    *hi = _mm256_add_epi32(*hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i bmp_convload_avx2(const uint8_t * src)
+{
+    return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) src));
+}
+
+__attribute__((target("avx2")))
+static size_t bmp_convhrow_avx2(const uint8_t * src, int16_t * dst, size_t n, uint32_t bytes, 
+                                const int16_t * weights, uint32_t taps, int shift)
+{
+    const __m256i round = _mm256_set1_epi32((1 << shift) >> 1);
+    const __m128i count = _mm_cvtsi32_si128(shift);
+    size_t x = 0;
+
+    for (; x + 16 <= n; x += 16) {
+        __m256i lo = round, hi = round;
+
+        for (uint32_t k = 0; k < taps; k += 2) {
+            __m256i a = bmp_convload_avx2(src + x + k*bytes);
+            __m256i b = (k + 1 < taps) ? bmp_convload_avx2(src + x + (k + 1)*bytes) : _mm256_setzero_si256();
+            bmp_convpair_avx2(a, b, weights[k], (k + 1 < taps) ? weights[k + 1] : 0, &lo, &hi);
+        }
+
+        lo = _mm256_sra_epi32(lo, count);
+        hi = _mm256_sra_epi32(hi, count);
+        _mm256_storeu_si256((__m256i *) (dst + x), _mm256_packs_epi32(lo, hi));
+    }
+
+    return x;
+}
+
+/**
+ * Clamp the 16 sums in <lo> and <hi> to bytes and store them in order.
+ */
+__attribute__((target("avx2")))
+static inline void bmp_convstore_avx2(uint8_t * dst, __m256i lo, __m256i hi)
+{
+    __m256i words = _mm256_packs_epi32(lo, hi);
+    __m256i bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(words, words), _MM_SHUFFLE(3, 1, 2, 0));
+
+    _mm_storeu_si128((__m128i *) dst, _mm256_castsi256_si128(bytes));
+}
+
+__attribute__((target("avx2")))
+static size_t bmp_convvrow_avx2(const int16_t * const * rows, uint8_t * dst, size_t n, 
+                                const int16_t * weights, uint32_t taps, int shift)
+{
+    const __m256i round = _mm256_set1_epi32((1 << shift) >> 1);
+    const __m128i count = _mm_cvtsi32_si128(shift);
+    size_t x = 0;
+
+    for (; x + 16 <= n; x += 16) {
+        __m256i lo = round, hi = round;
+
+        for (uint32_t k = 0; k < taps; k += 2) {
+            __m256i a = _mm256_loadu_si256((const __m256i *) (rows[k] + x));
+            __m256i b = (k + 1 < taps) ? _mm256_loadu_si256((const __m256i *) (rows[k + 1] + x)) : _mm256_setzero_si256();
+            bmp_convpair_avx2(a, b, weights[k], (k + 1 < taps) ? weights[k + 1] : 0, &lo, &hi);
+        }
+
+        bmp_convstore_avx2(dst + x, _mm256_sra_epi32(lo, count), _mm256_sra_epi32(hi, count));
+    }
+
+    return x;
+}
+
+/**
+ * 2D kernel of <size> x <size> taps taken in pairs in row-major order; 
+ * inlined with a constant <size> for the 3x3 and 5x5 paths.
+ */
+__attribute__((target("avx2"), always_inline))
+static inline size_t bmp_conv2drow_avx2(const uint8_t * const * rows, uint8_t * dst, size_t n, uint32_t bytes, 
+                                        const int16_t * weights, uint32_t size, int shift)
+{
+    const __m256i round = _mm256_set1_epi32((1 << shift) >> 1);
+    const __m128i count = _mm_cvtsi32_si128(shift);
+    uint32_t taps = size * size;
+    size_t x = 0;
+
+    for (; x + 16 <= n; x += 16) {
+        __m256i lo = round, hi = round;
+
+        for (uint32_t k = 0; k < taps; k += 2) {
+            __m256i a = bmp_convload_avx2(rows[k / size] + x + (k % size)*bytes);
+            __m256i b = _mm256_setzero_si256();
+            int16_t wb = 0;
+
+            if (k + 1 < taps) {
+                b = bmp_convload_avx2(rows[(k + 1) / size] + x + ((k + 1) % size)*bytes);
+                wb = weights[k + 1];
+            }
+
+            bmp_convpair_avx2(a, b, weights[k], wb, &lo, &hi);
+        }
+
+        bmp_convstore_avx2(dst + x, _mm256_sra_epi32(lo, count), _mm256_sra_epi32(hi, count));
+    }
+
+    return x;
+}
+
+__attribute__((target("avx2")))
+static size_t bmp_conv3x3_avx2(const uint8_t * const * rows, uint8_t * dst, size_t n, uint32_t bytes, 
+                               const int16_t * weights, int shift)
+{
+    return bmp_conv2drow_avx2(rows, dst, n, bytes, weights, 3, shift);
+}
+
+__attribute__((target("avx2")))
+static size_t bmp_conv5x5_avx2(const uint8_t * const * rows, uint8_t * dst, size_t n, uint32_t bytes, 
+                               const int16_t * weights, int shift)
+{
+    return bmp_conv2drow_avx2(rows, dst, n, bytes, weights, 5, shift);
+}
+
+__attribute__((target("avx2")))
+static size_t bmp_convnxn_avx2(const uint8_t * const * rows, uint8_t * dst, size_t n, uint32_t bytes, 
+                               const int16_t * weights, uint32_t size, int shift)
+{
+    return bmp_conv2drow_avx2(rows, dst, n, bytes, weights, size, shift);
+}
+#endif
+
+/**
+ * Horizontal pass: <n> outputs from a row already extended by the border,
+ * <taps> bytes-per-pixel apart, kept as 16-bit fixed point.
+ */
+static void bmp_convhrow(const uint8_t * src, int16_t * dst, size_t n, uint32_t bytes, 
+                         const int16_t * weights, uint32_t taps, int shift)
+{
+    size_t x = 0;
+
+#if BMP_X86
+    if (__builtin_cpu_supports("avx2")) {
+        x = bmp_convhrow_avx2(src, dst, n, bytes, weights, taps, shift);
+    }
+#endif
+
+    for (; x < n; x++) {
+        int32_t acc = 0;
+        for (uint32_t k = 0; k < taps; k++) acc += weights[k] * src[x + k*bytes];
+
+        acc = BMP_CONV_DESCALE(acc, shift);
+        dst[x] = (acc < INT16_MIN) ? INT16_MIN : (acc > INT16_MAX) ? INT16_MAX : acc;
+    }
+}
+
+// clamp a descaled sum to a byte
+static inline uint8_t bmp_convclamp(int32_t acc)
+{
+    return (acc < 0) ? 0 : (acc > 255) ? 255 : acc;
+}
+
+/**
+ * Vertical pass: <n> bytes from <taps> rows of the horizontal pass.
+ */
+static void bmp_convvrow(const int16_t * const * rows, uint8_t * dst, size_t n, 
+                         const int16_t * weights, uint32_t taps, int shift)
+{
+    size_t x = 0;
+
+#if BMP_X86
+    if (__builtin_cpu_supports("avx2")) {
+        x = bmp_convvrow_avx2(rows, dst, n, weights, taps, shift);
+    }
+#endif
+
+    for (; x < n; x++) {
+        int32_t acc = 0;
+        for (uint32_t k = 0; k < taps; k++) acc += weights[k] * rows[k][x];
+
+        dst[x] = bmp_convclamp(BMP_CONV_DESCALE(acc, shift));
+    }
+}
+
+/**
+ * Non-separable pass: <n> bytes from <size> rows extended by the border.
+ */
+__attribute__((always_inline))
+static inline void bmp_conv2drow_scalar(const uint8_t * const * rows, uint8_t * dst, size_t x, size_t n, 
+                                        uint32_t bytes, const int16_t * weights, uint32_t size, int shift)
+{
+    for (; x < n; x++) {
+        int32_t acc = 0;
+
+        for (uint32_t r = 0; r < size; r++) {
+            for (uint32_t k = 0; k < size; k++) acc += weights[r*size + k] * rows[r][x + k*bytes];
+        }
+
+        dst[x] = bmp_convclamp(BMP_CONV_DESCALE(acc, shift));
+    }
+}
+
+static void bmp_conv2drow(const uint8_t * const * rows, uint8_t * dst, size_t n, uint32_t bytes, 
+                          const int16_t * weights, uint32_t size, int shift)
+{
+    size_t x = 0;
+
+#if BMP_X86
+    if (__builtin_cpu_supports("avx2")) {
+        x = (size == 3) ? bmp_conv3x3_avx2(rows, dst, n, bytes, weights, shift)
+          : (size == 5) ? bmp_conv5x5_avx2(rows, dst, n, bytes, weights, shift)
+          : bmp_convnxn_avx2(rows, dst, n, bytes, weights, size, shift);
+    }
+#endif
+
+    // constant sizes let the compiler unroll the small kernels
+    if (size == 3) bmp_conv2drow_scalar(rows, dst, x, n, bytes, weights, 3, shift);
+    else if (size == 5) bmp_conv2drow_scalar(rows, dst, x, n, bytes, weights, 5, shift);
+    else bmp_conv2drow_scalar(rows, dst, x, n, bytes, weights, size, shift);
+}
+
+typedef struct bmp_convargs {
+    const uint8_t * src;
+    uint8_t * dst;
+    uint32_t width;
+    uint32_t height;
+    uint32_t bytes;         // bytes per pixel
+    size_t rowsize;
+    bmp_padtype padtype;
+    int separable;
+    uint32_t hsize;         // taps of the horizontal pass, or the 2D side
+    uint32_t vsize;
+    const int16_t * hweights;
+    const int16_t * vweights;
+    int hshift;
+    int vshift;
+    int failed;
+} bmp_convargs;
+
+/**
+ * One band of output rows. The last <vsize> input rows of the band, 
+ * extended by the border (and through the horizontal pass when 
+ * separable), are kept in a ring small enough to stay in cache; each 
+ * input row is read once per band.
+ */
+static void bmp_convband(void * arg, uint32_t begin, uint32_t end)
+{
+    bmp_convargs * args = arg;
+    uint32_t hr = args->hsize / 2, vr = args->vsize / 2;
+    size_t n = (size_t) args->width * args->bytes;
+    size_t extsize = (size_t) (args->width + 2*hr) * args->bytes;
+    size_t slot = args->separable ? n * sizeof(int16_t) : extsize;
+
+    uint8_t * ext = bmp_alloc(extsize);
+    uint8_t * ring = bmp_alloc(args->vsize * slot);
+
+    if (ext == NULL || ring == NULL) {
+        args->failed = 1;
+        bmp_free(ext);
+        bmp_free(ring);
+        return;
+    }
+
+    const int16_t * passed[BMP_CONV_MAXSIZE];
+    const uint8_t * extended[BMP_CONV_MAXSIZE];
+    int64_t first = (int64_t) begin - vr;
+    int64_t next = first;
+
+    for (uint32_t y = begin; y < end; y++)
+    {
+        for (; next <= (int64_t) y + vr; next++)
+        {
+            uint8_t * row = ring + (size_t) ((next - first) % args->vsize) * slot;
+            int64_t source = bmp_borderindex(next, args->height, args->padtype);
+            uint8_t * dst = args->separable ? ext : row;
+
+            if (source < 0) {
+                memset(row, 0, slot);
+                continue;
+            }
+
+            bmp_padrow(args->src + source * args->rowsize, dst, args->width, hr, 
+                       args->bytes * BMP_8_BITS, args->padtype, NULL);
+
+            if (args->separable) {
+                bmp_convhrow(ext, (int16_t *) row, n, args->bytes, args->hweights, args->hsize, args->hshift);
+            }
+        }
+
+        for (uint32_t k = 0; k < args->vsize; k++) {
+            uint8_t * row = ring + (size_t) ((y - begin + k) % args->vsize) * slot;
+            passed[k] = (const int16_t *) row;
+            extended[k] = row;
+        }
+
+        uint8_t * dst = args->dst + (size_t) y * args->rowsize;
+
+        if (args->separable) {
+            bmp_convvrow(passed, dst, n, args->vweights, args->vsize, args->vshift);
+        } else {
+            bmp_conv2drow(extended, dst, n, args->bytes, args->hweights, args->hsize, args->hshift);
+        }
+    }
+
+    bmp_free(ext);
+    bmp_free(ring);
+}
+
+/**
+ * Shared by both convolution entry points: checks <img>, runs the bands 
+ * into a new pixel array and swaps it in.
+ */
+static int bmp_convrun(bmp_image * img, bmp_convargs * args)
+{
+    BMP_STATS_SCOPE(BMP_STAT_CONVOLVE);
+
+    if (img == NULL || img->ciPixelArray == NULL) return 0;
+    if (!bmp_isuncompressed(img)) return 0;
+
+    switch (img->dib.bmiHeader.biBitCount)
+    {
+    case BMP_8_BITS:
+    case BMP_24_BITS:
+    case BMP_32_BITS:
+        break;
+    default:
+        return 0;
+    }
+
+    switch (args->padtype)
+    {
+    case BMP_PADTYPE_ZEROS:
+    case BMP_PADTYPE_REPLICATE:
+    case BMP_PADTYPE_REFLECT:
+    case BMP_PADTYPE_WRAP:
+        break;
+    default:
+        return 0;
+    }
+
+    // the kernels walk packed rows
+    if (!bmp_packrows(img)) return 0;
+
+    uint8_t * newPixelArray = bmp_alloc(bmp_getarraysize(img));
+    if (newPixelArray == NULL) return 0;
+
+    args->src = img->ciPixelArray;
+    args->dst = newPixelArray;
+    args->width = img->dib.bmiHeader.biWidth;
+    args->height = bmp_getheight(img);
+    args->bytes = img->dib.bmiHeader.biBitCount / BMP_8_BITS;
+    args->rowsize = bmp_getrowsize(img);
+
+    bmp_parallel_rows(args->height, bmp_rowgrain(args->rowsize), bmp_convband, args);
+
+    // the image is left as it was if a band could not run
+    if (args->failed) {
+        bmp_release(img, newPixelArray);
+        return 0;
+    }
+
+    bmp_release(img, img->ciPixelArray);
+    img->ciPixelArray = newPixelArray;
+
+    BMP_STATS_BYTES(bmp_getarraysize(img));
+
+    return 1;
+}
+
+// odd and at most BMP_CONV_MAXSIZE taps
+#define BMP_CONV_VALIDSIZE(size) ((size) % 2 == 1 && (size) <= BMP_CONV_MAXSIZE)
+
+int bmp_convolve_separable(bmp_image * img, const double * horizontal, uint32_t hsize, 
+                           const double * vertical, uint32_t vsize, bmp_padtype padtype)
+{
+    if (horizontal == NULL || vertical == NULL) return 0;
+    if (!BMP_CONV_VALIDSIZE(hsize) || !BMP_CONV_VALIDSIZE(vsize)) return 0;
+
+    int16_t hweights[BMP_CONV_MAXSIZE], vweights[BMP_CONV_MAXSIZE];
+
+    // the horizontal pass keeps up to BMP_CONV_INTERBITS fractional bits
+    int hshift = bmp_fixedweights(horizontal, hsize, hweights, 255);
+    if (hshift < 0) return 0;
+
+    double total = 0;
+    for (uint32_t k = 0; k < hsize; k++) total += fabs(horizontal[k]);
+
+    int interbits = BMP_CONV_INTERBITS;
+    while (interbits > 0 && total * 255 * (1 << interbits) > INT16_MAX) interbits--;
+    if (interbits > hshift) interbits = hshift;
+
+    int vshift = bmp_fixedweights(vertical, vsize, vweights, INT16_MAX);
+    if (vshift < 0) return 0;
+
+    bmp_convargs args = {
+        .padtype = padtype, .separable = 1, .hsize = hsize, .vsize = vsize,
+        .hweights = hweights, .vweights = vweights,
+        .hshift = hshift - interbits, .vshift = vshift + interbits
+    };
+
+    return bmp_convrun(img, &args);
+}
+
+int bmp_convolve(bmp_image * img, const double * kernel, uint32_t size, bmp_padtype padtype)
+{
+    if (kernel == NULL || !BMP_CONV_VALIDSIZE(size)) return 0;
+
+    int16_t weights[BMP_CONV_MAXSIZE * BMP_CONV_MAXSIZE];
+
+    int shift = bmp_fixedweights(kernel, size * size, weights, 255);
+    if (shift < 0) return 0;
+
+    bmp_convargs args = {
+        .padtype = padtype, .separable = 0, .hsize = size, .vsize = size,
+        .hweights = weights, .hshift = shift
+    };
+
+    return bmp_convrun(img, &args);
+}
+
+int bmp_gaussian(bmp_image * img, double sigma, bmp_padtype padtype)
+{
+    if (!(sigma > 0)) return 0;
+
+    // 3 sigma each side holds all but 0.3% of the weight
+    uint32_t radius = ceil(3 * sigma);
+    if (radius > BMP_CONV_MAXSIZE / 2) radius = BMP_CONV_MAXSIZE / 2;
+
+    double weights[BMP_CONV_MAXSIZE];
+    double total = 0;
+
+    for (uint32_t k = 0; k <= 2*radius; k++) {
+        double d = (double) k - radius;
+        weights[k] = exp(-d * d / (2 * sigma * sigma));
+        total += weights[k];
+    }
+
+    for (uint32_t k = 0; k <= 2*radius; k++) weights[k] /= total;
+
+    return bmp_convolve_separable(img, weights, 2*radius + 1, weights, 2*radius + 1, padtype);
+}
+
+int bmp_boxblur(bmp_image * img, uint32_t radius, bmp_padtype padtype)
+{
+    if (radius > BMP_CONV_MAXSIZE / 2) return 0;
+
+    double weights[BMP_CONV_MAXSIZE];
+    for (uint32_t k = 0; k <= 2*radius; k++) weights[k] = 1.0 / (2*radius + 1);
+
+    return bmp_convolve_separable(img, weights, 2*radius + 1, weights, 2*radius + 1, padtype);
+}
+
+int bmp_sharpen(bmp_image * img, bmp_padtype padtype)
+{
+    static const double kernel[9] = {
+         0, -1,  0,
+        -1,  5, -1,
+         0, -1,  0
+    };
+
+    return bmp_convolve(img, kernel, 3, padtype);
+}
+
+/**
+ * Fill <ext> with row <y> extended by <num> pixels on both sides under 
+ * <padtype>, or with zeros when the policy makes the whole row blank.
+ */
+static void bmp_extrow(const uint8_t * src, size_t rowsize, uint32_t width, uint32_t height, 
+                       uint32_t bytes, uint32_t num, bmp_padtype padtype, int64_t y, uint8_t * ext)
+{
+    int64_t source = bmp_borderindex(y, height, padtype);
+
+    if (source < 0) {
+        memset(ext, 0, (size_t) (width + 2*num) * bytes);
+    } else {
+        bmp_padrow(src + source * rowsize, ext, width, num, bytes * BMP_8_BITS, padtype, NULL);
+    }
+}
+
+typedef enum bmp_netkind {
+    BMP_NET_SWAP,   // both outputs are used
+    BMP_NET_MIN,    // only the low one is
+    BMP_NET_MAX     // only the high one is
+} bmp_netkind;
+
+typedef struct bmp_netop {
+    uint8_t a;
+    uint8_t b;
+    uint8_t kind;
+} bmp_netop;
+
+/**
+ * Batcher odd-even merge sort networks cut down to what the middle wire 
+ * (4 of 9, 12 of 25) depends on; compare-exchanges whose other output is 
+ * never read again are a plain min or max.
+ */
+static const bmp_netop bmp_median9[] = {
+    { 0, 1, BMP_NET_SWAP }, { 2, 3, BMP_NET_SWAP }, { 4, 5, BMP_NET_SWAP },
+    { 6, 7, BMP_NET_SWAP }, { 0, 2, BMP_NET_SWAP }, { 1, 3, BMP_NET_SWAP },
+    { 4, 6, BMP_NET_SWAP }, { 5, 7, BMP_NET_SWAP }, { 1, 2, BMP_NET_SWAP },
+    { 5, 6, BMP_NET_SWAP }, { 0, 4, BMP_NET_SWAP }, { 1, 5, BMP_NET_SWAP },
+    { 2, 6, BMP_NET_SWAP }, { 3, 7, BMP_NET_MIN }, { 2, 4, BMP_NET_SWAP },
+    { 3, 5, BMP_NET_SWAP }, { 1, 2, BMP_NET_MAX }, { 3, 4, BMP_NET_SWAP },
+    { 5, 6, BMP_NET_MIN }, { 0, 8, BMP_NET_MAX }, { 4, 8, BMP_NET_MIN },
+    { 2, 4, BMP_NET_MAX }, { 3, 5, BMP_NET_MIN }, { 3, 4, BMP_NET_MAX }
+};
+
+static const bmp_netop bmp_median25[] = {
+    { 0, 1, BMP_NET_SWAP }, { 2, 3, BMP_NET_SWAP }, { 4, 5, BMP_NET_SWAP },
+    { 6, 7, BMP_NET_SWAP }, { 8, 9, BMP_NET_SWAP }, { 10, 11, BMP_NET_SWAP },
+    { 12, 13, BMP_NET_SWAP }, { 14, 15, BMP_NET_SWAP }, { 16, 17, BMP_NET_SWAP },
+    { 18, 19, BMP_NET_SWAP }, { 20, 21, BMP_NET_SWAP }, { 22, 23, BMP_NET_SWAP },
+    { 0, 2, BMP_NET_SWAP }, { 1, 3, BMP_NET_SWAP }, { 4, 6, BMP_NET_SWAP },
+    { 5, 7, BMP_NET_SWAP }, { 8, 10, BMP_NET_SWAP }, { 9, 11, BMP_NET_SWAP },
+    { 12, 14, BMP_NET_SWAP }, { 13, 15, BMP_NET_SWAP }, { 16, 18, BMP_NET_SWAP },
+    { 17, 19, BMP_NET_SWAP }, { 20, 22, BMP_NET_SWAP }, { 21, 23, BMP_NET_SWAP },
+    { 1, 2, BMP_NET_SWAP }, { 5, 6, BMP_NET_SWAP }, { 9, 10, BMP_NET_SWAP },
+    { 13, 14, BMP_NET_SWAP }, { 17, 18, BMP_NET_SWAP }, { 21, 22, BMP_NET_SWAP },
+    { 0, 4, BMP_NET_SWAP }, { 1, 5, BMP_NET_SWAP }, { 2, 6, BMP_NET_SWAP },
+    { 3, 7, BMP_NET_SWAP }, { 8, 12, BMP_NET_SWAP }, { 9, 13, BMP_NET_SWAP },
+    { 10, 14, BMP_NET_SWAP }, { 11, 15, BMP_NET_SWAP }, { 16, 20, BMP_NET_SWAP },
+    { 17, 21, BMP_NET_SWAP }, { 18, 22, BMP_NET_SWAP }, { 19, 23, BMP_NET_SWAP },
+    { 2, 4, BMP_NET_SWAP }, { 3, 5, BMP_NET_SWAP }, { 10, 12, BMP_NET_SWAP },
+    { 11, 13, BMP_NET_SWAP }, { 18, 20, BMP_NET_SWAP }, { 19, 21, BMP_NET_SWAP },
+    { 1, 2, BMP_NET_SWAP }, { 3, 4, BMP_NET_SWAP }, { 5, 6, BMP_NET_SWAP },
+    { 9, 10, BMP_NET_SWAP }, { 11, 12, BMP_NET_SWAP }, { 13, 14, BMP_NET_SWAP },
+    { 17, 18, BMP_NET_SWAP }, { 19, 20, BMP_NET_SWAP }, { 21, 22, BMP_NET_SWAP },
+    { 0, 8, BMP_NET_SWAP }, { 1, 9, BMP_NET_SWAP }, { 2, 10, BMP_NET_SWAP },
+    { 3, 11, BMP_NET_SWAP }, { 4, 12, BMP_NET_SWAP }, { 5, 13, BMP_NET_SWAP },
+    { 6, 14, BMP_NET_SWAP }, { 7, 15, BMP_NET_MIN }, { 16, 24, BMP_NET_SWAP },
+    { 4, 8, BMP_NET_SWAP }, { 5, 9, BMP_NET_SWAP }, { 6, 10, BMP_NET_SWAP },
+    { 7, 11, BMP_NET_SWAP }, { 20, 24, BMP_NET_SWAP }, { 2, 4, BMP_NET_SWAP },
+    { 3, 5, BMP_NET_SWAP }, { 6, 8, BMP_NET_SWAP }, { 7, 9, BMP_NET_SWAP },
+    { 10, 12, BMP_NET_SWAP }, { 11, 13, BMP_NET_SWAP }, { 18, 20, BMP_NET_SWAP },
+    { 19, 21, BMP_NET_SWAP }, { 22, 24, BMP_NET_SWAP }, { 1, 2, BMP_NET_SWAP },
+    { 3, 4, BMP_NET_SWAP }, { 5, 6, BMP_NET_SWAP }, { 7, 8, BMP_NET_SWAP },
+    { 9, 10, BMP_NET_SWAP }, { 11, 12, BMP_NET_SWAP }, { 13, 14, BMP_NET_MIN },
+    { 17, 18, BMP_NET_SWAP }, { 19, 20, BMP_NET_SWAP }, { 21, 22, BMP_NET_SWAP },
+    { 23, 24, BMP_NET_SWAP }, { 0, 16, BMP_NET_MAX }, { 1, 17, BMP_NET_MAX },
+    { 2, 18, BMP_NET_MAX }, { 3, 19, BMP_NET_MAX }, { 4, 20, BMP_NET_MAX },
+    { 5, 21, BMP_NET_MAX }, { 6, 22, BMP_NET_MIN }, { 7, 23, BMP_NET_MIN },
+    { 8, 24, BMP_NET_MIN }, { 8, 16, BMP_NET_MAX }, { 9, 17, BMP_NET_MAX },
+    { 10, 18, BMP_NET_MIN }, { 11, 19, BMP_NET_MIN }, { 12, 20, BMP_NET_MIN },
+    { 13, 21, BMP_NET_MIN }, { 6, 10, BMP_NET_MAX }, { 7, 11, BMP_NET_MAX },
+    { 12, 16, BMP_NET_MIN }, { 13, 17, BMP_NET_MIN }, { 10, 12, BMP_NET_MAX },
+    { 11, 13, BMP_NET_MIN }, { 11, 12, BMP_NET_MAX }
+};
+
+#define BMP_NETSIZE(net) (sizeof(net) / sizeof(bmp_netop))
+
+#if BMP_X86
+/**
+ * 32 medians at a time: each wire holds the 32 bytes under one tap of the
+ * <size> x <size> window, and the network runs on whole vectors.
+ */
+__attribute__((target("avx2"), always_inline))
+static inline size_t bmp_medianrow_avx2(const uint8_t * const * rows, uint8_t * dst, size_t n, uint32_t bytes, 
+                                        uint32_t size, const bmp_netop * net, uint32_t nops)
+{
+    __m256i v[25];
+    size_t x = 0;
+
+    for (; x + 32 <= n; x += 32) {
+        for (uint32_t k = 0; k < size * size; k++) {
+            v[k] = _mm256_loadu_si256((const __m256i *) (rows[k / size] + x + (k % size)*bytes));
+        }
+
+#pragma GCC unroll 128
+        for (uint32_t i = 0; i < nops; i++) {
+            __m256i lo = _mm256_min_epu8(v[net[i].a], v[net[i].b]);
+            __m256i hi = _mm256_max_epu8(v[net[i].a], v[net[i].b]);
+            if (net[i].kind != BMP_NET_MAX) v[net[i].a] = lo;
+            if (net[i].kind != BMP_NET_MIN) v[net[i].b] = hi;
+        }
+
+        _mm256_storeu_si256((__m256i *) (dst + x), v[size * size / 2]);
+    }
+
+    return x;
+}
+
+__attribute__((target("avx2")))
+static size_t bmp_median3x3_avx2(const uint8_t * const * rows, uint8_t * dst, size_t n, uint32_t bytes)
+{
+    return bmp_medianrow_avx2(rows, dst, n, bytes, 3, bmp_median9, BMP_NETSIZE(bmp_median9));
+}
+
+__attribute__((target("avx2")))
+static size_t bmp_median5x5_avx2(const uint8_t * const * rows, uint8_t * dst, size_t n, uint32_t bytes)
+{
+    return bmp_medianrow_avx2(rows, dst, n, bytes, 5, bmp_median25, BMP_NETSIZE(bmp_median25));
+}
+#endif
+
+/**
+ * 3x3 or 5x5 medians of <n> bytes from <size> extended rows through the 
+ * sorting networks.
+ */
+static void bmp_mediannetrow(const uint8_t * const * rows, uint8_t * dst, size_t n, uint32_t bytes, uint32_t size)
+{
+    const bmp_netop * net = (size == 3) ? bmp_median9 : bmp_median25;
+    uint32_t nops = (size == 3) ? BMP_NETSIZE(bmp_median9) : BMP_NETSIZE(bmp_median25);
+    size_t x = 0;
+
+#if BMP_X86
+    if (__builtin_cpu_supports("avx2")) {
+        x = (size == 3) ? bmp_median3x3_avx2(rows, dst, n, bytes) : bmp_median5x5_avx2(rows, dst, n, bytes);
+    }
+#endif
+
+    for (; x < n; x++) {
+        uint8_t v[25];
+
+        for (uint32_t k = 0; k < size * size; k++) v[k] = rows[k / size][x + (k % size)*bytes];
+
+        for (uint32_t i = 0; i < nops; i++) {
+            uint8_t lo = (v[net[i].a] < v[net[i].b]) ? v[net[i].a] : v[net[i].b];
+            uint8_t hi = (v[net[i].a] < v[net[i].b]) ? v[net[i].b] : v[net[i].a];
+            v[net[i].a] = lo;
+            v[net[i].b] = hi;
+        }
+
+        dst[x] = v[size * size / 2];
+    }
+}
+
+typedef struct bmp_medianargs {
+    const uint8_t * src;
+    uint8_t * dst;
+    uint32_t width;
+    uint32_t height;
+    uint32_t bytes;
+    size_t rowsize;
+    uint32_t radius;
+    bmp_padtype padtype;
+    int failed;
+} bmp_medianargs;
+
+/**
+ * Small radii: a ring of the 3 or 5 extended rows the window covers.
+ */
+static void bmp_mediannetband(void * arg, uint32_t begin, uint32_t end)
+{
+    bmp_medianargs * args = arg;
+    uint32_t r = args->radius, size = 2*r + 1;
+    size_t n = (size_t) args->width * args->bytes;
+    size_t extsize = (size_t) (args->width + 2*r) * args->bytes;
+
+    uint8_t * ring = bmp_alloc(size * extsize);
+    if (ring == NULL) {
+        args->failed = 1;
+        return;
+    }
+
+    const uint8_t * rows[5];
+    int64_t next = (int64_t) begin - r;
+
+    for (uint32_t y = begin; y < end; y++)
+    {
+        for (; next <= (int64_t) y + r; next++) {
+            uint8_t * row = ring + (size_t) ((next - begin + r) % size) * extsize;
+            bmp_extrow(args->src, args->rowsize, args->width, args->height, args->bytes, r, args->padtype, next, row);
+        }
+
+        for (uint32_t k = 0; k < size; k++) {
+            rows[k] = ring + (size_t) ((y - begin + k) % size) * extsize;
+        }
+
+        bmp_mediannetrow(rows, args->dst + (size_t) y * args->rowsize, n, args->bytes, size);
+    }
+
+    bmp_free(ring);
+}
+
+/**
+ * Fine (256 bins) and coarse (16 bins of 16 levels) histograms kept side 
+ * by side, so both are updated in one pass.
+ */
+#define BMP_HIST_BINS (256 + 16)
+
+static inline void bmp_histcount(uint16_t * hist, uint8_t value, int16_t delta)
+{
+    hist[value] += delta;
+    hist[256 + (value >> 4)] += delta;
+}
+
+/**
+ * Histogram of the window around one pixel. Only the coarse bins slide 
+ * with every pixel; a segment of 16 fine bins is brought up to the 
+ * current position when a lookup descends into it.
+ */
+typedef struct bmp_histwindow {
+    uint16_t coarse[16];
+    uint16_t fine[256];
+    int64_t stamp[16];      // position each fine segment holds, -1 for none
+} bmp_histwindow;
+
+// window at position 0 over the column histograms <step> bins apart
+static void bmp_histstart(bmp_histwindow * w, const uint16_t * columns, size_t step, uint32_t r)
+{
+    memset(w->coarse, 0, sizeof(w->coarse));
+
+    for (uint32_t k = 0; k <= 2*r; k++) {
+        const uint16_t * column = columns + k * step + 256;
+        for (uint32_t i = 0; i < 16; i++) w->coarse[i] += column[i];
+    }
+
+    for (uint32_t i = 0; i < 16; i++) w->stamp[i] = -1;
+}
+
+// from position <x> to <x> + 1: the coarse bins only
+static inline void bmp_histslide(bmp_histwindow * w, const uint16_t * columns, size_t step, uint32_t x, uint32_t r)
+{
+    const uint16_t * add = columns + (x + 2*r + 1) * step + 256;
+    const uint16_t * sub = columns + x * step + 256;
+
+    for (uint32_t i = 0; i < 16; i++) w->coarse[i] += add[i] - sub[i];
+}
+
+// catch fine segment <bin> up to position <x>, rebuilding it when that is cheaper
+static void bmp_histrefresh(bmp_histwindow * w, const uint16_t * columns, size_t step, 
+                            uint32_t x, uint32_t r, uint32_t bin)
+{
+    uint16_t * fine = w->fine + (bin << 4);
+    const uint16_t * segment = columns + (bin << 4);
+    int64_t from = w->stamp[bin];
+
+    if (from < 0 || x - from > r) {
+        memset(fine, 0, 16 * sizeof(uint16_t));
+        for (uint32_t k = x; k <= x + 2*r; k++) {
+            const uint16_t * column = segment + k * step;
+            for (uint32_t i = 0; i < 16; i++) fine[i] += column[i];
+        }
+    } else {
+        for (uint32_t k = from; k < x; k++) {
+            const uint16_t * add = segment + (k + 2*r + 1) * step;
+            const uint16_t * sub = segment + k * step;
+            for (uint32_t i = 0; i < 16; i++) fine[i] += add[i] - sub[i];
+        }
+    }
+
+    w->stamp[bin] = x;
+}
+
+// the value of rank <rank> at position <x>: coarse bins first, then 16 fine ones
+static inline uint8_t bmp_histmedian(bmp_histwindow * w, const uint16_t * columns, size_t step, 
+                                     uint32_t x, uint32_t r, uint32_t rank)
+{
+    uint32_t bin = 0, count = 0;
+
+    while (count + w->coarse[bin] <= rank) count += w->coarse[bin++];
+
+    if (w->stamp[bin] != x) bmp_histrefresh(w, columns, step, x, r, bin);
+
+    uint32_t value = bin << 4;
+    while (count + w->fine[value] <= rank) count += w->fine[value++];
+
+    return value;
+}
+
+/**
+ * Large radii, after Perreault and Hebert: every byte column keeps the 
+ * histogram of the 2r+1 rows around the current one, updated by one 
+ * removal and one insertion per row. Along a row the coarse window bins 
+ * slide by adding the column entering and removing the one leaving, and 
+ * only the fine segments lookups reach are updated, so each pixel costs 
+ * about the same whatever the radius.
+ */
+static void bmp_medianhistband(void * arg, uint32_t begin, uint32_t end)
+{
+    bmp_medianargs * args = arg;
+    uint32_t r = args->radius, bytes = args->bytes;
+    size_t columns = (size_t) (args->width + 2*r) * bytes;
+    size_t step = (size_t) bytes * BMP_HIST_BINS;
+    uint32_t rank = (2*r + 1) * (2*r + 1) / 2;
+
+    uint8_t * ext = bmp_alloc(columns);
+    uint16_t * hist = bmp_calloc(columns * BMP_HIST_BINS * sizeof(uint16_t));
+
+    if (ext == NULL || hist == NULL) {
+        args->failed = 1;
+        bmp_free(ext);
+        bmp_free(hist);
+        return;
+    }
+
+    for (int64_t j = (int64_t) begin - r; j <= (int64_t) begin + r; j++) {
+        bmp_extrow(args->src, args->rowsize, args->width, args->height, bytes, r, args->padtype, j, ext);
+        for (size_t c = 0; c < columns; c++) bmp_histcount(hist + c * BMP_HIST_BINS, ext[c], 1);
+    }
+
+    for (uint32_t y = begin; y < end; y++)
+    {
+        if (y > begin) {
+            bmp_extrow(args->src, args->rowsize, args->width, args->height, bytes, r, args->padtype, (int64_t) y - r - 1, ext);
+            for (size_t c = 0; c < columns; c++) bmp_histcount(hist + c * BMP_HIST_BINS, ext[c], -1);
+
+            bmp_extrow(args->src, args->rowsize, args->width, args->height, bytes, r, args->padtype, (int64_t) y + r, ext);
+            for (size_t c = 0; c < columns; c++) bmp_histcount(hist + c * BMP_HIST_BINS, ext[c], 1);
+        }
+
+        uint8_t * dst = args->dst + (size_t) y * args->rowsize;
+
+        for (uint32_t channel = 0; channel < bytes; channel++)
+        {
+            const uint16_t * channels = hist + (size_t) channel * BMP_HIST_BINS;
+            bmp_histwindow window;
+
+            bmp_histstart(&window, channels, step, r);
+
+            for (uint32_t x = 0; x < args->width; x++) {
+                dst[(size_t) x * bytes + channel] = bmp_histmedian(&window, channels, step, x, r, rank);
+
+                if (x + 1 < args->width) bmp_histslide(&window, channels, step, x, r);
+            }
+        }
+    }
+
+    bmp_free(ext);
+    bmp_free(hist);
+}
+
+typedef struct bmp_medianparams {
+    uint32_t radius;
+    bmp_padtype padtype;
+} bmp_medianparams;
+
+// median of an image with byte channels, parameters already checked
+static int bmp_medianimage(bmp_image * img, const void * params)
+{
+    uint32_t radius = ((const bmp_medianparams *) params)->radius;
+    bmp_padtype padtype = ((const bmp_medianparams *) params)->padtype;
+
+    if (!bmp_packrows(img)) return 0;
+
+    uint8_t * newPixelArray = bmp_alloc(bmp_getarraysize(img));
+    if (newPixelArray == NULL) return 0;
+
+    bmp_medianargs args = {
+        img->ciPixelArray, newPixelArray, img->dib.bmiHeader.biWidth, bmp_getheight(img), 
+        img->dib.bmiHeader.biBitCount / BMP_8_BITS, bmp_getrowsize(img), radius, padtype, 0
+    };
+
+    // the column histograms cost a pass over 2r+1 rows per band
+    uint32_t grain = bmp_rowgrain(args.rowsize);
+    if (radius > 2 && grain < 4*radius) grain = 4*radius;
+
+    bmp_parallel_rows(args.height, grain, (radius <= 2) ? bmp_mediannetband : bmp_medianhistband, &args);
+
+    if (args.failed) {
+        bmp_release(img, newPixelArray);
+        return 0;
+    }
+
+    bmp_release(img, img->ciPixelArray);
+    img->ciPixelArray = newPixelArray;
+
+    return 1;
+}
+
+int bmp_median(bmp_image * img, uint32_t radius, bmp_padtype padtype)
+{
+    BMP_STATS_SCOPE(BMP_STAT_MEDIAN);
+
+    if (img == NULL || img->ciPixelArray == NULL) return 0;
+    if (radius > BMP_MEDIAN_MAXRADIUS) return 0;
+
+    switch (padtype)
+    {
+    case BMP_PADTYPE_ZEROS:
+    case BMP_PADTYPE_REPLICATE:
+    case BMP_PADTYPE_REFLECT:
+    case BMP_PADTYPE_WRAP:
+        break;
+    default:
+        return 0;
+    }
+
+    // RLE images are filtered on their decoded rows, and stay decoded
+    if (!bmp_decoderle(img)) return 0;
+    if (!bmp_isuncompressed(img)) return 0;
+
+    switch (img->dib.bmiHeader.biBitCount)
+    {
+    case BMP_1_BIT:
+    case BMP_2_BITS:
+    case BMP_4_BITS:
+    case BMP_8_BITS:
+    case BMP_24_BITS:
+    case BMP_32_BITS:
+        break;
+    default:
+        return 0;
+    }
+
+    if (radius == 0) return 1;
+
+    bmp_medianparams params = { radius, padtype };
+    int done = bmp_issubbyte(img) ? bmp_onindices(img, bmp_medianimage, &params) 
+                                  : bmp_medianimage(img, &params);
+
+    if (done) BMP_STATS_BYTES(bmp_getarraysize(img));
+
+    return done;
+}
+
+#if BMP_X86
+__attribute__((target("avx2")))
+static size_t bmp_morphrow_avx2(const uint8_t * a, const uint8_t * b, uint8_t * dst, size_t n, int dilate)
+{
+    size_t x = 0;
+
+    for (; x + 32 <= n; x += 32) {
+        __m256i va = _mm256_loadu_si256((const __m256i *) (a + x));
+        __m256i vb = _mm256_loadu_si256((const __m256i *) (b + x));
+        __m256i v = dilate ? _mm256_max_epu8(va, vb) : _mm256_min_epu8(va, vb);
+        _mm256_storeu_si256((__m256i *) (dst + x), v);
+    }
+
+    return x;
+}
+#endif
+
+/**
+ * Byte-wise minimum (erosion) or maximum (dilation) of two rows.
+ */
+static void bmp_morphrow(const uint8_t * a, const uint8_t * b, uint8_t * dst, size_t n, int dilate)
+{
+    size_t x = 0;
+
+#if BMP_X86
+    if (__builtin_cpu_supports("avx2")) {
+        x = bmp_morphrow_avx2(a, b, dst, n, dilate);
+    }
+#endif
+
+    if (dilate) {
+        for (; x < n; x++) dst[x] = (a[x] > b[x]) ? a[x] : b[x];
+    } else {
+        for (; x < n; x++) dst[x] = (a[x] < b[x]) ? a[x] : b[x];
+    }
+}
+
+#define BMP_MORPH_OP(a, b, dilate) ((dilate) ? ((a) > (b) ? (a) : (b)) : ((a) < (b) ? (a) : (b)))
+
+/**
+ * van Herk/Gil-Werman along a row extended by <r> on both sides: the 
+ * values are cut in blocks of 2r+1, <g> runs forwards and <h> backwards
+ * within each block, and any window is one <h> and one <g>. Three 
+ * comparisons per pixel whatever the size.
+ */
+static void bmp_vhgwrow(const uint8_t * src, uint8_t * dst, uint32_t n, uint32_t r, int dilate, 
+                        uint8_t * g, uint8_t * h)
+{
+    uint32_t k = 2*r + 1, m = n + 2*r;
+
+    for (uint32_t i = 0; i < m; i++) {
+        g[i] = (i % k == 0) ? src[i] : BMP_MORPH_OP(g[i - 1], src[i], dilate);
+    }
+
+    for (uint32_t i = m; i-- > 0; ) {
+        h[i] = (i == m - 1 || (i + 1) % k == 0) ? src[i] : BMP_MORPH_OP(h[i + 1], src[i], dilate);
+    }
+
+    for (uint32_t x = 0; x < n; x++) {
+        dst[x] = BMP_MORPH_OP(h[x], g[x + 2*r], dilate);
+    }
+}
+
+typedef struct bmp_morphargs {
+    const uint8_t * src;
+    uint8_t * dst;
+    uint32_t width;
+    uint32_t height;
+    size_t rowsize;
+    uint32_t hr;            // radii of the structuring element
+    uint32_t vr;
+    int dilate;
+    bmp_padtype padtype;
+    int failed;
+} bmp_morphargs;
+
+// output rows handled at once by a band, the vertical pass reads 2 vr more
+#define BMP_MORPH_CHUNK 64
+
+/**
+ * Rows go through the horizontal pass into <in>, then the same algorithm
+ * runs down the columns with whole rows as elements, so the vertical pass
+ * is vector minima or maxima only. Chunks bound the buffers whatever the 
+ * band height.
+ */
+static void bmp_morphband(void * arg, uint32_t begin, uint32_t end)
+{
+    bmp_morphargs * args = arg;
+    uint32_t width = args->width, hr = args->hr, vr = args->vr, k = 2*vr + 1;
+    uint32_t chunk = (4*k > BMP_MORPH_CHUNK) ? 4*k : BMP_MORPH_CHUNK;
+    size_t extsize = (size_t) width + 2*hr;
+    size_t rows = (size_t) chunk + 2*vr;
+
+    uint8_t * ext = bmp_alloc(3 * extsize + 3 * rows * width);
+    if (ext == NULL) {
+        args->failed = 1;
+        return;
+    }
+
+    uint8_t * hg = ext + extsize;
+    uint8_t * hh = hg + extsize;
+    uint8_t * in = hh + extsize;
+    uint8_t * g = in + rows * width;
+    uint8_t * h = g + rows * width;
+
+    for (uint32_t first = begin; first < end; first += chunk)
+    {
+        uint32_t last = (end - first > chunk) ? first + chunk : end;
+        uint32_t m = last - first + 2*vr;
+
+        for (uint32_t j = 0; j < m; j++) {
+            bmp_extrow(args->src, args->rowsize, width, args->height, 1, hr, args->padtype, 
+                       (int64_t) first - vr + j, ext);
+            bmp_vhgwrow(ext, in + (size_t) j * width, width, hr, args->dilate, hg, hh);
+        }
+
+        for (uint32_t j = 0; j < m; j++) {
+            uint8_t * row = g + (size_t) j * width;
+            if (j % k == 0) memcpy(row, in + (size_t) j * width, width);
+            else bmp_morphrow(row - width, in + (size_t) j * width, row, width, args->dilate);
+        }
+
+        for (uint32_t j = m; j-- > 0; ) {
+            uint8_t * row = h + (size_t) j * width;
+            if (j == m - 1 || (j + 1) % k == 0) memcpy(row, in + (size_t) j * width, width);
+            else bmp_morphrow(row + width, in + (size_t) j * width, row, width, args->dilate);
+        }
+
+        for (uint32_t y = first; y < last; y++) {
+            bmp_morphrow(h + (size_t) (y - first) * width, g + (size_t) (y - first + 2*vr) * width, 
+                         args->dst + (size_t) y * args->rowsize, width, args->dilate);
+        }
+    }
+
+    bmp_free(ext);
+}
+
+/**
+ * One erosion or dilation of the 8bpp rows <src> into <dst>, returns 0 if
+ * a band could not run.
+ */
+static int bmp_morphpass(const uint8_t * src, uint8_t * dst, bmp_image * img, 
+                         uint32_t hr, uint32_t vr, int dilate, bmp_padtype padtype)
+{
+    bmp_morphargs args = {
+        src, dst, img->dib.bmiHeader.biWidth, bmp_getheight(img), bmp_getrowsize(img), 
+        hr, vr, dilate, padtype, 0
+    };
+
+    bmp_parallel_rows(args.height, bmp_rowgrain(args.rowsize), bmp_morphband, &args);
+
+    return !args.failed;
+}
+
+typedef struct bmp_morphparams {
+    bmp_morphop op;
+    uint32_t width;
+    uint32_t height;
+    bmp_padtype padtype;
+} bmp_morphparams;
+
+// morphology of an 8bpp image, parameters already checked
+static int bmp_morphimage(bmp_image * img, const void * params)
+{
+    const bmp_morphparams * p = params;
+    bmp_morphop op = p->op;
+    bmp_padtype padtype = p->padtype;
+
+    if (!bmp_packrows(img)) return 0;
+
+    size_t datasize = bmp_getarraysize(img);
+    uint32_t hr = p->width / 2, vr = p->height / 2;
+    const uint8_t * src = img->ciPixelArray;
+
+    uint8_t * newPixelArray = bmp_alloc(datasize);
+    if (newPixelArray == NULL) return 0;
+
+    uint8_t * temp = NULL;
+    int done = 0;
+
+    switch (op)
+    {
+    case BMP_MORPH_ERODE:
+    case BMP_MORPH_DILATE:
+        done = bmp_morphpass(src, newPixelArray, img, hr, vr, op == BMP_MORPH_DILATE, padtype);
+        break;
+    case BMP_MORPH_OPEN:
+    case BMP_MORPH_CLOSE:
+    case BMP_MORPH_TOPHAT:
+    case BMP_MORPH_BLACKHAT:
+    {
+        temp = bmp_alloc(datasize);
+        if (temp == NULL) {
+            bmp_free(newPixelArray);
+            return 0;
+        }
+
+        // opening erodes first, closing dilates first
+        int dilate = (op == BMP_MORPH_CLOSE || op == BMP_MORPH_BLACKHAT);
+        done = bmp_morphpass(src, temp, img, hr, vr, dilate, padtype) 
+            && bmp_morphpass(temp, newPixelArray, img, hr, vr, !dilate, padtype);
+
+        if (!done) break;
+
+        if (op == BMP_MORPH_TOPHAT) {
+            for (size_t i = 0; i < datasize; i++) {
+                newPixelArray[i] = (src[i] > newPixelArray[i]) ? src[i] - newPixelArray[i] : 0;
+            }
+        } else if (op == BMP_MORPH_BLACKHAT) {
+            for (size_t i = 0; i < datasize; i++) {
+                newPixelArray[i] = (newPixelArray[i] > src[i]) ? newPixelArray[i] - src[i] : 0;
+            }
+        }
+        break;
+    }
+    default:
+        bmp_free(newPixelArray);
+        return 0;
+    }
+
+    bmp_free(temp);
+
+    if (!done) {
+        bmp_free(newPixelArray);
+        return 0;
+    }
+
+    bmp_release(img, img->ciPixelArray);
+    img->ciPixelArray = newPixelArray;
+
+    return 1;
+}
+
+int bmp_morphology(bmp_image * img, bmp_morphop op, uint32_t width, uint32_t height, bmp_padtype padtype)
+{
+    BMP_STATS_SCOPE(BMP_STAT_MORPHOLOGY);
+
+    if (img == NULL || img->ciPixelArray == NULL) return 0;
+    if (img->dib.bmiHeader.biBitCount != BMP_8_BITS && !bmp_issubbyte(img)) return 0;
+    if (!bmp_isuncompressed(img)) return 0;
+    if (width % 2 == 0 || height % 2 == 0) return 0;
+
+    switch (padtype)
+    {
+    case BMP_PADTYPE_ZEROS:
+    case BMP_PADTYPE_REPLICATE:
+    case BMP_PADTYPE_REFLECT:
+    case BMP_PADTYPE_WRAP:
+        break;
+    default:
+        return 0;
+    }
+
+    bmp_morphparams params = { op, width, height, padtype };
+    int done = bmp_issubbyte(img) ? bmp_onindices(img, bmp_morphimage, &params) 
+                                  : bmp_morphimage(img, &params);
+
+    if (done) BMP_STATS_BYTES(bmp_getarraysize(img));
+
+    return done;
+}
+
+/**
+ * Coefficients of one axis of a resize: output <o> reads <taps> source 
+ * pixels from starts[o] on, weighted by weights[o * stride...] in 
+ * BMP_RESIZE_SHIFT fixed point. The stride pads <taps> with zero weights 
+ * so the vector kernels can take whole groups.
+ */
+typedef struct bmp_resizeaxis {
+    uint32_t taps;
+    uint32_t stride;
+    uint32_t * starts;
+    int16_t * weights;
+} bmp_resizeaxis;
+
+// reach of the filters in source pixels, before widening for shrinking
+static double bmp_resizesupport(bmp_resizemode mode)
+{
+    return (mode == BMP_RESIZE_BICUBIC) ? 2.0 : 1.0;
+}
+
+static double bmp_resizekernel(bmp_resizemode mode, double x)
+{
+    x = fabs(x);
+
+    if (mode == BMP_RESIZE_BICUBIC) {
+        if (x < 1) return (1.5*x - 2.5)*x*x + 1;
+        if (x < 2) return ((-0.5*x + 2.5)*x - 4)*x + 2;
+        return 0;
+    }
+
+    return (x < 1) ? 1 - x : 0;
+}
+
+/**
+ * Fill <axis> for <in> to <out> pixels. Taps falling outside the source 
+ * are folded onto the edge pixels (replicate) and every window is 
+ * shifted inside the source, so the kernels never test borders.
+ */
+static int bmp_resizeaxis_init(bmp_resizeaxis * axis, uint32_t in, uint32_t out, 
+                               bmp_resizemode mode, uint32_t align)
+{
+    double scale = (double) in / out;
+    double width = (scale > 1) ? scale : 1;
+    double reach = (mode == BMP_RESIZE_AREA) ? scale / 2 : bmp_resizesupport(mode) * width;
+    uint32_t taps = (uint32_t) ceil(2 * reach) + 1;
+
+    if (taps > in) taps = in;
+
+    axis->taps = taps;
+    axis->stride = (taps + align - 1) / align * align;
+    axis->starts = bmp_alloc(out * sizeof(uint32_t));
+    axis->weights = bmp_calloc((size_t) out * axis->stride * sizeof(int16_t));
+
+    double * exact = bmp_alloc(taps * sizeof(double));
+
+    if (axis->starts == NULL || axis->weights == NULL || exact == NULL) {
+        bmp_free(exact);
+        return 0;
+    }
+
+    for (uint32_t o = 0; o < out; o++)
+    {
+        double centre = (o + 0.5) * scale;
+        int64_t lo, hi;
+
+        if (mode == BMP_RESIZE_AREA) {
+            lo = (int64_t) floor(centre - reach);
+            hi = (int64_t) ceil(centre + reach) - 1;
+        } else {
+            // pixel centres sit on integers
+            centre -= 0.5;
+            lo = (int64_t) ceil(centre - reach);
+            hi = (int64_t) floor(centre + reach);
+        }
+
+        int64_t start = (lo < 0) ? 0 : (lo > in - taps) ? in - taps : lo;
+        double sum = 0;
+
+        memset(exact, 0, taps * sizeof(double));
+
+        for (int64_t i = lo; i <= hi; i++)
+        {
+            double w;
+
+            if (mode == BMP_RESIZE_AREA) {
+                double a = (i > centre - reach) ? i : centre - reach;
+                double b = (i + 1 < centre + reach) ? i + 1 : centre + reach;
+                w = (b > a) ? b - a : 0;
+            } else {
+                w = bmp_resizekernel(mode, (i - centre) / width);
+            }
+
+            int64_t source = (i < 0) ? 0 : (i >= in) ? in - 1 : i;
+            exact[source - start] += w;
+            sum += w;
+        }
+
+        int16_t * fixed = axis->weights + (size_t) o * axis->stride;
+        int32_t total = 0;
+        uint32_t peak = 0;
+
+        for (uint32_t k = 0; k < taps; k++) {
+            fixed[k] = (sum > 0) ? (int16_t) lround(exact[k] / sum * (1 << BMP_RESIZE_SHIFT)) : 0;
+            total += fixed[k];
+            if (fixed[k] > fixed[peak]) peak = k;
+        }
+
+        // the rounding error goes to the heaviest tap, flat areas stay flat
+        fixed[peak] += (1 << BMP_RESIZE_SHIFT) - total;
+        axis->starts[o] = (uint32_t) start;
+    }
+
+    bmp_free(exact);
+
+    return 1;
+}
+
+static void bmp_resizeaxis_free(bmp_resizeaxis * axis)
+{
+    bmp_free(axis->starts);
+    bmp_free(axis->weights);
+}
+
+#define BMP_RESIZE_HSHIFT (BMP_RESIZE_SHIFT - BMP_CONV_INTERBITS)
+
+#if BMP_X86
+/**
+ * Gray rows: one output per step, eight taps per madd and a horizontal 
+ * sum at the end. Stops at the first window that would read past <size>.
+ */
+__attribute__((target("avx2")))
+static uint32_t bmp_resizehrow1_avx2(const uint8_t * src, int16_t * dst, uint32_t width, 
+                                     size_t size, const bmp_resizeaxis * axis)
+{
+    uint32_t x = 0;
+
+    for (; x < width; x++)
+    {
+        size_t start = axis->starts[x];
+        if (start + axis->stride > size) break;
+
+        const int16_t * w = axis->weights + (size_t) x * axis->stride;
+        __m128i acc = _mm_setzero_si128();
+
+        for (uint32_t k = 0; k < axis->stride; k += 8) {
+            __m128i p = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *) (src + start + k)));
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(p, _mm_loadu_si128((const __m128i *) (w + k))));
+        }
+
+        acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+        acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+
+        int32_t sum = BMP_CONV_DESCALE(_mm_cvtsi128_si32(acc), BMP_RESIZE_HSHIFT);
+        dst[x] = (sum < INT16_MIN) ? INT16_MIN : (sum > INT16_MAX) ? INT16_MAX : sum;
+    }
+
+    return x;
+}
+
+/**
+ * 24bpp and 32bpp rows: the channels of one output side by side, four 
+ * taps per step. One load brings four source pixels, the shuffle pairs 
+ * taps 0/1 in the low lane and 2/3 in the high one for the madd. 24bpp 
+ * stores a word past the pixel, so it also stops before the last output.
+ */
+__attribute__((target("avx2")))
+static uint32_t bmp_resizehrow34_avx2(const uint8_t * src, int16_t * dst, uint32_t width, uint32_t bytes, 
+                                      size_t size, const bmp_resizeaxis * axis)
+{
+    const __m128i pairs = (bytes == 3) 
+        ? _mm_setr_epi8(0, 3, 1, 4, 2, 5, -1, -1, 6, 9, 7, 10, 8, 11, -1, -1)
+        : _mm_setr_epi8(0, 4, 1, 5, 2, 6, 3, 7, 8, 12, 9, 13, 10, 14, 11, 15);
+    const __m256i spread = _mm256_setr_epi32(0, 0, 0, 0, 1, 1, 1, 1);
+    const __m128i round = _mm_set1_epi32((1 << BMP_RESIZE_HSHIFT) >> 1);
+    uint32_t last = (bytes == 3) ? width - 1 : width;
+    uint32_t x = 0;
+
+    for (; x < last; x++)
+    {
+        size_t start = (size_t) axis->starts[x] * bytes;
+        if (start + (size_t) (axis->stride - 4) * bytes + 16 > size) break;
+
+        const uint8_t * s = src + start;
+        const int16_t * w = axis->weights + (size_t) x * axis->stride;
+        __m256i acc = _mm256_setzero_si256();
+
+        for (uint32_t k = 0; k < axis->stride; k += 4) {
+            __m128i p = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (s + k*bytes)), pairs);
+            __m256i wk = _mm256_permutevar8x32_epi32(_mm256_castsi128_si256(_mm_loadl_epi64((const __m128i *) (w + k))), spread);
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_cvtepu8_epi16(p), wk));
+        }
+
+        __m128i sum = _mm_add_epi32(_mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1)), round);
+        sum = _mm_srai_epi32(sum, BMP_RESIZE_HSHIFT);
+        _mm_storel_epi64((__m128i *) (dst + (size_t) x * bytes), _mm_packs_epi32(sum, sum));
+    }
+
+    return x;
+}
+#endif
+
+/**
+ * Horizontal pass: one source row of <size> bytes to <width> pixels kept 
+ * as 16-bit fixed point with BMP_CONV_INTERBITS fractional bits.
+ */
+static void bmp_resizehrow(const uint8_t * src, int16_t * dst, uint32_t width, uint32_t bytes, 
+                           size_t size, const bmp_resizeaxis * axis)
+{
+    uint32_t x = 0;
+
+#if BMP_X86
+    if (__builtin_cpu_supports("avx2")) {
+        x = (bytes == 1) ? bmp_resizehrow1_avx2(src, dst, width, size, axis)
+                         : bmp_resizehrow34_avx2(src, dst, width, bytes, size, axis);
+    }
+#endif
+
+    for (; x < width; x++)
+    {
+        const uint8_t * s = src + (size_t) axis->starts[x] * bytes;
+        const int16_t * w = axis->weights + (size_t) x * axis->stride;
+
+        for (uint32_t c = 0; c < bytes; c++) {
+            int32_t acc = 0;
+            for (uint32_t k = 0; k < axis->taps; k++) acc += w[k] * s[k*bytes + c];
+
+            acc = BMP_CONV_DESCALE(acc, BMP_RESIZE_HSHIFT);
+            dst[(size_t) x * bytes + c] = (acc < INT16_MIN) ? INT16_MIN : (acc > INT16_MAX) ? INT16_MAX : acc;
+        }
+    }
+}
+
+/**
+ * A filtered resize, from the rows of an image in memory or read from a 
+ * stream (<in>), to an image in memory or written to a stream (<out>).
+ * Rows are in storage order and <bytes> per pixel; streamed indexed rows 
+ * go through <expand> first.
+ */
+typedef struct bmp_resizeargs {
+    const uint8_t * src;
+    uint8_t * dst;
+    size_t step;            // bytes between the rows of <src>
+    bmp_stream * in;
+    bmp_stream * out;
+    bmp_expandargs * expand;
+    uint8_t * raw;
+    uint8_t * expanded;
+    uint32_t width;         // of the source
+    uint32_t bytes;
+    uint32_t outwidth;
+    bmp_resizeaxis h;
+    bmp_resizeaxis v;
+    int failed;
+} bmp_resizeargs;
+
+/**
+ * Source row <y>. Streams only go forward, rows the filters skip are read 
+ * and dropped.
+ */
+static const uint8_t * bmp_resizesource(bmp_resizeargs * args, uint32_t y)
+{
+    if (args->in == NULL) return args->src + (size_t) y * args->step;
+
+    while (args->in->row <= y) {
+        if (bmp_stream_readrows(args->in, args->raw, 1) != 1) return NULL;
+    }
+
+    if (args->expand == NULL) return args->raw;
+
+    bmp_expandband(args->expand, 0, 1);
+
+    return args->expanded;
+}
+
+/**
+ * One band of output rows. The horizontal pass of the last v.taps source 
+ * rows is kept in a ring, so each source row is filtered once per band.
+ */
+static void bmp_resizeband(void * arg, uint32_t begin, uint32_t end)
+{
+    bmp_resizeargs * args = arg;
+    size_t n = (size_t) args->outwidth * args->bytes;
+    size_t size = (size_t) args->width * args->bytes;
+    uint32_t taps = args->v.taps;
+
+    int16_t * ring = bmp_alloc(taps * n * sizeof(int16_t));
+    const int16_t ** rows = bmp_alloc(taps * sizeof(int16_t *));
+    uint8_t * line = (args->dst == NULL) ? bmp_alloc(n) : NULL;
+
+    if (ring == NULL || rows == NULL || (args->dst == NULL && line == NULL)) {
+        args->failed = 1;
+        goto done;
+    }
+
+    uint32_t next = args->v.starts[begin];
+
+    for (uint32_t y = begin; y < end; y++)
+    {
+        uint32_t first = args->v.starts[y];
+        if (next < first) next = first;
+
+        for (; next < first + taps; next++)
+        {
+            const uint8_t * src = bmp_resizesource(args, next);
+
+            if (src == NULL) {
+                args->failed = 1;
+                goto done;
+            }
+
+            bmp_resizehrow(src, ring + (size_t) (next % taps) * n, args->outwidth, args->bytes, size, &args->h);
+        }
+
+        for (uint32_t k = 0; k < taps; k++) rows[k] = ring + (size_t) ((first + k) % taps) * n;
+
+        uint8_t * dst = (args->dst != NULL) ? args->dst + (size_t) y * n : line;
+
+        bmp_convvrow(rows, dst, n, args->v.weights + (size_t) y * args->v.stride, taps, 
+                     BMP_RESIZE_SHIFT + BMP_CONV_INTERBITS);
+
+        if (args->out != NULL && bmp_stream_writerows(args->out, line, 1) != 1) {
+            args->failed = 1;
+            goto done;
+        }
+    }
+
+done:
+    bmp_free(ring);
+    bmp_free(rows);
+    bmp_free(line);
+}
+
+/**
+ * Coefficients of both axes for <width> x <height> sources of <bytes>.
+ */
+static int bmp_resizeplan(bmp_resizeargs * args, uint32_t width, uint32_t height, uint32_t bytes, 
+                          uint32_t outwidth, uint32_t outheight, bmp_resizemode mode)
+{
+    args->width = width;
+    args->bytes = bytes;
+    args->outwidth = outwidth;
+
+    int hok = bmp_resizeaxis_init(&args->h, width, outwidth, mode, (bytes == 1) ? 8 : 4);
+    int vok = bmp_resizeaxis_init(&args->v, height, outheight, mode, 1);
+
+    return hok && vok;
+}
+
+/**
+ * Nearest neighbour maps: source <xmap>[x] and <ymap>[y] for each output 
+ * pixel, in storage order.
+ */
+typedef struct bmp_nearestargs {
+    const uint8_t * src;
+    uint8_t * dst;
+    uint32_t rowsize;
+    uint32_t outrowsize;
+    uint32_t bitcount;
+    uint32_t width;
+    uint32_t outwidth;
+    uint32_t * xmap;
+    uint32_t * ymap;
+    int failed;
+} bmp_nearestargs;
+
+// room bmp_nearestrow() needs for the 8bpp rows of 1bpp, 2bpp and 4bpp images
+static size_t bmp_nearestworksize(const bmp_nearestargs * args)
+{
+    return (args->bitcount < BMP_8_BITS) ? (size_t) args->width + args->outwidth : 0;
+}
+
+// centre of output <o> of <out> falls in source pixel floor((o + 0.5) * in / out)
+static uint32_t * bmp_nearestmap(uint32_t in, uint32_t out)
+{
+    uint32_t * map = bmp_alloc(out * sizeof(uint32_t));
+    if (map == NULL) return NULL;
+
+    for (uint32_t o = 0; o < out; o++) {
+        map[o] = (uint32_t) (((2 * (uint64_t) o + 1) * in) / (2 * (uint64_t) out));
+    }
+
+    return map;
+}
+
+static void bmp_nearestrow(const bmp_nearestargs * args, const uint8_t * src, uint8_t * dst, uint8_t * work)
+{
+    const uint32_t * xmap = args->xmap;
+    uint32_t n = args->outwidth;
+
+    switch (args->bitcount)
+    {
+    case BMP_8_BITS:
+        for (uint32_t x = 0; x < n; x++) dst[x] = src[xmap[x]];
+        break;
+    case BMP_16_BITS:
+        for (uint32_t x = 0; x < n; x++) memcpy(dst + 2*x, src + 2*(size_t) xmap[x], 2);
+        break;
+    case BMP_24_BITS:
+        for (uint32_t x = 0; x < n; x++) memcpy(dst + 3*(size_t) x, src + 3*(size_t) xmap[x], 3);
+        break;
+    case BMP_32_BITS:
+        for (uint32_t x = 0; x < n; x++) memcpy(dst + 4*(size_t) x, src + 4*(size_t) xmap[x], 4);
+        break;
+    default:
+    {
+        // indices are picked from the 8bpp working row, then packed again
+        uint8_t * picked = work + args->width;
+
+        bmp_unpackindices(src, work, args->width, args->bitcount);
+        for (uint32_t x = 0; x < n; x++) picked[x] = work[xmap[x]];
+        bmp_packindices(picked, dst, n, args->bitcount);
+        break;
+    }
+    }
+}
+
+static void bmp_nearestband(void * arg, uint32_t begin, uint32_t end)
+{
+    bmp_nearestargs * args = arg;
+    uint8_t * work = NULL;
+
+    if (bmp_nearestworksize(args) > 0) {
+        work = bmp_alloc(bmp_nearestworksize(args));
+        if (work == NULL) {
+            args->failed = 1;
+            return;
+        }
+    }
+
+    for (uint32_t y = begin; y < end; y++)
+    {
+        uint8_t * dst = args->dst + (size_t) y * args->outrowsize;
+
+        // upscaled rows repeat the one above
+        if (y > begin && args->ymap[y] == args->ymap[y - 1]) {
+            memcpy(dst, dst - args->outrowsize, args->outrowsize);
+            continue;
+        }
+
+        bmp_nearestrow(args, args->src + (size_t) args->ymap[y] * args->rowsize, dst, work);
+    }
+
+    bmp_free(work);
+}
+
+static int bmp_nearestplan(bmp_nearestargs * args, bmp_image * src, bmp_image * new)
+{
+    args->rowsize = bmp_getrowstep(src);
+    args->outrowsize = bmp_getrowsize(new);
+    args->bitcount = src->dib.bmiHeader.biBitCount;
+    args->width = src->dib.bmiHeader.biWidth;
+    args->outwidth = new->dib.bmiHeader.biWidth;
+    args->xmap = bmp_nearestmap(src->dib.bmiHeader.biWidth, new->dib.bmiHeader.biWidth);
+    args->ymap = bmp_nearestmap(bmp_getheight(src), bmp_getheight(new));
+
+    return args->xmap != NULL && args->ymap != NULL;
+}
+
+/**
+ * Set the size of the headers <img> to <width> x <height>, the sign of the 
+ * height (the row order) is kept.
+ */
+static void bmp_resizeheaders(bmp_image * img, uint32_t width, uint32_t height)
+{
+    img->dib.bmiHeader.biWidth = width;
+    img->dib.bmiHeader.biHeight = (img->dib.bmiHeader.biHeight < 0) ? -(int32_t) height : (int32_t) height;
+    img->dib.bmiHeader.biSizeImage = bmp_getstride(img) * height;
+
+    img->fileheader.bfType = BMP_FILETYPE_BM;
+    img->fileheader.bfOffBits = bmp_getheaderssize(img);
+    img->fileheader.bfSize = img->fileheader.bfOffBits + img->dib.bmiHeader.biSizeImage;
+}
+
+/**
+ * Bytes per pixel the filtered modes work on for <img>, 0 if they cannot.
+ */
+static uint32_t bmp_resizebytes(bmp_image * img)
+{
+    if (bmp_isindexed(img)) return 1;
+
+    // 16bpp and bit field images go through bmp_resizefields()
+    if (img->dib.bmiHeader.biCompression != BMP_BI_RGB) return 0;
+
+    switch (img->dib.bmiHeader.biBitCount)
+    {
+    case BMP_24_BITS:
+    case BMP_32_BITS:
+        return img->dib.bmiHeader.biBitCount / BMP_8_BITS;
+    default:
+        return 0;
+    }
+}
+
+// whether the filtered modes resize <img> through its decoded channels
+static int bmp_resizedecodes(bmp_image * img)
+{
+    uint32_t bitcount = img->dib.bmiHeader.biBitCount;
+
+    return bmp_isuncompressed(img) && bmp_resizebytes(img) == 0 
+        && (bitcount == BMP_16_BITS || bitcount == BMP_32_BITS);
+}
+
+static bmp_image * bmp_resizenearest(bmp_image * img, uint32_t width, uint32_t height)
+{
+    bmp_image * decoded = NULL;
+
+    switch (img->dib.bmiHeader.biCompression)
+    {
+    case BMP_BI_RLE8:
+        decoded = bmp_rle8decoder(img);
+        break;
+    case BMP_BI_RLE4:
+        decoded = bmp_rle4decoder(img);
+        break;
+    default:
+        if (!bmp_isuncompressed(img)) return NULL;
+        break;
+    }
+
+    bmp_image * src = (decoded != NULL) ? decoded : img;
+    if (!bmp_isuncompressed(src)) return NULL;
+
+    bmp_image * new = bmp_cloneheaders(src);
+    bmp_nearestargs args = { 0 };
+
+    if (new != NULL) {
+        bmp_resizeheaders(new, width, height);
+        new->ciPixelArray = bmp_alloc(bmp_getarraysize(new));
+    }
+
+    if (new == NULL || new->ciPixelArray == NULL || !bmp_nearestplan(&args, src, new)) {
+        new = bmp_cleanup(NULL, new);
+        goto done;
+    }
+
+    args.src = src->ciPixelArray;
+    args.dst = new->ciPixelArray;
+
+    bmp_parallel_rows(height, bmp_rowgrain(args.outrowsize), bmp_nearestband, &args);
+
+    if (args.failed) new = bmp_cleanup(NULL, new);
+
+done:
+    bmp_free(args.xmap);
+    bmp_free(args.ymap);
+    bmp_cleanup(NULL, decoded);
+
+    return new;
+}
+
+static bmp_image * bmp_resizefiltered(bmp_image * img, uint32_t width, uint32_t height, bmp_resizemode mode)
+{
+    bmp_image * expanded = bmp_isindexed(img) ? bmp_materialize(img) : NULL;
+    bmp_image * src = (expanded != NULL) ? expanded : img;
+    uint32_t bytes = bmp_resizebytes(src);
+
+    if (bytes == 0 || bmp_isindexed(img) != (expanded != NULL)) {
+        bmp_cleanup(NULL, expanded);
+        return NULL;
+    }
+
+    bmp_image * new = bmp_cloneheaders(src);
+    bmp_resizeargs args = { 0 };
+
+    if (new != NULL) {
+        bmp_resizeheaders(new, width, height);
+        new->ciPixelArray = bmp_alloc(bmp_getarraysize(new));
+    }
+
+    if (new == NULL || new->ciPixelArray == NULL || 
+        !bmp_resizeplan(&args, src->dib.bmiHeader.biWidth, bmp_getheight(src), bytes, width, height, mode))
+    {
+        new = bmp_cleanup(NULL, new);
+        goto done;
+    }
+
+    args.src = src->ciPixelArray;
+    args.dst = new->ciPixelArray;
+    args.step = bmp_getrowstep(src);
+
+    bmp_parallel_rows(height, bmp_rowgrain(bmp_getrowsize(new)), bmp_resizeband, &args);
+
+    if (args.failed) new = bmp_cleanup(NULL, new);
+
+done:
+    bmp_resizeaxis_free(&args.h);
+    bmp_resizeaxis_free(&args.v);
+    bmp_cleanup(NULL, expanded);
+
+    return new;
+}
+
+/**
+ * Filtered resize of bit field pixels: decoded to BGRA, resized as such 
+ * and packed back into the fields of <img>, whose headers the result 
+ * keeps.
+ */
+static bmp_image * bmp_resizefields(bmp_image * img, uint32_t width, uint32_t height, bmp_resizemode mode)
+{
+    uint32_t bitcount = img->dib.bmiHeader.biBitCount;
+    uint32_t masks[4];
+
+    bmp_bitmasks(img, masks);
+    if (bitcount == BMP_16_BITS) {
+        for (uint32_t c = 0; c < 4; c++) masks[c] &= 0xFFFF;
+    }
+
+    bmp_image * wide = bmp_convertimage(img, BMP_32_BITS, BMP_BI_RGB, NULL);
+    bmp_image * resized = (wide != NULL) ? bmp_resizefiltered(wide, width, height, mode) : NULL;
+    bmp_image * packed = (resized != NULL) ? bmp_convertimage(resized, bitcount, BMP_BI_RGB, masks) : NULL;
+    bmp_image * new = (packed != NULL) ? bmp_cloneheaders(img) : NULL;
+
+    if (new != NULL) {
+        bmp_resizeheaders(new, width, height);
+        new->ciPixelArray = packed->ciPixelArray;
+        packed->ciPixelArray = NULL;
+    }
+
+    bmp_cleanup(NULL, wide);
+    bmp_cleanup(NULL, resized);
+    bmp_cleanup(NULL, packed);
+
+    return new;
+}
+
+bmp_image * bmp_resize(bmp_image * img, uint32_t width, uint32_t height, bmp_resizemode mode)
+{
+    BMP_STATS_SCOPE(BMP_STAT_RESIZE);
+
+    if (img == NULL || img->ciPixelArray == NULL) return NULL;
+    if (width == 0 || height == 0 || img->dib.bmiHeader.biWidth <= 0 || bmp_getheight(img) == 0) return NULL;
+
+    bmp_image * new = NULL;
+
+    switch (mode)
+    {
+    case BMP_RESIZE_NEAREST:
+        new = bmp_resizenearest(img, width, height);
+        break;
+    case BMP_RESIZE_AREA:
+    case BMP_RESIZE_BILINEAR:
+    case BMP_RESIZE_BICUBIC:
+        new = bmp_resizedecodes(img) ? bmp_resizefields(img, width, height, mode) 
+                                     : bmp_resizefiltered(img, width, height, mode);
+        break;
+    default:
+        return NULL;
+    }
+
+    if (new != NULL) BMP_STATS_BYTES(bmp_getdatasize(img));
+
+    return new;
+}
+
+/**
+ * bmp_thumbnail() in nearest mode: source rows are read up to the next 
+ * one the map asks for.
+ */
+static int bmp_thumbnailnearest(bmp_stream * in, bmp_stream * out, bmp_image * header)
+{
+    bmp_nearestargs args = { 0 };
+    uint8_t * raw = bmp_alloc(in->rowsize);
+    uint8_t * line = bmp_alloc(bmp_getrowsize(header));
+    int status = (raw != NULL && line != NULL && bmp_nearestplan(&args, &in->header, header));
+    uint8_t * work = NULL;
+
+    if (status && bmp_nearestworksize(&args) > 0) {
+        work = bmp_alloc(bmp_nearestworksize(&args));
+        status = (work != NULL);
+    }
+
+    for (uint32_t y = 0; status && y < out->rows; y++)
+    {
+        while (status && in->row <= args.ymap[y]) {
+            status = (bmp_stream_readrows(in, raw, 1) == 1);
+            if (status) bmp_nearestrow(&args, raw, line, work);
+        }
+
+        if (status) status = (bmp_stream_writerows(out, line, 1) == 1);
+    }
+
+    bmp_free(args.xmap);
+    bmp_free(args.ymap);
+    bmp_free(raw);
+    bmp_free(line);
+    bmp_free(work);
+
+    return status;
+}
+
+/**
+ * bmp_thumbnail() in the filtered modes, one band over every output row.
+ */
+static int bmp_thumbnailfiltered(bmp_stream * in, bmp_stream * out, bmp_resizemode mode)
+{
+    bmp_resizeargs args = { 0 };
+    bmp_image * header = &in->header;
+    uint32_t bytes = bmp_isindexed(header) ? out->header.dib.bmiHeader.biBitCount / BMP_8_BITS 
+                                           : bmp_resizebytes(header);
+
+    args.in = in;
+    args.out = out;
+    args.raw = bmp_alloc(in->rowsize);
+
+    int status = (args.raw != NULL) && bmp_resizeplan(&args, header->dib.bmiHeader.biWidth, in->rows, 
+                            bytes, out->header.dib.bmiHeader.biWidth, out->rows, mode);
+
+    if (status && bmp_isindexed(header))
+    {
+        args.expand = bmp_calloc(sizeof(bmp_expandargs));
+        args.expanded = bmp_alloc((size_t) args.width * bytes);
+
+        if (args.expand != NULL && args.expanded != NULL) {
+            bmp_expandpalette(header, args.expand);
+            args.expand->src = args.raw;
+            args.expand->dst = args.expanded;
+            args.expand->width = args.width;
+            args.expand->rowsize = in->rowsize;
+            args.expand->bitcount = header->dib.bmiHeader.biBitCount;
+            args.expand->bytes = bytes;
+        } else {
+            status = 0;
+        }
+    }
+
+    if (status) {
+        bmp_resizeband(&args, 0, out->rows);
+        status = !args.failed;
+    }
+
+    bmp_resizeaxis_free(&args.h);
+    bmp_resizeaxis_free(&args.v);
+    bmp_free(args.expand);
+    bmp_free(args.expanded);
+    bmp_free(args.raw);
+
+    return status;
+}
+
+int bmp_thumbnail(const char * src, const char * dst, uint32_t width, uint32_t height, bmp_resizemode mode)
+{
+    BMP_STATS_SCOPE(BMP_STAT_THUMBNAIL);
+
+    if (src == NULL || dst == NULL || width == 0 || height == 0) return 0;
+
+    bmp_stream * in = bmp_stream_openread(src, BMP_ROWORDER_STORAGE);
+
+    // bit field pixels are resized through bmp_resizefields(), in memory
+    if (in != NULL && mode != BMP_RESIZE_NEAREST && bmp_resizedecodes(&in->header)) {
+        bmp_stream_close(in);
+        in = NULL;
+    }
+
+    if (in == NULL)
+    {
+        bmp_image * img = bmp_read(src);
+        bmp_image * new = bmp_resize(img, width, height, mode);
+        int status = (new != NULL) && bmp_save(new, dst);
+
+        bmp_cleanup(NULL, img);
+        bmp_cleanup(NULL, new);
+
+        return status;
+    }
+
+    bmp_image * header = NULL;
+    bmp_image * source = &in->header;
+
+    if (source->dib.bmiHeader.biWidth <= 0 || in->rows == 0) {
+        bmp_stream_close(in);
+        return 0;
+    }
+
+    switch (mode)
+    {
+    case BMP_RESIZE_NEAREST:
+        header = bmp_cloneheaders(source);
+        break;
+    case BMP_RESIZE_AREA:
+    case BMP_RESIZE_BILINEAR:
+    case BMP_RESIZE_BICUBIC:
+        if (bmp_isindexed(source)) {
+            bmp_expandargs palette;
+            header = bmp_expandheader(source, bmp_expandpalette(source, &palette));
+        } else if (bmp_resizebytes(source) != 0) {
+            header = bmp_cloneheaders(source);
+        }
+        break;
+    default:
+        break;
+    }
+
+    if (header == NULL) {
+        bmp_stream_close(in);
+        return 0;
+    }
+
+    bmp_resizeheaders(header, width, height);
+
+    bmp_stream * out = bmp_stream_openwrite(dst, header, BMP_ROWORDER_STORAGE);
+    int status = 0;
+
+    if (out != NULL) {
+        status = (mode == BMP_RESIZE_NEAREST) ? bmp_thumbnailnearest(in, out, header) 
+                                              : bmp_thumbnailfiltered(in, out, mode);
+        status = bmp_stream_close(out) && status;
+    }
+
+    size_t bytes = (size_t) in->rowsize * in->row;
+    BMP_STATS_BYTES(bytes);
+    (void) bytes;
+
+    bmp_stream_close(in);
+    bmp_cleanup(NULL, header);
+
+    return status;
+}
+
+#if BMP_X86
+/**
+ * Reverse the order of <width> pixels of <bytes> from <src> into <dst>, 
+ * 32 bytes at a time: shuffled inside each lane, then the lanes swapped.
+ */
+__attribute__((target("avx2")))
+static uint32_t bmp_reverserow_avx2(const uint8_t * src, uint8_t * dst, uint32_t width, uint32_t bytes)
+{
+    const __m256i bytemask = _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+                                              15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    const __m256i wordmask = _mm256_setr_epi8(14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1,
+                                              14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1);
+    const __m256i dwords = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+    uint32_t step = 32 / bytes;
+    uint32_t x = 0;
+
+    for (; x + step <= width; x += step)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (src + (size_t) x * bytes));
+
+        if (bytes == 4) {
+            v = _mm256_permutevar8x32_epi32(v, dwords);
+        } else {
+            v = _mm256_shuffle_epi8(v, (bytes == 1) ? bytemask : wordmask);
+            v = _mm256_permute4x64_epi64(v, _MM_SHUFFLE(1, 0, 3, 2));
+        }
+
+        _mm256_storeu_si256((__m256i *) (dst + (size_t) (width - x - step) * bytes), v);
+    }
+
+    return x;
+}
+
+/**
+ * 24bpp: five pixels per step. Each store starts a byte early, on the 
+ * last byte of the pixels still to come, which a later step rewrites.
+ */
+__attribute__((target("ssse3")))
+static uint32_t bmp_reverserow_ssse3_24(const uint8_t * src, uint8_t * dst, uint32_t width)
+{
+    const __m128i mask = _mm_setr_epi8(-1, 12, 13, 14, 9, 10, 11, 6, 7, 8, 3, 4, 5, 0, 1, 2);
+    uint32_t x = 0;
+
+    for (; x + 6 <= width; x += 5) {
+        __m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (src + (size_t) x * 3)), mask);
+        _mm_storeu_si128((__m128i *) (dst + (size_t) (width - x - 5) * 3 - 1), v);
+    }
+
+    return x;
+}
+#endif
+
+/**
+ * Mirror of the row <src> into <dst>, which must not overlap.
+ */
+static void bmp_reverserow(const uint8_t * src, uint8_t * dst, uint32_t width, uint32_t bytes)
+{
+    uint32_t x = 0;
+
+#if BMP_X86
+    if (bytes == 3) {
+        if (__builtin_cpu_supports("ssse3")) x = bmp_reverserow_ssse3_24(src, dst, width);
+    } else if (__builtin_cpu_supports("avx2")) {
+        x = bmp_reverserow_avx2(src, dst, width, bytes);
+    }
+#endif
+
+    for (; x < width; x++) {
+        memcpy(dst + (size_t) (width - 1 - x) * bytes, src + (size_t) x * bytes, bytes);
+    }
+}
+
+typedef struct bmp_flipargs {
+    const uint8_t * src;
+    uint8_t * dst;
+    uint32_t width;
+    uint32_t height;
+    uint32_t rowsize;
+    uint32_t step;          // bytes between the rows of <src>, and of <dst> in place
+    uint32_t bytes;
+    uint32_t bits;          // below 8, rows are mirrored as 8bpp working rows
+    int failed;
+} bmp_flipargs;
+
+// bytes of the rows bmp_flipvband() swaps at a time
+#define BMP_FLIP_CHUNK 1024
+
+/**
+ * Swaps row y with its mirror, over the top half of the rows. Rows go 
+ * through a buffer on the stack, so an in-place flip cannot fail half 
+ * done.
+ */
+static void bmp_flipvband(void * arg, uint32_t begin, uint32_t end)
+{
+    bmp_flipargs * args = arg;
+    uint8_t temp[BMP_FLIP_CHUNK];
+
+    for (uint32_t y = begin; y < end; y++) {
+        uint8_t * top = args->dst + (size_t) y * args->step;
+        uint8_t * bottom = args->dst + (size_t) (args->height - 1 - y) * args->step;
+
+        for (size_t i = 0; i < args->rowsize; i += BMP_FLIP_CHUNK) {
+            size_t n = (args->rowsize - i < BMP_FLIP_CHUNK) ? args->rowsize - i : BMP_FLIP_CHUNK;
+
+            memcpy(temp, top + i, n);
+            memcpy(top + i, bottom + i, n);
+            memcpy(bottom + i, temp, n);
+        }
+    }
+}
+
+/**
+ * Mirror of the row <src> into <dst>, which may be the same row for 
+ * 1bpp, 2bpp and 4bpp images only; those go through <temp>, room for two 
+ * 8bpp rows, the others take it as the copy of an in-place row.
+ */
+static void bmp_mirrorrow(const bmp_flipargs * args, const uint8_t * src, uint8_t * dst, uint8_t * temp)
+{
+    if (args->bits < BMP_8_BITS) {
+        bmp_unpackindices(src, temp, args->width, args->bits);
+        bmp_reverserow(temp, temp + args->width, args->width, 1);
+        bmp_packindices(temp + args->width, dst, args->width, args->bits);
+        return;
+    }
+
+    if (src == dst) {
+        memcpy(temp, src, args->rowsize);
+        src = temp;
+    }
+
+    bmp_reverserow(src, dst, args->width, args->bytes);
+}
+
+static size_t bmp_mirrorsize(const bmp_flipargs * args)
+{
+    return (args->bits < BMP_8_BITS) ? 2 * (size_t) args->width : args->rowsize;
+}
+
+/**
+ * bmp_mirrorrow() in place without any room: pixels are swapped pairwise
+ * from both ends. Slower, only for bands that cannot get their scratch, 
+ * so an in-place mirror is never left half done.
+ */
+static void bmp_mirrorinplace(const bmp_flipargs * args, uint8_t * row)
+{
+    uint32_t width = args->width;
+
+    if (args->bits < BMP_8_BITS)
+    {
+        uint32_t bits = args->bits, mask = (1u << bits) - 1;
+
+        for (uint32_t x = 0; x < width / 2; x++) {
+            uint32_t y = width - 1 - x;
+            uint32_t sx = 8 - bits - x * bits % 8, sy = 8 - bits - y * bits % 8;
+            uint8_t * bx = row + x * bits / 8, * by = row + y * bits / 8;
+            uint32_t a = (*bx >> sx) & mask, b = (*by >> sy) & mask;
+
+            *bx = (*bx & ~(mask << sx)) | (b << sx);
+            *by = (*by & ~(mask << sy)) | (a << sy);
+        }
+        return;
+    }
+
+    uint32_t bytes = args->bytes;
+    uint8_t temp[4];
+
+    for (uint32_t x = 0; x < width / 2; x++) {
+        uint8_t * left = row + (size_t) x * bytes, * right = row + (size_t) (width - 1 - x) * bytes;
+
+        memcpy(temp, left, bytes);
+        memcpy(left, right, bytes);
+        memcpy(right, temp, bytes);
+    }
+}
+
+static void bmp_fliphband(void * arg, uint32_t begin, uint32_t end)
+{
+    bmp_flipargs * args = arg;
+    uint8_t * temp = bmp_alloc(bmp_mirrorsize(args));
+
+    for (uint32_t y = begin; y < end; y++) {
+        uint8_t * row = args->dst + (size_t) y * args->step;
+
+        if (temp != NULL) bmp_mirrorrow(args, row, row, temp);
+        else bmp_mirrorinplace(args, row);
+    }
+
+    bmp_free(temp);
+}
+
+// half a turn: row y is the mirror of the opposite source row
+static void bmp_rotate180band(void * arg, uint32_t begin, uint32_t end)
+{
+    bmp_flipargs * args = arg;
+    uint8_t * temp = NULL;
+
+    if (args->bits < BMP_8_BITS) {
+        temp = bmp_alloc(bmp_mirrorsize(args));
+        if (temp == NULL) {
+            args->failed = 1;
+            return;
+        }
+    }
+
+    for (uint32_t y = begin; y < end; y++) {
+        bmp_mirrorrow(args, args->src + (size_t) (args->height - 1 - y) * args->step, 
+                      args->dst + (size_t) y * args->rowsize, temp);
+    }
+
+    bmp_free(temp);
+}
+
+/**
+ * Bytes per pixel of the images the orientation functions take, 0 for 
+ * the others. 1bpp, 2bpp and 4bpp images are moved as 8bpp working rows.
+ */
+static uint32_t bmp_orientbytes(bmp_image * img)
+{
+    if (img == NULL || img->ciPixelArray == NULL || !bmp_isuncompressed(img)) return 0;
+
+    switch (img->dib.bmiHeader.biBitCount)
+    {
+    case BMP_1_BIT:
+    case BMP_2_BITS:
+    case BMP_4_BITS:
+        return 1;
+    case BMP_8_BITS:
+    case BMP_16_BITS:
+    case BMP_24_BITS:
+    case BMP_32_BITS:
+        return img->dib.bmiHeader.biBitCount / BMP_8_BITS;
+    default:
+        return 0;
+    }
+}
+
+static void bmp_flipargs_init(bmp_flipargs * args, bmp_image * img, uint32_t bytes)
+{
+    args->src = img->ciPixelArray;
+    args->dst = img->ciPixelArray;
+    args->width = img->dib.bmiHeader.biWidth;
+    args->height = bmp_getheight(img);
+    args->rowsize = bmp_getrowsize(img);
+    args->step = bmp_getrowstep(img);
+    args->bytes = bytes;
+    args->bits = img->dib.bmiHeader.biBitCount;
+    args->failed = 0;
+}
+
+int bmp_flipv(bmp_image * img)
+{
+    BMP_STATS_SCOPE(BMP_STAT_FLIPV);
+
+    // whole rows move, any uncompressed depth will do
+    if (img == NULL || img->ciPixelArray == NULL || !bmp_isuncompressed(img)) return 0;
+
+    bmp_flipargs args;
+    bmp_flipargs_init(&args, img, 0);
+
+    bmp_parallel_rows(args.height / 2, bmp_rowgrain(2 * (size_t) args.rowsize), bmp_flipvband, &args);
+
+    BMP_STATS_BYTES(bmp_getdatasize(img));
+
+    return 1;
+}
+
+int bmp_fliph(bmp_image * img)
+{
+    BMP_STATS_SCOPE(BMP_STAT_FLIPH);
+
+    uint32_t bytes = bmp_orientbytes(img);
+    if (bytes == 0) return 0;
+
+    bmp_flipargs args;
+    bmp_flipargs_init(&args, img, bytes);
+
+    bmp_parallel_rows(args.height, bmp_rowgrain(args.rowsize), bmp_fliphband, &args);
+
+    BMP_STATS_BYTES(bmp_getdatasize(img));
+
+    return 1;
+}
+
+// side in pixels of the tiles a transposition walks
+#define BMP_TRANSPOSE_TILE 64
+
+/**
+ * Destination row c of a transposition holds source column c. Either 
+ * image may be walked bottom to top through a negative stride, which 
+ * turns the transposition into a quarter turn.
+ */
+typedef struct bmp_transposeargs {
+    const uint8_t * src;    // first source row
+    uint8_t * dst;          // first destination row
+    ptrdiff_t srcstride;
+    ptrdiff_t dststride;
+    uint32_t width;         // of the source
+    uint32_t height;
+    uint32_t bytes;
+    uint32_t bits;          // below 8, strips of columns go through 8bpp rows
+    int failed;
+} bmp_transposeargs;
+
+#if BMP_X86
+/**
+ * Transpose of a 16 byte square block. Every round interleaves vector i 
+ * with vector i + n/2, which rotates the (vector, lane) index bits by 
+ * one lane width; after log2(n) rounds rows and columns have traded 
+ * places.
+ */
+#define BMP_TRANSPOSE_SSE2(unpacklo, unpackhi, n, rounds) \
+    do { \
+        __m128i v[n], t[n]; \
+        _Pragma("GCC unroll 16") \
+        for (uint32_t i = 0; i < (n); i++) v[i] = _mm_loadu_si128((const __m128i *) (src + i*srcstride)); \
+        _Pragma("GCC unroll 4") \
+        for (uint32_t r = 0; r < (rounds); r++) { \
+            _Pragma("GCC unroll 8") \
+            for (uint32_t i = 0; i < (n) / 2; i++) { \
+                t[2*i] = unpacklo(v[i], v[i + (n) / 2]); \
+                t[2*i + 1] = unpackhi(v[i], v[i + (n) / 2]); \
+            } \
+            _Pragma("GCC unroll 16") \
+            for (uint32_t i = 0; i < (n); i++) v[i] = t[i]; \
+        } \
+        _Pragma("GCC unroll 16") \
+        for (uint32_t i = 0; i < (n); i++) _mm_storeu_si128((__m128i *) (dst + i*dststride), v[i]); \
+    } while (0)
+
+static void bmp_transposeblock_sse2(const uint8_t * src, ptrdiff_t srcstride, uint8_t * dst, ptrdiff_t dststride, 
+                                    uint32_t bytes)
+{
+    switch (bytes)
+    {
+    case 1:
+        BMP_TRANSPOSE_SSE2(_mm_unpacklo_epi8, _mm_unpackhi_epi8, 16, 4);
+        break;
+    case 2:
+        BMP_TRANSPOSE_SSE2(_mm_unpacklo_epi16, _mm_unpackhi_epi16, 8, 3);
+        break;
+    default:
+        BMP_TRANSPOSE_SSE2(_mm_unpacklo_epi32, _mm_unpackhi_epi32, 4, 2);
+        break;
+    }
+}
+#endif
+
+/**
+ * Tile of <rows> source rows from <r0> by <cols> source columns from <c0>: 
+ * 16 byte blocks where they fit, pixel by pixel around them (and for 
+ * 24bpp, whose pixels do not tile a vector).
+ */
+static void bmp_transposetile(const bmp_transposeargs * args, uint32_t r0, uint32_t c0, uint32_t rows, uint32_t cols)
+{
+    uint32_t bytes = args->bytes;
+    uint32_t rb = 0, cb = 0;
+
+#if BMP_X86
+    if (bytes != 3)
+    {
+        uint32_t block = 16 / bytes;
+        rb = rows / block * block;
+        cb = cols / block * block;
+
+        for (uint32_t r = 0; r < rb; r += block) {
+            for (uint32_t c = 0; c < cb; c += block) {
+                bmp_transposeblock_sse2(args->src + (ptrdiff_t) (r0 + r) * args->srcstride + (size_t) (c0 + c) * bytes, 
+                                        args->srcstride, 
+                                        args->dst + (ptrdiff_t) (c0 + c) * args->dststride + (size_t) (r0 + r) * bytes, 
+                                        args->dststride, bytes);
+            }
+        }
+    }
+#endif
+
+    for (uint32_t r = 0; r < rows; r++)
+    {
+        const uint8_t * src = args->src + (ptrdiff_t) (r0 + r) * args->srcstride + (size_t) c0 * bytes;
+        uint8_t * dst = args->dst + (ptrdiff_t) c0 * args->dststride + (size_t) (r0 + r) * bytes;
+
+        uint32_t c = (r < rb) ? cb : 0;
+
+        switch (bytes)
+        {
+        case 1:
+            for (; c < cols; c++) dst[c * args->dststride] = src[c];
+            break;
+        case 2:
+            for (; c < cols; c++) memcpy(dst + c * args->dststride, src + 2*c, 2);
+            break;
+        case 3:
+            for (; c < cols; c++) memcpy(dst + c * args->dststride, src + 3*c, 3);
+            break;
+        default:
+            for (; c < cols; c++) memcpy(dst + c * args->dststride, src + 4*c, 4);
+            break;
+        }
+    }
+}
+
+/**
+ * Destination rows [begin, end) of a 1bpp, 2bpp or 4bpp transposition: 
+ * strips of source columns are unpacked row by row, transposed as 8bpp 
+ * tiles, and each destination row packed back from the result.
+ */
+static void bmp_transposebits(bmp_transposeargs * args, uint32_t begin, uint32_t end)
+{
+    size_t strip = (size_t) args->height * BMP_TRANSPOSE_TILE;
+    uint8_t * columns = bmp_alloc(2 * strip);
+    if (columns == NULL) {
+        args->failed = 1;
+        return;
+    }
+
+    bmp_transposeargs work = {
+        columns, columns + strip, BMP_TRANSPOSE_TILE, args->height, 
+        BMP_TRANSPOSE_TILE, args->height, 1, BMP_8_BITS, 0
+    };
+
+    for (uint32_t c0 = begin; c0 < end; c0 += BMP_TRANSPOSE_TILE) {
+        uint32_t cols = (end - c0 < BMP_TRANSPOSE_TILE) ? end - c0 : BMP_TRANSPOSE_TILE;
+
+        for (uint32_t r = 0; r < args->height; r++) {
+            bmp_unpackspan(args->src + (ptrdiff_t) r * args->srcstride, c0, cols, args->bits, 
+                           columns + (size_t) r * BMP_TRANSPOSE_TILE);
+        }
+
+        for (uint32_t r0 = 0; r0 < args->height; r0 += BMP_TRANSPOSE_TILE) {
+            uint32_t rows = (args->height - r0 < BMP_TRANSPOSE_TILE) ? args->height - r0 : BMP_TRANSPOSE_TILE;
+            bmp_transposetile(&work, r0, 0, rows, cols);
+        }
+
+        for (uint32_t c = 0; c < cols; c++) {
+            bmp_packindices(work.dst + (size_t) c * args->height, 
+                            args->dst + (ptrdiff_t) (c0 + c) * args->dststride, args->height, args->bits);
+        }
+    }
+
+    bmp_free(columns);
+}
+
+// destination rows [begin, end), tile by tile down the source
+static void bmp_transposeband(void * arg, uint32_t begin, uint32_t end)
+{
+    bmp_transposeargs * args = arg;
+
+    if (args->bits < BMP_8_BITS) {
+        bmp_transposebits(args, begin, end);
+        return;
+    }
+
+    for (uint32_t c0 = begin; c0 < end; c0 += BMP_TRANSPOSE_TILE) {
+        uint32_t cols = (end - c0 < BMP_TRANSPOSE_TILE) ? end - c0 : BMP_TRANSPOSE_TILE;
+
+        for (uint32_t r0 = 0; r0 < args->height; r0 += BMP_TRANSPOSE_TILE) {
+            uint32_t rows = (args->height - r0 < BMP_TRANSPOSE_TILE) ? args->height - r0 : BMP_TRANSPOSE_TILE;
+            bmp_transposetile(args, r0, c0, rows, cols);
+        }
+    }
+}
+
+/**
+ * New image with the headers of <img>, its sides (and resolution) 
+ * swapped if <swap>.
+ */
+static bmp_image * bmp_orientheaders(bmp_image * img, int swap)
+{
+    bmp_image * new = bmp_cloneheaders(img);
+    if (new == NULL) return NULL;
+
+    if (swap) {
+        new->dib.bmiHeader.biXPelsPerMeter = img->dib.bmiHeader.biYPelsPerMeter;
+        new->dib.bmiHeader.biYPelsPerMeter = img->dib.bmiHeader.biXPelsPerMeter;
+        bmp_resizeheaders(new, bmp_getheight(img), img->dib.bmiHeader.biWidth);
+    }
+
+    new->ciPixelArray = bmp_alloc(bmp_getarraysize(new));
+    if (new->ciPixelArray == NULL) return bmp_cleanup(NULL, new);
+
+    return new;
+}
+
+/**
+ * Quarter turns and the transposition of <img> as a storage-order 
+ * transposition. <revsrc> walks the source rows backwards, <revdst> the 
+ * destination rows.
+ */
+static bmp_image * bmp_transposeimage(bmp_image * img, uint32_t bytes, int revsrc, int revdst)
+{
+    uint32_t width = img->dib.bmiHeader.biWidth, height = bmp_getheight(img);
+
+    bmp_image * new = bmp_orientheaders(img, 1);
+    if (new == NULL) return NULL;
+
+    ptrdiff_t srcstride = bmp_getrowstep(img), dststride = bmp_getrowsize(new);
+
+    bmp_transposeargs args = {
+        img->ciPixelArray + (revsrc ? (height - 1) * srcstride : 0),
+        new->ciPixelArray + (revdst ? (width - 1) * dststride : 0),
+        revsrc ? -srcstride : srcstride, revdst ? -dststride : dststride,
+        width, height, bytes, img->dib.bmiHeader.biBitCount, 0
+    };
+
+    bmp_parallel_rows(width, BMP_TRANSPOSE_TILE, bmp_transposeband, &args);
+
+    if (args.failed) new = bmp_cleanup(NULL, new);
+
+    return new;
+}
+
+bmp_image * bmp_rotate(bmp_image * img, bmp_rotation rotation)
+{
+    BMP_STATS_SCOPE(BMP_STAT_ROTATE);
+
+    uint32_t bytes = bmp_orientbytes(img);
+    if (bytes == 0) return NULL;
+
+    /**
+     * Storage is upside down for positive heights, where a quarter turn 
+     * becomes the opposite one seen from the file.
+     */
+    int topdown = img->dib.bmiHeader.biHeight < 0;
+    bmp_image * new = NULL;
+
+    switch (rotation)
+    {
+    case BMP_ROTATE_90:
+        new = bmp_transposeimage(img, bytes, topdown, !topdown);
+        break;
+    case BMP_ROTATE_270:
+        new = bmp_transposeimage(img, bytes, !topdown, topdown);
+        break;
+    case BMP_ROTATE_180:
+    {
+        new = bmp_orientheaders(img, 0);
+        if (new == NULL) return NULL;
+
+        bmp_flipargs args;
+        bmp_flipargs_init(&args, img, bytes);
+        args.dst = new->ciPixelArray;
+
+        bmp_parallel_rows(args.height, bmp_rowgrain(args.rowsize), bmp_rotate180band, &args);
+
+        if (args.failed) new = bmp_cleanup(NULL, new);
+        break;
+    }
+    default:
+        return NULL;
+    }
+
+    if (new != NULL) BMP_STATS_BYTES(bmp_getdatasize(img));
+
+    return new;
+}
+
+bmp_image * bmp_transpose(bmp_image * img)
+{
+    BMP_STATS_SCOPE(BMP_STAT_TRANSPOSE);
+
+    uint32_t bytes = bmp_orientbytes(img);
+    if (bytes == 0) return NULL;
+
+    // seen from a bottom-up file, the main diagonal is the other one
+    int bottomup = img->dib.bmiHeader.biHeight > 0;
+    bmp_image * new = bmp_transposeimage(img, bytes, bottomup, bottomup);
+
+    if (new != NULL) BMP_STATS_BYTES(bmp_getdatasize(img));
+
+    return new;
+}
+
+/**
+ * Recompute the sizes in the pipeline result headers after its format 
+ * changed.
+ */
+static void bmp_pipelinesizes(bmp_image * header)
+{
+    header->dib.bmiHeader.biSizeImage = bmp_getstride(header) * bmp_getheight(header);
+    header->fileheader.bfOffBits = bmp_getheaderssize(header);
+    header->fileheader.bfSize = header->fileheader.bfOffBits + header->dib.bmiHeader.biSizeImage;
+}
+
+/**
+ * Append an operation receiving rows in the current result format, NULL 
+ * when the pipeline is full.
+ */
+static bmp_operation * bmp_pipelineop(bmp_pipeline * pipeline, bmp_opkind kind)
+{
+    if (pipeline == NULL || pipeline->nops == BMP_PIPELINE_MAXOPS) return NULL;
+
+    bmp_operation * op = &pipeline->ops[pipeline->nops];
+    bmp_image * header = pipeline->header;
+
+    memset(op, 0, sizeof(bmp_operation));
+    op->kind = kind;
+    op->bitcount = header->dib.bmiHeader.biBitCount;
+    op->width = header->dib.bmiHeader.biWidth;
+    op->height = bmp_getheight(header);
+    op->rowsize = bmp_getrowsize(header);
+    op->outrowsize = op->rowsize;
+
+    return op;
+}
+
+bmp_pipeline * bmp_pipeline_create(bmp_image * img)
+{
+    if (img == NULL || img->ciPixelArray == NULL) return NULL;
+    if (!bmp_isuncompressed(img)) return NULL;
+
+    bmp_pipeline * pipeline = bmp_calloc(sizeof(bmp_pipeline));
+    if (pipeline == NULL) return NULL;
+
+    pipeline->src = img;
+    pipeline->header = bmp_calloc(sizeof(bmp_image));
+    if (pipeline->header == NULL) {
+        bmp_free(pipeline);
+        return NULL;
+    }
+
+    pipeline->header->fileheader = img->fileheader;
+    bmp_cpdibs(pipeline->header, img);
+
+    uint32_t palettesize = bmp_getpalettesize(img);
+
+    if (palettesize > 0 && img->dib.bmiColors != NULL)
+    {
+        pipeline->header->dib.bmiColors = bmp_alloc(palettesize);
+        if (pipeline->header->dib.bmiColors == NULL) {
+            bmp_pipeline_free(pipeline);
+            return NULL;
+        }
+
+        memcpy(pipeline->header->dib.bmiColors, img->dib.bmiColors, palettesize);
+    }
+
+    bmp_pipelinesizes(pipeline->header);
+
+    return pipeline;
+}
+
+int bmp_pipeline_add_gray(bmp_pipeline * pipeline, bmp_setncolours ncolours)
+{
+    if (pipeline != NULL && bmp_isindexed(pipeline->header)) {
+        bmp_graypalette(pipeline->header->dib.bmiColors, bmp_palettecount(pipeline->header), ncolours);
+        return 1;
+    }
+
+    bmp_operation * op = bmp_pipelineop(pipeline, BMP_OP_GRAY);
+    if (op == NULL) return 0;
+
+    switch (op->bitcount)
+    {
+    case BMP_16_BITS:
+    case BMP_32_BITS:
+        if (bmp_hasfields(pipeline->header) 
+            && !bmp_grayfieldtables(pipeline->header, op->tables, op->shifts, op->maxima)) {
+            bmp_free(op->tables[0]);
+            bmp_free(op->tables[1]);
+            bmp_free(op->tables[2]);
+            return 0;
+        }
+        break;
+    case BMP_24_BITS:
+        break;
+    default:
+        return 0;
+    }
+
+    bmp_image * header = bmp_grayheader(pipeline->header, ncolours);
+    if (header == NULL) {
+        bmp_free(op->tables[0]);
+        bmp_free(op->tables[1]);
+        bmp_free(op->tables[2]);
+        return 0;
+    }
+
+    bmp_cleanup(NULL, pipeline->header);
+    pipeline->header = header;
+    bmp_pipelinesizes(header);
+
+    op->outrowsize = op->width;
+    pipeline->nops++;
+
+    return 1;
+}
+
+int bmp_pipeline_add_lut(bmp_pipeline * pipeline, const bmp_lut * lut)
+{
+    if (pipeline == NULL || lut == NULL) return 0;
+
+    if (bmp_isindexed(pipeline->header)) {
+        bmp_lutpalette(pipeline->header->dib.bmiColors, bmp_palettecount(pipeline->header), lut);
+        return 1;
+    }
+
+    // back-to-back tables fold into one, so a chain of them is one lookup
+    bmp_operation * op = (pipeline->nops > 0) ? &pipeline->ops[pipeline->nops - 1] : NULL;
+
+    if (op != NULL && op->kind == BMP_OP_LUT) {
+        bmp_lut_compose(&op->lut, &op->lut, lut);
+    } else {
+        op = bmp_pipelineop(pipeline, BMP_OP_LUT);
+        if (op == NULL) return 0;
+
+        op->lut = *lut;
+        pipeline->nops++;
+    }
+
+    op->uniform = bmp_lutuniform(&op->lut, op->bitcount / BMP_8_BITS);
+
+    if (bmp_hasfields(pipeline->header)) {
+        if (op->fields == NULL) op->fields = bmp_alloc(sizeof(bmp_lutfields));
+        if (op->fields == NULL) {
+            pipeline->nops--;
+            return 0;
+        }
+        bmp_lutfields_init(op->fields, pipeline->header, &op->lut);
+    }
+
+    return 1;
+}
+
+int bmp_pipeline_add_invert(bmp_pipeline * pipeline)
+{
+    bmp_lut lut;
+    bmp_lut_invert(&lut);
+
+    return bmp_pipeline_add_lut(pipeline, &lut);
+}
+
+int bmp_pipeline_add_filter(bmp_pipeline * pipeline, bmp_color color)
+{
+    if (pipeline == NULL) return 0;
+
+    // same bit depths bmp_filtercolor() handles, the others are left as is
+    switch (pipeline->header->dib.bmiHeader.biBitCount)
+    {
+    case BMP_16_BITS:
+    case BMP_24_BITS:
+    case BMP_32_BITS:
+        break;
+    default:
+        if (!bmp_isindexed(pipeline->header)) return 1;
+        break;
+    }
+
+    bmp_lut lut;
+    bmp_lut_filter(&lut, color);
+
+    return bmp_pipeline_add_lut(pipeline, &lut);
+}
+
+int bmp_pipeline_add_pad(bmp_pipeline * pipeline, uint32_t rows, uint32_t columns, bmp_padtype padtype)
+{
+    bmp_operation * op = bmp_pipelineop(pipeline, BMP_OP_PAD);
+    if (op == NULL) return 0;
+
+    switch (padtype)
+    {
+    case BMP_PADTYPE_ZEROS:
+    case BMP_PADTYPE_REPLICATE:
+    case BMP_PADTYPE_REFLECT:
+    case BMP_PADTYPE_WRAP:
+        break;
+    default:
+        return 0;
+    }
+
+    bmp_image * header = pipeline->header;
+    uint32_t newHeight = op->height + 2*rows;
+
+    header->dib.bmiHeader.biWidth = op->width + 2*columns;
+    header->dib.bmiHeader.biHeight = (header->dib.bmiHeader.biHeight < 0) 
+                    ? -(int32_t) newHeight : (int32_t) newHeight;
+    bmp_pipelinesizes(header);
+
+    op->rows = rows;
+    op->columns = columns;
+    op->padtype = padtype;
+    op->outrowsize = bmp_getrowsize(header);
+    pipeline->nops++;
+
+    return 1;
+}
+
+/**
+ * Apply one operation to a row; <src> and <dst> may be the same buffer 
+ * for the point operations only. <work> holds 8bpp rows for paddings of 
+ * 1bpp, 2bpp and 4bpp images.
+ */
+static void bmp_pipelineapply(bmp_operation * op, const uint8_t * src, uint8_t * dst, uint8_t * work)
+{
+    switch (op->kind)
+    {
+    case BMP_OP_GRAY:
+        if (op->tables[0] != NULL) {
+            bmp_grayfieldrow(src, dst, op->width, op->bitcount / BMP_8_BITS, op->tables, op->shifts, op->maxima);
+        } else {
+            bmp_grayrow(src, dst, op->width, op->bitcount / BMP_8_BITS);
+        }
+        break;
+    case BMP_OP_LUT:
+        // same bit depths bmp_applylut() handles, the others pass through
+        switch (op->bitcount)
+        {
+        case BMP_8_BITS:
+        case BMP_16_BITS:
+        case BMP_24_BITS:
+        case BMP_32_BITS:
+            if (op->fields != NULL) {
+                bmp_lutfieldrow(op->fields, src, dst, op->width, op->bitcount / BMP_8_BITS);
+            } else {
+                bmp_lutrow(&op->lut, op->uniform, src, dst, op->rowsize, op->bitcount / BMP_8_BITS);
+            }
+            break;
+        default:
+            if (src != dst) memcpy(dst, src, op->rowsize);
+            break;
+        }
+        break;
+    case BMP_OP_PAD:
+        bmp_padrow(src, dst, op->width, op->columns, op->bitcount, op->padtype, work);
+        break;
+    }
+}
+
+/**
+ * Produce row <y> of the pipeline result into <dst>. Vertical paddings are
+ * walked backwards first to find where the row comes from: a source row, 
+ * or a blank row made by one of the paddings. The remaining operations 
+ * then run one after another on the two <scratch> rows, the third one 
+ * being the work area of the paddings.
+ */
+static void bmp_pipelinerow(bmp_pipeline * pipeline, uint32_t y, uint8_t * dst, uint8_t * scratch[3])
+{
+    const uint8_t * row = NULL;
+    uint32_t first = 0;
+    int64_t source = y;
+
+    for (uint32_t k = pipeline->nops; k-- > 0; )
+    {
+        bmp_operation * op = &pipeline->ops[k];
+
+        if (op->kind != BMP_OP_PAD) continue;
+
+        source = bmp_borderindex(source - op->rows, op->height, op->padtype);
+        if (source >= 0) continue;
+
+        memset(scratch[0], 0, op->outrowsize);
+        row = scratch[0];
+        first = k + 1;
+        break;
+    }
+
+    if (row == NULL) {
+        row = pipeline->src->ciPixelArray + (size_t) source * bmp_getrowstep(pipeline->src);
+    }
+
+    if (first == pipeline->nops) {
+        memcpy(dst, row, bmp_getrowsize(pipeline->header));
+        return;
+    }
+
+    for (uint32_t k = first; k < pipeline->nops; k++)
+    {
+        uint8_t * out = (k + 1 == pipeline->nops) ? dst 
+                      : (row == scratch[0]) ? scratch[1] : scratch[0];
+
+        bmp_pipelineapply(&pipeline->ops[k], row, out, scratch[2]);
+        row = out;
+    }
+}
+
+typedef struct bmp_pipeargs {
+    bmp_pipeline * pipeline;
+    uint8_t * dst;          // receives the rows [first, first + rows of the band)
+    uint32_t first;
+    uint32_t rowsize;
+    size_t scratchsize;     // largest row anywhere in the chain
+    size_t worksize;        // 8bpp rows of the widest sub-byte padding
+    int failed;
+} bmp_pipeargs;
+
+static void bmp_pipelineband(void * arg, uint32_t begin, uint32_t end)
+{
+    bmp_pipeargs * args = arg;
+    uint8_t * scratch[3];
+
+    // each band works on rows of its own, small enough to stay in cache
+    scratch[0] = bmp_alloc(2 * args->scratchsize + args->worksize);
+    if (scratch[0] == NULL) {
+        args->failed = 1;
+        return;
+    }
+    scratch[1] = scratch[0] + args->scratchsize;
+    scratch[2] = scratch[1] + args->scratchsize;
+
+    for (uint32_t y = begin; y < end; y++) {
+        bmp_pipelinerow(args->pipeline, args->first + y, 
+                        args->dst + (size_t) y * args->rowsize, scratch);
+    }
+
+    bmp_free(scratch[0]);
+}
+
+static void bmp_pipelineargs(bmp_pipeline * pipeline, bmp_pipeargs * args)
+{
+    args->pipeline = pipeline;
+    args->dst = NULL;
+    args->first = 0;
+    args->rowsize = bmp_getrowsize(pipeline->header);
+    args->scratchsize = args->rowsize;
+    args->worksize = 0;
+    args->failed = 0;
+
+    for (uint32_t k = 0; k < pipeline->nops; k++) {
+        bmp_operation * op = &pipeline->ops[k];
+
+        if (op->rowsize > args->scratchsize) args->scratchsize = op->rowsize;
+        if (op->outrowsize > args->scratchsize) args->scratchsize = op->outrowsize;
+
+        if (op->kind == BMP_OP_PAD && op->bitcount < BMP_8_BITS) {
+            size_t work = 2 * (size_t) op->width + 2 * (size_t) op->columns;
+            if (work > args->worksize) args->worksize = work;
+        }
+    }
+
+    if (args->scratchsize == 0) args->scratchsize = 1;
+}
+
+bmp_image * bmp_pipeline_run(bmp_pipeline * pipeline)
+{
+    BMP_STATS_SCOPE(BMP_STAT_PIPELINE_RUN);
+
+    if (pipeline == NULL) return NULL;
+
+    bmp_image * new = bmp_calloc(sizeof(bmp_image));
+    if (new == NULL) return NULL;
+
+    new->fileheader = pipeline->header->fileheader;
+    bmp_cpdibs(new, pipeline->header);
+
+    uint32_t palettesize = bmp_getpalettesize(new);
+
+    if (palettesize > 0 && pipeline->header->dib.bmiColors != NULL)
+    {
+        new->dib.bmiColors = bmp_alloc(palettesize);
+        if (new->dib.bmiColors == NULL) return bmp_cleanup(NULL, new);
+
+        memcpy(new->dib.bmiColors, pipeline->header->dib.bmiColors, palettesize);
+    }
+
+    new->ciPixelArray = bmp_alloc(bmp_getarraysize(new));
+    if (new->ciPixelArray == NULL) return bmp_cleanup(NULL, new);
+
+    bmp_pipeargs args;
+    bmp_pipelineargs(pipeline, &args);
+    args.dst = new->ciPixelArray;
+
+    bmp_parallel_rows(bmp_getheight(new), bmp_rowgrain(args.scratchsize), bmp_pipelineband, &args);
+
+    if (args.failed) return bmp_cleanup(NULL, new);
+
+    BMP_STATS_BYTES(bmp_getarraysize(new));
+
+    return new;
+}
+
+int bmp_pipeline_save(bmp_pipeline * pipeline, const char * filename)
+{
+    BMP_STATS_SCOPE(BMP_STAT_PIPELINE_SAVE);
+
+    if (pipeline == NULL) return 0;
+
+    bmp_stream * stream = bmp_stream_openwrite(filename, pipeline->header, BMP_ROWORDER_STORAGE);
+    if (stream == NULL) return 0;
+
+    bmp_pipeargs args;
+    bmp_pipelineargs(pipeline, &args);
+
+    uint32_t height = bmp_getheight(pipeline->header);
+    uint32_t chunk = BMP_PIPELINE_CHUNK / ((args.rowsize > 0) ? args.rowsize : 1);
+    if (chunk == 0) chunk = 1;
+    if (chunk > height) chunk = height;
+
+    args.dst = bmp_alloc((size_t) chunk * args.rowsize + 1);
+    if (args.dst == NULL) {
+        bmp_stream_close(stream);
+        return 0;
+    }
+
+    int status = 1;
+
+    for (; args.first < height && status; args.first += chunk)
+    {
+        uint32_t rows = (height - args.first < chunk) ? height - args.first : chunk;
+
+        bmp_parallel_rows(rows, bmp_rowgrain(args.scratchsize), bmp_pipelineband, &args);
+
+        status = !args.failed && bmp_stream_writerows(stream, args.dst, rows) == rows;
+    }
+
+    BMP_STATS_BYTES((uint64_t) args.first * args.rowsize);
+
+    bmp_free(args.dst);
+
+    return bmp_stream_close(stream) && status;
+}
+
+void bmp_pipeline_free(bmp_pipeline * pipeline)
+{
+    if (pipeline == NULL) return;
+
+    for (uint32_t k = 0; k < pipeline->nops; k++) {
+        bmp_free(pipeline->ops[k].tables[0]);
+        bmp_free(pipeline->ops[k].tables[1]);
+        bmp_free(pipeline->ops[k].tables[2]);
+        bmp_free(pipeline->ops[k].fields);
+    }
+
+    bmp_cleanup(NULL, pipeline->header);
+    bmp_free(pipeline);
+}
+
+void bmp_printdetails(bmp_image * img)
+{
+    printf("\n");
+    printf("From BITMAPFILEHEADER: \n");
+
+    printf("filetype:         \t%u  \t0x%x\n", img->fileheader.bfType, img->fileheader.bfType);
+    printf("filesize:         \t%u  \t0x%x\n", img->fileheader.bfSize, img->fileheader.bfSize);
+    printf("reserved1:        \t%u  \t0x%x\n", img->fileheader.bfReserved1, img->fileheader.bfReserved1);
+    printf("reserved2:        \t%u  \t0x%x\n", img->fileheader.bfReserved2, img->fileheader.bfReserved2);
+    printf("offset bits:      \t%u  \t0x%x\n", img->fileheader.bfOffBits, img->fileheader.bfOffBits);
+
+    printf("\n");
+    printf("From BITMAPINFOHEADER: \n");
+
+    printf("size:             \t%u  \t0x%x\n", img->dib.bmiHeader.biSize, img->dib.bmiHeader.biSize);
+    printf("width:            \t%u  \t0x%x\n", img->dib.bmiHeader.biWidth, img->dib.bmiHeader.biWidth);
+    printf("height:           \t%u  \t0x%x\n", img->dib.bmiHeader.biHeight, img->dib.bmiHeader.biHeight);
+    printf("planes:           \t%u  \t0x%x\n", img->dib.bmiHeader.biPlanes, img->dib.bmiHeader.biPlanes);
+    printf("bits per pixel:   \t%u  \t0x%x\n", img->dib.bmiHeader.biBitCount, img->dib.bmiHeader.biBitCount);
+    printf("compression:      \t%u  \t0x%x\n", img->dib.bmiHeader.biCompression, img->dib.bmiHeader.biCompression);
+    printf("imagesize:        \t%u  \t0x%x\n", img->dib.bmiHeader.biSizeImage, img->dib.bmiHeader.biSizeImage);
+    printf("xresolution:      \t%u  \t0x%x\n", img->dib.bmiHeader.biXPelsPerMeter, img->dib.bmiHeader.biXPelsPerMeter);
+    printf("yresolution:      \t%u  \t0x%x\n", img->dib.bmiHeader.biYPelsPerMeter, img->dib.bmiHeader.biYPelsPerMeter);
+    printf("colours used:     \t%u  \t0x%x\n", img->dib.bmiHeader.biClrUsed, img->dib.bmiHeader.biClrUsed);
+    printf("main colours:     \t%u  \t0x%x\n", img->dib.bmiHeader.biClrImportant, img->dib.bmiHeader.biClrImportant);
+
+    if (img->dib.bmiHeader.biSize >= BMP_V4HEADER)
+    {
+        printf("\n");
+        printf("From BITMAPV4HEADER: \n");
+
+        printf("red mask:       \t0x%x\n", img->dib.bmiv4Header.bV4RedMask);
+        printf("green mask:     \t0x%x\n", img->dib.bmiv4Header.bV4GreenMask);
+        printf("blue mask:      \t0x%x\n", img->dib.bmiv4Header.bV4BlueMask);
+        printf("alpha mask:     \t0x%x\n", img->dib.bmiv4Header.bV4AlphaMask);
+        printf("color space:    \t0x%x\n", img->dib.bmiv4Header.bV4CSType);
+        printf("red (x):        \t0x%x\n", img->dib.bmiv4Header.bV4Endpoints.ciexyzRed.ciexyzX);
+        printf("red (y):        \t0x%x\n", img->dib.bmiv4Header.bV4Endpoints.ciexyzRed.ciexyzY);
+        printf("red (z):        \t0x%x\n", img->dib.bmiv4Header.bV4Endpoints.ciexyzRed.ciexyzZ);
+        printf("green (x):      \t0x%x\n", img->dib.bmiv4Header.bV4Endpoints.ciexyzGreen.ciexyzX);
+        printf("green (y):      \t0x%x\n", img->dib.bmiv4Header.bV4Endpoints.ciexyzGreen.ciexyzY);
+        printf("green (z):      \t0x%x\n", img->dib.bmiv4Header.bV4Endpoints.ciexyzGreen.ciexyzZ);
+        printf("blue (x):       \t0x%x\n", img->dib.bmiv4Header.bV4Endpoints.ciexyzBlue.ciexyzX);
+        printf("blue (y):       \t0x%x\n", img->dib.bmiv4Header.bV4Endpoints.ciexyzBlue.ciexyzY);
+        printf("blue (z):       \t0x%x\n", img->dib.bmiv4Header.bV4Endpoints.ciexyzBlue.ciexyzZ);
+        printf("gamma red:      \t0x%x\n", img->dib.bmiv4Header.bV4GammaRed);
+        printf("gamma green:    \t0x%x\n", img->dib.bmiv4Header.bV4GammaGreen);
+        printf("gamma blue:     \t0x%x\n", img->dib.bmiv4Header.bV4GammaBlue);
+    }
+    
+    if (img->dib.bmiHeader.biSize >= BMP_V5HEADER)
+    {
+        printf("\n");
+        printf("From BITMAPV5HEADER: \n");
+
+        printf("intent:         \t%u    \t0x%x\n", img->dib.bmiv5Header.bV5Intent, img->dib.bmiv5Header.bV5Intent);
+        printf("profile data:   \t%u    \t0x%x\n", img->dib.bmiv5Header.bV5ProfileData, img->dib.bmiv5Header.bV5ProfileData);
+        printf("profile size:   \t%u    \t0x%x\n", img->dib.bmiv5Header.bV5ProfileSize, img->dib.bmiv5Header.bV5ProfileSize);
+        printf("reserved:       \t%u    \t0x%x\n", img->dib.bmiv5Header.bV5Reserved, img->dib.bmiv5Header.bV5Reserved);
+    }
+
+    printf("\n");
+}
+
+static const char * bmp_statnames[BMP_STAT_COUNT] = {
+    "bmp_read", "bmp_open_mapped", "bmp_save", "bmp_rle8decoder", "bmp_rle4decoder",
+    "bmp_rgb2gray", "bmp_invert", "bmp_filtercolor", "bmp_applylut", "bmp_padh", "bmp_padv",
+    "bmp_addpad", "bmp_convolve", "bmp_median", "bmp_morphology", "bmp_resize", "bmp_thumbnail",
+    "bmp_flipv", "bmp_fliph", "bmp_rotate", "bmp_transpose", "bmp_planar_split", "bmp_planar_merge",
+    "bmp_convert", "bmp_pipeline_run", "bmp_pipeline_save", "bmp_read_buffer", "bmp_save_buffer"
+};
+
+static void bmp_formatns(char * buf, size_t len, uint64_t ns)
+{
+    if (ns < 1000) snprintf(buf, len, "%lluns", (unsigned long long) ns);
+    else if (ns < 1000000) snprintf(buf, len, "%.1fus", ns / 1e3);
+    else if (ns < 1000000000) snprintf(buf, len, "%.1fms", ns / 1e6);
+    else snprintf(buf, len, "%.1fs", ns / 1e9);
+}
+
+static void bmp_printhistogram(const char * label, const uint64_t histogram[BMP_STATS_BUCKETS])
+{
+    char low[16];
+    char high[16];
+
+    printf("  %s", label);
+
+    for (uint32_t i = 0; i < BMP_STATS_BUCKETS; i++) {
+        if (histogram[i] == 0) continue;
+        bmp_formatns(low, sizeof(low), 1ull << i);
+        bmp_formatns(high, sizeof(high), 2ull << i);
+        printf(" [%s,%s):%llu", low, high, (unsigned long long) histogram[i]);
+    }
+
+    printf("\n");
+}
+
+void bmp_printstats(const bmp_stats * stats)
+{
+    printf("\n");
+
+    if (!stats->enabled) {
+        printf("Instrumentation disabled (build bmp.c with -DBMP_STATS)\n");
+        return;
+    }
+
+    printf("function          \tcalls     \tMB        \twall ms   \tcpu ms    \tMB/s\n");
+
+    for (uint32_t i = 0; i < BMP_STAT_COUNT; i++)
+    {
+        const bmp_funcstats * f = &stats->functions[i];
+        if (f->calls == 0) continue;
+
+        printf("%-18s\t%-10llu\t%-10.2f\t%-10.3f\t%-10.3f\t%.1f\n", bmp_statnames[i],
+               (unsigned long long) f->calls, f->bytes / 1e6, f->wallns / 1e6, f->cpuns / 1e6,
+               (f->wallns > 0) ? f->bytes * 1e3 / f->wallns : 0.0);
+        bmp_printhistogram("wall:", f->wallhist);
+        bmp_printhistogram("cpu: ", f->cpuhist);
+    }
+
+    printf("\n");
+    printf("allocations:      \t%llu  \t(%.2f MB)\n", (unsigned long long) stats->allocs, stats->allocbytes / 1e6);
+    printf("releases:         \t%llu\n", (unsigned long long) stats->frees);
+}
+
+void bmp_printpixel(bmp_image * img, int x, int y)
+{
+    switch (img->dib.bmiHeader.biBitCount)
+    {
+    case BMP_1_BIT:
+    case BMP_2_BITS:
+    case BMP_4_BITS:
+    case BMP_8_BITS:
+        printf(
+            "img[%i][%i] = (%u)\n", x, y, 
+            bmp_getpixelcolor(img, x, y, BMP_COLOR_RED)
+        );
+        break;
+    case BMP_16_BITS:
+    case BMP_24_BITS:
+        printf(
+            "img[%i][%i] = (%u, %u, %u)\n", x, y, 
+            bmp_getpixelcolor(img, x, y, BMP_COLOR_RED), 
+            bmp_getpixelcolor(img, x, y, BMP_COLOR_GREEN), 
+            bmp_getpixelcolor(img, x, y, BMP_COLOR_BLUE)
+        );
+        break;
+    case BMP_32_BITS:
+        printf(
+            "img[%i][%i] = (%u, %u, %u, %u)\n", x, y, 
+            bmp_getpixelcolor(img, x, y, BMP_COLOR_RED), 
+            bmp_getpixelcolor(img, x, y, BMP_COLOR_GREEN), 
+            bmp_getpixelcolor(img, x, y, BMP_COLOR_BLUE), 
+            bmp_getpixelcolor(img, x, y, BMP_COLOR_ALPHA)
+        );
+        break;
+    default:
+        break;
+    }
+}
+
+void bmp_stats_snapshot(bmp_stats * stats)
+{
+    if (stats == NULL) return;
+
+    const uint64_t * from = (const uint64_t *) bmp_statistics.functions;
+    uint64_t * to = (uint64_t *) stats->functions;
+
+    stats->enabled = bmp_statistics.enabled;
+
+    for (size_t i = 0; i < BMP_STATS_COUNTERS; i++) {
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    }
+
+    stats->allocs = __atomic_load_n(&bmp_statistics.allocs, __ATOMIC_RELAXED);
+    stats->allocbytes = __atomic_load_n(&bmp_statistics.allocbytes, __ATOMIC_RELAXED);
+    stats->frees = __atomic_load_n(&bmp_statistics.frees, __ATOMIC_RELAXED);
+}
+
+void bmp_stats_reset(void)
+{
+    uint64_t * counters = (uint64_t *) bmp_statistics.functions;
+
+    for (size_t i = 0; i < BMP_STATS_COUNTERS; i++) {
+        __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+    }
+
+    __atomic_store_n(&bmp_statistics.allocs, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&bmp_statistics.allocbytes, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&bmp_statistics.frees, 0, __ATOMIC_RELAXED);
+}
+
+static void * bmp_sysalloc(void * context, size_t size)
+{
+    (void) context;
+    return malloc(size);
+}
+
+static void bmp_sysrelease(void * context, void * ptr)
+{
+    (void) context;
+    free(ptr);
+}
+
+static bmp_allocator bmp_allocator_current = { bmp_sysalloc, bmp_sysrelease, NULL };
+
+void bmp_set_allocator(const bmp_allocator * allocator)
+{
+    if (allocator == NULL) {
+        bmp_allocator_current = (bmp_allocator) { bmp_sysalloc, bmp_sysrelease, NULL };
+    } else {
+        bmp_allocator_current = *allocator;
+    }
+}
+
+void * bmp_alloc(size_t size)
+{
+    BMP_STATS_ADD(allocs, 1);
+    BMP_STATS_ADD(allocbytes, size);
+
+    return bmp_allocator_current.alloc(bmp_allocator_current.context, size);
+}
+
+void bmp_free(void * ptr)
+{
+    if (ptr == NULL) return;
+
+    BMP_STATS_ADD(frees, 1);
+    bmp_allocator_current.release(bmp_allocator_current.context, ptr);
+}
+
+void * bmp_calloc(size_t size)
+{
+    void * ptr = bmp_alloc(size);
+    if (ptr != NULL) memset(ptr, 0, size);
+    return ptr;
+}
+
+/**
+ * Every pool block starts with this header, padded so the caller part 
+ * stays 16-byte aligned.
+ */
+typedef struct bmp_block {
+    size_t sizeclass;
+    struct bmp_block * next;    // while the block sits in the pool
+} bmp_block;
+
+#define BMP_BLOCK_HEADER ((sizeof(bmp_block) + 15) & ~(size_t) 15)
+
+struct bmp_bufpool {
+    pthread_mutex_t lock;
+    bmp_block * free[BMP_BUFPOOL_CLASSES];
+    size_t cached;
+    size_t limit;
+};
+
+/**
+ * Size class of a block of <size> bytes (header included) and the block
+ * size it is rounded up to.
+ */
+static size_t bmp_sizeclass(size_t size, size_t * blocksize)
+{
+    if (size <= ((size_t) 1 << BMP_BUFPOOL_MINSHIFT)) {
+        *blocksize = (size_t) 1 << BMP_BUFPOOL_MINSHIFT;
+        return 0;
+    }
+
+    // 2^k < size <= 2^(k+1), split in BMP_BUFPOOL_STEPS steps
+    uint32_t k = 63 - __builtin_clzll((unsigned long long) size - 1);
+    size_t step = ((size_t) 1 << k) / BMP_BUFPOOL_STEPS;
+    size_t sub = (size - 1 - ((size_t) 1 << k)) / step;
+
+    *blocksize = ((size_t) 1 << k) + (sub + 1) * step;
+
+    return (k - BMP_BUFPOOL_MINSHIFT) * BMP_BUFPOOL_STEPS + sub + 1;
+}
+
+static void * bmp_bufpool_alloc(void * context, size_t size)
+{
+    bmp_bufpool * pool = context;
+    size_t blocksize;
+    size_t sizeclass = bmp_sizeclass(size + BMP_BLOCK_HEADER, &blocksize);
+
+    if (sizeclass >= BMP_BUFPOOL_CLASSES) return NULL;
+
+    pthread_mutex_lock(&pool->lock);
+
+    bmp_block * block = pool->free[sizeclass];
+    if (block != NULL) {
+        pool->free[sizeclass] = block->next;
+        pool->cached -= blocksize;
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    if (block == NULL) {
+        block = malloc(blocksize);
+        if (block == NULL) return NULL;
+        block->sizeclass = sizeclass;
+    }
+
+    return (uint8_t *) block + BMP_BLOCK_HEADER;
+}
+
+static void bmp_bufpool_release(void * context, void * ptr)
+{
+    bmp_bufpool * pool = context;
+    bmp_block * block = (bmp_block *) ((uint8_t *) ptr - BMP_BLOCK_HEADER);
+    size_t blocksize;
+
+    // recompute the rounded size from the class
+    size_t sizeclass = block->sizeclass;
+    if (sizeclass == 0) {
+        blocksize = (size_t) 1 << BMP_BUFPOOL_MINSHIFT;
+    } else {
+        uint32_t k = (sizeclass - 1) / BMP_BUFPOOL_STEPS + BMP_BUFPOOL_MINSHIFT;
+        size_t sub = (sizeclass - 1) % BMP_BUFPOOL_STEPS;
+        blocksize = ((size_t) 1 << k) + (sub + 1) * (((size_t) 1 << k) / BMP_BUFPOOL_STEPS);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+
+    if (pool->limit == 0 || pool->cached + blocksize <= pool->limit) {
+        block->next = pool->free[sizeclass];
+        pool->free[sizeclass] = block;
+        pool->cached += blocksize;
+        block = NULL;
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    free(block);
+}
+
+bmp_bufpool * bmp_bufpool_create(size_t limit)
+{
+    bmp_bufpool * pool = calloc(1, sizeof(bmp_bufpool));
+    if (pool == NULL) return NULL;
+
+    if (pthread_mutex_init(&pool->lock, NULL) != 0) {
+        free(pool);
+        return NULL;
+    }
+
+    pool->limit = limit;
+
+    return pool;
+}
+
+bmp_allocator bmp_bufpool_allocator(bmp_bufpool * pool)
+{
+    return (bmp_allocator) { bmp_bufpool_alloc, bmp_bufpool_release, pool };
+}
+
+void bmp_bufpool_destroy(bmp_bufpool * pool)
+{
+    if (pool == NULL) return;
+
+    for (size_t i = 0; i < BMP_BUFPOOL_CLASSES; i++) {
+        while (pool->free[i] != NULL) {
+            bmp_block * block = pool->free[i];
+            pool->free[i] = block->next;
+            free(block);
+        }
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+bmp_image * bmp_cleanup(FILE * fptr , bmp_image * img)
+{
+    if (fptr != NULL) fclose(fptr);
+
+    if (img != NULL) {
+        bmp_release(img, img->dib.bmiColors);
+        bmp_release(img, img->ciPixelArray);
+        if (img->mapAddress != NULL) munmap(img->mapAddress, img->mapLength);
+        bmp_free(img);
+    }
+
+    return NULL;
+}
+
+int bmp_ismapped(bmp_image * img, const void * ptr)
+{
+    if (img == NULL || img->mapAddress == NULL || ptr == NULL) return 0;
+
+    const uint8_t * begin = img->mapAddress;
+    const uint8_t * p = ptr;
+
+    return (p >= begin) && (p < begin + img->mapLength);
+}
+
+void bmp_release(bmp_image * img, void * ptr)
+{
+    if (ptr == NULL) return;
+
+    // buffers living inside the file mapping are released by bmp_cleanup()
+    if (bmp_ismapped(img, ptr)) return;
+
+    bmp_free(ptr);
+}
+
+int bmp_checkheaders(bmp_image * img)
+{
+    if (img->fileheader.bfType != BMP_FILETYPE_BM)
+        return 0;
+
+    switch (img->dib.bmiHeader.biBitCount) {
+    case BMP_0_BITS: break;
+    case BMP_1_BIT: break;
+    case BMP_2_BITS: break;
+    case BMP_4_BITS: break;
+    case BMP_8_BITS: break;
+    case BMP_16_BITS: break;
+    case BMP_24_BITS: break;
+    case BMP_32_BITS: break;
+    default : return 0;
+    }
+
+    if (img->dib.bmiHeader.biPlanes != BMP_DEFAULT_COLORPLANES) 
+        return 0;
+
+    switch (img->dib.bmiHeader.biCompression) {
+    case BMP_BI_RGB: break;
+    case BMP_BI_RLE8: break;
+    case BMP_BI_RLE4: break;
+    case BMP_BI_BITFIELDS: break;
+    case BMP_BI_JPEG: break;
+    case BMP_BI_PNG: break;
+    case BMP_BI_ALPHABITFIELDS: break;
+    case BMP_BI_CMYK: break;
+    case BMP_BI_CMYKRLE8: break;
+    case BMP_BI_CMYKRLE4: break;
+    default : return 0;
+    }
+
+    // -INT32_MIN has no int32_t, and padded pixels must fit 32-bit sizes
+    if (img->dib.bmiHeader.biWidth <= 0 || img->dib.bmiHeader.biHeight == INT32_MIN)
+        return 0;
+
+    uint64_t stride = ((uint64_t) img->dib.bmiHeader.biWidth * img->dib.bmiHeader.biBitCount + 31) / 32 * 4;
+
+    if (stride > UINT32_MAX || stride * bmp_getheight(img) > UINT32_MAX) return 0;
+
+    if (bmp_isuncompressed(img) == 0 && img->fileheader.bfOffBits > img->fileheader.bfSize)
+        return 0;
+
+    if (img->dib.bmiHeader.biSize >= BMP_V4HEADER)
+    {
+        switch (img->dib.bmiv4Header.bV4CSType)
+        {
+        case BMP_LCS_CALIBRATED_RGB: break;
+        case BMP_LCS_sRGB: break;
+        case BMP_LCS_WINDOWS_COLOR_SPACE: break;
+        case BMP_LCS_PROFILE_LINKED: break;
+        case BMP_LCS_PROFILE_EMBEDDED: break;
+        default: return 0;
+        }
+    }
+    
+    if (img->dib.bmiHeader.biSize >= BMP_V5HEADER)
+    {
+        switch (img->dib.bmiv5Header.bV5Intent)
+        {
+        case BMP_LCS_GM_ABS_COLORIMETRIC: break;
+        case BMP_LCS_GM_BUSINESS: break;
+        case BMP_LCS_GM_GRAPHICS: break;
+        case BMP_LCS_GM_IMAGES: break;
+        default: return 0;
+        }
+    }
+
+    return 1;
+}
+
+bmp_image * bmp_getredbricks()
+{
+    bmp_image * img = bmp_calloc(sizeof(bmp_image));
+    if (img == NULL) return NULL;
+
+    img->fileheader.bfType = BMP_FILETYPE_BM;
+    img->fileheader.bfSize = 630;
+    img->fileheader.bfReserved1 = 0;
+    img->fileheader.bfReserved2 = 0;
+    img->fileheader.bfOffBits = 118;
+
+    img->dib.bmiHeader.biSize = 40;
+    img->dib.bmiHeader.biWidth = 32;
+    img->dib.bmiHeader.biHeight = 32;
+    img->dib.bmiHeader.biPlanes = 1;
+    img->dib.bmiHeader.biBitCount = BMP_4_BITS;
+    img->dib.bmiHeader.biCompression = BMP_BI_RGB;
+    img->dib.bmiHeader.biSizeImage = 0;
+    img->dib.bmiHeader.biXPelsPerMeter = 0;
+    img->dib.bmiHeader.biYPelsPerMeter = 0;
+    img->dib.bmiHeader.biClrUsed = 0;
+    img->dib.bmiHeader.biClrImportant = 0;
+
+    img->dib.bmiColors = bmp_alloc(sizeof(bmp_rgbquad)*pow(2,img->dib.bmiHeader.biBitCount));
+
+    img->dib.bmiColors[0].rgbBlue = 0x00; img->dib.bmiColors[0].rgbGreen = 0x00; img->dib.bmiColors[0].rgbRed = 0x00; img->dib.bmiColors[0].rgbReserved = 0x00;
+    img->dib.bmiColors[1].rgbBlue = 0x00; img->dib.bmiColors[1].rgbGreen = 0x00; img->dib.bmiColors[1].rgbRed = 0x80; img->dib.bmiColors[1].rgbReserved = 0x00;
+    img->dib.bmiColors[2].rgbBlue = 0x00; img->dib.bmiColors[2].rgbGreen = 0x80; img->dib.bmiColors[2].rgbRed = 0x00; img->dib.bmiColors[2].rgbReserved = 0x00;
+    img->dib.bmiColors[3].rgbBlue = 0x00; img->dib.bmiColors[3].rgbGreen = 0x80; img->dib.bmiColors[3].rgbRed = 0x80; img->dib.bmiColors[3].rgbReserved = 0x00;
+    
+    img->dib.bmiColors[4].rgbBlue = 0x80; img->dib.bmiColors[4].rgbGreen = 0x00; img->dib.bmiColors[4].rgbRed = 0x00; img->dib.bmiColors[4].rgbReserved = 0x00;
+    img->dib.bmiColors[5].rgbBlue = 0x80; img->dib.bmiColors[5].rgbGreen = 0x00; img->dib.bmiColors[5].rgbRed = 0x80; img->dib.bmiColors[5].rgbReserved = 0x00;
+    img->dib.bmiColors[6].rgbBlue = 0x80; img->dib.bmiColors[6].rgbGreen = 0x80; img->dib.bmiColors[6].rgbRed = 0x00; img->dib.bmiColors[6].rgbReserved = 0x00;
+    img->dib.bmiColors[7].rgbBlue = 0x80; img->dib.bmiColors[7].rgbGreen = 0x80; img->dib.bmiColors[7].rgbRed = 0x80; img->dib.bmiColors[7].rgbReserved = 0x00;
+    
+    img->dib.bmiColors[8].rgbBlue = 0xc0; img->dib.bmiColors[8].rgbGreen = 0xc0; img->dib.bmiColors[8].rgbRed = 0xc0; img->dib.bmiColors[8].rgbReserved = 0x00;
+    img->dib.bmiColors[9].rgbBlue = 0x00; img->dib.bmiColors[9].rgbGreen = 0x00; img->dib.bmiColors[9].rgbRed = 0xff; img->dib.bmiColors[9].rgbReserved = 0x00;
+    img->dib.bmiColors[10].rgbBlue = 0x00; img->dib.bmiColors[10].rgbGreen = 0xff; img->dib.bmiColors[10].rgbRed = 0x00; img->dib.bmiColors[10].rgbReserved = 0x00;
+    img->dib.bmiColors[11].rgbBlue = 0x00; img->dib.bmiColors[11].rgbGreen = 0xff; img->dib.bmiColors[11].rgbRed = 0xff; img->dib.bmiColors[11].rgbReserved = 0x00;
+    
+    img->dib.bmiColors[12].rgbBlue = 0xff; img->dib.bmiColors[12].rgbGreen = 0x00; img->dib.bmiColors[12].rgbRed = 0x00; img->dib.bmiColors[12].rgbReserved = 0x00;
+    img->dib.bmiColors[13].rgbBlue = 0xff; img->dib.bmiColors[13].rgbGreen = 0x00; img->dib.bmiColors[13].rgbRed = 0xff; img->dib.bmiColors[13].rgbReserved = 0x00;
+    img->dib.bmiColors[14].rgbBlue = 0xff; img->dib.bmiColors[14].rgbGreen = 0xff; img->dib.bmiColors[14].rgbRed = 0x00; img->dib.bmiColors[14].rgbReserved = 0x00;
+    img->dib.bmiColors[15].rgbBlue = 0xff; img->dib.bmiColors[15].rgbGreen = 0xff; img->dib.bmiColors[15].rgbRed = 0xff; img->dib.bmiColors[15].rgbReserved = 0x00;
+
+    unsigned char ciPixelArray[] = {
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x09, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 
+        0x11, 0x11, 0x01, 0x19, 0x11, 0x01, 0x10, 0x10, 0x09, 0x09, 0x01, 0x09, 0x11, 0x11, 0x01, 0x90, 
+        0x11, 0x01, 0x19, 0x09, 0x09, 0x91, 0x11, 0x10, 0x09, 0x11, 0x09, 0x11, 0x19, 0x10, 0x90, 0x11, 
+        0x19, 0x01, 0x19, 0x19, 0x10, 0x10, 0x11, 0x10, 0x09, 0x01, 0x91, 0x10, 0x91, 0x09, 0x10, 0x10, 
+        0x11, 0x10, 0x11, 0x91, 0x99, 0x11, 0x09, 0x90, 0x09, 0x91, 0x01, 0x11, 0x11, 0x11, 0x91, 0x10, 
+        0x90, 0x99, 0x11, 0x11, 0x11, 0x11, 0x19, 0x00, 0x09, 0x01, 0x91, 0x01, 0x01, 0x19, 0x00, 0x99, 
+        0x09, 0x19, 0x01, 0x00, 0x11, 0x90, 0x91, 0x10, 0x09, 0x01, 0x11, 0x99, 0x10, 0x01, 0x11, 0x11, 
+        0x91, 0x11, 0x11, 0x19, 0x10, 0x11, 0x99, 0x10, 0x09, 0x10, 0x01, 0x11, 0x11, 0x11, 0x19, 0x10, 
+        0x11, 0x09, 0x09, 0x10, 0x19, 0x10, 0x10, 0x10, 0x09, 0x01, 0x11, 0x19, 0x00, 0x01, 0x10, 0x19, 
+        0x10, 0x11, 0x11, 0x01, 0x99, 0x01, 0x11, 0x90, 0x09, 0x19, 0x11, 0x91, 0x11, 0x91, 0x01, 0x11, 
+        0x19, 0x10, 0x99, 0x00, 0x01, 0x19, 0x09, 0x10, 0x09, 0x19, 0x10, 0x91, 0x11, 0x01, 0x11, 0x11, 
+        0x91, 0x01, 0x91, 0x19, 0x11, 0x00, 0x99, 0x90, 0x09, 0x01, 0x01, 0x99, 0x19, 0x01, 0x91, 0x10, 
+        0x19, 0x91, 0x91, 0x09, 0x11, 0x99, 0x11, 0x10, 0x09, 0x91, 0x11, 0x10, 0x11, 0x91, 0x99, 0x10, 
+        0x90, 0x11, 0x01, 0x11, 0x11, 0x19, 0x11, 0x90, 0x09, 0x11, 0x00, 0x19, 0x10, 0x11, 0x01, 0x11, 
+        0x99, 0x99, 0x99, 0x99, 0x99, 0x99, 0x99, 0x99, 0x09, 0x99, 0x99, 0x99, 0x99, 0x99, 0x99, 0x99, 
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 
+        0x90, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 
+        0x99, 0x11, 0x11, 0x11, 0x19, 0x10, 0x19, 0x19, 0x11, 0x09, 0x10, 0x90, 0x91, 0x90, 0x91, 0x00, 
+        0x91, 0x19, 0x19, 0x09, 0x01, 0x10, 0x09, 0x01, 0x11, 0x11, 0x91, 0x11, 0x11, 0x11, 0x10, 0x00, 
+        0x91, 0x11, 0x01, 0x19, 0x10, 0x11, 0x10, 0x01, 0x01, 0x11, 0x90, 0x11, 0x11, 0x11, 0x91, 0x00, 
+        0x99, 0x09, 0x19, 0x10, 0x11, 0x90, 0x09, 0x90, 0x91, 0x01, 0x19, 0x09, 0x91, 0x11, 0x01, 0x00, 
+        0x90, 0x10, 0x19, 0x11, 0x00, 0x11, 0x11, 0x00, 0x10, 0x11, 0x01, 0x10, 0x11, 0x19, 0x11, 0x00, 
+        0x90, 0x19, 0x10, 0x91, 0x01, 0x90, 0x19, 0x99, 0x00, 0x11, 0x91, 0x01, 0x11, 0x01, 0x91, 0x00, 
+        0x99, 0x09, 0x09, 0x01, 0x10, 0x11, 0x91, 0x01, 0x10, 0x91, 0x99, 0x11, 0x10, 0x90, 0x91, 0x00, 
+        0x91, 0x11, 0x00, 0x10, 0x11, 0x01, 0x10, 0x19, 0x19, 0x09, 0x10, 0x00, 0x99, 0x01, 0x01, 0x00, 
+        0x91, 0x01, 0x19, 0x91, 0x19, 0x91, 0x11, 0x09, 0x10, 0x11, 0x00, 0x91, 0x00, 0x10, 0x90, 0x00, 
+        0x99, 0x01, 0x11, 0x10, 0x09, 0x10, 0x10, 0x19, 0x09, 0x01, 0x91, 0x90, 0x11, 0x09, 0x11, 0x00, 
+        0x90, 0x99, 0x11, 0x11, 0x11, 0x90, 0x19, 0x01, 0x19, 0x01, 0x91, 0x01, 0x01, 0x19, 0x09, 0x00, 
+        0x91, 0x10, 0x11, 0x91, 0x99, 0x09, 0x09, 0x90, 0x11, 0x91, 0x01, 0x19, 0x11, 0x11, 0x91, 0x00, 
+        0x91, 0x19, 0x01, 0x00, 0x11, 0x00, 0x91, 0x10, 0x11, 0x01, 0x11, 0x11, 0x10, 0x01, 0x11, 0x00, 
+        0x99, 0x99, 0x99, 0x99, 0x99, 0x99, 0x99, 0x99, 0x99, 0x99, 0x99, 0x99, 0x99, 0x99, 0x99, 0x90 
+    };
+
+    uint32_t datasize = img->dib.bmiHeader.biWidth * img->dib.bmiHeader.biHeight * img->dib.bmiHeader.biBitCount / BMP_8_BITS;
+
+    img->ciPixelArray = bmp_alloc(datasize);
+    
+    for (unsigned int i = 0; i < datasize; i++) {
+        img->ciPixelArray[i] = (uint8_t) ciPixelArray[i];
+    }
+
+    return img;
+}
+
+bmp_image * bmp_8bpp_sample()
+{
+    bmp_image * img = bmp_calloc(sizeof(bmp_image));
+
+    /**
+     * BITMAPINFOHEADER 
+     * - only format supported until this release
+     */
+    img->dib.bmiHeader.biSize = 40;
+    img->dib.bmiHeader.biWidth = 256;
+    img->dib.bmiHeader.biHeight = 256;
+    img->dib.bmiHeader.biPlanes = 1;
+    img->dib.bmiHeader.biBitCount = BMP_8_BITS;
+    img->dib.bmiHeader.biCompression = BMP_BI_RGB;
+    img->dib.bmiHeader.biSizeImage = 0;
+    img->dib.bmiHeader.biXPelsPerMeter = 0;
+    img->dib.bmiHeader.biYPelsPerMeter = 0;
+    img->dib.bmiHeader.biClrUsed = 0;
+    img->dib.bmiHeader.biClrImportant = 0;
+
+    /**
+     * BITMAPFILEHEADER
+     * - use BITMAPINFOHEADER data to build it
+     * - size of colour palette is set to maximum if 'biClrUsed' is zero
+     *   according to 'biBitCount'
+     */    
+    uint32_t colourpalettesize = pow(2,img->dib.bmiHeader.biBitCount) 
+                    * sizeof(bmp_rgbquad);
+    
+    uint32_t datasize = img->dib.bmiHeader.biWidth 
+                    * img->dib.bmiHeader.biHeight 
+                    * img->dib.bmiHeader.biBitCount / BMP_8_BITS;
+
+    img->fileheader.bfType = BMP_FILETYPE_BM;
+    img->fileheader.bfSize = BMP_FILEHEADER_SIZE 
+                    + img->dib.bmiHeader.biSize 
+                    + colourpalettesize 
+                    + datasize;
+    
+    img->fileheader.bfReserved1 = 0;
+    img->fileheader.bfReserved2 = 0;
+    
+    img->fileheader.bfOffBits = BMP_FILEHEADER_SIZE 
+                    + img->dib.bmiHeader.biSize 
+                    + colourpalettesize;
+
+    /**
+     * COLOUR PALETTE
+     * - images with 1bpp, 2bpp, 4bpp and 8bpp implement this field 
+     */
+    img->dib.bmiColors = bmp_alloc(colourpalettesize);
+
+    for (size_t i = 0; i < pow(2,img->dib.bmiHeader.biBitCount); i++) {
+        img->dib.bmiColors[i].rgbBlue = i;
+        img->dib.bmiColors[i].rgbGreen = i;
+        img->dib.bmiColors[i].rgbRed = i;
+        img->dib.bmiColors[i].rgbReserved = 0;
+    }
+
+    /**
+     * PIXEL ARRAY
+     * - raw data of the image
+     */
+    img->ciPixelArray = bmp_alloc(datasize);
+
+    uint32_t newline = 0;
+
+    for (size_t i = 0; i < datasize; i++) {
+        if (newline >= img->dib.bmiHeader.biWidth) {
+            newline = 0;
+        }
+        img->ciPixelArray[i] = newline;
+        newline++;
+    }
+
+    return img;
+}
+
+bmp_image * bmp_16bpp_sample()
+{
+    bmp_image * img = bmp_calloc(sizeof(bmp_image));
+
+    /**
+     * BITMAPINFOHEADER 
+     * - only format supported until this release
+     */
+    img->dib.bmiHeader.biSize = 40;
+    img->dib.bmiHeader.biWidth = pow(2,5);
+    img->dib.bmiHeader.biHeight = pow(2,5);
+    img->dib.bmiHeader.biPlanes = 1;
+    img->dib.bmiHeader.biBitCount = BMP_16_BITS;
+    img->dib.bmiHeader.biCompression = BMP_BI_RGB;
+    img->dib.bmiHeader.biSizeImage = 0;
+    img->dib.bmiHeader.biXPelsPerMeter = 0;
+    img->dib.bmiHeader.biYPelsPerMeter = 0;
+    img->dib.bmiHeader.biClrUsed = 0;
+    img->dib.bmiHeader.biClrImportant = 0;
+
+    /**
+     * BITMAPFILEHEADER
+     * - use BITMAPINFOHEADER data to build it
+     * - 16bpp with BI_RGB compression have no bmiColors member
+     */    
+    uint32_t colourpalettesize = 0;
+    
+    uint32_t datasize = img->dib.bmiHeader.biWidth 
+                    * img->dib.bmiHeader.biHeight 
+                    * img->dib.bmiHeader.biBitCount / BMP_8_BITS;
+
+    img->fileheader.bfType = BMP_FILETYPE_BM;
+    img->fileheader.bfSize = BMP_FILEHEADER_SIZE 
+                    + img->dib.bmiHeader.biSize 
+                    + colourpalettesize 
+                    + datasize;
+    
+    img->fileheader.bfReserved1 = 0;
+    img->fileheader.bfReserved2 = 0;
+    
+    img->fileheader.bfOffBits = BMP_FILEHEADER_SIZE 
+                    + img->dib.bmiHeader.biSize 
+                    + colourpalettesize;
+    
+    /**
+     * PIXEL ARRAY
+     * - raw data of the image
+     */
+    img->ciPixelArray = bmp_alloc(datasize);
+
+    uint16_t * raw = (uint16_t *) img->ciPixelArray;
+
+    for (uint16_t x = 0; x < img->dib.bmiHeader.biWidth; x++)
+    {
+        for (uint16_t y = 0; y < img->dib.bmiHeader.biHeight; y++)
+        {
+            raw[y * img->dib.bmiHeader.biWidth + x] = x + (y << 10);
+        }
+    }
+
+    return img;
+}
+
+bmp_image * bmp_32bpp_sample()
+{
+    bmp_image * img = bmp_calloc(sizeof(bmp_image));
+
+    /**
+     * BITMAPINFOHEADER 
+     * - only format supported until this release
+     */
+    img->dib.bmiHeader.biSize = 40;
+    img->dib.bmiHeader.biWidth = pow(2,8);
+    img->dib.bmiHeader.biHeight = pow(2,8);
+    img->dib.bmiHeader.biPlanes = 1;
+    img->dib.bmiHeader.biBitCount = BMP_32_BITS;
+    img->dib.bmiHeader.biCompression = BMP_BI_RGB;
+    img->dib.bmiHeader.biSizeImage = 0;
+    img->dib.bmiHeader.biXPelsPerMeter = 0;
+    img->dib.bmiHeader.biYPelsPerMeter = 0;
+    img->dib.bmiHeader.biClrUsed = 0;
+    img->dib.bmiHeader.biClrImportant = 0;
+
+    /**
+     * BITMAPFILEHEADER
+     * - use BITMAPINFOHEADER data to build it
+     * - 32bpp with BI_RGB compression have no bmiColors member
+     */    
+    uint32_t colourpalettesize = 0;
+    
+    uint32_t datasize = img->dib.bmiHeader.biWidth 
+                    * img->dib.bmiHeader.biHeight 
+                    * img->dib.bmiHeader.biBitCount / BMP_8_BITS;
+
+    img->fileheader.bfType = BMP_FILETYPE_BM;
+    img->fileheader.bfSize = BMP_FILEHEADER_SIZE 
+                    + img->dib.bmiHeader.biSize 
+                    + colourpalettesize 
+                    + datasize;
+    
+    img->fileheader.bfReserved1 = 0;
+    img->fileheader.bfReserved2 = 0;
+    
+    img->fileheader.bfOffBits = BMP_FILEHEADER_SIZE 
+                    + img->dib.bmiHeader.biSize 
+                    + colourpalettesize;
+    
+    /**
+     * PIXEL ARRAY
+     * - raw data of the image
+     */
+    img->ciPixelArray = bmp_alloc(datasize);
+
+    uint32_t * raw = (uint32_t *) img->ciPixelArray;
+
+    for (uint32_t x = 0; x < img->dib.bmiHeader.biWidth; x++)
+    {
+        for (uint32_t y = 0; y < img->dib.bmiHeader.biHeight; y++)
+        {
+            raw[y * img->dib.bmiHeader.biWidth + x] = x  + (y << 8);
+        }
+    }
+
+    return img;
+}
+
+uint32_t bmp_getfilesize(bmp_image * img)
+{
+    return img->fileheader.bfSize;
+}
+
+uint32_t bmp_getsavesize(bmp_image * img)
+{
+    uint32_t datasize = bmp_getdatasize(img);
+
+    if (bmp_isuncompressed(img)) datasize = bmp_getstride(img) * bmp_getheight(img);
+
+    return bmp_getheaderssize(img) + datasize;
+}
+
+uint32_t bmp_getoffset(bmp_image * img)
+{
+    return img->fileheader.bfOffBits;
+}
+
+uint32_t bmp_getarraysize(bmp_image * img)
+{
+    if (bmp_isuncompressed(img)) return bmp_getrowstep(img) * bmp_getheight(img);
+
+    return bmp_getdatasize(img);
+}
+
+uint32_t bmp_getdatasize(bmp_image * img)
+{
+    return img->fileheader.bfSize - img->fileheader.bfOffBits;
+}
+
+uint32_t bmp_getheight(bmp_image * img)
+{
+    int32_t height = img->dib.bmiHeader.biHeight;
+    return (height < 0) ? (uint32_t) -height : (uint32_t) height;
+}
+
+uint32_t bmp_getrowsize(bmp_image * img)
+{
+    return ((uint64_t) img->dib.bmiHeader.biWidth * img->dib.bmiHeader.biBitCount + 7) / 8;
+}
+
+uint32_t bmp_getstride(bmp_image * img)
+{
+    return (((uint64_t) img->dib.bmiHeader.biWidth * img->dib.bmiHeader.biBitCount + 31) / 32) * 4;
+}
+
+uint32_t bmp_getrowstep(bmp_image * img)
+{
+    return (img->rowStride != 0) ? img->rowStride : bmp_getrowsize(img);
+}
+
+uint32_t bmp_getheaderssize(bmp_image * img)
+{
+    uint32_t size = BMP_FILEHEADER_SIZE + sizeof(bmp_infoheader);
+
+    if (img->dib.bmiHeader.biSize >= BMP_V4HEADER) size += sizeof(bmp_v4header);
+    if (img->dib.bmiHeader.biSize >= BMP_V5HEADER) size += sizeof(bmp_v5header);
+
+    if (img->dib.bmiColors != NULL) size += bmp_getpalettesize(img);
+
+    return size;
+}
+
+int bmp_isindexed(bmp_image * img)
+{
+    return img->dib.bmiHeader.biBitCount <= BMP_8_BITS 
+        && img->dib.bmiHeader.biBitCount > BMP_0_BITS
+        && img->dib.bmiColors != NULL;
+}
+
+int bmp_isuncompressed(bmp_image * img)
+{
+    switch (img->dib.bmiHeader.biCompression)
+    {
+    case BMP_BI_RGB:
+    case BMP_BI_BITFIELDS:
+    case BMP_BI_ALPHABITFIELDS:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+void bmp_unpad(bmp_image * img, const uint8_t * data)
+{
+    uint32_t rows = bmp_getheight(img);
+    uint32_t rowsize = bmp_getrowsize(img);
+    uint32_t stride = bmp_getstride(img);
+
+    // rows only move towards the beginning, so <data> may be <ciPixelArray>
+    if (stride != rowsize || data != img->ciPixelArray)
+    {
+        for (uint32_t y = 0; y < rows; y++) {
+            memmove(img->ciPixelArray + (size_t) y * rowsize, 
+                    data + (size_t) y * stride, rowsize);
+        }
+    }
+}
+
+int bmp_packrows(bmp_image * img)
+{
+    if (img == NULL || img->rowStride == 0) return 1;
+
+    uint8_t * data = img->ciPixelArray;
+
+    img->ciPixelArray = bmp_alloc((size_t) bmp_getrowsize(img) * bmp_getheight(img));
+    if (img->ciPixelArray == NULL) {
+        img->ciPixelArray = data;
+        return 0;
+    }
+
+    bmp_unpad(img, data);
+    bmp_release(img, data);
+    img->rowStride = 0;
+
+    return 1;
+}
+
+uint32_t bmp_getdibformat(bmp_image * img)
+{
+    switch (img->dib.bmiHeader.biSize)
+    {
+    case BMP_INFOHEADER: return BMP_INFOHEADER;
+    case BMP_V4HEADER: return BMP_V4HEADER;
+    case BMP_V5HEADER: return BMP_V5HEADER;
+    default:
+        return BMP_UNKNOWN_HEADER;
+    }
+}
+
+uint16_t bmp_getbitcount(bmp_image * img)
+{
+    return img->dib.bmiHeader.biBitCount;
+}
+
+uint32_t bmp_getpalettesize(bmp_image * img)
+{
+    switch (img->dib.bmiHeader.biBitCount)
+    {
+    case BMP_0_BITS:
+    case BMP_1_BIT:
+    case BMP_2_BITS:
+    case BMP_4_BITS:
+    case BMP_8_BITS:
+        if (img->dib.bmiHeader.biClrUsed == 0) {
+            return sizeof(bmp_rgbquad) * pow(2, img->dib.bmiHeader.biBitCount);
+        } else {
+            return sizeof(bmp_rgbquad) * img->dib.bmiHeader.biClrUsed;
+        }
+        break;
+    case BMP_16_BITS:
+        // BI_RGB images carry no bit masks, BI_ALPHABITFIELDS adds alpha's
+        if (img->dib.bmiHeader.biCompression == BMP_BI_ALPHABITFIELDS) return sizeof(bmp_rgbquad) * 4;
+        if (img->dib.bmiHeader.biCompression != BMP_BI_BITFIELDS) return 0;
+        return sizeof(bmp_rgbquad) * 3;
+        break;
+    case BMP_32_BITS:
+        if (img->dib.bmiHeader.biCompression == BMP_BI_ALPHABITFIELDS) return sizeof(bmp_rgbquad) * 4;
+        if (img->dib.bmiHeader.biCompression != BMP_BI_BITFIELDS) return 0;
+        return sizeof(bmp_rgbquad) * 4;
+        break;
+    case BMP_24_BITS:
+        // never expect color palette
+    default: return 0;
+    }
+}
+
+uint32_t bmp_getcompression(bmp_image * img)
+{
+    switch (img->dib.bmiHeader.biCompression)
+    {
+    case BMP_BI_RGB: return BMP_BI_RGB;
+    case BMP_BI_RLE8: return BMP_BI_RLE8;
+    case BMP_BI_RLE4: return BMP_BI_RLE4;
+    case BMP_BI_BITFIELDS: return BMP_BI_BITFIELDS;
+    case BMP_BI_JPEG: return BMP_BI_JPEG;
+    case BMP_BI_PNG: return BMP_BI_PNG;
+    case BMP_BI_ALPHABITFIELDS: return BMP_BI_ALPHABITFIELDS;
+    case BMP_BI_CMYK: return BMP_BI_CMYK;
+    case BMP_BI_CMYKRLE8: return BMP_BI_CMYKRLE8;
+    case BMP_BI_CMYKRLE4: return BMP_BI_CMYKRLE4;
+    default:
+        return BMP_UNKNOWN_COMPRESSION;
+    }
+}
+
+uint32_t bmp_getnpixels(bmp_image * img)
+{
+    return img->dib.bmiHeader.biWidth * img->dib.bmiHeader.biHeight;
+}
+
+uint32_t bmp_getncolors(bmp_image * img)
+{
+    switch (img->dib.bmiHeader.biBitCount)
+    {
+    case BMP_0_BITS:
+    case BMP_1_BIT:
+    case BMP_2_BITS:
+    case BMP_4_BITS:
+    case BMP_8_BITS:
+        if (img->dib.bmiHeader.biClrUsed == 0) {
+            return pow(2, img->dib.bmiHeader.biBitCount);
+        } else {
+            return img->dib.bmiHeader.biClrUsed;
+        }
+        break;
+    case BMP_16_BITS:
+        return 3;
+        break;
+    case BMP_32_BITS:
+        return 4;
+        break;
+    case BMP_24_BITS:
+        // never expect color palette
+    default: return 0;
+    }
+}
+
+void bmp_cpdibs(bmp_image * new, bmp_image * img)
+{
+    if (new == NULL) return;
+    if (img == NULL) return;
+
+    new->dib.bmiHeader.biSize = img->dib.bmiHeader.biSize;
+    new->dib.bmiHeader.biWidth = img->dib.bmiHeader.biWidth;
+    new->dib.bmiHeader.biHeight = img->dib.bmiHeader.biHeight;
+    new->dib.bmiHeader.biPlanes = img->dib.bmiHeader.biPlanes;
+    new->dib.bmiHeader.biBitCount = img->dib.bmiHeader.biBitCount;
+    new->dib.bmiHeader.biCompression = img->dib.bmiHeader.biCompression;
+    new->dib.bmiHeader.biXPelsPerMeter = img->dib.bmiHeader.biXPelsPerMeter;
+    new->dib.bmiHeader.biYPelsPerMeter = img->dib.bmiHeader.biYPelsPerMeter;
+    new->dib.bmiHeader.biClrUsed = img->dib.bmiHeader.biClrUsed;
+    new->dib.bmiHeader.biClrImportant = img->dib.bmiHeader.biClrImportant;
+
+    if (new->dib.bmiHeader.biSize >= BMP_V4HEADER)
+    {
+        new->dib.bmiv4Header.bV4RedMask = img->dib.bmiv4Header.bV4RedMask;
+        new->dib.bmiv4Header.bV4GreenMask = img->dib.bmiv4Header.bV4GreenMask;
+        new->dib.bmiv4Header.bV4BlueMask = img->dib.bmiv4Header.bV4BlueMask;
+        new->dib.bmiv4Header.bV4AlphaMask = img->dib.bmiv4Header.bV4AlphaMask;
+        new->dib.bmiv4Header.bV4CSType = img->dib.bmiv4Header.bV4CSType;
+        new->dib.bmiv4Header.bV4Endpoints.ciexyzRed.ciexyzX = img->dib.bmiv4Header.bV4Endpoints.ciexyzRed.ciexyzX;
+        new->dib.bmiv4Header.bV4Endpoints.ciexyzRed.ciexyzY = img->dib.bmiv4Header.bV4Endpoints.ciexyzRed.ciexyzY;
+        new->dib.bmiv4Header.bV4Endpoints.ciexyzRed.ciexyzZ = img->dib.bmiv4Header.bV4Endpoints.ciexyzRed.ciexyzZ;
+        new->dib.bmiv4Header.bV4Endpoints.ciexyzGreen.ciexyzX = img->dib.bmiv4Header.bV4Endpoints.ciexyzGreen.ciexyzX;
+        new->dib.bmiv4Header.bV4Endpoints.ciexyzGreen.ciexyzY = img->dib.bmiv4Header.bV4Endpoints.ciexyzGreen.ciexyzY;
+        new->dib.bmiv4Header.bV4Endpoints.ciexyzGreen.ciexyzZ = img->dib.bmiv4Header.bV4Endpoints.ciexyzGreen.ciexyzZ;
+        new->dib.bmiv4Header.bV4Endpoints.ciexyzBlue.ciexyzX = img->dib.bmiv4Header.bV4Endpoints.ciexyzBlue.ciexyzX;
+        new->dib.bmiv4Header.bV4Endpoints.ciexyzBlue.ciexyzY = img->dib.bmiv4Header.bV4Endpoints.ciexyzBlue.ciexyzY;
+        new->dib.bmiv4Header.bV4Endpoints.ciexyzBlue.ciexyzZ = img->dib.bmiv4Header.bV4Endpoints.ciexyzBlue.ciexyzZ;
+        new->dib.bmiv4Header.bV4GammaRed = img->dib.bmiv4Header.bV4GammaRed;
+        new->dib.bmiv4Header.bV4GammaGreen = img->dib.bmiv4Header.bV4GammaGreen;
+        new->dib.bmiv4Header.bV4GammaBlue = img->dib.bmiv4Header.bV4GammaBlue;
+    }
+
+    if (new->dib.bmiHeader.biSize >= BMP_V5HEADER)
+    {
+        new->dib.bmiv5Header.bV5Intent = img->dib.bmiv5Header.bV5Intent;
+        new->dib.bmiv5Header.bV5ProfileData = img->dib.bmiv5Header.bV5ProfileData;
+        new->dib.bmiv5Header.bV5ProfileSize = img->dib.bmiv5Header.bV5ProfileSize;
+        new->dib.bmiv5Header.bV5Reserved = img->dib.bmiv5Header.bV5Reserved;
+    }
+}
+
+/**
+ * Headers and palette of the BI_RGB image an RLE decoder produces from 
+ * <img>, pixels are zeroed.
+ */
+static bmp_image * bmp_rledecoded(bmp_image * img)
+{
+    bmp_image * new = bmp_calloc(sizeof(bmp_image));
+    if (new == NULL) return NULL;
+
+    bmp_cpdibs(new, img);
+    
+    new->dib.bmiHeader.biSize = BMP_INFOHEADER;
+    new->dib.bmiHeader.biCompression = BMP_BI_RGB;
+    new->dib.bmiHeader.biSizeImage = bmp_getstride(new) * bmp_getheight(new);
+    
+    new->dib.bmiHeader.biClrUsed = 0;
+    new->dib.bmiHeader.biClrImportant = 0;
+
+    uint32_t palettesize = bmp_getpalettesize(img);
+    
+    new->fileheader.bfType = BMP_FILETYPE_BM;
+    new->fileheader.bfSize = BMP_FILEHEADER_SIZE 
+                    + new->dib.bmiHeader.biSize 
+                    + palettesize 
+                    + new->dib.bmiHeader.biSizeImage;
+    
+    new->fileheader.bfReserved1 = 0;
+    new->fileheader.bfReserved2 = 0;
+    
+    new->fileheader.bfOffBits = BMP_FILEHEADER_SIZE 
+                    + new->dib.bmiHeader.biSize 
+                    + palettesize;
+
+    if (palettesize > 0 && img->dib.bmiColors != NULL)
+    {
+        new->dib.bmiColors = bmp_alloc(palettesize);
+        if (new->dib.bmiColors == NULL) return bmp_cleanup(NULL, new);
+
+        memcpy(new->dib.bmiColors, img->dib.bmiColors, palettesize);
+    }
+
+    // pixels skipped by deltas and early ends of line keep index 0
+    new->ciPixelArray = bmp_calloc(bmp_getarraysize(new));
+    if (new->ciPixelArray == NULL) return bmp_cleanup(NULL, new);
+
+    return new;
+}
+
+bmp_image * bmp_rle8decoder(bmp_image * img)
+{
+    BMP_STATS_SCOPE(BMP_STAT_RLE8DECODER);
+
+    if (img == NULL) return NULL;
+    if (bmp_getcompression(img) != BMP_BI_RLE8) return NULL;
+    if (img->dib.bmiHeader.biBitCount != BMP_8_BITS) return NULL;
+
+    bmp_image * new = bmp_rledecoded(img);
+    if (new == NULL) return NULL;
+
+    bmp_rle8decode(img->ciPixelArray, bmp_getdatasize(img), new->ciPixelArray, 
+                   new->dib.bmiHeader.biWidth, bmp_getheight(new));
+
+    BMP_STATS_BYTES(bmp_getarraysize(new));
+
+    return new;
+}
+
+bmp_image * bmp_rle4decoder(bmp_image * img)
+{
+    BMP_STATS_SCOPE(BMP_STAT_RLE4DECODER);
+
+    if (img == NULL) return NULL;
+    if (bmp_getcompression(img) != BMP_BI_RLE4) return NULL;
+    if (img->dib.bmiHeader.biBitCount != BMP_4_BITS) return NULL;
+
+    bmp_image * new = bmp_rledecoded(img);
+    if (new == NULL) return NULL;
+
+    bmp_rle4decode(img->ciPixelArray, bmp_getdatasize(img), new->ciPixelArray, 
+                   new->dib.bmiHeader.biWidth, bmp_getheight(new));
+
+    BMP_STATS_BYTES(bmp_getarraysize(new));
+
+    return new;
+}
+
+void bmp_rle8decode(const uint8_t * src, size_t size, uint8_t * dst, uint32_t width, uint32_t height)
+{
+    const uint8_t * end = src + size;
+    uint32_t x = 0;
+    uint32_t y = 0;
+
+    while (end - src >= 2 && y < height)
+    {
+        uint8_t count = src[0];
+        uint8_t value = src[1];
+        uint8_t * row = dst + (size_t) y * width;
+
+        src += 2;
+
+        // encoded mode: <count> copies of <value>, clipped to the row
+        if (count > 0) {
+            uint32_t n = (count < width - x) ? count : width - x;
+            memset(row + x, value, n);
+            x += n;
+            continue;
+        }
+
+        switch (value)
+        {
+        case 0: // end of line
+            x = 0;
+            y++;
+            break;
+        case 1: // end of bitmap
+            return;
+        case 2: // delta: move right and up
+            if (end - src < 2) return;
+            x += src[0];
+            y += src[1];
+            if (x > width) x = width;
+            src += 2;
+            break;
+        default: // absolute mode: <value> literal bytes, padded to 16 bits
+        {
+            uint32_t n = value;
+            if (n > (size_t) (end - src)) n = end - src;
+            if (n > width - x) n = width - x;
+
+            memcpy(row + x, src, n);
+            x += n;
+
+            size_t skip = value + (value & 1);
+            if (skip > (size_t) (end - src)) return;
+            src += skip;
+            break;
+        }
+        }
+    }
+}
+
+static inline void bmp_setnibble(uint8_t * row, uint32_t x, uint8_t value)
+{
+    uint8_t * byte = row + (x >> 1);
+
+    if (x & 1) *byte = (*byte & 0xF0) | (value & 0x0F);
+    else *byte = (*byte & 0x0F) | (value << 4);
+}
+
+void bmp_rle4decode(const uint8_t * src, size_t size, uint8_t * dst, uint32_t width, uint32_t height)
+{
+    const uint8_t * end = src + size;
+    uint32_t rowsize = (width + 1) / 2;
+    uint32_t x = 0;
+    uint32_t y = 0;
+
+    while (end - src >= 2 && y < height)
+    {
+        uint8_t count = src[0];
+        uint8_t value = src[1];
+        uint8_t * row = dst + (size_t) y * rowsize;
+
+        src += 2;
+
+        /**
+         * encoded mode: <count> pixels alternating between both nibbles 
+         * of <value>. Once aligned on a byte the run is a plain memset.
+         */
+        if (count > 0) {
+            uint32_t n = (count < width - x) ? count : width - x;
+
+            if (n > 0 && (x & 1)) {
+                bmp_setnibble(row, x++, value >> 4);
+                value = (uint8_t) ((value << 4) | (value >> 4));
+                n--;
+            }
+
+            memset(row + (x >> 1), value, n >> 1);
+            x += n & ~1u;
+
+            if (n & 1) bmp_setnibble(row, x++, value >> 4);
+            continue;
+        }
+
+        switch (value)
+        {
+        case 0: // end of line
+            x = 0;
+            y++;
+            break;
+        case 1: // end of bitmap
+            return;
+        case 2: // delta: move right and up
+            if (end - src < 2) return;
+            x += src[0];
+            y += src[1];
+            if (x > width) x = width;
+            src += 2;
+            break;
+        default: // absolute mode: <value> literal nibbles, padded to 16 bits
+        {
+            uint32_t bytes = (value + 1) / 2;
+            uint32_t n = value;
+
+            if (bytes > (size_t) (end - src)) n = 2 * (end - src);
+            if (n > width - x) n = width - x;
+
+            if (!(x & 1)) {
+                memcpy(row + (x >> 1), src, n >> 1);
+                if (n & 1) bmp_setnibble(row, x + n - 1, src[n >> 1] >> 4);
+            } else {
+                for (uint32_t i = 0; i < n; i++) {
+                    uint8_t nibble = (i & 1) ? src[i >> 1] & 0x0F : src[i >> 1] >> 4;
+                    bmp_setnibble(row, x + i, nibble);
+                }
+            }
+            x += n;
+
+            size_t skip = bytes + (bytes & 1);
+            if (skip > (size_t) (end - src)) return;
+            src += skip;
+            break;
+        }
+        }
+    }
+}
+
+/**
+ * Length (up to <limit>) of the run starting at pixel <i> of an index row:
+ * repeated values for RLE8, alternating pairs of values for RLE4.
+ */
+static uint32_t bmp_rlerun(const uint8_t * p, uint32_t i, uint32_t width, int nibbles, uint32_t limit)
+{
+    uint32_t n = 1;
+
+    if (width - i < limit) limit = width - i;
+
+    if (nibbles) {
+        if (limit < 2) return limit;
+        for (n = 2; n < limit && p[i + n] == p[i + (n & 1)]; n++);
+    } else {
+        for (; n < limit && p[i + n] == p[i]; n++);
+    }
+
+    return n;
+}
+
+// bytes taken by an absolute-mode segment of <n> pixels
+static uint32_t bmp_rleabsolute(uint32_t n, int nibbles)
+{
+    uint32_t bytes = nibbles ? (n + 1) / 2 : n;
+    return 2 + bytes + (bytes & 1);
+}
+
+/**
+ * Encode one row of pixel indices (one byte per pixel) as segments of
+ * <lengths>, each flagged encoded or absolute in <absolute>, returning the
+ * number of segments.
+ */
+static uint32_t bmp_rleplan(const uint8_t * p, uint32_t width, int nibbles, bmp_rlemode mode, 
+                            uint32_t * cost, uint8_t * lengths, uint8_t * absolute)
+{
+    uint32_t nsegments = 0;
+
+    if (mode == BMP_RLEMODE_SMALLEST)
+    {
+        /**
+         * cost[i] is the smallest encoding of pixels [i, width): try every
+         * encoded run and every absolute segment starting at i.
+         */
+        cost[width] = 0;
+
+        for (uint32_t i = width; i-- > 0; )
+        {
+            uint32_t run = bmp_rlerun(p, i, width, nibbles, 255);
+            uint32_t best = UINT32_MAX;
+
+            for (uint32_t k = 1; k <= run; k++) {
+                if (2 + cost[i + k] < best) {
+                    best = 2 + cost[i + k];
+                    lengths[i] = k;
+                    absolute[i] = 0;
+                }
+            }
+
+            for (uint32_t k = 3; k <= 255 && i + k <= width; k++) {
+                uint32_t c = bmp_rleabsolute(k, nibbles) + cost[i + k];
+                if (c < best) {
+                    best = c;
+                    lengths[i] = k;
+                    absolute[i] = 1;
+                }
+            }
+
+            cost[i] = best;
+        }
+
+        // walk the choices front to back, compacting them into segments
+        for (uint32_t i = 0; i < width; i += lengths[nsegments - 1]) {
+            lengths[nsegments] = lengths[i];
+            absolute[nsegments] = absolute[i];
+            nsegments++;
+        }
+
+        return nsegments;
+    }
+
+    /**
+     * Greedy: take every run long enough to beat absolute mode, gather 
+     * everything else into absolute segments.
+     */
+    uint32_t worth = nibbles ? 6 : 3;
+
+    for (uint32_t i = 0; i < width; )
+    {
+        uint32_t run = bmp_rlerun(p, i, width, nibbles, 255);
+
+        if (run >= worth || run == width - i) {
+            lengths[nsegments] = run;
+            absolute[nsegments++] = 0;
+            i += run;
+            continue;
+        }
+
+        uint32_t j = i + 1;
+        while (j < width && j - i < 255 && bmp_rlerun(p, j, width, nibbles, worth) < worth) j++;
+
+        uint32_t n = j - i;
+
+        if (n >= 3) {
+            lengths[nsegments] = n;
+            absolute[nsegments++] = 1;
+        } else {
+            for (uint32_t k = 0; k < n; ) {
+                uint32_t part = bmp_rlerun(p, i + k, i + n, nibbles, 255);
+                lengths[nsegments] = part;
+                absolute[nsegments++] = 0;
+                k += part;
+            }
+        }
+
+        i = j;
+    }
+
+    return nsegments;
+}
+
+/**
+ * Shared body of both encoders: returns the encoded image, NULL when the
+ * image cannot be run-length encoded.
+ */
+static bmp_image * bmp_rleencoder(bmp_image * img, bmp_rlemode mode, int nibbles)
+{
+    if (img == NULL) return NULL;
+    if (img->dib.bmiHeader.biBitCount != (nibbles ? BMP_4_BITS : BMP_8_BITS)) return NULL;
+    if (img->dib.bmiHeader.biCompression != BMP_BI_RGB) return NULL;
+
+    // RLE bitmaps are always stored bottom-up
+    if (img->dib.bmiHeader.biHeight < 0) return NULL;
+
+    uint32_t width = img->dib.bmiHeader.biWidth;
+    uint32_t height = bmp_getheight(img);
+    uint32_t step = bmp_getrowstep(img);
+
+    // worst case: every pixel as its own run, plus the escapes
+    size_t capacity = (size_t) height * (2 * (size_t) width + 2) + 2;
+
+    uint8_t * out = bmp_alloc(capacity);
+    uint8_t * indices = bmp_alloc(width + 1);
+    uint32_t * cost = bmp_alloc((width + 1) * sizeof(uint32_t));
+    uint8_t * lengths = bmp_alloc(width + 1);
+    uint8_t * absolute = bmp_alloc(width + 1);
+
+    bmp_image * new = NULL;
+
+    if (out == NULL || indices == NULL || cost == NULL || lengths == NULL || absolute == NULL) 
+        goto done;
+
+    size_t size = 0;
+
+    for (uint32_t y = 0; y < height; y++)
+    {
+        const uint8_t * row = img->ciPixelArray + (size_t) y * step;
+
+        if (nibbles) {
+            for (uint32_t x = 0; x < width; x++) {
+                indices[x] = (x & 1) ? row[x >> 1] & 0x0F : row[x >> 1] >> 4;
+            }
+        } else {
+            memcpy(indices, row, width);
+        }
+
+        uint32_t nsegments = bmp_rleplan(indices, width, nibbles, mode, cost, lengths, absolute);
+        uint32_t x = 0;
+
+        for (uint32_t k = 0; k < nsegments; k++)
+        {
+            uint32_t n = lengths[k];
+
+            if (!absolute[k]) {
+                out[size++] = n;
+                out[size++] = nibbles 
+                    ? (uint8_t) ((indices[x] << 4) | indices[(n > 1) ? x + 1 : x]) 
+                    : indices[x];
+            } else {
+                out[size++] = 0;
+                out[size++] = n;
+
+                uint32_t bytes = nibbles ? (n + 1) / 2 : n;
+
+                if (nibbles) {
+                    for (uint32_t i = 0; i < bytes; i++) {
+                        uint8_t low = (2*i + 1 < n) ? indices[x + 2*i + 1] : 0;
+                        out[size++] = (uint8_t) ((indices[x + 2*i] << 4) | low);
+                    }
+                } else {
+                    memcpy(out + size, indices + x, n);
+                    size += n;
+                }
+
+                if (bytes & 1) out[size++] = 0;
+            }
+
+            x += n;
+        }
+
+        // end of line, or end of bitmap after the last row
+        out[size++] = 0;
+        out[size++] = (y + 1 < height) ? 0 : 1;
+    }
+
+    if (height == 0) {
+        out[size++] = 0;
+        out[size++] = 1;
+    }
+
+    new = bmp_calloc(sizeof(bmp_image));
+    if (new == NULL) goto done;
+
+    bmp_cpdibs(new, img);
+
+    new->dib.bmiHeader.biCompression = nibbles ? BMP_BI_RLE4 : BMP_BI_RLE8;
+    new->dib.bmiHeader.biSizeImage = size;
+
+    uint32_t palettesize = bmp_getpalettesize(img);
+
+    if (palettesize > 0 && img->dib.bmiColors != NULL)
+    {
+        new->dib.bmiColors = bmp_alloc(palettesize);
+        if (new->dib.bmiColors == NULL) {
+            new = bmp_cleanup(NULL, new);
+            goto done;
+        }
+
+        memcpy(new->dib.bmiColors, img->dib.bmiColors, palettesize);
+    }
+
+    new->fileheader.bfType = BMP_FILETYPE_BM;
+    new->fileheader.bfReserved1 = 0;
+    new->fileheader.bfReserved2 = 0;
+    new->fileheader.bfOffBits = bmp_getheaderssize(new);
+    new->fileheader.bfSize = new->fileheader.bfOffBits + size;
+
+    // hand over an exact-size copy of the stream
+    new->ciPixelArray = bmp_alloc(size);
+    if (new->ciPixelArray == NULL) {
+        new = bmp_cleanup(NULL, new);
+        goto done;
+    }
+
+    memcpy(new->ciPixelArray, out, size);
+
+done:
+    bmp_free(out);
+    bmp_free(indices);
+    bmp_free(cost);
+    bmp_free(lengths);
+    bmp_free(absolute);
+
+    return new;
+}
+
+bmp_image * bmp_rle8encoder(bmp_image * img, bmp_rlemode mode)
+{
+    return bmp_rleencoder(img, mode, 0);
+}
+
+bmp_image * bmp_rle4encoder(bmp_image * img, bmp_rlemode mode)
+{
+    return bmp_rleencoder(img, mode, 1);
+}
+
+int bmp_saverle(bmp_image * img, const char * filename, bmp_rlemode mode)
+{
+    if (img == NULL) return 0;
+
+    bmp_image * encoded = NULL;
+
+    switch (img->dib.bmiHeader.biBitCount)
+    {
+    case BMP_4_BITS:
+        encoded = bmp_rle4encoder(img, mode);
+        break;
+    case BMP_8_BITS:
+        encoded = bmp_rle8encoder(img, mode);
+        break;
+    default:
+        return 0;
+    }
 
-    unsigned char ciPixelArray[] = {
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x09, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 
-        0x11, 0x11, 0x01, 0x19, 0x11, 0x01, 0x10, 0x10, 0x09, 0x09, 0x01, 0x09, 0x11, 0x11, 0x01, 0x90, 
-        0x11, 0x01, 0x19, 0x09, 0x09, 0x91, 0x11, 0x10, 0x09, 0x11, 0x09, 0x11, 0x19, 0x10, 0x90, 0x11, 
-        0x19, 0x01, 0x19, 0x19, 0x10, 0x10, 0x11, 0x10, 0x09, 0x01, 0x91, 0x10, 0x91, 0x09, 0x10, 0x10, 
-        0x11, 0x10, 0x11, 0x91, 0x99, 0x11, 0x09, 0x90, 0x09, 0x91, 0x01, 0x11, 0x11, 0x11, 0x91, 0x10, 
-        0x90, 0x99, 0x11, 0x11, 0x11, 0x11, 0x19, 0x00, 0x09, 0x01, 0x91, 0x01, 0x01, 0x19, 0x00, 0x99, 
-        0x09, 0x19, 0x01, 0x00, 0x11, 0x90, 0x91, 0x10, 0x09, 0x01, 0x11, 0x99, 0x10, 0x01, 0x11, 0x11, 
-        0x91, 0x11, 0x11, 0x19, 0x10, 0x11, 0x99, 0x10, 0x09, 0x10, 0x01, 0x11, 0x11, 0x11, 0x19, 0x10, 
-        0x11, 0x09, 0x09, 0x10, 0x19, 0x10, 0x10, 0x10, 0x09, 0x01, 0x11, 0x19, 0x00, 0x01, 0x10, 0x19, 
-        0x10, 0x11, 0x11, 0x01, 0x99, 0x01, 0x11, 0x90, 0x09, 0x19, 0x11, 0x91, 0x11, 0x91, 0x01, 0x11, 
-        0x19, 0x10, 0x99, 0x00, 0x01, 0x19, 0x09, 0x10, 0x09, 0x19, 0x10, 0x91, 0x11, 0x01, 0x11, 0x11, 
-        0x91, 0x01, 0x91, 0x19, 0x11, 0x00, 0x99, 0x90, 0x09, 0x01, 0x01, 0x99, 0x19, 0x01, 0x91, 0x10, 
-        0x19, 0x91, 0x91, 0x09, 0x11, 0x99, 0x11, 0x10, 0x09, 0x91, 0x11, 0x10, 0x11, 0x91, 0x99, 0x10, 
-        0x90, 0x11, 0x01, 0x11, 0x11, 0x19, 0x11, 0x90, 0x09, 0x11, 0x00, 0x19, 0x10, 0x11, 0x01, 0x11, 
-        0x99, 0x99, 0x99, 0x99, 0x99, 0x99, 0x99, 0x99, 0x09, 0x99, 0x99, 0x99, 0x99, 0x99, 0x99, 0x99, 
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 
-        0x90, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 
-        0x99, 0x11, 0x11, 0x11, 0x19, 0x10, 0x19, 0x19, 0x11, 0x09, 0x10, 0x90, 0x91, 0x90, 0x91, 0x00, 
-        0x91, 0x19, 0x19, 0x09, 0x01, 0x10, 0x09, 0x01, 0x11, 0x11, 0x91, 0x11, 0x11, 0x11, 0x10, 0x00, 
-        0x91, 0x11, 0x01, 0x19, 0x10, 0x11, 0x10, 0x01, 0x01, 0x11, 0x90, 0x11, 0x11, 0x11, 0x91, 0x00, 
-        0x99, 0x09, 0x19, 0x10, 0x11, 0x90, 0x09, 0x90, 0x91, 0x01, 0x19, 0x09, 0x91, 0x11, 0x01, 0x00, 
-        0x90, 0x10, 0x19, 0x11, 0x00, 0x11, 0x11, 0x00, 0x10, 0x11, 0x01, 0x10, 0x11, 0x19, 0x11, 0x00, 
-        0x90, 0x19, 0x10, 0x91, 0x01, 0x90, 0x19, 0x99, 0x00, 0x11, 0x91, 0x01, 0x11, 0x01, 0x91, 0x00, 
-        0x99, 0x09, 0x09, 0x01, 0x10, 0x11, 0x91, 0x01, 0x10, 0x91, 0x99, 0x11, 0x10, 0x90, 0x91, 0x00, 
-        0x91, 0x11, 0x00, 0x10, 0x11, 0x01, 0x10, 0x19, 0x19, 0x09, 0x10, 0x00, 0x99, 0x01, 0x01, 0x00, 
-        0x91, 0x01, 0x19, 0x91, 0x19, 0x91, 0x11, 0x09, 0x10, 0x11, 0x00, 0x91, 0x00, 0x10, 0x90, 0x00, 
-        0x99, 0x01, 0x11, 0x10, 0x09, 0x10, 0x10, 0x19, 0x09, 0x01, 0x91, 0x90, 0x11, 0x09, 0x11, 0x00, 
-        0x90, 0x99, 0x11, 0x11, 0x11, 0x90, 0x19, 0x01, 0x19, 0x01, 0x91, 0x01, 0x01, 0x19, 0x09, 0x00, 
-        0x91, 0x10, 0x11, 0x91, 0x99, 0x09, 0x09, 0x90, 0x11, 0x91, 0x01, 0x19, 0x11, 0x11, 0x91, 0x00, 
-        0x91, 0x19, 0x01, 0x00, 0x11, 0x00, 0x91, 0x10, 0x11, 0x01, 0x11, 0x11, 0x10, 0x01, 0x11, 0x00, 
-        0x99, 0x99, 0x99, 0x99, 0x99, 0x99, 0x99, 0x99, 0x99, 0x99, 0x99, 0x99, 0x99, 0x99, 0x99, 0x90 
-    };
+    if (encoded == NULL) return 0;
 
-    uint32_t datasize = img->dib.bmiHeader.biWidth * img->dib.bmiHeader.biHeight * img->dib.bmiHeader.biBitCount / BMP_8_BITS;
+    int status = bmp_save(encoded, filename);
 
-    img->ciPixelArray = malloc(datasize);
-    
-    for (unsigned int i = 0; i < datasize; i++) {
-        img->ciPixelArray[i] = (uint8_t) ciPixelArray[i];
+    bmp_cleanup(NULL, encoded);
+
+    return status;
+}
+
+bmp_stream * bmp_stream_openread(const char * filename, bmp_roworder order)
+{
+    bmp_stream * stream = bmp_calloc(sizeof(bmp_stream));
+    if (stream == NULL) return NULL;
+
+    stream->fptr = fopen(filename, "r");
+    if (stream->fptr == NULL) {
+        bmp_free(stream);
+        return NULL;
     }
 
-    return img;
+    if (bmp_readheaders(stream->fptr, &stream->header) == 0) {
+        bmp_stream_close(stream);
+        return NULL;
+    }
+
+    // rows can only be addressed individually in uncompressed data
+    switch (stream->header.dib.bmiHeader.biCompression) {
+    case BMP_BI_RGB:
+    case BMP_BI_BITFIELDS:
+    case BMP_BI_ALPHABITFIELDS:
+        break;
+    default:
+        bmp_stream_close(stream);
+        return NULL;
+    }
+
+    stream->rows = bmp_getheight(&stream->header);
+    stream->rowsize = bmp_getrowsize(&stream->header);
+    stream->stride = bmp_getstride(&stream->header);
+    stream->order = order;
+
+    if (fseek(stream->fptr, stream->header.fileheader.bfOffBits, SEEK_SET) != 0) {
+        bmp_stream_close(stream);
+        return NULL;
+    }
+
+    return stream;
 }
 
-bmp_image * bmp_8bpp_sample()
+bmp_stream * bmp_stream_openwrite(const char * filename, bmp_image * header, bmp_roworder order)
 {
-    bmp_image * img = malloc(sizeof(bmp_image));
+    if (header == NULL) return NULL;
 
-    /**
-     * BITMAPINFOHEADER 
-     * - only format supported until this release
-     */
-    img->dib.bmiHeader.biSize = 40;
-    img->dib.bmiHeader.biWidth = 256;
-    img->dib.bmiHeader.biHeight = 256;
-    img->dib.bmiHeader.biPlanes = 1;
-    img->dib.bmiHeader.biBitCount = BMP_8_BITS;
-    img->dib.bmiHeader.biCompression = BMP_BI_RGB;
-    img->dib.bmiHeader.biSizeImage = 0;
-    img->dib.bmiHeader.biXPelsPerMeter = 0;
-    img->dib.bmiHeader.biYPelsPerMeter = 0;
-    img->dib.bmiHeader.biClrUsed = 0;
-    img->dib.bmiHeader.biClrImportant = 0;
+    bmp_stream * stream = bmp_calloc(sizeof(bmp_stream));
+    if (stream == NULL) return NULL;
 
-    /**
-     * BITMAPFILEHEADER
-     * - use BITMAPINFOHEADER data to build it
-     * - size of colour palette is set to maximum if 'biClrUsed' is zero
-     *   according to 'biBitCount'
-     */    
-    uint32_t colourpalettesize = pow(2,img->dib.bmiHeader.biBitCount) 
-                    * sizeof(bmp_rgbquad);
-    
-    uint32_t datasize = img->dib.bmiHeader.biWidth 
-                    * img->dib.bmiHeader.biHeight 
-                    * img->dib.bmiHeader.biBitCount / BMP_8_BITS;
+    stream->writing = 1;
+    stream->order = order;
 
-    img->fileheader.bfType = BMP_FILETYPE_BM;
-    img->fileheader.bfSize = BMP_FILEHEADER_SIZE 
-                    + img->dib.bmiHeader.biSize 
-                    + colourpalettesize 
-                    + datasize;
-    
-    img->fileheader.bfReserved1 = 0;
-    img->fileheader.bfReserved2 = 0;
-    
-    img->fileheader.bfOffBits = BMP_FILEHEADER_SIZE 
-                    + img->dib.bmiHeader.biSize 
-                    + colourpalettesize;
+    stream->header.fileheader = header->fileheader;
+    bmp_cpdibs(&stream->header, header);
+    stream->header.dib.bmiColors = header->dib.bmiColors;
 
-    /**
-     * COLOUR PALETTE
-     * - images with 1bpp, 2bpp, 4bpp and 8bpp implement this field 
-     */
-    img->dib.bmiColors = malloc(colourpalettesize);
+    stream->rows = bmp_getheight(&stream->header);
+    stream->rowsize = bmp_getrowsize(&stream->header);
+    stream->stride = bmp_getstride(&stream->header);
 
-    for (size_t i = 0; i < pow(2,img->dib.bmiHeader.biBitCount); i++) {
-        img->dib.bmiColors[i].rgbBlue = i;
-        img->dib.bmiColors[i].rgbGreen = i;
-        img->dib.bmiColors[i].rgbRed = i;
-        img->dib.bmiColors[i].rgbReserved = 0;
+    uint32_t palettesize = (header->dib.bmiColors != NULL) 
+                    ? bmp_getpalettesize(&stream->header) : 0;
+
+    stream->header.fileheader.bfType = BMP_FILETYPE_BM;
+    stream->header.fileheader.bfOffBits = BMP_FILEHEADER_SIZE 
+                    + stream->header.dib.bmiHeader.biSize 
+                    + palettesize;
+    stream->header.dib.bmiHeader.biSizeImage = stream->stride * stream->rows;
+    stream->header.fileheader.bfSize = stream->header.fileheader.bfOffBits 
+                    + stream->header.dib.bmiHeader.biSizeImage;
+
+    stream->fptr = fopen(filename, "w");
+    if (stream->fptr == NULL) {
+        bmp_free(stream);
+        return NULL;
     }
 
-    /**
-     * PIXEL ARRAY
-     * - raw data of the image
-     */
-    img->ciPixelArray = malloc(datasize);
+    if (bmp_writeheaders(stream->fptr, &stream->header) == 0) {
+        fclose(stream->fptr);
+        bmp_free(stream);
+        return NULL;
+    }
 
-    uint32_t newline = 0;
+    // the palette belongs to the caller, it is not needed anymore
+    stream->header.dib.bmiColors = NULL;
 
-    for (size_t i = 0; i < datasize; i++) {
-        if (newline >= img->dib.bmiHeader.biWidth) {
-            newline = 0;
-        }
-        img->ciPixelArray[i] = newline;
-        newline++;
+    return stream;
+}
+
+static int bmp_stream_reversed(bmp_stream * stream)
+{
+    int32_t height = stream->header.dib.bmiHeader.biHeight;
+
+    return (stream->order == BMP_ROWORDER_TOPDOWN && height > 0)
+        || (stream->order == BMP_ROWORDER_BOTTOMUP && height < 0);
+}
+
+/**
+ * Position the file on the next row, only needed when the caller walks the
+ * rows against the storage order.
+ */
+static int bmp_stream_seekrow(bmp_stream * stream)
+{
+    if (!bmp_stream_reversed(stream)) return 1;
+
+    uint32_t filerow = stream->rows - 1 - stream->row;
+    long offset = stream->header.fileheader.bfOffBits 
+                    + (long) filerow * stream->stride;
+
+    return fseek(stream->fptr, offset, SEEK_SET) == 0;
+}
+
+uint32_t bmp_stream_readrows(bmp_stream * stream, uint8_t * rows, uint32_t nrows)
+{
+    if (stream == NULL || stream->writing) return 0;
+
+    uint8_t pad[4];
+    uint32_t padsize = stream->stride - stream->rowsize;
+    uint32_t done = 0;
+
+    while (done < nrows && stream->row < stream->rows)
+    {
+        if (bmp_stream_seekrow(stream) == 0) break;
+
+        uint8_t * row = rows + (size_t) done * stream->rowsize;
+
+        if (fread(row, 1, stream->rowsize, stream->fptr) != stream->rowsize) break;
+        if (padsize > 0 && fread(pad, 1, padsize, stream->fptr) != padsize) break;
+
+        stream->row++;
+        done++;
     }
 
-    return img;
+    return done;
 }
 
-bmp_image * bmp_16bpp_sample()
+uint32_t bmp_stream_writerows(bmp_stream * stream, const uint8_t * rows, uint32_t nrows)
 {
-    bmp_image * img = malloc(sizeof(bmp_image));
+    if (stream == NULL || !stream->writing) return 0;
 
-    /**
-     * BITMAPINFOHEADER 
-     * - only format supported until this release
-     */
-    img->dib.bmiHeader.biSize = 40;
-    img->dib.bmiHeader.biWidth = pow(2,5);
-    img->dib.bmiHeader.biHeight = pow(2,5);
-    img->dib.bmiHeader.biPlanes = 1;
-    img->dib.bmiHeader.biBitCount = BMP_16_BITS;
-    img->dib.bmiHeader.biCompression = BMP_BI_RGB;
-    img->dib.bmiHeader.biSizeImage = 0;
-    img->dib.bmiHeader.biXPelsPerMeter = 0;
-    img->dib.bmiHeader.biYPelsPerMeter = 0;
-    img->dib.bmiHeader.biClrUsed = 0;
-    img->dib.bmiHeader.biClrImportant = 0;
+    const uint8_t pad[4] = {0, 0, 0, 0};
+    uint32_t padsize = stream->stride - stream->rowsize;
+    uint32_t done = 0;
 
-    /**
-     * BITMAPFILEHEADER
-     * - use BITMAPINFOHEADER data to build it
-     * - 16bpp with BI_RGB compression have no bmiColors member
-     */    
-    uint32_t colourpalettesize = 0;
-    
-    uint32_t datasize = img->dib.bmiHeader.biWidth 
-                    * img->dib.bmiHeader.biHeight 
-                    * img->dib.bmiHeader.biBitCount / BMP_8_BITS;
+    while (done < nrows && stream->row < stream->rows)
+    {
+        if (bmp_stream_seekrow(stream) == 0) break;
 
-    img->fileheader.bfType = BMP_FILETYPE_BM;
-    img->fileheader.bfSize = BMP_FILEHEADER_SIZE 
-                    + img->dib.bmiHeader.biSize 
-                    + colourpalettesize 
-                    + datasize;
-    
-    img->fileheader.bfReserved1 = 0;
-    img->fileheader.bfReserved2 = 0;
-    
-    img->fileheader.bfOffBits = BMP_FILEHEADER_SIZE 
-                    + img->dib.bmiHeader.biSize 
-                    + colourpalettesize;
-    
-    /**
-     * PIXEL ARRAY
-     * - raw data of the image
-     */
-    img->ciPixelArray = malloc(datasize);
+        const uint8_t * row = rows + (size_t) done * stream->rowsize;
 
-    uint16_t * raw = (uint16_t *) img->ciPixelArray;
+        if (fwrite(row, 1, stream->rowsize, stream->fptr) != stream->rowsize) break;
+        if (padsize > 0 && fwrite(pad, 1, padsize, stream->fptr) != padsize) break;
 
-    for (uint16_t x = 0; x < img->dib.bmiHeader.biWidth; x++)
+        stream->row++;
+        done++;
+    }
+
+    return done;
+}
+
+void bmp_stream_bind(bmp_stream * stream, bmp_image * view, uint8_t * rows, uint32_t nrows)
+{
+    memset(view, 0, sizeof(bmp_image));
+
+    view->fileheader = stream->header.fileheader;
+    view->dib = stream->header.dib;
+    view->dib.bmiHeader.biHeight = nrows;
+    view->dib.bmiHeader.biSizeImage = nrows * stream->stride;
+    view->fileheader.bfSize = view->fileheader.bfOffBits 
+                    + view->dib.bmiHeader.biSizeImage;
+    view->ciPixelArray = rows;
+}
+
+int bmp_stream_close(bmp_stream * stream)
+{
+    if (stream == NULL) return 0;
+
+    int status = 1;
+
+    if (stream->writing)
     {
-        for (uint16_t y = 0; y < img->dib.bmiHeader.biHeight; y++)
+        /**
+         * Rows written in storage order can stop short of the declared 
+         * height, in that case the headers shrink to what was written.
+         */
+        if (stream->row < stream->rows && 
+            (!bmp_stream_reversed(stream) || stream->row == 0))
         {
-            raw[y * img->dib.bmiHeader.biWidth + x] = x + (y << 10);
+            int32_t height = stream->header.dib.bmiHeader.biHeight;
+            stream->header.dib.bmiHeader.biHeight = (height < 0) 
+                    ? -(int32_t) stream->row : (int32_t) stream->row;
+            stream->rows = stream->row;
         }
+
+        stream->header.dib.bmiHeader.biSizeImage = stream->stride * stream->rows;
+        stream->header.fileheader.bfSize = stream->header.fileheader.bfOffBits 
+                    + stream->header.dib.bmiHeader.biSizeImage;
+
+        if (fseek(stream->fptr, 0, SEEK_SET) != 0) status = 0;
+        else if (fwrite(&stream->header.fileheader, sizeof(bmp_fileheader), 1, stream->fptr) != 1) status = 0;
+        else if (fwrite(&stream->header.dib.bmiHeader, sizeof(bmp_infoheader), 1, stream->fptr) != 1) status = 0;
+    }
+    else
+    {
+        bmp_release(&stream->header, stream->header.dib.bmiColors);
     }
 
-    return img;
-}
+    if (stream->fptr != NULL && fclose(stream->fptr) != 0) status = 0;
 
-bmp_image * bmp_32bpp_sample()
-{
-    bmp_image * img = malloc(sizeof(bmp_image));
+    bmp_free(stream);
 
-    /**
-     * BITMAPINFOHEADER 
-     * - only format supported until this release
-     */
-    img->dib.bmiHeader.biSize = 40;
-    img->dib.bmiHeader.biWidth = pow(2,8);
-    img->dib.bmiHeader.biHeight = pow(2,8);
-    img->dib.bmiHeader.biPlanes = 1;
-    img->dib.bmiHeader.biBitCount = BMP_32_BITS;
-    img->dib.bmiHeader.biCompression = BMP_BI_RGB;
-    img->dib.bmiHeader.biSizeImage = 0;
-    img->dib.bmiHeader.biXPelsPerMeter = 0;
-    img->dib.bmiHeader.biYPelsPerMeter = 0;
-    img->dib.bmiHeader.biClrUsed = 0;
-    img->dib.bmiHeader.biClrImportant = 0;
+    return status;
+}
 
-    /**
-     * BITMAPFILEHEADER
-     * - use BITMAPINFOHEADER data to build it
-     * - 32bpp with BI_RGB compression have no bmiColors member
-     */    
-    uint32_t colourpalettesize = 0;
-    
-    uint32_t datasize = img->dib.bmiHeader.biWidth 
-                    * img->dib.bmiHeader.biHeight 
-                    * img->dib.bmiHeader.biBitCount / BMP_8_BITS;
+typedef struct bmp_job {
+    bmp_task task;
+    void * arg;
+    atomic_uint pending;    // bands not finished yet
+} bmp_job;
 
-    img->fileheader.bfType = BMP_FILETYPE_BM;
-    img->fileheader.bfSize = BMP_FILEHEADER_SIZE 
-                    + img->dib.bmiHeader.biSize 
-                    + colourpalettesize 
-                    + datasize;
-    
-    img->fileheader.bfReserved1 = 0;
-    img->fileheader.bfReserved2 = 0;
-    
-    img->fileheader.bfOffBits = BMP_FILEHEADER_SIZE 
-                    + img->dib.bmiHeader.biSize 
-                    + colourpalettesize;
-    
-    /**
-     * PIXEL ARRAY
-     * - raw data of the image
-     */
-    img->ciPixelArray = malloc(datasize);
+typedef struct bmp_band {
+    bmp_job * job;
+    uint32_t begin;
+    uint32_t end;
+} bmp_band;
 
-    uint32_t * raw = (uint32_t *) img->ciPixelArray;
+/**
+ * Each worker owns a deque: it pops its own bands from the tail (the most
+ * recently queued, still warm in cache) while idle threads steal from the
+ * head.
+ */
+typedef struct bmp_deque {
+    pthread_mutex_t lock;
+    bmp_band * bands;
+    uint32_t capacity;
+    uint32_t head;
+    uint32_t tail;
+} bmp_deque;
+
+static struct {
+    pthread_mutex_t lock;   // guards the pool setup and the conditions
+    pthread_cond_t wake;    // workers sleep here while nothing is queued
+    pthread_cond_t done;    // submitters sleep here until their job ends
+    pthread_cond_t idle;    // reconfigurations wait here for the jobs to end
+    pthread_t * workers;
+    bmp_deque * deques;     // one per worker
+    uint32_t nworkers;      // threads besides the submitting one
+    uint32_t nthreads;      // 0 until the pool is first used
+    uint32_t active;        // jobs submitted and not over yet
+    atomic_uint queued;     // bands waiting in all deques
+    atomic_uint next;       // deque receiving the next submission
+    int stopping;
+    int reconfiguring;      // new jobs wait until bmp_set_threads() is done
+} bmp_pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+    .idle = PTHREAD_COND_INITIALIZER
+};
+
+// set on pool threads and on submitters while their job runs, so nested calls run inline
+static _Thread_local int bmp_inworker = 0;
+
+static int bmp_pushband(bmp_deque * deque, bmp_band band)
+{
+    pthread_mutex_lock(&deque->lock);
 
-    for (uint32_t x = 0; x < img->dib.bmiHeader.biWidth; x++)
+    if (deque->tail == deque->capacity)
     {
-        for (uint32_t y = 0; y < img->dib.bmiHeader.biHeight; y++)
-        {
-            raw[y * img->dib.bmiHeader.biWidth + x] = x  + (y << 8);
+        // reclaim the slots already stolen before growing
+        if (deque->head > 0) {
+            memmove(deque->bands, deque->bands + deque->head, 
+                    (deque->tail - deque->head) * sizeof(bmp_band));
+            deque->tail -= deque->head;
+            deque->head = 0;
+        } else {
+            uint32_t capacity = deque->capacity ? 2*deque->capacity : 64;
+            bmp_band * bands = realloc(deque->bands, capacity * sizeof(bmp_band));
+
+            if (bands == NULL) {
+                pthread_mutex_unlock(&deque->lock);
+                return 0;
+            }
+
+            deque->bands = bands;
+            deque->capacity = capacity;
         }
     }
 
-    return img;
+    deque->bands[deque->tail++] = band;
+
+    pthread_mutex_unlock(&deque->lock);
+
+    return 1;
 }
 
-uint32_t bmp_getfilesize(bmp_image * img)
+static int bmp_popband(bmp_deque * deque, bmp_band * band, int steal)
 {
-    return img->fileheader.bfSize;
+    int found = 0;
+
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->head < deque->tail) {
+        *band = steal ? deque->bands[deque->head++] : deque->bands[--deque->tail];
+        found = 1;
+    }
+
+    if (deque->head == deque->tail) deque->head = deque->tail = 0;
+
+    pthread_mutex_unlock(&deque->lock);
+
+    return found;
 }
 
-uint32_t bmp_getoffset(bmp_image * img)
+/**
+ * Take a band from the deque of worker <self> or, failing that, steal one
+ * from the others. Submitting threads pass <self> == nworkers: they own no
+ * deque and only steal.
+ */
+static int bmp_takeband(uint32_t self, bmp_band * band)
 {
-    return img->fileheader.bfOffBits;
+    if (atomic_load(&bmp_pool.queued) == 0) return 0;
+
+    if (self < bmp_pool.nworkers && bmp_popband(&bmp_pool.deques[self], band, 0)) {
+        atomic_fetch_sub(&bmp_pool.queued, 1);
+        return 1;
+    }
+
+    for (uint32_t k = 1; k <= bmp_pool.nworkers; k++)
+    {
+        uint32_t victim = (self + k) % bmp_pool.nworkers;
+
+        if (bmp_popband(&bmp_pool.deques[victim], band, 1)) {
+            atomic_fetch_sub(&bmp_pool.queued, 1);
+            return 1;
+        }
+    }
+
+    return 0;
 }
 
-uint32_t bmp_getdatasize(bmp_image * img)
+static void bmp_runband(bmp_band * band)
 {
-    return img->fileheader.bfSize - img->fileheader.bfOffBits;
+    bmp_job * job = band->job;
+
+    job->task(job->arg, band->begin, band->end);
+
+    if (atomic_fetch_sub(&job->pending, 1) == 1) {
+        pthread_mutex_lock(&bmp_pool.lock);
+        pthread_cond_broadcast(&bmp_pool.done);
+        pthread_mutex_unlock(&bmp_pool.lock);
+    }
 }
 
-uint32_t bmp_getdibformat(bmp_image * img)
+static void * bmp_worker(void * arg)
 {
-    switch (img->dib.bmiHeader.biSize)
+    uint32_t self = (uint32_t) (uintptr_t) arg;
+    bmp_band band;
+
+    bmp_inworker = 1;
+
+    for (;;)
     {
-    case BMP_INFOHEADER: return BMP_INFOHEADER;
-    case BMP_V4HEADER: return BMP_V4HEADER;
-    case BMP_V5HEADER: return BMP_V5HEADER;
-    default:
-        return BMP_UNKNOWN_HEADER;
+        if (bmp_takeband(self, &band)) {
+            bmp_runband(&band);
+            continue;
+        }
+
+        pthread_mutex_lock(&bmp_pool.lock);
+
+        while (!bmp_pool.stopping && atomic_load(&bmp_pool.queued) == 0)
+            pthread_cond_wait(&bmp_pool.wake, &bmp_pool.lock);
+
+        int stopping = bmp_pool.stopping;
+
+        pthread_mutex_unlock(&bmp_pool.lock);
+
+        if (stopping) break;
     }
-}
 
-uint16_t bmp_getbitcount(bmp_image * img)
-{
-    return img->dib.bmiHeader.biBitCount;
+    return NULL;
 }
 
-uint32_t bmp_getpalettesize(bmp_image * img)
+/**
+ * Join the workers and release the deques, bmp_pool.lock must be held 
+ * (it is released while joining). The pool is left with no helper.
+ */
+static void bmp_stoppool(void)
 {
-    switch (img->dib.bmiHeader.biBitCount)
-    {
-    case BMP_0_BITS:
-    case BMP_1_BIT:
-    case BMP_2_BITS:
-    case BMP_4_BITS:
-    case BMP_8_BITS:
-        if (img->dib.bmiHeader.biClrUsed == 0) {
-            return sizeof(bmp_rgbquad) * pow(2, img->dib.bmiHeader.biBitCount);
-        } else {
-            return sizeof(bmp_rgbquad) * img->dib.bmiHeader.biClrUsed;
+    bmp_pool.stopping = 1;
+    pthread_cond_broadcast(&bmp_pool.wake);
+    pthread_mutex_unlock(&bmp_pool.lock);
+
+    for (uint32_t i = 0; i < bmp_pool.nworkers; i++) {
+        pthread_join(bmp_pool.workers[i], NULL);
+    }
+
+    pthread_mutex_lock(&bmp_pool.lock);
+
+    if (bmp_pool.deques != NULL) {
+        for (uint32_t i = 0; i < bmp_pool.nworkers; i++) {
+            pthread_mutex_destroy(&bmp_pool.deques[i].lock);
+            free(bmp_pool.deques[i].bands);
         }
-        break;
-    case BMP_16_BITS:
-        return sizeof(bmp_rgbquad) * 3;
-        break;
-    case BMP_32_BITS:
-        return sizeof(bmp_rgbquad) * 4;
-        break;
-    case BMP_24_BITS:
-        // never expect color palette
-    default: return 0;
     }
+
+    free(bmp_pool.workers);
+    free(bmp_pool.deques);
+
+    bmp_pool.workers = NULL;
+    bmp_pool.deques = NULL;
+    bmp_pool.nworkers = 0;
+    bmp_pool.nthreads = 1;
+    bmp_pool.stopping = 0;
 }
 
-uint32_t bmp_getcompression(bmp_image * img)
+/**
+ * Start the helper threads for <threads> threads in total, bmp_pool.lock 
+ * must be held. If any of them cannot be set up, the ones already started
+ * are stopped and everything runs on the calling threads.
+ */
+static void bmp_startpool(uint32_t threads)
 {
-    switch (img->dib.bmiHeader.biCompression)
+    if (threads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (online > 0) ? (uint32_t) online : 1;
+    }
+
+    bmp_pool.nthreads = 1;
+    bmp_pool.nworkers = 0;
+    bmp_pool.stopping = 0;
+
+    if (threads == 1) return;
+
+    bmp_pool.workers = calloc(threads - 1, sizeof(pthread_t));
+    bmp_pool.deques = calloc(threads - 1, sizeof(bmp_deque));
+
+    if (bmp_pool.workers == NULL || bmp_pool.deques == NULL) {
+        bmp_stoppool();
+        return;
+    }
+
+    for (uint32_t i = 0; i < threads - 1; i++)
     {
-    case BMP_BI_RGB: return BMP_BI_RGB;
-    case BMP_BI_RLE8: return BMP_BI_RLE8;
-    case BMP_BI_RLE4: return BMP_BI_RLE4;
-    case BMP_BI_BITFIELDS: return BMP_BI_BITFIELDS;
-    case BMP_BI_JPEG: return BMP_BI_JPEG;
-    case BMP_BI_PNG: return BMP_BI_PNG;
-    case BMP_BI_ALPHABITFIELDS: return BMP_BI_ALPHABITFIELDS;
-    case BMP_BI_CMYK: return BMP_BI_CMYK;
-    case BMP_BI_CMYKRLE8: return BMP_BI_CMYKRLE8;
-    case BMP_BI_CMYKRLE4: return BMP_BI_CMYKRLE4;
-    default:
-        return BMP_UNKNOWN_COMPRESSION;
+        // the deque of a worker exists before it can be stolen from
+        if (pthread_mutex_init(&bmp_pool.deques[i].lock, NULL) != 0) break;
+
+        if (pthread_create(&bmp_pool.workers[i], NULL, bmp_worker, (void *) (uintptr_t) i) != 0) {
+            pthread_mutex_destroy(&bmp_pool.deques[i].lock);
+            break;
+        }
+
+        bmp_pool.nworkers++;
+    }
+
+    if (bmp_pool.nworkers < threads - 1) {
+        bmp_stoppool();
+        return;
     }
+
+    bmp_pool.nthreads = threads;
 }
 
-uint32_t bmp_getnpixels(bmp_image * img)
+void bmp_set_threads(uint32_t threads)
 {
-    return img->dib.bmiHeader.biWidth * img->dib.bmiHeader.biHeight;
+    pthread_mutex_lock(&bmp_pool.lock);
+
+    // one reconfiguration at a time, once the running jobs are over
+    while (bmp_pool.reconfiguring) pthread_cond_wait(&bmp_pool.idle, &bmp_pool.lock);
+    bmp_pool.reconfiguring = 1;
+
+    while (bmp_pool.active > 0) pthread_cond_wait(&bmp_pool.idle, &bmp_pool.lock);
+
+    if (bmp_pool.nthreads != 0) bmp_stoppool();
+    bmp_startpool(threads);
+
+    bmp_pool.reconfiguring = 0;
+    pthread_cond_broadcast(&bmp_pool.idle);
+
+    pthread_mutex_unlock(&bmp_pool.lock);
 }
 
-uint32_t bmp_getncolors(bmp_image * img)
+/**
+ * Wait for any reconfiguration to end and start the pool on first use, 
+ * bmp_pool.lock must be held. The start counts as a reconfiguration, as
+ * bmp_startpool() may release the lock to unwind.
+ */
+static void bmp_readypool(void)
 {
-    switch (img->dib.bmiHeader.biBitCount)
-    {
-    case BMP_0_BITS:
-    case BMP_1_BIT:
-    case BMP_2_BITS:
-    case BMP_4_BITS:
-    case BMP_8_BITS:
-        if (img->dib.bmiHeader.biClrUsed == 0) {
-            return pow(2, img->dib.bmiHeader.biBitCount);
-        } else {
-            return img->dib.bmiHeader.biClrUsed;
-        }
-        break;
-    case BMP_16_BITS:
-        return 3;
-        break;
-    case BMP_32_BITS:
-        return 4;
-        break;
-    case BMP_24_BITS:
-        // never expect color palette
-    default: return 0;
+    while (bmp_pool.reconfiguring) pthread_cond_wait(&bmp_pool.idle, &bmp_pool.lock);
+
+    if (bmp_pool.nthreads == 0) {
+        bmp_pool.reconfiguring = 1;
+        bmp_startpool(0);
+        bmp_pool.reconfiguring = 0;
+        pthread_cond_broadcast(&bmp_pool.idle);
     }
 }
 
-void bmp_cpdibs(bmp_image * new, bmp_image * img)
+uint32_t bmp_get_threads(void)
 {
-    if (new == NULL) return;
-    if (img == NULL) return;
+    pthread_mutex_lock(&bmp_pool.lock);
 
-    new->dib.bmiHeader.biSize = img->dib.bmiHeader.biSize;
-    new->dib.bmiHeader.biWidth = img->dib.bmiHeader.biWidth;
-    new->dib.bmiHeader.biHeight = img->dib.bmiHeader.biHeight;
-    new->dib.bmiHeader.biPlanes = img->dib.bmiHeader.biPlanes;
-    new->dib.bmiHeader.biBitCount = img->dib.bmiHeader.biBitCount;
-    new->dib.bmiHeader.biCompression = img->dib.bmiHeader.biCompression;
-    new->dib.bmiHeader.biXPelsPerMeter = img->dib.bmiHeader.biXPelsPerMeter;
-    new->dib.bmiHeader.biYPelsPerMeter = img->dib.bmiHeader.biYPelsPerMeter;
-    new->dib.bmiHeader.biClrUsed = img->dib.bmiHeader.biClrUsed;
-    new->dib.bmiHeader.biClrImportant = img->dib.bmiHeader.biClrImportant;
+    bmp_readypool();
+    uint32_t threads = bmp_pool.nthreads;
 
-    if (new->dib.bmiHeader.biSize >= BMP_V4HEADER)
-    {
-        new->dib.bmiv4Header.bV4RedMask = img->dib.bmiv4Header.bV4RedMask;
-        new->dib.bmiv4Header.bV4GreenMask = img->dib.bmiv4Header.bV4GreenMask;
-        new->dib.bmiv4Header.bV4BlueMask = img->dib.bmiv4Header.bV4BlueMask;
-        new->dib.bmiv4Header.bV4AlphaMask = img->dib.bmiv4Header.bV4AlphaMask;
-        new->dib.bmiv4Header.bV4CSType = img->dib.bmiv4Header.bV4CSType;
-        new->dib.bmiv4Header.bV4Endpoints.ciexyzRed.ciexyzX = img->dib.bmiv4Header.bV4Endpoints.ciexyzRed.ciexyzX;
-        new->dib.bmiv4Header.bV4Endpoints.ciexyzRed.ciexyzY = img->dib.bmiv4Header.bV4Endpoints.ciexyzRed.ciexyzY;
-        new->dib.bmiv4Header.bV4Endpoints.ciexyzRed.ciexyzZ = img->dib.bmiv4Header.bV4Endpoints.ciexyzRed.ciexyzZ;
-        new->dib.bmiv4Header.bV4Endpoints.ciexyzGreen.ciexyzX = img->dib.bmiv4Header.bV4Endpoints.ciexyzGreen.ciexyzX;
-        new->dib.bmiv4Header.bV4Endpoints.ciexyzGreen.ciexyzY = img->dib.bmiv4Header.bV4Endpoints.ciexyzGreen.ciexyzY;
-        new->dib.bmiv4Header.bV4Endpoints.ciexyzGreen.ciexyzZ = img->dib.bmiv4Header.bV4Endpoints.ciexyzGreen.ciexyzZ;
-        new->dib.bmiv4Header.bV4Endpoints.ciexyzBlue.ciexyzX = img->dib.bmiv4Header.bV4Endpoints.ciexyzBlue.ciexyzX;
-        new->dib.bmiv4Header.bV4Endpoints.ciexyzBlue.ciexyzY = img->dib.bmiv4Header.bV4Endpoints.ciexyzBlue.ciexyzY;
-        new->dib.bmiv4Header.bV4Endpoints.ciexyzBlue.ciexyzZ = img->dib.bmiv4Header.bV4Endpoints.ciexyzBlue.ciexyzZ;
-        new->dib.bmiv4Header.bV4GammaRed = img->dib.bmiv4Header.bV4GammaRed;
-        new->dib.bmiv4Header.bV4GammaGreen = img->dib.bmiv4Header.bV4GammaGreen;
-        new->dib.bmiv4Header.bV4GammaBlue = img->dib.bmiv4Header.bV4GammaBlue;
-    }
+    pthread_mutex_unlock(&bmp_pool.lock);
 
-    if (new->dib.bmiHeader.biSize >= BMP_V5HEADER)
-    {
-        new->dib.bmiv5Header.bV5Intent = img->dib.bmiv5Header.bV5Intent;
-        new->dib.bmiv5Header.bV5ProfileData = img->dib.bmiv5Header.bV5ProfileData;
-        new->dib.bmiv5Header.bV5ProfileSize = img->dib.bmiv5Header.bV5ProfileSize;
-        new->dib.bmiv5Header.bV5Reserved = img->dib.bmiv5Header.bV5Reserved;
-    }
+    return threads;
 }
 
-bmp_image * bmp_rle8decoder(bmp_image * img)
+/**
+ * Register a job about to use the helper threads, starting them on first 
+ * use, and return how many threads it may use. With a single thread 
+ * nothing is registered.
+ */
+static uint32_t bmp_enterpool(void)
 {
-    if (img == NULL) return NULL;
-    if (bmp_getcompression(img) != BMP_BI_RLE8) return NULL;
+    pthread_mutex_lock(&bmp_pool.lock);
 
-    bmp_image * new = malloc(sizeof(bmp_image));
+    bmp_readypool();
+    uint32_t threads = bmp_pool.nthreads;
+    if (threads > 1) bmp_pool.active++;
 
-    bmp_cpdibs(new, img);
-    
-    new->dib.bmiHeader.biSize = BMP_INFOHEADER;
-    new->dib.bmiHeader.biCompression = BMP_BI_RGB;
-    new->dib.bmiHeader.biSizeImage = new->dib.bmiHeader.biWidth
-                    * new->dib.bmiHeader.biHeight
-                    * new->dib.bmiHeader.biBitCount / BMP_8_BITS;
-    
-    new->dib.bmiHeader.biClrUsed = 0;
-    new->dib.bmiHeader.biClrImportant = 0;
+    pthread_mutex_unlock(&bmp_pool.lock);
 
-    uint32_t palettesize = bmp_getpalettesize(img);
-    
-    new->fileheader.bfType = BMP_FILETYPE_BM;
-    new->fileheader.bfSize = BMP_FILEHEADER_SIZE 
-                    + new->dib.bmiHeader.biSize 
-                    + palettesize 
-                    + new->dib.bmiHeader.biSizeImage;
-    
-    new->fileheader.bfReserved1 = 0;
-    new->fileheader.bfReserved2 = 0;
-    
-    new->fileheader.bfOffBits = BMP_FILEHEADER_SIZE 
-                    + new->dib.bmiHeader.biSize 
-                    + palettesize;
+    return threads;
+}
 
-    if (palettesize > 0)
-    {
-        new->dib.bmiColors = malloc(palettesize);
-        
-        uint8_t * ncptr = (uint8_t *) new->dib.bmiColors;
-        uint8_t * icptr = (uint8_t *) img->dib.bmiColors;
+static void bmp_leavepool(void)
+{
+    pthread_mutex_lock(&bmp_pool.lock);
 
-        for (uint32_t i = 0; i < palettesize; i++) {
-            ncptr[i] = icptr[i];
-        }
+    if (--bmp_pool.active == 0) pthread_cond_broadcast(&bmp_pool.idle);
+
+    pthread_mutex_unlock(&bmp_pool.lock);
+}
+
+uint32_t bmp_rowgrain(size_t rowbytes)
+{
+    if (rowbytes == 0 || rowbytes >= BMP_PARALLEL_MINBYTES) return 1;
+    return BMP_PARALLEL_MINBYTES / rowbytes;
+}
+
+void bmp_parallel_rows(uint32_t rows, uint32_t grain, bmp_task task, void * arg)
+{
+    if (rows == 0) return;
+    if (grain == 0) grain = 1;
+
+    if (bmp_inworker || rows <= grain) {
+        task(arg, 0, rows);
+        return;
     }
 
-    uint32_t datasize = bmp_getdatasize(img);
-    
-    bmp_rle8duo * duos = malloc(sizeof(bmp_rle8duo)*datasize/2);
-    
-    for (uint32_t i = 0; i < datasize/2; i++)
+    uint32_t threads = bmp_enterpool();
+
+    if (threads <= 1) {
+        task(arg, 0, rows);
+        return;
+    }
+
+    bmp_inworker = 1;
+
+    uint32_t nbands = (rows + grain - 1) / grain;
+    if (nbands > threads * BMP_PARALLEL_BANDS) nbands = threads * BMP_PARALLEL_BANDS;
+
+    uint32_t bandsize = (rows + nbands - 1) / nbands;
+    nbands = (rows + bandsize - 1) / bandsize;
+
+    bmp_job job;
+    job.task = task;
+    job.arg = arg;
+    atomic_init(&job.pending, nbands);
+
+    /**
+     * Neighbouring bands go to the same deque, so each worker starts on a
+     * contiguous stretch of the image. Bands that cannot be queued run 
+     * right here.
+     */
+    uint32_t first = atomic_fetch_add(&bmp_pool.next, 1);
+    uint32_t perdeque = (nbands + bmp_pool.nworkers - 1) / bmp_pool.nworkers;
+    uint32_t queued = 0;
+
+    for (uint32_t i = 0; i < nbands; i++)
     {
-        duos[i].count = img->ciPixelArray[2*i+0];
-        duos[i].value = img->ciPixelArray[2*i+1];
+        bmp_band band = { &job, i * bandsize, (i + 1) * bandsize };
+        if (band.end > rows) band.end = rows;
+
+        bmp_deque * deque = &bmp_pool.deques[(first + i / perdeque) % bmp_pool.nworkers];
+
+        if (bmp_pushband(deque, band)) queued++;
+        else bmp_runband(&band);
     }
-    
-    new->ciPixelArray = malloc(new->dib.bmiHeader.biSizeImage);
-    
-    uint32_t index = 0;
-    
-    for (uint32_t pixel = 0; pixel < new->dib.bmiHeader.biSizeImage;)
+
+    atomic_fetch_add(&bmp_pool.queued, queued);
+
+    pthread_mutex_lock(&bmp_pool.lock);
+    pthread_cond_broadcast(&bmp_pool.wake);
+    pthread_mutex_unlock(&bmp_pool.lock);
+
+    // help out instead of sleeping while there is anything to steal
+    while (atomic_load(&job.pending) > 0)
     {
-        if (duos[index+1].count == 0)
-        {
-            if (duos[index+1].value == 1) break;
-            if (duos[index+1].value == 0) {
-                if (duos[index].count > 0) duos[index].count -= 1;
-            }
-        }
+        bmp_band band;
 
-        while (duos[index].count > 0)
-        {
-            new->ciPixelArray[pixel] = duos[index].value;
-            pixel += 1; 
-            duos[index].count -= 1;
+        if (bmp_takeband(bmp_pool.nworkers, &band)) {
+            bmp_runband(&band);
+            continue;
         }
 
-        index = index + 1;
+        pthread_mutex_lock(&bmp_pool.lock);
+        while (atomic_load(&job.pending) > 0 && atomic_load(&bmp_pool.queued) == 0)
+            pthread_cond_wait(&bmp_pool.done, &bmp_pool.lock);
+        pthread_mutex_unlock(&bmp_pool.lock);
     }
 
-    free(duos);
-
-    return new;
-}
\ No newline at end of file
+    bmp_inworker = 0;
+    bmp_leavepool();
+}
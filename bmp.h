@@ -30,6 +30,25 @@
 
 #define BMP_FILEHEADER_SIZE 14
 
+// rows handed to each writev() call by bmp_save()
+#define BMP_SAVE_IOVROWS 256
+
+// largest kernel side taken by the convolution functions
+#define BMP_CONV_MAXSIZE 31
+
+// fractional bits kept between the two passes of a separable convolution
+#define BMP_CONV_INTERBITS 6
+
+// largest radius of bmp_median(), whose window counts must fit 16 bits
+#define BMP_MEDIAN_MAXRADIUS 127
+
+// fractional bits of the resize coefficients
+#define BMP_RESIZE_SHIFT 14
+
+// fractional bits of the factors reading bit fields as bytes
+#define BMP_BITFIELD_SHIFT 16
+#define BMP_BITFIELD_ROUND (1 << (BMP_BITFIELD_SHIFT - 1))
+
 // 16bpp bit masks ========================================
 #define BMP_BITFIELDS_R5G5B5_R5 0x7C00
 #define BMP_BITFIELDS_R5G5B5_G5 0x03E0
@@ -55,6 +74,16 @@
 #define BMP_ALPHABITFIELDS_R8G7B9A5_B9 0x000001FF
 #define BMP_ALPHABITFIELDS_R8G7B9A5_A5 0x1F000000
 
+// gray-scale weights ======================================
+// BT.601 luma in Q15 fixed point, the weights add up to exactly 1 << 15 so
+// gray inputs map to themselves. Results are rounded half up:
+// gray = (R*W_RED + G*W_GREEN + B*W_BLUE + ROUND) >> SHIFT
+#define BMP_GRAY_WEIGHT_RED 9798
+#define BMP_GRAY_WEIGHT_GREEN 19235
+#define BMP_GRAY_WEIGHT_BLUE 3735
+#define BMP_GRAY_SHIFT 15
+#define BMP_GRAY_ROUND (1 << (BMP_GRAY_SHIFT - 1))
+
 #pragma pack(1)
 
 /* Enumerations ---------------------------------------------------------------*/
@@ -109,11 +138,48 @@ typedef enum bmp_setncolours {
     BMP_SET_2_COLOURS = 2
 } bmp_setncolours;
 
+// how pixels outside the image are seen, e.g. for "abcd" extended by 3
 typedef enum bmp_padtype {
-    BMP_PADTYPE_ZEROS,
-    BMP_PADTYPE_REPLICATE
+    BMP_PADTYPE_ZEROS,      // 000|abcd|000
+    BMP_PADTYPE_REPLICATE,  // aaa|abcd|ddd
+    BMP_PADTYPE_REFLECT,    // dcb|abcd|cba
+    BMP_PADTYPE_WRAP        // bcd|abcd|abc
 } bmp_padtype;
 
+typedef enum bmp_morphop {
+    BMP_MORPH_ERODE,
+    BMP_MORPH_DILATE,
+    BMP_MORPH_OPEN,         // erosion then dilation
+    BMP_MORPH_CLOSE,        // dilation then erosion
+    BMP_MORPH_TOPHAT,       // image minus its opening
+    BMP_MORPH_BLACKHAT      // closing minus the image
+} bmp_morphop;
+
+typedef enum bmp_resizemode {
+    BMP_RESIZE_NEAREST,     // any depth, indexed images keep their palette
+    BMP_RESIZE_AREA,        // mean of the covered pixels, for shrinking
+    BMP_RESIZE_BILINEAR,    // triangle filter
+    BMP_RESIZE_BICUBIC      // Keys cubic, a = -0.5
+} bmp_resizemode;
+
+// clockwise, as the image is seen
+typedef enum bmp_rotation {
+    BMP_ROTATE_90,
+    BMP_ROTATE_180,
+    BMP_ROTATE_270
+} bmp_rotation;
+
+typedef enum bmp_rlemode {
+    BMP_RLEMODE_FAST,
+    BMP_RLEMODE_SMALLEST
+} bmp_rlemode;
+
+typedef enum bmp_roworder {
+    BMP_ROWORDER_STORAGE,
+    BMP_ROWORDER_TOPDOWN,
+    BMP_ROWORDER_BOTTOMUP
+} bmp_roworder;
+
 // (from https://docs.microsoft.com/en-us/windows/win32/api/wingdi/ns-wingdi-logcolorspacea)
 // (from https://docs.microsoft.com/en-us/openspecs/windows_protocols/ms-wmf/eb4bbd50-b3ce-4917-895c-be31f214797f) 
 typedef enum bmp_bv4cstype {
@@ -136,14 +202,6 @@ typedef enum bmp_bv5intent {
     BMP_LCS_GM_IMAGES
 } bmp_bv5intent;
 
-/* RLE structures -------------------------------------------------------------*/
-
-#pragma pack(1)
-typedef struct bmp_rle8duo {
-    uint8_t count;
-    uint8_t value;
-} bmp_rle8duo;
-
 /* Coordinates structures -----------------------------------------------------*/
 
 // CIEXYZ structure
@@ -253,8 +311,210 @@ typedef struct bmp_image {
     bmp_fileheader fileheader;
     bmp_dibheader dib;
     uint8_t * ciPixelArray;
+    uint8_t * mapAddress; // file mapping from bmp_open_mapped(), NULL otherwise
+    size_t mapLength;
+    uint32_t rowStride;   // bytes between rows left padded in the mapping, 0 for packed rows
 } bmp_image;
 
+/* Streaming Structure --------------------------------------------------------*/
+
+#pragma pack(1)
+typedef struct bmp_stream {
+    FILE * fptr;
+    bmp_image header;   // headers and palette, <ciPixelArray> is never used
+    uint32_t rows;      // number of rows in the file
+    uint32_t row;       // rows already transferred, in the caller's order
+    uint32_t rowsize;   // bytes per row in the caller buffers (no padding)
+    uint32_t stride;    // bytes per row in the file (4-byte aligned)
+    bmp_roworder order;
+    int writing;
+} bmp_stream;
+
+#pragma pack()
+
+/* Parallel execution ---------------------------------------------------------*/
+
+// smallest amount of pixel data (in bytes) worth a band of its own
+#define BMP_PARALLEL_MINBYTES (64 * 1024)
+
+// bands queued per thread, so idle threads have something to steal
+#define BMP_PARALLEL_BANDS 4
+
+/**
+ * @brief Work on the rows [begin, end) of an operation; <arg> carries 
+ * whatever the operation needs.
+ */
+typedef void (*bmp_task)(void * arg, uint32_t begin, uint32_t end);
+
+/* Lookup tables --------------------------------------------------------------*/
+
+// one table per bmp_color: blue, green, red and alpha
+#define BMP_LUT_CHANNELS 4
+
+typedef struct bmp_lut {
+    uint8_t table[BMP_LUT_CHANNELS][256];
+} bmp_lut;
+
+/**
+ * @brief A <bmp_lut> laid over the bit fields of 16bpp or 32bpp pixels: 
+ * the red, green, blue and alpha bits each field contributes to the 
+ * result, indexed by the top 8 bits of the field.
+ */
+typedef struct bmp_lutfields {
+    uint32_t shifts[4];
+    uint32_t maxima[4];
+    uint32_t table[4][256];
+    uint32_t keep;          // bits outside the masks, left as they are
+} bmp_lutfields;
+
+/* Planar images ------------------------------------------------------------*/
+
+// alignment of the planes and of their row stride
+#define BMP_PLANAR_ALIGN 64
+
+/**
+ * @brief The channels of an image in separate planes, rows in the storage 
+ * order of the image. planes[] is indexed by bmp_color; the alpha plane 
+ * is NULL for images without one.
+ */
+typedef struct bmp_planar {
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;        // bytes between rows of a plane
+    uint8_t * planes[BMP_LUT_CHANNELS];
+    void * block;           // the allocation behind the planes
+} bmp_planar;
+
+/* Pipelines ------------------------------------------------------------------*/
+
+// operations a single pipeline can record
+#define BMP_PIPELINE_MAXOPS 16
+
+// output bytes produced between two writes of bmp_pipeline_save()
+#define BMP_PIPELINE_CHUNK (1024 * 1024)
+
+typedef enum bmp_opkind {
+    BMP_OP_GRAY,
+    BMP_OP_LUT,
+    BMP_OP_PAD
+} bmp_opkind;
+
+typedef struct bmp_operation {
+    bmp_opkind kind;
+    uint32_t bitcount;      // bits per pixel of the rows it receives
+    uint32_t width;         // width of the rows it receives
+    uint32_t height;        // height of the image it receives
+    uint32_t rowsize;       // bytes per row received
+    uint32_t outrowsize;    // bytes per row produced
+    uint32_t rows;          // BMP_OP_PAD
+    uint32_t columns;
+    bmp_padtype padtype;
+    bmp_lut lut;            // BMP_OP_LUT
+    int uniform;            // same table for every byte of the row
+    bmp_lutfields * fields; // BMP_OP_LUT on bit field rows
+    uint32_t * tables[3];   // BMP_OP_GRAY on bit field rows
+    uint32_t shifts[3];
+    uint32_t maxima[3];
+} bmp_operation;
+
+typedef struct bmp_pipeline {
+    bmp_image * src;        // borrowed, never modified
+    bmp_image * header;     // headers and palette of the result
+    uint32_t nops;
+    bmp_operation ops[BMP_PIPELINE_MAXOPS];
+} bmp_pipeline;
+
+/* Memory ---------------------------------------------------------------------*/
+
+/**
+ * @brief Source of the memory behind every <bmp_image>, palette, pixel 
+ * array, stream and pipeline the library creates. bmp_cleanup() and the 
+ * other destructors hand it back through <release>.
+ */
+typedef struct bmp_allocator {
+    void * (*alloc)(void * context, size_t size);
+    void (*release)(void * context, void * ptr);
+    void * context;
+} bmp_allocator;
+
+// smallest block handed out by a buffer pool is 1 << BMP_BUFPOOL_MINSHIFT
+#define BMP_BUFPOOL_MINSHIFT 6
+
+// size classes per power of two, so rounding wastes at most 1/4 of a block
+#define BMP_BUFPOOL_STEPS 4
+
+#define BMP_BUFPOOL_CLASSES ((48 - BMP_BUFPOOL_MINSHIFT) * BMP_BUFPOOL_STEPS + 1)
+
+/**
+ * @brief Size-class pool recycling released blocks, so a batch of images
+ * of the same size reuses the same (already faulted-in) buffers.
+ */
+typedef struct bmp_bufpool bmp_bufpool;
+
+/* Instrumentation ------------------------------------------------------------*/
+
+/**
+ * Building bmp.c with -DBMP_STATS makes the functions below record their
+ * calls; without it the counters stay at zero and cost nothing.
+ */
+#ifdef BMP_STATS
+#define BMP_STATS_ENABLED 1
+#else
+#define BMP_STATS_ENABLED 0
+#endif
+
+// histogram bucket i counts calls lasting [2^i, 2^(i+1)) nanoseconds
+#define BMP_STATS_BUCKETS 32
+
+typedef enum bmp_statid {
+    BMP_STAT_READ,
+    BMP_STAT_OPEN_MAPPED,
+    BMP_STAT_SAVE,
+    BMP_STAT_RLE8DECODER,
+    BMP_STAT_RLE4DECODER,
+    BMP_STAT_RGB2GRAY,
+    BMP_STAT_INVERT,
+    BMP_STAT_FILTERCOLOR,
+    BMP_STAT_APPLYLUT,
+    BMP_STAT_PADH,
+    BMP_STAT_PADV,
+    BMP_STAT_ADDPAD,
+    BMP_STAT_CONVOLVE,
+    BMP_STAT_MEDIAN,
+    BMP_STAT_MORPHOLOGY,
+    BMP_STAT_RESIZE,
+    BMP_STAT_THUMBNAIL,
+    BMP_STAT_FLIPV,
+    BMP_STAT_FLIPH,
+    BMP_STAT_ROTATE,
+    BMP_STAT_TRANSPOSE,
+    BMP_STAT_PLANAR_SPLIT,
+    BMP_STAT_PLANAR_MERGE,
+    BMP_STAT_CONVERT,
+    BMP_STAT_PIPELINE_RUN,
+    BMP_STAT_PIPELINE_SAVE,
+    BMP_STAT_READ_BUFFER,
+    BMP_STAT_SAVE_BUFFER,
+    BMP_STAT_COUNT
+} bmp_statid;
+
+typedef struct bmp_funcstats {
+    uint64_t calls;
+    uint64_t bytes;         // pixel data bytes handled
+    uint64_t wallns;
+    uint64_t cpuns;         // whole process, so worker threads are included
+    uint64_t wallhist[BMP_STATS_BUCKETS];
+    uint64_t cpuhist[BMP_STATS_BUCKETS];
+} bmp_funcstats;
+
+typedef struct bmp_stats {
+    int enabled;            // BMP_STATS_ENABLED of the library build
+    bmp_funcstats functions[BMP_STAT_COUNT];
+    uint64_t allocs;        // through bmp_alloc()
+    uint64_t allocbytes;
+    uint64_t frees;         // through bmp_free()
+} bmp_stats;
+
 /* Functions ------------------------------------------------------------------*/
 
 /* file related functions -----------------------------------------------------*/
@@ -269,19 +529,153 @@ typedef struct bmp_image {
  */
 bmp_image * bmp_read(const char * filename);
 
+/**
+ * @brief Map a Bitmap file into memory instead of copying it.
+ * 
+ * Headers are validated with bmp_checkheaders(), the palette and pixels
+ * they describe must lie within the file, and both <bmiColors> and
+ * <ciPixelArray> point straight into a private (copy-on-write) mapping of
+ * the file, so in-place operations never modify the file on disk. The 
+ * mapping is released by bmp_cleanup(). Rows padded in the file stay as
+ * they are, <rowStride> bytes apart (see bmp_getrowstep()), until an 
+ * operation needs them packed (see bmp_packrows()).
+ * 
+ * @param filename string specifying the filename to be mapped.
+ * @return bmp_image* - pointer to the struct referencing the mapped
+ *                      <filename> image data, NULL if something goes wrong.
+ */
+bmp_image * bmp_open_mapped(const char * filename);
+
+/**
+ * @brief Read a Bitmap file already in memory, e.g. fetched by 
+ * asynchronous I/O. Headers are validated like bmp_open_mapped() does and
+ * the palette and pixels are copied, so <data> may be reused right after.
+ * 
+ * @param data the whole file.
+ * @param size bytes at <data>.
+ * @return bmp_image* - pointer to the new image, NULL if something goes 
+ *                      wrong.
+ */
+bmp_image * bmp_read_buffer(const void * data, size_t size);
+
 /**
  * @brief Creates a Bitmap file with the <bmp_image> metadata.
  * 
+ * Rows are padded to the 4-byte file stride on the way out and the size
+ * fields of the written headers are recomputed, <img> is left untouched.
+ * 
  * @param img pointer to the <bmp_image> metadata.
  * @param filename string specifying the filename to be created.
  * @return int - returns 0 if something goes wrong, 1 otherwise.
  */
 int bmp_save(bmp_image * img, const char * filename);
 
+/**
+ * @brief Write the file bmp_save() would create into memory, e.g. for 
+ * asynchronous I/O to take it from there.
+ * 
+ * @param img pointer to the <bmp_image> metadata.
+ * @param data buffer for the file.
+ * @param size bytes at <data>, at least bmp_getsavesize().
+ * @return int - returns 0 if <data> is too small or something goes wrong, 
+ *               1 otherwise.
+ */
+int bmp_save_buffer(bmp_image * img, void * data, size_t size);
+
+/**
+ * @brief Read the file headers and the colour palette of a Bitmap file,
+ * leaving <fptr> at the end of the palette.
+ * 
+ * @param fptr file pointer positioned at the beginning of the file.
+ * @param img pointer to the <bmp_image> to be filled.
+ * @return int - returns 0 if something goes wrong, 1 otherwise.
+ */
+int bmp_readheaders(FILE * fptr, bmp_image * img);
+
+/**
+ * @brief Write the file headers and the colour palette of a Bitmap file.
+ * 
+ * @param fptr file pointer positioned at the beginning of the file.
+ * @param img pointer to the <bmp_image> metadata.
+ * @return int - returns 0 if something goes wrong, 1 otherwise.
+ */
+int bmp_writeheaders(FILE * fptr, bmp_image * img);
+
+/* streaming functions --------------------------------------------------------*/
+
+/**
+ * @brief Open a Bitmap file to be read a few rows at a time.
+ * 
+ * Only the headers and the palette are kept in memory, so images larger
+ * than the available RAM can be processed. Compressed files are refused.
+ * 
+ * @param filename string specifying the filename to be read.
+ * @param order order in which rows are handed to the caller.
+ * @return bmp_stream* - pointer to the stream, NULL if something goes wrong.
+ */
+bmp_stream * bmp_stream_openread(const char * filename, bmp_roworder order);
+
+/**
+ * @brief Create a Bitmap file to be written a few rows at a time.
+ * 
+ * @param filename string specifying the filename to be created.
+ * @param header <bmp_image> supplying headers and palette (its pixels are 
+ *               not used).
+ * @param order order in which rows are received from the caller.
+ * @return bmp_stream* - pointer to the stream, NULL if something goes wrong.
+ */
+bmp_stream * bmp_stream_openwrite(const char * filename, bmp_image * header, bmp_roworder order);
+
+/**
+ * @brief Read the next rows of the stream into a caller buffer.
+ * 
+ * @param stream pointer to a stream opened for reading.
+ * @param rows buffer holding at least <nrows> unpadded rows.
+ * @param nrows number of rows wanted.
+ * @return uint32_t - number of rows read, 0 at the end of the image.
+ */
+uint32_t bmp_stream_readrows(bmp_stream * stream, uint8_t * rows, uint32_t nrows);
+
+/**
+ * @brief Write the next rows from a caller buffer into the stream.
+ * 
+ * @param stream pointer to a stream opened for writing.
+ * @param rows buffer holding <nrows> unpadded rows.
+ * @param nrows number of rows to be written.
+ * @return uint32_t - number of rows written.
+ */
+uint32_t bmp_stream_writerows(bmp_stream * stream, const uint8_t * rows, uint32_t nrows);
+
+/**
+ * @brief Describe a buffer of rows as a <bmp_image>, so the in-place 
+ * operations (bmp_invert(), bmp_filtercolor(), ...) can run on it.
+ * 
+ * The view borrows both the rows and the stream palette: never call
+ * bmp_cleanup() on it.
+ * 
+ * @param stream pointer to the stream the rows belong to.
+ * @param view pointer to the <bmp_image> to be filled.
+ * @param rows buffer holding <nrows> unpadded rows.
+ * @param nrows number of rows in the buffer.
+ */
+void bmp_stream_bind(bmp_stream * stream, bmp_image * view, uint8_t * rows, uint32_t nrows);
+
+/**
+ * @brief Close the stream. Streams opened for writing get their 
+ * <bfSize>, <biSizeImage> (and <biHeight>, if fewer rows were written)
+ * patched to match the file contents.
+ * 
+ * @param stream pointer to the stream.
+ * @return int - returns 0 if something goes wrong, 1 otherwise.
+ */
+int bmp_stream_close(bmp_stream * stream);
+
 /* RGB functions --------------------------------------------------------------*/
 
 /**
- * @brief Get the specified color value from the image[x,y] pixel.
+ * @brief Get the specified color value from the image[x,y] pixel. Indexed
+ * images (1bpp to 8bpp) give the palette index whatever the color; 16bpp
+ * pixels are read through their bit masks.
  * 
  * @param img pointer to the <bmp_image> metadata.
  * @param x the pixel x position.
@@ -294,6 +688,9 @@ uint8_t bmp_getpixelcolor(bmp_image * img, int x, int y, bmp_color color);
 /**
  * @brief Find the gray-scale equivalent value from RGB entries.
  * 
+ * Uses the BMP_GRAY_WEIGHT_* fixed-point weights, rounding half up; every
+ * gray conversion in the library matches this function bit for bit.
+ * 
  * @param red red color entry value.
  * @param green green color entry value.
  * @param blue blue color entry value.
@@ -302,7 +699,29 @@ uint8_t bmp_getpixelcolor(bmp_image * img, int x, int y, bmp_color color);
 uint8_t bmp_findgray(uint8_t red, uint8_t green, uint8_t blue);
 
 /**
- * @brief Converts an RGB (24bpp) image into a indexed gray level image (8bpp) 
+ * @brief Create the headers and gray palette of the 8bpp image that 
+ * bmp_rgb2gray() produces from <img>, without any pixel data.
+ * 
+ * @param img pointer to the <bmp_image> metadata.
+ * @param ncolours how many colours to use in the gray palette.
+ * @return bmp_image* pointer to the new header-only image.
+ */
+bmp_image * bmp_grayheader(bmp_image * img, bmp_setncolours ncolours);
+
+/**
+ * @brief Convert every row of a 16bpp, 24bpp or 32bpp image into 8bpp gray
+ * levels, in a single row-major pass (SSSE3/AVX2 when available).
+ * 
+ * @param img pointer to the <bmp_image> metadata.
+ * @param dst buffer receiving <biWidth> bytes per row.
+ */
+void bmp_rgb2grayrows(bmp_image * img, uint8_t * dst);
+
+/**
+ * @brief Converts an RGB (16bpp, 24bpp or 32bpp) image into a indexed gray 
+ * level image (8bpp). Indexed images (1bpp to 8bpp, compressed or not) keep
+ * their indices and get their palette converted instead; see 
+ * bmp_materialize() for pixels holding the gray levels.
  * 
  * @param img pointer to the <bmp_image> metadata.
  * @param ncolours how many colours to use in the gray palette.
@@ -311,7 +730,8 @@ uint8_t bmp_findgray(uint8_t red, uint8_t green, uint8_t blue);
 bmp_image * bmp_rgb2gray(bmp_image * img, bmp_setncolours ncolours);
 
 /**
- * @brief Filter an RGB (24bpp) image by the specified color.
+ * @brief Filter an RGB (16bpp, 24bpp or 32bpp) image by the specified color. 
+ * Indexed images are filtered through their palette.
  * 
  * @param img pointer to the <bmp_image> metadata.
  * @param color the specified color to filter.
@@ -319,23 +739,232 @@ bmp_image * bmp_rgb2gray(bmp_image * img, bmp_setncolours ncolours);
 void bmp_filtercolor(bmp_image * img, bmp_color color);
 
 /**
- * @brief Invert colors from an RGB (24bpp) image.
+ * @brief Invert colors from an RGB (16bpp, 24bpp or 32bpp) image. Indexed 
+ * images are inverted through their palette.
  * 
  * @param img pointer to the <bmp_image> metadata.
  */
 void bmp_invert(bmp_image * img);
 
+/**
+ * @brief Turn an indexed image (1bpp to 8bpp, BI_RGB, BI_RLE8 or BI_RLE4) 
+ * into one whose pixels carry the palette colours: 8bpp gray levels with a
+ * plain gray palette if every palette entry is gray, 24bpp otherwise.
+ * 
+ * @param img pointer to the <bmp_image> metadata.
+ * @return bmp_image* - pointer to the new image, NULL if <img> is not 
+ *                      indexed or something goes wrong.
+ */
+bmp_image * bmp_materialize(bmp_image * img);
+
+/* lookup table functions -----------------------------------------------------*/
+
+/**
+ * @brief Fill <lut> with tables that keep every value.
+ * 
+ * @param lut pointer to the <bmp_lut> to fill.
+ */
+void bmp_lut_identity(bmp_lut * lut);
+
+/**
+ * @brief Fill <lut> with the colour inversion of bmp_invert(), alpha kept.
+ * 
+ * @param lut pointer to the <bmp_lut> to fill.
+ */
+void bmp_lut_invert(bmp_lut * lut);
+
+/**
+ * @brief Fill <lut> with the filter of bmp_filtercolor(): <color> is kept,
+ * the other colour channels become 0 and alpha is kept.
+ * 
+ * @param lut pointer to the <bmp_lut> to fill.
+ * @param color the colour to keep.
+ */
+void bmp_lut_filter(bmp_lut * lut, bmp_color color);
+
+/**
+ * @brief Fill <lut> so that colour values from <level> up become 255 and 
+ * the others 0, alpha kept.
+ * 
+ * @param lut pointer to the <bmp_lut> to fill.
+ * @param level the lowest value mapped to 255.
+ */
+void bmp_lut_threshold(bmp_lut * lut, uint8_t level);
+
+/**
+ * @brief Fill <lut> with the power curve 255 * (v / 255)^gamma on the 
+ * colour channels, alpha kept.
+ * 
+ * @param lut pointer to the <bmp_lut> to fill.
+ * @param gamma the exponent, the identity is used if it is not positive.
+ */
+void bmp_lut_gamma(bmp_lut * lut, double gamma);
+
+/**
+ * @brief Fill <lut> with a contrast stretch mapping colour values 
+ * [<low>, <high>] linearly onto [0, 255], clamping the rest, alpha kept.
+ * 
+ * @param lut pointer to the <bmp_lut> to fill.
+ * @param low value mapped to 0.
+ * @param high value mapped to 255, a threshold at <low> if not above it.
+ */
+void bmp_lut_stretch(bmp_lut * lut, uint8_t low, uint8_t high);
+
+/**
+ * @brief Fill <lut> with the quantization used by the gray palettes of 
+ * bmp_rgb2gray(): colour values are rounded down to <ncolours> steps, 
+ * alpha kept.
+ * 
+ * @param lut pointer to the <bmp_lut> to fill.
+ * @param ncolours how many colours to keep, 0 meaning 256.
+ */
+void bmp_lut_quantize(bmp_lut * lut, bmp_setncolours ncolours);
+
+/**
+ * @brief Fold two tables into one doing <first> and then <then>, so a 
+ * chain of tone operations costs a single pass over the pixels.
+ * 
+ * @param lut pointer to the result, which may be <first> or <then>.
+ * @param first pointer to the table applied first.
+ * @param then pointer to the table applied second.
+ */
+void bmp_lut_compose(bmp_lut * lut, const bmp_lut * first, const bmp_lut * then);
+
+/**
+ * @brief Run every pixel of an 8bpp, 16bpp, 24bpp or 32bpp image through 
+ * <lut>, each byte through the table of its channel (8bpp pixels through 
+ * the blue one). 16bpp and bit field pixels go field by field, each read 
+ * as a byte and written back to its width. Indexed images go through 
+ * their palette instead.
+ * 
+ * @param img pointer to the <bmp_image> metadata.
+ * @param lut pointer to the tables.
+ */
+void bmp_applylut(bmp_image * img, const bmp_lut * lut);
+
+/* planar functions -----------------------------------------------------------*/
+
+/**
+ * @brief Allocate the planes for a <width> x <height> image, content 
+ * undefined.
+ * 
+ * @param width pixels per row.
+ * @param height rows.
+ * @param alpha non-zero to add the alpha plane.
+ * @return bmp_planar* - the planes, NULL if something goes wrong.
+ */
+bmp_planar * bmp_planar_create(uint32_t width, uint32_t height, int alpha);
+
+/**
+ * @brief Free <planar> and its planes.
+ * 
+ * @param planar pointer to the planes.
+ */
+void bmp_planar_free(bmp_planar * planar);
+
+/**
+ * @brief Split the pixels of an uncompressed (BI_RGB) 24bpp or 32bpp image
+ * into planes, the fourth byte of 32bpp pixels going to the alpha plane.
+ * 
+ * @param img pointer to the <bmp_image> metadata.
+ * @return bmp_planar* - the planes, NULL if <img> is not supported or 
+ *                       something goes wrong.
+ */
+bmp_planar * bmp_planar_split(bmp_image * img);
+
+/**
+ * @brief Interleave <planar> back into the pixels of <img>, which must have
+ * its size and a format taken by bmp_planar_split().
+ * 
+ * @param planar pointer to the planes.
+ * @param img pointer to the <bmp_image> metadata.
+ * @return int - returns 0 if <img> does not match, 1 otherwise.
+ */
+int bmp_planar_merge(const bmp_planar * planar, bmp_image * img);
+
+/**
+ * @brief bmp_filtercolor() on planes: the planes of the other two colours
+ * are cleared.
+ * 
+ * @param planar pointer to the planes.
+ * @param color the colour kept.
+ */
+void bmp_planar_filtercolor(bmp_planar * planar, bmp_color color);
+
+/**
+ * @brief bmp_applylut() on planes, each plane through the table of its 
+ * channel.
+ * 
+ * @param planar pointer to the planes.
+ * @param lut pointer to the tables.
+ */
+void bmp_planar_applylut(bmp_planar * planar, const bmp_lut * lut);
+
+/* conversion functions -------------------------------------------------------*/
+
+/**
+ * @brief Convert <img> to another pixel format. Every uncompressed or RLE 
+ * image with a palette, every 16bpp and 32bpp bit field layout and 24bpp 
+ * BI_RGB are read; rows are decoded into 32bpp BGRA and encoded into the 
+ * target. Indexed sources keep their palette when it fits the target 
+ * depth, other colours go to a 3-3-2 colour cube at 8bpp and to gray 
+ * levels at 4bpp and 1bpp. The fourth byte of 32bpp targets is the alpha
+ * of the source, 0 if it has none.
+ * 
+ * @param img pointer to the <bmp_image> metadata.
+ * @param bitcount BMP_1_BIT, BMP_4_BITS, BMP_8_BITS, BMP_16_BITS, 
+ *                 BMP_24_BITS or BMP_32_BITS.
+ * @param compression BMP_BI_RGB (16bpp as X1R5G5B5), BMP_BI_BITFIELDS for 
+ *                    16bpp R5G6B5, BMP_BI_RLE8 for 8bpp or BMP_BI_RLE4 
+ *                    for 4bpp.
+ * @return bmp_image* - the new image, NULL if either format is not 
+ *                      supported or something goes wrong.
+ */
+bmp_image * bmp_convert(bmp_image * img, bmp_bitcount bitcount, bmp_compression compression);
+
+/**
+ * @brief Convert <img> like bmp_convert() into a bit field layout of 
+ * <bitcount> bits per pixel. Every field is rounded from its byte; the 
+ * result is BI_ALPHABITFIELDS when <masks> has an alpha field, 
+ * BI_BITFIELDS otherwise, and keeps the masks in its palette.
+ * 
+ * @param img pointer to the <bmp_image> metadata.
+ * @param bitcount BMP_16_BITS or BMP_32_BITS.
+ * @param masks red, green, blue and alpha masks (0 for no alpha), such as
+ *              the BMP_BITFIELDS_* and BMP_ALPHABITFIELDS_* ones. Each
+ *              is a contiguous run of bits and none overlap.
+ * @return bmp_image* - the new image, NULL if <img> or the masks are not 
+ *                      supported or something goes wrong.
+ */
+bmp_image * bmp_convert_bitfields(bmp_image * img, bmp_bitcount bitcount, const uint32_t masks[4]);
+
 /* padding functions ----------------------------------------------------------*/
 
 /**
- * @brief Add padding borders to the specified image.
+ * @brief Map a row or column index that may fall outside an image onto 
+ * the one it reads under <type>. Neighbourhood operations only need this
+ * near the edges, so no padded copy of the image is ever made for them.
+ * 
+ * @param i index, possibly negative or past the end.
+ * @param n number of rows or columns of the image.
+ * @param type border policy.
+ * @return int64_t - index in [0, n), -1 if the pixel reads as zero.
+ */
+int64_t bmp_borderindex(int64_t i, uint32_t n, bmp_padtype type);
+
+/**
+ * @brief Add padding borders to the specified (uncompressed, any bit 
+ * depth) image, building the result with a single allocation.
  * 
  * @param img pointer to the <bmp_image> metadata.
  * @param rows number of rows to be added as padding.
  * @param columns number of columns to be added as padding.
  * @param padtype padding type to be used.
+ * @return int - returns 0 if <img> is not supported or the padded image
+ *               would not fit a Bitmap header (<img> is then left as it
+ *               was), 1 otherwise.
  */
-void bmp_addpad(bmp_image * img, uint32_t rows, uint32_t columns, bmp_padtype padtype);
+int bmp_addpad(bmp_image * img, uint32_t rows, uint32_t columns, bmp_padtype padtype);
 
 /**
  * @brief Add padding horizontaly.
@@ -343,8 +972,9 @@ void bmp_addpad(bmp_image * img, uint32_t rows, uint32_t columns, bmp_padtype pa
  * @param img pointer to the <bmp_image> metadata.
  * @param num number of columns to be added as padding.
  * @param padtype padding type to be used.
+ * @return int - returns 0 if <img> was left as it was, see bmp_addpad().
  */
-void bmp_padh(bmp_image * img, uint32_t num, bmp_padtype padtype);
+int bmp_padh(bmp_image * img, uint32_t num, bmp_padtype padtype);
 
 /**
  * @brief Add padding vertically.
@@ -352,8 +982,281 @@ void bmp_padh(bmp_image * img, uint32_t num, bmp_padtype padtype);
  * @param img pointer to the <bmp_image> metadata.
  * @param num number of rows to be added as padding.
  * @param padtype padding type to be used.
+ * @return int - returns 0 if <img> was left as it was, see bmp_addpad().
+ */
+int bmp_padv(bmp_image * img, uint32_t num, bmp_padtype padtype);
+
+/* filtering functions --------------------------------------------------------*/
+
+/**
+ * @brief Convolve an uncompressed 8bpp, 24bpp or 32bpp image with a 
+ * separable kernel, <horizontal> along the rows then <vertical> along the
+ * columns. Every byte is filtered as a channel of its own, so 8bpp values
+ * are taken as gray levels. Weights run in 16-bit fixed point; borders 
+ * follow <padtype>.
+ * 
+ * @param img pointer to the <bmp_image> metadata.
+ * @param horizontal weights of the horizontal pass.
+ * @param hsize number of horizontal weights, odd and at most 
+ *              BMP_CONV_MAXSIZE.
+ * @param vertical weights of the vertical pass.
+ * @param vsize number of vertical weights, odd and at most 
+ *              BMP_CONV_MAXSIZE.
+ * @param padtype border policy.
+ * @return int - returns 0 if <img> or the kernel are not supported or 
+ *               something goes wrong, 1 otherwise.
+ */
+int bmp_convolve_separable(bmp_image * img, const double * horizontal, uint32_t hsize, 
+                           const double * vertical, uint32_t vsize, bmp_padtype padtype);
+
+/**
+ * @brief Convolve an image, as bmp_convolve_separable() does, with a 
+ * square non-separable kernel. 3x3 and 5x5 kernels have unrolled paths.
+ * 
+ * @param img pointer to the <bmp_image> metadata.
+ * @param kernel <size> x <size> weights, row by row.
+ * @param size side of the kernel, odd and at most BMP_CONV_MAXSIZE.
+ * @param padtype border policy.
+ * @return int - returns 0 if <img> or the kernel are not supported or 
+ *               something goes wrong, 1 otherwise.
+ */
+int bmp_convolve(bmp_image * img, const double * kernel, uint32_t size, bmp_padtype padtype);
+
+/**
+ * @brief Gaussian blur through bmp_convolve_separable(), the kernel 
+ * reaching 3 <sigma> each side (capped by BMP_CONV_MAXSIZE).
+ * 
+ * @param img pointer to the <bmp_image> metadata.
+ * @param sigma standard deviation in pixels.
+ * @param padtype border policy.
+ * @return int - returns 0 if something goes wrong, 1 otherwise.
+ */
+int bmp_gaussian(bmp_image * img, double sigma, bmp_padtype padtype);
+
+/**
+ * @brief Box blur through bmp_convolve_separable().
+ * 
+ * @param img pointer to the <bmp_image> metadata.
+ * @param radius pixels each side, at most BMP_CONV_MAXSIZE / 2.
+ * @param padtype border policy.
+ * @return int - returns 0 if something goes wrong, 1 otherwise.
+ */
+int bmp_boxblur(bmp_image * img, uint32_t radius, bmp_padtype padtype);
+
+/**
+ * @brief Sharpen with the 3x3 kernel (0 -1 0, -1 5 -1, 0 -1 0) through 
+ * bmp_convolve().
+ * 
+ * @param img pointer to the <bmp_image> metadata.
+ * @param padtype border policy.
+ * @return int - returns 0 if something goes wrong, 1 otherwise.
+ */
+int bmp_sharpen(bmp_image * img, bmp_padtype padtype);
+
+/**
+ * @brief Median filter over the (2 <radius> + 1)^2 window, for impulse 
+ * noise such as salt-and-pepper. Uncompressed 8bpp, 24bpp and 32bpp 
+ * images are filtered one byte channel at a time, 1bpp, 2bpp and 4bpp 
+ * ones on their palette indices unpacked to one per byte. RLE images are 
+ * decoded first and left uncompressed. Radii 1 and 2 run 
+ * vectorized sorting networks; larger ones keep sliding histograms, so 
+ * the cost per pixel does not grow with the radius.
+ * 
+ * @param img pointer to the <bmp_image> metadata.
+ * @param radius window radius, at most BMP_MEDIAN_MAXRADIUS.
+ * @param padtype border policy.
+ * @return int - returns 0 if <img> is not supported or something goes 
+ *               wrong, 1 otherwise.
+ */
+int bmp_median(bmp_image * img, uint32_t radius, bmp_padtype padtype);
+
+/**
+ * @brief Grayscale (or binary mask) morphology of an uncompressed 8bpp 
+ * image with a <width> x <height> rectangle centred on each pixel. The 
+ * rectangle is run as a horizontal then a vertical pass of the van 
+ * Herk/Gil-Werman algorithm, so the cost does not depend on its size. 
+ * 1bpp, 2bpp and 4bpp images work on their palette indices, unpacked to 
+ * one per byte and packed again.
+ * 
+ * @param img pointer to the <bmp_image> metadata.
+ * @param op the operation.
+ * @param width width of the structuring element, odd.
+ * @param height height of the structuring element, odd.
+ * @param padtype border policy.
+ * @return int - returns 0 if <img> is not supported or something goes 
+ *               wrong, 1 otherwise.
+ */
+int bmp_morphology(bmp_image * img, bmp_morphop op, uint32_t width, uint32_t height, bmp_padtype padtype);
+
+/* resizing functions ---------------------------------------------------------*/
+
+/**
+ * @brief Resize <img> to <width> x <height>. BMP_RESIZE_NEAREST works on 
+ * every uncompressed or RLE depth and keeps the palette of indexed 
+ * images. The filtered modes run separable fixed-point passes over the 
+ * byte channels of 24bpp and 32bpp images; indexed images are expanded 
+ * first, as in bmp_materialize(), and 16bpp and bit field pixels are 
+ * decoded to BGRA and packed back into their fields. When shrinking, the filters widen 
+ * with the scale so every source pixel contributes.
+ * 
+ * @param img pointer to the <bmp_image> metadata.
+ * @param width width of the result.
+ * @param height height of the result.
+ * @param mode the resampling filter.
+ * @return bmp_image* - the new image, NULL if <img> is not supported or 
+ *                      something goes wrong.
+ */
+bmp_image * bmp_resize(bmp_image * img, uint32_t width, uint32_t height, bmp_resizemode mode);
+
+/**
+ * @brief Resize the file <src> into the file <dst> like bmp_resize(), 
+ * reading the source rows once and in storage order, so only a few rows 
+ * of either image are in memory at a time. Compressed files cannot be 
+ * read a row at a time and go through bmp_read() and bmp_resize(), as 
+ * do 16bpp and bit field files in the filtered modes.
+ * 
+ * @param src path of the source file.
+ * @param dst path of the resized file.
+ * @param width width of the result.
+ * @param height height of the result.
+ * @param mode the resampling filter.
+ * @return int - returns 0 if something goes wrong, 1 otherwise.
+ */
+int bmp_thumbnail(const char * src, const char * dst, uint32_t width, uint32_t height, bmp_resizemode mode);
+
+/* orientation functions ------------------------------------------------------*/
+
+/**
+ * @brief Flip <img> upside down in place, swapping whole rows. Any 
+ * uncompressed depth.
+ * 
+ * @param img pointer to the <bmp_image> metadata.
+ * @return int - returns 0 if <img> is not supported, 1 otherwise.
+ */
+int bmp_flipv(bmp_image * img);
+
+/**
+ * @brief Mirror <img> left to right in place. Any uncompressed depth; 
+ * 1bpp, 2bpp and 4bpp rows are mirrored as one index per byte.
+ * 
+ * @param img pointer to the <bmp_image> metadata.
+ * @return int - returns 0 if <img> is not supported or something goes 
+ *               wrong, 1 otherwise.
+ */
+int bmp_fliph(bmp_image * img);
+
+/**
+ * @brief Rotate <img> clockwise into a new image, its sides swapped by the
+ * quarter turns. Any uncompressed depth, 1bpp, 2bpp and 4bpp images 
+ * going through rows of one index per byte; the row order (sign of the 
+ * height) and the palette are kept.
+ * 
+ * @param img pointer to the <bmp_image> metadata.
+ * @param rotation the angle.
+ * @return bmp_image* - the new image, NULL if <img> is not supported or 
+ *                      something goes wrong.
+ */
+bmp_image * bmp_rotate(bmp_image * img, bmp_rotation rotation);
+
+/**
+ * @brief Mirror <img> across its top-left to bottom-right diagonal into a
+ * new image, same formats as bmp_rotate().
+ * 
+ * @param img pointer to the <bmp_image> metadata.
+ * @return bmp_image* - the new image, NULL if <img> is not supported or 
+ *                      something goes wrong.
+ */
+bmp_image * bmp_transpose(bmp_image * img);
+
+/* pipeline functions ---------------------------------------------------------*/
+
+/**
+ * @brief Start recording operations on <img>. Nothing is computed until 
+ * bmp_pipeline_run() or bmp_pipeline_save(), which then take every row 
+ * through the whole chain at once: one pass over the source, one over 
+ * the result, no intermediate images.
+ * 
+ * @param img pointer to an uncompressed <bmp_image>, which must outlive 
+ *            the pipeline and is never modified.
+ * @return bmp_pipeline* - pointer to the empty pipeline, NULL if something
+ *                         goes wrong.
+ */
+bmp_pipeline * bmp_pipeline_create(bmp_image * img);
+
+/**
+ * @brief Record a bmp_rgb2gray() conversion. Like bmp_invert() and 
+ * bmp_filtercolor(), it is applied to the palette straight away when the 
+ * rows are indexed at this point of the chain.
+ * 
+ * @param pipeline pointer to the pipeline.
+ * @param ncolours how many colours to use in the gray palette.
+ * @return int - returns 0 if the rows are neither indexed nor 16bpp, 24bpp
+ *               or 32bpp at this point of the chain, 1 otherwise.
+ */
+int bmp_pipeline_add_gray(bmp_pipeline * pipeline, bmp_setncolours ncolours);
+
+/**
+ * @brief Record a bmp_applylut(). A table recorded right after another is
+ * folded into it, so a chain of them still costs one lookup per byte.
+ * 
+ * @param pipeline pointer to the pipeline.
+ * @param lut pointer to the tables, copied.
+ * @return int - returns 0 if something goes wrong, 1 otherwise.
+ */
+int bmp_pipeline_add_lut(bmp_pipeline * pipeline, const bmp_lut * lut);
+
+/**
+ * @brief Record a bmp_invert().
+ * 
+ * @param pipeline pointer to the pipeline.
+ * @return int - returns 0 if something goes wrong, 1 otherwise.
+ */
+int bmp_pipeline_add_invert(bmp_pipeline * pipeline);
+
+/**
+ * @brief Record a bmp_filtercolor().
+ * 
+ * @param pipeline pointer to the pipeline.
+ * @param color the specified color to filter.
+ * @return int - returns 0 if something goes wrong, 1 otherwise.
+ */
+int bmp_pipeline_add_filter(bmp_pipeline * pipeline, bmp_color color);
+
+/**
+ * @brief Record a bmp_addpad().
+ * 
+ * @param pipeline pointer to the pipeline.
+ * @param rows number of rows to be added as padding.
+ * @param columns number of columns to be added as padding.
+ * @param padtype padding type to be used.
+ * @return int - returns 0 if something goes wrong, 1 otherwise.
+ */
+int bmp_pipeline_add_pad(bmp_pipeline * pipeline, uint32_t rows, uint32_t columns, bmp_padtype padtype);
+
+/**
+ * @brief Run the recorded operations into a new image.
+ * 
+ * @param pipeline pointer to the pipeline.
+ * @return bmp_image* - pointer to the result, NULL if something goes wrong.
+ */
+bmp_image * bmp_pipeline_run(bmp_pipeline * pipeline);
+
+/**
+ * @brief Run the recorded operations straight into a Bitmap file, a few 
+ * rows at a time, without holding the result in memory.
+ * 
+ * @param pipeline pointer to the pipeline.
+ * @param filename string specifying the filename to be created.
+ * @return int - returns 0 if something goes wrong, 1 otherwise.
+ */
+int bmp_pipeline_save(bmp_pipeline * pipeline, const char * filename);
+
+/**
+ * @brief Release the pipeline (the source image is left alone).
+ * 
+ * @param pipeline pointer to the pipeline.
  */
-void bmp_padv(bmp_image * img, uint32_t num, bmp_padtype padtype);
+void bmp_pipeline_free(bmp_pipeline * pipeline);
 
 /* printing functions ---------------------------------------------------------*/
 
@@ -364,6 +1267,14 @@ void bmp_padv(bmp_image * img, uint32_t num, bmp_padtype padtype);
  */
 void bmp_printdetails(bmp_image * img);
 
+/**
+ * @brief Print the counters of a bmp_stats_snapshot(): calls, bytes, time 
+ * spent and time histograms of each instrumented function, allocations.
+ * 
+ * @param stats pointer to the snapshot.
+ */
+void bmp_printstats(const bmp_stats * stats);
+
 /**
  * @brief Print the specified image[x,y] pixel value.
  * 
@@ -387,11 +1298,32 @@ bmp_image * bmp_cleanup(FILE * fptr , bmp_image * img);
 /**
  * @brief Check file headers to evaluate Bitmap conformity.
  * 
+ * Besides the known types, widths must be positive, heights other than
+ * INT32_MIN and the padded pixel array of the image within 4 GiB.
+ * 
  * @param img pointer to the <bmp_image> metadata.
  * @return int - returns 0 if headers have some problem, 1 otherwise.
  */
 int bmp_checkheaders(bmp_image * img);
 
+/**
+ * @brief Check whether a buffer lives inside the image's file mapping.
+ * 
+ * @param img <bmp_image> pointer.
+ * @param ptr buffer to be checked.
+ * @return int - returns 1 if <ptr> points into the mapping, 0 otherwise.
+ */
+int bmp_ismapped(bmp_image * img, const void * ptr);
+
+/**
+ * @brief Release a buffer owned by the image (pixels or palette),
+ * skipping buffers that belong to its file mapping.
+ * 
+ * @param img <bmp_image> pointer.
+ * @param ptr buffer to be released.
+ */
+void bmp_release(bmp_image * img, void * ptr);
+
 /* easter eggs ----------------------------------------------------------------*/
 
 /**
@@ -432,6 +1364,14 @@ bmp_image * bmp_32bpp_sample();
  */
 uint32_t bmp_getfilesize(bmp_image * img);
 
+/**
+ * @brief Get the size of the file bmp_save() would write, rows padded.
+ * 
+ * @param img <bmp_image> pointer.
+ * @return uint32_t - the file size.
+ */
+uint32_t bmp_getsavesize(bmp_image * img);
+
 /**
  * @brief Get offset from the <bmp_image> metadata.
  * 
@@ -440,6 +1380,16 @@ uint32_t bmp_getfilesize(bmp_image * img);
  */
 uint32_t bmp_getoffset(bmp_image * img);
 
+/**
+ * @brief Get how many bytes <ciPixelArray> holds: bmp_getrowstep() times
+ * the number of rows for uncompressed images, the compressed data 
+ * otherwise.
+ * 
+ * @param img <bmp_image> pointer.
+ * @return uint32_t - the pixel array size.
+ */
+uint32_t bmp_getarraysize(bmp_image * img);
+
 /**
  * @brief Get datasize from the <bmp_image> metadata.
  * 
@@ -448,6 +1398,85 @@ uint32_t bmp_getoffset(bmp_image * img);
  */
 uint32_t bmp_getdatasize(bmp_image * img);
 
+/**
+ * @brief Get the number of rows, whatever the image orientation.
+ * 
+ * @param img <bmp_image> pointer.
+ * @return uint32_t - the absolute value of <biHeight>.
+ */
+uint32_t bmp_getheight(bmp_image * img);
+
+/**
+ * @brief Get how many bytes a row takes in <ciPixelArray> (no padding).
+ * 
+ * @param img <bmp_image> pointer.
+ * @return uint32_t - the row size.
+ */
+uint32_t bmp_getrowsize(bmp_image * img);
+
+/**
+ * @brief Get how many bytes a row takes in the file (4-byte aligned).
+ * 
+ * @param img <bmp_image> pointer.
+ * @return uint32_t - the row stride.
+ */
+uint32_t bmp_getstride(bmp_image * img);
+
+/**
+ * @brief Get how many bytes separate two rows of <ciPixelArray>: the row
+ * size, or <rowStride> for mapped images whose rows keep their padding.
+ * 
+ * @param img <bmp_image> pointer.
+ * @return uint32_t - the distance between rows.
+ */
+uint32_t bmp_getrowstep(bmp_image * img);
+
+/**
+ * @brief Get how many bytes precede the pixel data when the image is saved
+ * (file header, DIB headers and colour palette).
+ * 
+ * @param img <bmp_image> pointer.
+ * @return uint32_t - the pixel data offset bmp_save() will use.
+ */
+uint32_t bmp_getheaderssize(bmp_image * img);
+
+/**
+ * @brief Check whether the pixel data is stored row by row (BI_RGB,
+ * BI_BITFIELDS or BI_ALPHABITFIELDS) rather than compressed.
+ * 
+ * @param img <bmp_image> pointer.
+ * @return int - returns 1 for uncompressed images, 0 otherwise.
+ */
+int bmp_isuncompressed(bmp_image * img);
+
+/**
+ * @brief Check whether pixels are palette indices (1bpp to 8bpp with a 
+ * colour palette).
+ * 
+ * @param img <bmp_image> pointer.
+ * @return int - returns 1 for indexed images, 0 otherwise.
+ */
+int bmp_isindexed(bmp_image * img);
+
+/**
+ * @brief Pack 4-byte aligned file rows from <data> into <ciPixelArray>.
+ * The headers keep describing the file.
+ * 
+ * @param img <bmp_image> pointer.
+ * @param data padded rows as stored in the file (may be <ciPixelArray>).
+ */
+void bmp_unpad(bmp_image * img, const uint8_t * data);
+
+/**
+ * @brief Give a mapped image whose rows kept their padding a packed copy
+ * of its pixels, as operations that rewrite rows in place need. Images 
+ * with packed rows are left as they are.
+ * 
+ * @param img <bmp_image> pointer.
+ * @return int - returns 0 if the copy cannot be allocated, 1 otherwise.
+ */
+int bmp_packrows(bmp_image * img);
+
 /**
  * @brief Get DIB header format from the <bmp_image> metadata.
  * 
@@ -510,7 +1539,200 @@ void bmp_cpdibs(bmp_image * b, bmp_image * a);
  * @brief Decode a <bmp_image> from BI_RLE8 into BI_RGB.
  * 
  * @param img <bmp_image> pointer.
+ * @return bmp_image* - pointer to the decoded image, NULL if <img> is not 
+ *                      an 8bpp BI_RLE8 image or memory runs out.
  */
 bmp_image * bmp_rle8decoder(bmp_image * img);
 
-#endif
\ No newline at end of file
+/**
+ * @brief Decode a BI_RLE8 stream into unpadded 8bpp rows.
+ * 
+ * Handles encoded runs, end of line, end of bitmap, delta and absolute 
+ * mode escapes. Runs and deltas are clipped to the image and decoding
+ * stops at the end of <src>, so malformed streams never write outside
+ * <dst>. Pixels the stream does not reach are left untouched.
+ * 
+ * @param src compressed stream.
+ * @param size compressed stream size in bytes.
+ * @param dst buffer holding <width> * <height> bytes.
+ * @param width image width in pixels.
+ * @param height number of rows.
+ */
+void bmp_rle8decode(const uint8_t * src, size_t size, uint8_t * dst, uint32_t width, uint32_t height);
+
+/**
+ * @brief Decode a <bmp_image> from BI_RLE4 into BI_RGB.
+ * 
+ * @param img <bmp_image> pointer.
+ * @return bmp_image* - pointer to the decoded image, NULL if <img> is not 
+ *                      a 4bpp BI_RLE4 image or memory runs out.
+ */
+bmp_image * bmp_rle4decoder(bmp_image * img);
+
+/**
+ * @brief Decode a BI_RLE4 stream into unpadded 4bpp rows, with the same 
+ * escapes and safety guarantees as bmp_rle8decode().
+ * 
+ * @param src compressed stream.
+ * @param size compressed stream size in bytes.
+ * @param dst buffer holding <height> rows of (<width> + 1) / 2 bytes.
+ * @param width image width in pixels.
+ * @param height number of rows.
+ */
+void bmp_rle4decode(const uint8_t * src, size_t size, uint8_t * dst, uint32_t width, uint32_t height);
+
+/**
+ * @brief Encode an 8bpp BI_RGB <bmp_image> into BI_RLE8.
+ * 
+ * BMP_RLEMODE_FAST takes runs greedily; BMP_RLEMODE_SMALLEST picks, row by
+ * row, the mix of encoded runs and absolute segments with the fewest bytes.
+ * 
+ * @param img <bmp_image> pointer (bottom-up).
+ * @param mode encoding strategy.
+ * @return bmp_image* - pointer to the encoded image, NULL if something 
+ *                      goes wrong.
+ */
+bmp_image * bmp_rle8encoder(bmp_image * img, bmp_rlemode mode);
+
+/**
+ * @brief Encode a 4bpp BI_RGB <bmp_image> into BI_RLE4, see 
+ * bmp_rle8encoder() for the modes.
+ * 
+ * @param img <bmp_image> pointer (bottom-up).
+ * @param mode encoding strategy.
+ * @return bmp_image* - pointer to the encoded image, NULL if something 
+ *                      goes wrong.
+ */
+bmp_image * bmp_rle4encoder(bmp_image * img, bmp_rlemode mode);
+
+/**
+ * @brief Save a 4bpp or 8bpp image run-length encoded (BI_RLE4 or BI_RLE8).
+ * 
+ * @param img pointer to the <bmp_image> metadata.
+ * @param filename string specifying the filename to be created.
+ * @param mode encoding strategy.
+ * @return int - returns 0 if something goes wrong, 1 otherwise.
+ */
+int bmp_saverle(bmp_image * img, const char * filename, bmp_rlemode mode);
+
+/* memory functions -----------------------------------------------------------*/
+
+/**
+ * @brief Replace the allocator used by the library. Set it before 
+ * creating any image: blocks must be released by the allocator that 
+ * made them.
+ * 
+ * @param allocator pointer to the allocator (copied), NULL restores 
+ *                  malloc() and free().
+ */
+void bmp_set_allocator(const bmp_allocator * allocator);
+
+/**
+ * @brief Allocate memory from the current allocator, e.g. for pixels of 
+ * an image later released by bmp_cleanup().
+ * 
+ * @param size number of bytes.
+ * @return void* - pointer to the block, NULL if something goes wrong.
+ */
+void * bmp_alloc(size_t size);
+
+/**
+ * @brief Same as bmp_alloc(), with the block zeroed.
+ * 
+ * @param size number of bytes.
+ * @return void* - pointer to the block, NULL if something goes wrong.
+ */
+void * bmp_calloc(size_t size);
+
+/**
+ * @brief Release memory obtained from bmp_alloc().
+ * 
+ * @param ptr pointer to the block (may be NULL).
+ */
+void bmp_free(void * ptr);
+
+/**
+ * @brief Create a buffer pool.
+ * 
+ * @param limit bytes of released blocks kept for reuse, 0 for no limit.
+ * @return bmp_bufpool* - pointer to the pool, NULL if something goes wrong.
+ */
+bmp_bufpool * bmp_bufpool_create(size_t limit);
+
+/**
+ * @brief Allocator drawing from <pool>, to be given to bmp_set_allocator().
+ * 
+ * @param pool pointer to the pool.
+ * @return bmp_allocator - the allocator.
+ */
+bmp_allocator bmp_bufpool_allocator(bmp_bufpool * pool);
+
+/**
+ * @brief Destroy the pool, once every block it handed out has been 
+ * released and it is no longer the library allocator.
+ * 
+ * @param pool pointer to the pool.
+ */
+void bmp_bufpool_destroy(bmp_bufpool * pool);
+
+/* instrumentation functions --------------------------------------------------*/
+
+/**
+ * @brief Copy the current counters (all zero unless built with BMP_STATS).
+ * 
+ * @param stats pointer to the <bmp_stats> to be filled.
+ */
+void bmp_stats_snapshot(bmp_stats * stats);
+
+/**
+ * @brief Set every counter back to zero.
+ */
+void bmp_stats_reset(void);
+
+/* parallel functions ---------------------------------------------------------*/
+
+/**
+ * @brief Set how many threads the image operations may use.
+ * 
+ * Operations running on other threads finish their parallel work first,
+ * and new ones wait for the change, so it must not be called from inside
+ * a bmp_parallel_rows() task. If some thread cannot be started, 
+ * everything runs on the calling threads. The result of every operation 
+ * is the same whatever the number of threads.
+ * 
+ * @param threads number of threads, 0 for one per online CPU, 1 to run 
+ *                everything on the calling thread.
+ */
+void bmp_set_threads(uint32_t threads);
+
+/**
+ * @brief Get how many threads the image operations may use.
+ * 
+ * @return uint32_t - the number of threads, calling thread included.
+ */
+uint32_t bmp_get_threads(void);
+
+/**
+ * @brief Split [0, rows) into bands and run <task> on them with the 
+ * work-stealing thread pool, returning once every band is done.
+ * 
+ * Small jobs, single-threaded configurations and calls made from inside
+ * a task run <task> directly on the calling thread.
+ * 
+ * @param rows number of rows.
+ * @param grain minimum number of rows per band.
+ * @param task function processing a band of rows.
+ * @param arg argument handed to <task>.
+ */
+void bmp_parallel_rows(uint32_t rows, uint32_t grain, bmp_task task, void * arg);
+
+/**
+ * @brief Minimum number of rows per band for rows of <rowbytes> bytes,
+ * so each band carries at least BMP_PARALLEL_MINBYTES.
+ * 
+ * @param rowbytes bytes touched per row.
+ * @return uint32_t - the grain for bmp_parallel_rows().
+ */
+uint32_t bmp_rowgrain(size_t rowbytes);
+
+#endif
@@ -2,25 +2,1509 @@
  * @file main.c
  * @author Nilo Edson (niloedson.ms@gmail.com)
  * @brief Handles Bitmap format images and allows you to load, work with, convert or generate *.bmp files.
- * @version 4.1
+ * @version 4.2
  * @date 2022-04-17
- * 
+ *
  * @copyright Copyright (c) 2022
- * 
+ *
+ * Usage: repo [-j workers] [-T threads] [-m megabytes] [-d depth]
+ *             [-i uring|threads] [-o dir] [-e file] [-x op[,op...]] input...
+ *
+ * Batch driver: every input (a file, a directory whose *.bmp files are
+ * taken, or a glob) is read, run through the operation chain and, with
+ * -o, saved under the same name in <dir>. The work is a pipeline of three
+ * stages joined by bounded queues, so disks and CPUs stay busy together:
+ *
+ *   - a reader thread keeps up to <depth> files being read ahead through
+ *     asynchronous I/O (io_uring where the kernel has it, a pool of I/O
+ *     threads otherwise, or with -i threads), with readahead hints;
+ *   - <workers> compute threads (one per CPU by default) decode the files
+ *     from memory, run the chain and encode the results, each library
+ *     call using <threads> row threads (1 by default);
+ *   - a writer thread keeps up to <depth> results being written the same
+ *     way.
+ *
+ * A file is only read once the memory it needs, estimated from its
+ * headers and the chain, fits in the -m budget along with the files in
+ * flight. File data, images and the scratch buffers of the library all
+ * come from one buffer pool, so blocks released by a file are reused by
+ * the next ones. Files that cannot be read, processed or saved are skipped and
+ * listed at the end (and in <file> with -e), followed by the throughput
+ * and the latency percentiles.
+ *
+ * Operations: decode, encode, materialize, gray, invert, filter=red|green|
+ * blue, gaussian=sigma, boxblur=r, sharpen, median=r, erode=WxH,
+ * dilate=WxH, open=WxH, close=WxH, resize=WxH[:nearest|area|bilinear|
+ * bicubic], rotate=90|180|270, fliph, flipv, transpose, pad=RxC,
+ * convert=bits.
  */
 
+#define _DEFAULT_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <pthread.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define BATCH_HAVE_URING_H 1
+#endif
+#endif
+
+#if defined(BATCH_HAVE_URING_H) && defined(__NR_io_uring_setup)
+#define BATCH_URING 1
+#else
+#define BATCH_URING 0
+#endif
+
 #include "main.h"
 
-void main()
+#define BATCH_MAXOPS 32
+
+// bytes read first from every file, enough for its headers (small files fit whole)
+#define BATCH_HEADSIZE (64 * 1024)
+
+// largest queue depth, also the most I/O threads of the fallback
+#define BATCH_MAXDEPTH 256
+
+typedef enum batch_opkind {
+    BATCH_DECODE,
+    BATCH_ENCODE,
+    BATCH_MATERIALIZE,
+    BATCH_GRAY,
+    BATCH_INVERT,
+    BATCH_FILTER,
+    BATCH_GAUSSIAN,
+    BATCH_BOXBLUR,
+    BATCH_SHARPEN,
+    BATCH_MEDIAN,
+    BATCH_MORPH,
+    BATCH_RESIZE,
+    BATCH_ROTATE,
+    BATCH_FLIPH,
+    BATCH_FLIPV,
+    BATCH_TRANSPOSE,
+    BATCH_PAD,
+    BATCH_CONVERT
+} batch_opkind;
+
+typedef struct batch_op {
+    const char * name;      // as given, for the failure reports
+    batch_opkind kind;
+    uint32_t width;         // resize and morphology sizes, pad columns
+    uint32_t height;        // pad rows
+    uint32_t value;         // radius, angle, bit count, colour, mode or morphology
+    double sigma;
+} batch_op;
+
+typedef struct batch_file {
+    char * path;
+    const char * error;     // NULL once the file went through
+    const char * failedop;
+    uint64_t latency;       // ns from the first read to the last write
+    uint64_t bytes;         // size of the source file
+} batch_file;
+
+/**
+ * @brief Blocking queue of at most <capacity> pointers between two stages;
+ * producers wait while it is full, consumers while it is empty.
+ */
+typedef struct batch_queue {
+    void ** items;
+    uint32_t capacity;
+    uint32_t head;
+    uint32_t count;
+    int closed;             // no more pushes, pops drain what is left
+    pthread_mutex_t lock;
+    pthread_cond_t notempty;
+    pthread_cond_t notfull;
+} batch_queue;
+
+/**
+ * @brief One read or write of <iov> at <offset>; <result> receives the
+ * bytes transferred or a negative errno.
+ */
+typedef struct batch_request {
+    int fd;
+    int write;
+    struct iovec iov;
+    off_t offset;
+    ssize_t result;
+    void * owner;
+} batch_request;
+
+/**
+ * @brief Asynchronous I/O: requests are submitted, completions come back
+ * in any order. Every stage owns one, used from that stage only.
+ */
+typedef struct batch_io {
+    int ring;               // io_uring descriptor, -1 for the thread pool
+#if BATCH_URING
+    void * sqring;
+    void * cqring;
+    size_t sqringsize;
+    size_t cqringsize;
+    struct io_uring_sqe * sqes;
+    size_t sqessize;
+    unsigned * sqtail;
+    unsigned * sqmask;
+    unsigned * sqarray;
+    unsigned * cqhead;
+    unsigned * cqtail;
+    unsigned * cqmask;
+    struct io_uring_cqe * cqes;
+#endif
+    batch_queue submitted;
+    batch_queue completed;
+    pthread_t * threads;
+    uint32_t nthreads;
+} batch_io;
+
+/**
+ * @brief A file on its way through the stages. <data> holds the file as
+ * read, then the file to be written.
+ */
+typedef struct batch_job {
+    batch_file * file;
+    int fd;
+    uint8_t * data;
+    size_t size;
+    size_t done;            // bytes of <data> transferred so far
+    uint64_t cost;          // memory taken from the budget
+    uint64_t start;
+    batch_request request;
+} batch_job;
+
+typedef struct batch {
+    batch_file * files;
+    uint32_t nfiles;
+
+    batch_op ops[BATCH_MAXOPS];
+    uint32_t nops;
+    const char * outdir;
+
+    uint32_t depth;         // files each I/O stage keeps in flight
+    int threadio;           // use the I/O threads even where io_uring works
+    batch_io reader;
+    batch_io writer;
+    batch_queue decoded;    // files read, for the compute threads
+    batch_queue encoded;    // results, for the writer
+
+    // memory in flight, bounded by <budget>
+    pthread_mutex_t lock;
+    pthread_cond_t freed;
+    uint64_t budget;
+    uint64_t inflight;
+    uint64_t peak;
+} batch;
+
+static uint64_t batch_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* operation chain -------------------------------------------------------------*/
+
+/**
+ * @brief Parse the plain decimal number at <arg>, ended by <stop> ('\0'
+ * for the end of <arg>), into <value> within [<min>, <max>]. Only digits
+ * are taken, plus a decimal point if <fraction>: signs, exponents, empty
+ * numbers and trailing text are rejected. Returns what follows the
+ * number and <stop>, NULL if something is wrong.
+ */
+static const char * batch_parsenumber(const char * arg, char stop, int fraction, 
+    double min, double max, double * value)
+{
+    size_t digits = strspn(arg, "0123456789");
+    size_t length = digits;
+
+    if (fraction && arg[length] == '.') length += 1 + strspn(arg + length + 1, "0123456789");
+    if (digits == 0 || arg[length] != stop) return NULL;
+
+    // the span is digits only, so neither function reads past it
+    double number = fraction ? strtod(arg, NULL) : (double) strtoul(arg, NULL, 10);
+    if (!(number >= min && number <= max)) return NULL;
+
+    *value = number;
+    return (stop == '\0') ? arg + length : arg + length + 1;
+}
+
+/**
+ * @brief batch_parsenumber() for whole numbers.
+ */
+static const char * batch_parseuint(const char * arg, char stop, 
+    uint32_t min, uint32_t max, uint32_t * value)
+{
+    double number;
+    const char * rest = batch_parsenumber(arg, stop, 0, min, max, &number);
+
+    if (rest != NULL) *value = number;
+    return rest;
+}
+
+/**
+ * @brief Parse a WxH size, both positive and within a Bitmap header,
+ * ended by <stop>.
+ */
+static int batch_parsesize(const char * arg, char stop, uint32_t * width, uint32_t * height)
+{
+    const char * rest = (arg != NULL) ? batch_parseuint(arg, 'x', 1, INT32_MAX, width) : NULL;
+
+    return rest != NULL && batch_parseuint(rest, stop, 1, INT32_MAX, height) != NULL;
+}
+
+/**
+ * @brief Parse one operation, <arg> being what follows its '=' (NULL
+ * without one).
+ */
+static int batch_parseop(batch_op * op, const char * name, const char * arg)
+{
+    static const struct { const char * name; batch_opkind kind; } plain[] = {
+        { "decode", BATCH_DECODE }, { "encode", BATCH_ENCODE },
+        { "materialize", BATCH_MATERIALIZE }, { "gray", BATCH_GRAY },
+        { "invert", BATCH_INVERT }, { "sharpen", BATCH_SHARPEN },
+        { "fliph", BATCH_FLIPH }, { "flipv", BATCH_FLIPV },
+        { "transpose", BATCH_TRANSPOSE }
+    };
+    static const char * morphs[] = { "erode", "dilate", "open", "close" };
+    static const char * modes[] = { "nearest", "area", "bilinear", "bicubic" };
+
+    memset(op, 0, sizeof(batch_op));
+    op->name = name;
+
+    for (size_t i = 0; i < sizeof(plain) / sizeof(plain[0]); i++) {
+        if (strcmp(name, plain[i].name) == 0) {
+            op->kind = plain[i].kind;
+            return arg == NULL;
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(morphs) / sizeof(morphs[0]); i++) {
+        if (strcmp(name, morphs[i]) == 0) {
+            op->kind = BATCH_MORPH;
+            op->value = BMP_MORPH_ERODE + i;
+            return batch_parsesize(arg, '\0', &op->width, &op->height)
+                && op->width % 2 == 1 && op->height % 2 == 1;
+        }
+    }
+
+    if (arg == NULL) return 0;
+
+    if (strcmp(name, "filter") == 0) {
+        op->kind = BATCH_FILTER;
+        if (strcmp(arg, "red") == 0) op->value = BMP_COLOR_RED;
+        else if (strcmp(arg, "green") == 0) op->value = BMP_COLOR_GREEN;
+        else if (strcmp(arg, "blue") == 0) op->value = BMP_COLOR_BLUE;
+        else return 0;
+        return 1;
+    }
+
+    if (strcmp(name, "gaussian") == 0) {
+        op->kind = BATCH_GAUSSIAN;
+        // ceil(3 * sigma) must still be a radius
+        return batch_parsenumber(arg, '\0', 1, 0, INT32_MAX / 3, &op->sigma) != NULL 
+            && op->sigma > 0;
+    }
+
+    if (strcmp(name, "boxblur") == 0 || strcmp(name, "median") == 0) {
+        op->kind = (name[0] == 'b') ? BATCH_BOXBLUR : BATCH_MEDIAN;
+        return batch_parseuint(arg, '\0', 0, (op->kind == BATCH_MEDIAN) ? BMP_MEDIAN_MAXRADIUS : INT32_MAX,
+            &op->value) != NULL;
+    }
+
+    if (strcmp(name, "resize") == 0) {
+        op->kind = BATCH_RESIZE;
+        op->value = BMP_RESIZE_BILINEAR;
+
+        const char * mode = strchr(arg, ':');
+        if (mode != NULL) {
+            size_t m = 0;
+            while (m < sizeof(modes) / sizeof(modes[0]) && strcmp(mode + 1, modes[m]) != 0) m++;
+            if (m == sizeof(modes) / sizeof(modes[0])) return 0;
+            op->value = BMP_RESIZE_NEAREST + m;
+        }
+        return batch_parsesize(arg, (mode != NULL) ? ':' : '\0', &op->width, &op->height);
+    }
+
+    if (strcmp(name, "rotate") == 0) {
+        op->kind = BATCH_ROTATE;
+        return batch_parseuint(arg, '\0', 90, 270, &op->value) != NULL && op->value % 90 == 0;
+    }
+
+    if (strcmp(name, "pad") == 0) {
+        op->kind = BATCH_PAD;
+        const char * rest = batch_parseuint(arg, 'x', 0, INT32_MAX, &op->height);
+        return rest != NULL && batch_parseuint(rest, '\0', 0, INT32_MAX, &op->width) != NULL;
+    }
+
+    if (strcmp(name, "convert") == 0) {
+        op->kind = BATCH_CONVERT;
+        if (batch_parseuint(arg, '\0', BMP_1_BIT, BMP_32_BITS, &op->value) == NULL) return 0;
+        switch (op->value)
+        {
+        case BMP_1_BIT:
+        case BMP_4_BITS:
+        case BMP_8_BITS:
+        case BMP_16_BITS:
+        case BMP_24_BITS:
+        case BMP_32_BITS:
+            return 1;
+        default:
+            return 0;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Parse a comma separated chain into <b>; <chain> is cut in place
+ * and must outlive it.
+ */
+static int batch_parsechain(batch * b, char * chain)
+{
+    for (char * token = strtok(chain, ","); token != NULL; token = strtok(NULL, ","))
+    {
+        if (b->nops == BATCH_MAXOPS) return 0;
+
+        char * arg = strchr(token, '=');
+        if (arg != NULL) *arg++ = '\0';
+
+        if (!batch_parseop(&b->ops[b->nops], token, arg)) {
+            fprintf(stderr, "bad operation: %s%s%s\n", token, arg ? "=" : "", arg ? arg : "");
+            return 0;
+        }
+        b->nops++;
+    }
+
+    return 1;
+}
+
+// bytes of a <width> x <height> image at <bits> per pixel, as the library keeps it
+static uint64_t batch_imagebytes(uint64_t width, uint64_t height, uint32_t bits)
+{
+    return (width * bits + 7) / 8 * height;
+}
+
+/**
+ * @brief Memory a file of <size> bytes with the headers <img> needs at its
+ * peak: the file itself, then two images at a time, an operation's source
+ * and its result, as the chain changes their size and depth, and the
+ * encoded result. Compressed sources are counted decoded, as most
+ * operations decode them first.
+ */
+static uint64_t batch_cost(const batch * b, bmp_image * img, uint64_t size)
+{
+    uint64_t width = img->dib.bmiHeader.biWidth;
+    uint64_t height = bmp_getheight(img);
+    uint32_t bits = img->dib.bmiHeader.biBitCount;
+
+    uint64_t current = batch_imagebytes(width, height, bits);
+    uint64_t peak = current;
+
+    for (uint32_t k = 0; k < b->nops; k++)
+    {
+        const batch_op * op = &b->ops[k];
+
+        switch (op->kind)
+        {
+        case BATCH_MATERIALIZE:
+            bits = BMP_24_BITS;
+            break;
+        case BATCH_GRAY:
+            bits = BMP_8_BITS;
+            break;
+        case BATCH_CONVERT:
+            bits = op->value;
+            break;
+        case BATCH_RESIZE:
+            width = op->width;
+            height = op->height;
+            break;
+        case BATCH_ROTATE:
+        case BATCH_TRANSPOSE:
+        {
+            if (op->kind == BATCH_ROTATE && op->value == 180) break;
+            uint64_t side = width;
+            width = height;
+            height = side;
+            break;
+        }
+        case BATCH_PAD:
+            width += 2 * (uint64_t) op->width;
+            height += 2 * (uint64_t) op->height;
+            break;
+        default:
+            break;
+        }
+
+        uint64_t next = batch_imagebytes(width, height, bits);
+        if (current + next > peak) peak = current + next;
+        current = next;
+    }
+
+    // headers, palette and the row padding of the written file
+    if (b->outdir != NULL) peak += current + 3 * height + 2048;
+
+    return size + peak;
+}
+
+static int batch_apply(const batch_op * op, bmp_image ** img)
+{
+    bmp_image * src = *img;
+    bmp_image * new = NULL;
+
+    switch (op->kind)
+    {
+    case BATCH_DECODE:
+        switch (src->dib.bmiHeader.biCompression)
+        {
+        case BMP_BI_RLE8:
+            new = bmp_rle8decoder(src);
+            break;
+        case BMP_BI_RLE4:
+            new = bmp_rle4decoder(src);
+            break;
+        default:
+            return 1;
+        }
+        break;
+    case BATCH_ENCODE:
+        if (!bmp_isuncompressed(src)) return 1;
+        switch (src->dib.bmiHeader.biBitCount)
+        {
+        case BMP_8_BITS:
+            new = bmp_rle8encoder(src, BMP_RLEMODE_FAST);
+            break;
+        case BMP_4_BITS:
+            new = bmp_rle4encoder(src, BMP_RLEMODE_FAST);
+            break;
+        default:
+            return 1;
+        }
+        break;
+    case BATCH_MATERIALIZE:
+        if (!bmp_isindexed(src)) return 1;
+        new = bmp_materialize(src);
+        break;
+    case BATCH_GRAY:
+        new = bmp_rgb2gray(src, BMP_SET_256_COLOURS);
+        break;
+    case BATCH_INVERT:
+        bmp_invert(src);
+        return 1;
+    case BATCH_FILTER:
+        bmp_filtercolor(src, op->value);
+        return 1;
+    case BATCH_GAUSSIAN:
+        return bmp_gaussian(src, op->sigma, BMP_PADTYPE_REPLICATE);
+    case BATCH_BOXBLUR:
+        return bmp_boxblur(src, op->value, BMP_PADTYPE_REPLICATE);
+    case BATCH_SHARPEN:
+        return bmp_sharpen(src, BMP_PADTYPE_REPLICATE);
+    case BATCH_MEDIAN:
+        return bmp_median(src, op->value, BMP_PADTYPE_REPLICATE);
+    case BATCH_MORPH:
+        return bmp_morphology(src, op->value, op->width, op->height, BMP_PADTYPE_REPLICATE);
+    case BATCH_RESIZE:
+        new = bmp_resize(src, op->width, op->height, op->value);
+        break;
+    case BATCH_ROTATE:
+        new = bmp_rotate(src, (op->value == 90) ? BMP_ROTATE_90
+                            : (op->value == 180) ? BMP_ROTATE_180 : BMP_ROTATE_270);
+        break;
+    case BATCH_FLIPH:
+        return bmp_fliph(src);
+    case BATCH_FLIPV:
+        return bmp_flipv(src);
+    case BATCH_TRANSPOSE:
+        new = bmp_transpose(src);
+        break;
+    case BATCH_PAD:
+        return bmp_addpad(src, op->height, op->width, BMP_PADTYPE_REPLICATE);
+    case BATCH_CONVERT:
+        new = bmp_convert(src, op->value, BMP_BI_RGB);
+        break;
+    }
+
+    if (new == NULL) return 0;
+
+    bmp_cleanup(NULL, src);
+    *img = new;
+
+    return 1;
+}
+
+/* memory budget ---------------------------------------------------------------*/
+
+/**
+ * @brief Wait until <cost> more bytes fit in the budget. A file larger
+ * than the whole budget still runs, alone.
+ */
+static void batch_acquire(batch * b, uint64_t cost)
+{
+    pthread_mutex_lock(&b->lock);
+
+    while (b->inflight > 0 && b->inflight + cost > b->budget) {
+        pthread_cond_wait(&b->freed, &b->lock);
+    }
+
+    b->inflight += cost;
+    if (b->inflight > b->peak) b->peak = b->inflight;
+
+    pthread_mutex_unlock(&b->lock);
+}
+
+// batch_acquire() without the wait, 0 if <cost> does not fit yet
+static int batch_tryacquire(batch * b, uint64_t cost)
+{
+    int fits;
+
+    pthread_mutex_lock(&b->lock);
+
+    fits = (b->inflight == 0 || b->inflight + cost <= b->budget);
+    if (fits) {
+        b->inflight += cost;
+        if (b->inflight > b->peak) b->peak = b->inflight;
+    }
+
+    pthread_mutex_unlock(&b->lock);
+
+    return fits;
+}
+
+static void batch_releasecost(batch * b, uint64_t cost)
+{
+    pthread_mutex_lock(&b->lock);
+    b->inflight -= cost;
+    pthread_cond_broadcast(&b->freed);
+    pthread_mutex_unlock(&b->lock);
+}
+
+/* queues ----------------------------------------------------------------------*/
+
+static int batch_queue_init(batch_queue * q, uint32_t capacity)
+{
+    memset(q, 0, sizeof(batch_queue));
+
+    q->items = malloc(capacity * sizeof(void *));
+    if (q->items == NULL) return 0;
+
+    q->capacity = capacity;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->notempty, NULL);
+    pthread_cond_init(&q->notfull, NULL);
+
+    return 1;
+}
+
+static void batch_queue_destroy(batch_queue * q)
+{
+    if (q->items == NULL) return;
+
+    free(q->items);
+    q->items = NULL;
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->notempty);
+    pthread_cond_destroy(&q->notfull);
+}
+
+static void batch_queue_push(batch_queue * q, void * item)
+{
+    pthread_mutex_lock(&q->lock);
+
+    while (q->count == q->capacity) pthread_cond_wait(&q->notfull, &q->lock);
+
+    q->items[(q->head + q->count) % q->capacity] = item;
+    q->count++;
+
+    pthread_cond_signal(&q->notempty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/**
+ * @brief Oldest item of <q>, waiting for one if <wait>. NULL once the
+ * queue is closed and empty, or right away if it is empty and not <wait>.
+ */
+static void * batch_queue_pop(batch_queue * q, int wait)
+{
+    void * item = NULL;
+
+    pthread_mutex_lock(&q->lock);
+
+    while (wait && q->count == 0 && !q->closed) pthread_cond_wait(&q->notempty, &q->lock);
+
+    if (q->count > 0) {
+        item = q->items[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+        pthread_cond_signal(&q->notfull);
+    }
+
+    pthread_mutex_unlock(&q->lock);
+
+    return item;
+}
+
+static void batch_queue_close(batch_queue * q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->notempty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* asynchronous I/O ------------------------------------------------------------*/
+
+#if BATCH_URING
+static int batch_uring_enter(batch_io * io, unsigned submit, unsigned wait)
+{
+    for (;;) {
+        long status = syscall(__NR_io_uring_enter, io->ring, submit, wait,
+                              wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (status >= 0) return 1;
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) return 0;
+    }
+}
+
+/**
+ * @brief Set up a ring of <depth> entries through the raw system calls,
+ * so no liburing is needed. 0 if the kernel (or a sandbox) refuses it.
+ */
+static int batch_uring_init(batch_io * io, uint32_t depth)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    io->ring = syscall(__NR_io_uring_setup, depth, &p);
+    if (io->ring < 0) return 0;
+
+    io->sqringsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    io->cqringsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    io->sqessize = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    // both rings may share one mapping
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (io->cqringsize > io->sqringsize) io->sqringsize = io->cqringsize;
+        io->cqringsize = io->sqringsize;
+    }
+
+    io->sqring = mmap(NULL, io->sqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      io->ring, IORING_OFF_SQ_RING);
+    io->cqring = (p.features & IORING_FEAT_SINGLE_MMAP) ? io->sqring
+               : mmap(NULL, io->cqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      io->ring, IORING_OFF_CQ_RING);
+    io->sqes = mmap(NULL, io->sqessize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    io->ring, IORING_OFF_SQES);
+
+    if (io->sqring == MAP_FAILED || io->cqring == MAP_FAILED || io->sqes == MAP_FAILED) {
+        if (io->sqes != MAP_FAILED) munmap(io->sqes, io->sqessize);
+        if (io->cqring != MAP_FAILED && io->cqring != io->sqring) munmap(io->cqring, io->cqringsize);
+        if (io->sqring != MAP_FAILED) munmap(io->sqring, io->sqringsize);
+        close(io->ring);
+        io->ring = -1;
+        return 0;
+    }
+
+    uint8_t * sq = io->sqring;
+    uint8_t * cq = io->cqring;
+
+    io->sqtail = (unsigned *) (sq + p.sq_off.tail);
+    io->sqmask = (unsigned *) (sq + p.sq_off.ring_mask);
+    io->sqarray = (unsigned *) (sq + p.sq_off.array);
+    io->cqhead = (unsigned *) (cq + p.cq_off.head);
+    io->cqtail = (unsigned *) (cq + p.cq_off.tail);
+    io->cqmask = (unsigned *) (cq + p.cq_off.ring_mask);
+    io->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    return 1;
+}
+
+// stages never have more than <depth> requests out, so the rings never fill
+static int batch_uring_submit(batch_io * io, batch_request * request)
+{
+    unsigned tail = *io->sqtail;
+    unsigned index = tail & *io->sqmask;
+    struct io_uring_sqe * sqe = &io->sqes[index];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = request->write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = request->fd;
+    sqe->addr = (uintptr_t) &request->iov;
+    sqe->len = 1;
+    sqe->off = request->offset;
+    sqe->user_data = (uintptr_t) request;
+
+    io->sqarray[index] = index;
+    __atomic_store_n(io->sqtail, tail + 1, __ATOMIC_RELEASE);
+
+    return batch_uring_enter(io, 1, 0);
+}
+
+static batch_request * batch_uring_wait(batch_io * io)
+{
+    for (;;)
+    {
+        unsigned head = *io->cqhead;
+
+        if (head != __atomic_load_n(io->cqtail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe * cqe = &io->cqes[head & *io->cqmask];
+            batch_request * request = (batch_request *) (uintptr_t) cqe->user_data;
+
+            request->result = cqe->res;
+            __atomic_store_n(io->cqhead, head + 1, __ATOMIC_RELEASE);
+            return request;
+        }
+
+        if (!batch_uring_enter(io, 0, 1)) return NULL;
+    }
+}
+#endif
+
+/**
+ * @brief Fallback I/O thread: blocking pread()/pwrite() calls, as many at
+ * a time as there are threads.
+ */
+static void * batch_iothread(void * arg)
+{
+    batch_io * io = arg;
+    batch_request * request;
+
+    while ((request = batch_queue_pop(&io->submitted, 1)) != NULL)
+    {
+        ssize_t result;
+
+        do {
+            result = request->write
+                   ? pwrite(request->fd, request->iov.iov_base, request->iov.iov_len, request->offset)
+                   : pread(request->fd, request->iov.iov_base, request->iov.iov_len, request->offset);
+        } while (result < 0 && errno == EINTR);
+
+        request->result = (result < 0) ? -errno : result;
+        batch_queue_push(&io->completed, request);
+    }
+
+    return NULL;
+}
+
+static int batch_io_init(batch_io * io, uint32_t depth, int threadio)
+{
+    memset(io, 0, sizeof(batch_io));
+    io->ring = -1;
+
+#if BATCH_URING
+    if (!threadio && batch_uring_init(io, depth)) return 1;
+#else
+    (void) threadio;
+#endif
+
+    if (!batch_queue_init(&io->submitted, depth) || !batch_queue_init(&io->completed, depth)) return 0;
+
+    io->threads = malloc(depth * sizeof(pthread_t));
+    if (io->threads == NULL) return 0;
+
+    for (; io->nthreads < depth; io->nthreads++) {
+        if (pthread_create(&io->threads[io->nthreads], NULL, batch_iothread, io) != 0) break;
+    }
+
+    return io->nthreads > 0;
+}
+
+static int batch_io_submit(batch_io * io, batch_request * request)
 {
-    /* code */
+#if BATCH_URING
+    if (io->ring >= 0) return batch_uring_submit(io, request);
+#endif
+
+    batch_queue_push(&io->submitted, request);
+
+    return 1;
+}
+
+// the next request to complete, NULL if the ring failed
+static batch_request * batch_io_wait(batch_io * io)
+{
+#if BATCH_URING
+    if (io->ring >= 0) return batch_uring_wait(io);
+#endif
+
+    return batch_queue_pop(&io->completed, 1);
+}
+
+static void batch_io_destroy(batch_io * io)
+{
+#if BATCH_URING
+    if (io->ring >= 0) {
+        munmap(io->sqes, io->sqessize);
+        if (io->cqring != io->sqring) munmap(io->cqring, io->cqringsize);
+        munmap(io->sqring, io->sqringsize);
+        close(io->ring);
+        return;
+    }
+#endif
+
+    if (io->submitted.items != NULL) {
+        batch_queue_close(&io->submitted);
+        for (uint32_t i = 0; i < io->nthreads; i++) pthread_join(io->threads[i], NULL);
+    }
+
+    free(io->threads);
+    batch_queue_destroy(&io->submitted);
+    batch_queue_destroy(&io->completed);
+}
+
+// the rest of <job>'s data from <done> on
+static int batch_transfer(batch_io * io, batch_job * job, int write)
+{
+    job->request.fd = job->fd;
+    job->request.write = write;
+    job->request.iov.iov_base = job->data + job->done;
+    job->request.iov.iov_len = job->size - job->done;
+    job->request.offset = job->done;
+    job->request.owner = job;
+
+    return batch_io_submit(io, &job->request);
+}
+
+/* stages ----------------------------------------------------------------------*/
+
+// end of the road for <job>, whether it went through or not
+static void batch_finish(batch * b, batch_job * job, const char * error)
+{
+    if (error != NULL && job->file->error == NULL) job->file->error = error;
+
+    job->file->latency = batch_now() - job->start;
+
+    if (job->fd >= 0) close(job->fd);
+    bmp_free(job->data);
+
+    if (job->cost > 0) batch_releasecost(b, job->cost);
+    free(job);
+}
+
+/**
+ * @brief Open the file of <job> and read its first bytes; readahead is
+ * requested for the whole file, which is read right after.
+ */
+static int batch_openread(batch * b, batch_job * job)
+{
+    struct stat st;
+
+    job->fd = open(job->file->path, O_RDONLY);
+    if (job->fd < 0) return 0;
+
+    if (fstat(job->fd, &st) != 0) return 0;
+
+    if (st.st_size < BMP_FILEHEADER_SIZE + BMP_INFOHEADER) {
+        job->file->error = "unreadable headers";
+        return 0;
+    }
+
+    job->file->bytes = st.st_size;
+    job->size = (st.st_size < BATCH_HEADSIZE) ? (size_t) st.st_size : BATCH_HEADSIZE;
+
+    posix_fadvise(job->fd, 0, st.st_size, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(job->fd, 0, st.st_size, POSIX_FADV_WILLNEED);
+
+    job->data = bmp_alloc(job->size);
+    if (job->data == NULL) return 0;
+
+    return batch_transfer(&b->reader, job, 0);
+}
+
+// price <job> from the headers at the start of its data
+static int batch_price(batch * b, batch_job * job)
+{
+    bmp_image header;
+    memset(&header, 0, sizeof(bmp_image));
+
+    memcpy(&header.fileheader, job->data, sizeof(bmp_fileheader));
+    memcpy(&header.dib.bmiHeader, job->data + sizeof(bmp_fileheader), sizeof(bmp_infoheader));
+
+    if (header.fileheader.bfType != BMP_FILETYPE_BM || header.dib.bmiHeader.biWidth <= 0) return 0;
+
+    job->cost = batch_cost(b, &header, job->file->bytes);
+
+    return 1;
+}
+
+// grow <job> to the whole file and read the rest, or hand it over if it is all there
+static int batch_readbody(batch * b, batch_job * job)
+{
+    if (job->size == job->file->bytes) {
+        close(job->fd);
+        job->fd = -1;
+        batch_queue_push(&b->decoded, job);
+        return 1;
+    }
+
+    // the library allocator has no realloc, the head is copied over
+    uint8_t * data = bmp_alloc(job->file->bytes);
+    if (data == NULL) return 0;
+
+    memcpy(data, job->data, job->size);
+    bmp_free(job->data);
+    job->data = data;
+    job->size = job->file->bytes;
+
+    return batch_transfer(&b->reader, job, 0);
+}
+
+/**
+ * @brief Reader stage. Up to <depth> files are open at a time: their
+ * first bytes are read to price them, then the rest once the budget lets
+ * them in, oldest first. When nothing is being read the thread waits for
+ * the budget itself.
+ */
+static void * batch_readstage(void * arg)
+{
+    batch * b = arg;
+    batch_job * waiting[BATCH_MAXDEPTH];
+    uint32_t first = 0, nwaiting = 0;
+    uint32_t next = 0, active = 0, inflight = 0;
+
+    for (;;)
+    {
+        while (active < b->depth && next < b->nfiles)
+        {
+            batch_job * job = calloc(1, sizeof(batch_job));
+            if (job == NULL) {
+                b->files[next++].error = "out of memory";
+                continue;
+            }
+
+            job->file = &b->files[next++];
+            job->start = batch_now();
+
+            if (!batch_openread(b, job)) {
+                batch_finish(b, job, (job->fd < 0) ? "cannot open" : "cannot read");
+                continue;
+            }
+
+            active++;
+            inflight++;
+        }
+
+        while (nwaiting > 0)
+        {
+            batch_job * job = waiting[first];
+
+            if (inflight > 0 && !batch_tryacquire(b, job->cost)) break;
+            if (inflight == 0) batch_acquire(b, job->cost);
+
+            first = (first + 1) % BATCH_MAXDEPTH;
+            nwaiting--;
+
+            // small files were read whole with their headers
+            int whole = (job->size == job->file->bytes);
+
+            if (!batch_readbody(b, job)) {
+                batch_finish(b, job, "cannot read");
+                active--;
+            } else if (whole) {
+                active--;
+            } else {
+                inflight++;
+            }
+        }
+
+        if (inflight == 0) {
+            if (active == 0 && next == b->nfiles) break;
+            continue;
+        }
+
+        batch_request * request = batch_io_wait(&b->reader);
+        if (request == NULL) break;
+        inflight--;
+
+        batch_job * job = request->owner;
+
+        if (request->result <= 0) {
+            batch_finish(b, job, "read failed");
+            active--;
+            continue;
+        }
+
+        job->done += request->result;
+
+        // short reads go on from where they stopped
+        if (job->done < job->size) {
+            if (batch_transfer(&b->reader, job, 0)) {
+                inflight++;
+            } else {
+                batch_finish(b, job, "read failed");
+                active--;
+            }
+            continue;
+        }
+
+        if (job->cost == 0) {
+            if (!batch_price(b, job)) {
+                batch_finish(b, job, "unreadable headers");
+                active--;
+                continue;
+            }
+            waiting[(first + nwaiting) % BATCH_MAXDEPTH] = job;
+            nwaiting++;
+            continue;
+        }
+
+        close(job->fd);
+        job->fd = -1;
+        batch_queue_push(&b->decoded, job);
+        active--;
+    }
+
+    batch_queue_close(&b->decoded);
+
+    return NULL;
+}
+
+/**
+ * @brief Compute stage: decode, run the chain and encode, all in memory.
+ */
+static void * batch_computestage(void * arg)
+{
+    batch * b = arg;
+    batch_job * job;
+
+    while ((job = batch_queue_pop(&b->decoded, 1)) != NULL)
+    {
+        bmp_image * img = bmp_read_buffer(job->data, job->size);
+
+        bmp_free(job->data);
+        job->data = NULL;
+
+        if (img == NULL) {
+            batch_finish(b, job, "bmp_read_buffer failed");
+            continue;
+        }
+
+        for (uint32_t k = 0; k < b->nops && job->file->error == NULL; k++) {
+            if (!batch_apply(&b->ops[k], &img)) {
+                job->file->error = "operation failed";
+                job->file->failedop = b->ops[k].name;
+            }
+        }
+
+        if (job->file->error != NULL || b->outdir == NULL) {
+            bmp_cleanup(NULL, img);
+            batch_finish(b, job, NULL);
+            continue;
+        }
+
+        job->size = bmp_getsavesize(img);
+        job->done = 0;
+        job->data = bmp_alloc(job->size);
+
+        int encoded = (job->data != NULL && bmp_save_buffer(img, job->data, job->size));
+        bmp_cleanup(NULL, img);
+
+        if (!encoded) {
+            batch_finish(b, job, "bmp_save_buffer failed");
+            continue;
+        }
+
+        batch_queue_push(&b->encoded, job);
+    }
+
+    return NULL;
+}
+
+static int batch_openwrite(batch * b, batch_job * job)
+{
+    const char * name = strrchr(job->file->path, '/');
+    name = (name != NULL) ? name + 1 : job->file->path;
+
+    size_t len = strlen(b->outdir) + strlen(name) + 2;
+    char * out = malloc(len);
+    if (out == NULL) return 0;
+
+    snprintf(out, len, "%s/%s", b->outdir, name);
+    job->fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    free(out);
+
+    return job->fd >= 0 && batch_transfer(&b->writer, job, 1);
+}
+
+/**
+ * @brief Writer stage: up to <depth> results being written, new ones
+ * taken whenever there is room.
+ */
+static void * batch_writestage(void * arg)
+{
+    batch * b = arg;
+    uint32_t inflight = 0;
+
+    for (;;)
+    {
+        batch_job * job = (inflight < b->depth) ? batch_queue_pop(&b->encoded, inflight == 0) : NULL;
+
+        if (job != NULL) {
+            if (batch_openwrite(b, job)) inflight++;
+            else batch_finish(b, job, "cannot write");
+            continue;
+        }
+
+        if (inflight == 0) break;
+
+        batch_request * request = batch_io_wait(&b->writer);
+        if (request == NULL) break;
+        inflight--;
+
+        job = request->owner;
+
+        if (request->result <= 0) {
+            batch_finish(b, job, "write failed");
+            continue;
+        }
+
+        job->done += request->result;
+
+        if (job->done < job->size) {
+            if (batch_transfer(&b->writer, job, 1)) inflight++;
+            else batch_finish(b, job, "write failed");
+            continue;
+        }
+
+        int status = close(job->fd);
+        job->fd = -1;
+        batch_finish(b, job, (status == 0) ? NULL : "write failed");
+    }
+
+    return NULL;
+}
+
+/* inputs ----------------------------------------------------------------------*/
+
+typedef struct batch_paths {
+    char ** paths;
+    uint32_t n;
+    uint32_t capacity;
+} batch_paths;
+
+static int batch_addpath(batch_paths * list, const char * path)
+{
+    if (list->n == list->capacity) {
+        uint32_t capacity = list->capacity ? 2 * list->capacity : 256;
+        char ** paths = realloc(list->paths, capacity * sizeof(char *));
+        if (paths == NULL) return 0;
+        list->paths = paths;
+        list->capacity = capacity;
+    }
+
+    list->paths[list->n] = strdup(path);
+    if (list->paths[list->n] == NULL) return 0;
+    list->n++;
+
+    return 1;
+}
+
+static int batch_cmppath(const void * a, const void * b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+// the *.bmp files of <dirname>, in name order
+static int batch_adddir(batch_paths * list, const char * dirname)
+{
+    DIR * dir = opendir(dirname);
+    if (dir == NULL) return 0;
+
+    uint32_t first = list->n;
+    struct dirent * entry;
+    int status = 1;
+
+    while (status && (entry = readdir(dir)) != NULL)
+    {
+        size_t len = strlen(entry->d_name);
+        if (len < 4 || strcasecmp(entry->d_name + len - 4, ".bmp") != 0) continue;
+
+        char * path = malloc(strlen(dirname) + len + 2);
+        if (path == NULL) {
+            status = 0;
+            break;
+        }
+
+        sprintf(path, "%s/%s", dirname, entry->d_name);
+        status = batch_addpath(list, path);
+        free(path);
+    }
+
+    closedir(dir);
+
+    qsort(list->paths + first, list->n - first, sizeof(char *), batch_cmppath);
+
+    return status;
+}
+
+/**
+ * @brief Expand one input: a directory, a glob or a plain file (kept
+ * even if it does not exist, so it is reported with the failures).
+ */
+static int batch_addinput(batch_paths * list, const char * input)
+{
+    glob_t matches;
+    int status = 1;
+
+    if (glob(input, GLOB_NOCHECK, NULL, &matches) != 0) return batch_addpath(list, input);
+
+    for (size_t i = 0; status && i < matches.gl_pathc; i++)
+    {
+        struct stat st;
+        const char * path = matches.gl_pathv[i];
+
+        if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+            status = batch_adddir(list, path);
+        } else {
+            status = batch_addpath(list, path);
+        }
+    }
+
+    globfree(&matches);
+
+    return status;
+}
+
+/* report ----------------------------------------------------------------------*/
+
+static int batch_cmpu64(const void * a, const void * b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+// nearest-rank percentile <p> of the <n> sorted samples
+static double batch_percentile(const uint64_t * sorted, uint32_t n, double p)
+{
+    uint32_t rank = (uint32_t) (p / 100.0 * n + 0.999999);
+    if (rank == 0) rank = 1;
+    if (rank > n) rank = n;
+    return sorted[rank - 1] / 1e6;
+}
+
+static int batch_report(batch * b, uint64_t elapsed, const char * errors)
+{
+    uint64_t * latencies = malloc((b->nfiles + 1) * sizeof(uint64_t));
+    if (latencies == NULL) return 0;
+
+    uint32_t done = 0, failed = 0;
+    uint64_t bytes = 0;
+
+    FILE * log = NULL;
+    if (errors != NULL && (log = fopen(errors, "w")) == NULL) {
+        fprintf(stderr, "could not write %s\n", errors);
+    }
+
+    for (uint32_t i = 0; i < b->nfiles; i++)
+    {
+        batch_file * file = &b->files[i];
+
+        if (file->error != NULL) {
+            // the first few on the terminal, all of them in the log
+            if (failed < 10) {
+                fprintf(stderr, "skipped %s: %s%s%s\n", file->path, file->error,
+                        file->failedop ? " at " : "", file->failedop ? file->failedop : "");
+            }
+            if (log != NULL) {
+                fprintf(log, "%s\t%s%s%s\n", file->path, file->error,
+                        file->failedop ? " at " : "", file->failedop ? file->failedop : "");
+            }
+            failed++;
+            continue;
+        }
+
+        latencies[done++] = file->latency;
+        bytes += file->bytes;
+    }
+
+    if (failed > 10) fprintf(stderr, "... and %u more\n", failed - 10);
+    if (log != NULL) fclose(log);
+
+    double seconds = elapsed / 1e9;
+
+    printf("%u files processed, %u skipped, in %.3f s: %.1f files/s, %.1f MB/s\n",
+           done, failed, seconds, seconds > 0 ? done / seconds : 0,
+           seconds > 0 ? bytes / 1e6 / seconds : 0);
+
+    if (done > 0) {
+        qsort(latencies, done, sizeof(uint64_t), batch_cmpu64);
+        printf("latency (ms): p50 %.2f, p90 %.2f, p99 %.2f, p99.9 %.2f, max %.2f\n",
+               batch_percentile(latencies, done, 50), batch_percentile(latencies, done, 90),
+               batch_percentile(latencies, done, 99), batch_percentile(latencies, done, 99.9),
+               latencies[done - 1] / 1e6);
+    }
+
+    printf("peak memory in flight: %.1f MB of %.1f MB, %s I/O, depth %u\n", b->peak / 1e6,
+           b->budget / 1e6, (b->reader.ring >= 0) ? "io_uring" : "threaded", b->depth);
+
+    free(latencies);
+
+    return 1;
+}
+
+/* driver ----------------------------------------------------------------------*/
+
+static void batch_usage(const char * name)
+{
+    fprintf(stderr, "usage: %s [-j workers] [-T threads] [-m megabytes] [-d depth] "
+                    "[-i uring|threads] [-o dir] [-e file] [-x op[,op...]] input...\n", name);
+}
+
+int main(int argc, char * argv[])
+{
+    static batch b;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t workers = (cpus > 0) ? (uint32_t) cpus : 1;
+    uint32_t threads = 1;
+    uint32_t megabytes = 1024;
+    const char * errors = NULL;
+    const char * number = "";
+    int opt;
+
+    b.depth = 16;
+
+    while ((opt = getopt(argc, argv, "j:T:m:d:i:o:e:x:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'j': number = batch_parseuint(optarg, '\0', 0, UINT32_MAX, &workers); break;
+        case 'T': number = batch_parseuint(optarg, '\0', 0, UINT32_MAX, &threads); break;
+        case 'm': number = batch_parseuint(optarg, '\0', 0, UINT32_MAX, &megabytes); break;
+        case 'd': number = batch_parseuint(optarg, '\0', 0, UINT32_MAX, &b.depth); break;
+        case 'i':
+            if (strcmp(optarg, "threads") == 0) {
+                b.threadio = 1;
+            } else if (strcmp(optarg, "uring") != 0) {
+                batch_usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'o': b.outdir = optarg; break;
+        case 'e': errors = optarg; break;
+        case 'x':
+            if (!batch_parsechain(&b, optarg)) return 1;
+            break;
+        default:
+            batch_usage(argv[0]);
+            return 1;
+        }
+
+        if (number == NULL) {
+            batch_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind == argc) {
+        batch_usage(argv[0]);
+        return 1;
+    }
+
+    if (workers == 0) workers = 1;
+    if (megabytes == 0) megabytes = 1;
+    if (b.depth == 0) b.depth = 1;
+    if (b.depth > BATCH_MAXDEPTH) b.depth = BATCH_MAXDEPTH;
+
+    batch_paths list = { 0 };
+
+    for (int i = optind; i < argc; i++) {
+        if (!batch_addinput(&list, argv[i])) {
+            fprintf(stderr, "could not list %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    b.nfiles = list.n;
+    b.files = calloc(list.n + 1, sizeof(batch_file));
+    if (b.files == NULL) return 1;
+
+    for (uint32_t i = 0; i < list.n; i++) b.files[i].path = list.paths[i];
+
+    pthread_mutex_init(&b.lock, NULL);
+    pthread_cond_init(&b.freed, NULL);
+    b.budget = (uint64_t) megabytes * 1000000u;
+
+    if (!batch_queue_init(&b.decoded, b.depth) || !batch_queue_init(&b.encoded, b.depth) ||
+        !batch_io_init(&b.reader, b.depth, b.threadio) ||
+        (b.outdir != NULL && !batch_io_init(&b.writer, b.depth, b.threadio))) {
+        fprintf(stderr, "could not set up the I/O\n");
+        return 1;
+    }
+
+    // released blocks kept for reuse stay within the budget of the files in flight
+    bmp_bufpool * pool = bmp_bufpool_create(b.budget);
+    bmp_allocator allocator = bmp_bufpool_allocator(pool);
+    if (pool != NULL) bmp_set_allocator(&allocator);
+
+    // files are the unit of parallelism, row threads only help the big ones
+    bmp_set_threads(threads);
+
+    if (workers > b.nfiles) workers = (b.nfiles > 0) ? b.nfiles : 1;
+
+    pthread_t * tids = malloc(workers * sizeof(pthread_t));
+    pthread_t reader, writer;
+    if (tids == NULL) return 1;
+
+    uint64_t start = batch_now();
+    uint32_t started = 0;
+
+    if (pthread_create(&reader, NULL, batch_readstage, &b) != 0 ||
+        (b.outdir != NULL && pthread_create(&writer, NULL, batch_writestage, &b) != 0)) {
+        fprintf(stderr, "could not start the I/O threads\n");
+        return 1;
+    }
+
+    for (; started < workers; started++) {
+        if (pthread_create(&tids[started], NULL, batch_computestage, &b) != 0) break;
+    }
+
+    // without any compute thread of its own, the work is done here
+    if (started == 0) batch_computestage(&b);
+
+    pthread_join(reader, NULL);
+    for (uint32_t i = 0; i < started; i++) pthread_join(tids[i], NULL);
+
+    if (b.outdir != NULL) {
+        batch_queue_close(&b.encoded);
+        pthread_join(writer, NULL);
+    }
+
+    uint64_t elapsed = batch_now() - start;
+
+    batch_report(&b, elapsed, errors);
 
-    bmp_image * img = bmp_read("./samples/salt-pepper.bmp");
+    uint32_t failed = 0;
+    for (uint32_t i = 0; i < b.nfiles; i++) {
+        if (b.files[i].error != NULL) failed++;
+        free(b.files[i].path);
+    }
 
-    bmp_image * decoded = bmp_rle8decoder(img);
+    free(list.paths);
+    free(b.files);
+    free(tids);
+    batch_io_destroy(&b.reader);
+    if (b.outdir != NULL) batch_io_destroy(&b.writer);
+    batch_queue_destroy(&b.decoded);
+    batch_queue_destroy(&b.encoded);
+    pthread_mutex_destroy(&b.lock);
+    pthread_cond_destroy(&b.freed);
 
-    bmp_save(decoded, "salt-pepper-decoded.bmp");
+    bmp_set_allocator(NULL);
+    bmp_bufpool_destroy(pool);
 
-    bmp_cleanup(NULL, img);
-    bmp_cleanup(NULL, decoded);
-}
\ No newline at end of file
+    return failed > 0 ? 2 : 0;
+}